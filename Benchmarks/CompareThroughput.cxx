@@ -0,0 +1,184 @@
+/**
+ * \file CompareThroughput.cxx
+ * \brief Compares the CSV output of a benchmark with a stored baseline and fails on slowdowns
+ *
+ * The rows of the two files are matched on the key columns. A row is slower if it takes more than the tolerance
+ * longer than the baseline, e.g. 0.25 accepts up to 25% more nanoseconds per call, or fibers per second down to
+ * 1/1.25 of the baseline. Rows without a baseline are reported but do not fail, so new benchmarks can be added
+ * before the baseline is updated.
+ *
+ * Usage: CompareThroughput baseline.csv results.csv value_column higher|lower tolerance key_column...
+ *
+ * where higher or lower tells which values of value_column are better.
+*/
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+typedef std::vector<std::string> CsvRow;
+
+CsvRow SplitCsvLine(const std::string& line)
+{
+  CsvRow             fields;
+  std::istringstream stream(line);
+  std::string        field;
+  while( std::getline(stream, field, ',') )
+    {
+    fields.push_back(field);
+    }
+  return fields;
+}
+
+/**
+ * Reads a CSV file with a header line. Lines that do not have as many fields as the header, e.g. messages
+ * the benchmark printed, are skipped.
+ * \return true on failure
+*/
+bool ReadCsv(const std::string& file_name, CsvRow& header, std::vector<CsvRow>& rows)
+{
+  std::ifstream in(file_name.c_str() );
+  std::string   line;
+  if( !in || !std::getline(in, line) )
+    {
+    std::cout << "Could not read " << file_name << std::endl;
+    return true;
+    }
+  header = SplitCsvLine(line);
+  while( std::getline(in, line) )
+    {
+    const CsvRow row = SplitCsvLine(line);
+    if( row.size() == header.size() )
+      {
+      rows.push_back(row);
+      }
+    }
+  return false;
+}
+
+/** Index of the column, -1 if the header does not have it */
+int FindColumn(const CsvRow& header, const std::string& name)
+{
+  for( size_t i = 0; i < header.size(); ++i )
+    {
+    if( header[i] == name )
+      {
+      return static_cast<int>(i);
+      }
+    }
+  return -1;
+}
+
+/**
+ * Looks up the columns in the header
+ * \return true if one is missing
+*/
+bool FindColumns(const std::string& file_name, const CsvRow& header, const std::vector<std::string>& names,
+                 std::vector<int>& columns)
+{
+  columns.clear();
+  for( size_t i = 0; i < names.size(); ++i )
+    {
+    columns.push_back(FindColumn(header, names[i]) );
+    if( columns.back() < 0 )
+      {
+      std::cout << file_name << " has no column " << names[i] << std::endl;
+      return true;
+      }
+    }
+  return false;
+}
+
+std::string RowKey(const CsvRow& row, const std::vector<int>& key_columns)
+{
+  std::string key;
+  for( size_t i = 0; i < key_columns.size(); ++i )
+    {
+    key += (i > 0 ? "," : "") + row[key_columns[i]];
+    }
+  return key;
+}
+}
+
+int main(int argc, char * *argv)
+{
+  if( argc < 7 || (std::string(argv[4]) != "higher" && std::string(argv[4]) != "lower") || atof(argv[5]) < 0 )
+    {
+    std::cout << "Usage: " << argv[0]
+              << " baseline.csv results.csv value_column higher|lower tolerance key_column..." << std::endl;
+    return EXIT_FAILURE;
+    }
+  const std::string              baseline_file = argv[1];
+  const std::string              results_file = argv[2];
+  const std::string              value_name = argv[3];
+  const bool                     higher_is_better = std::string(argv[4]) == "higher";
+  const double                   tolerance = atof(argv[5]);
+  const std::vector<std::string> key_names(argv + 6, argv + argc);
+
+  CsvRow              baseline_header, results_header;
+  std::vector<CsvRow> baseline_rows, results_rows;
+  if( ReadCsv(baseline_file, baseline_header, baseline_rows) || ReadCsv(results_file, results_header, results_rows) )
+    {
+    return EXIT_FAILURE;
+    }
+
+  // The value column is looked up after the key columns
+  std::vector<std::string> column_names(key_names);
+  column_names.push_back(value_name);
+  std::vector<int> baseline_keys, results_keys;
+  if( FindColumns(baseline_file, baseline_header, column_names, baseline_keys) ||
+      FindColumns(results_file, results_header, column_names, results_keys) )
+    {
+    return EXIT_FAILURE;
+    }
+  const int baseline_value = baseline_keys.back();
+  const int results_value = results_keys.back();
+  baseline_keys.pop_back();
+  results_keys.pop_back();
+
+  std::map<std::string, double> baseline;
+  for( size_t i = 0; i < baseline_rows.size(); ++i )
+    {
+    baseline[RowKey(baseline_rows[i], baseline_keys)] = atof(baseline_rows[i][baseline_value].c_str() );
+    }
+
+  int num_slower = 0;
+  for( size_t i = 0; i < results_rows.size(); ++i )
+    {
+    const std::string                             key = RowKey(results_rows[i], results_keys);
+    const double                                  value = atof(results_rows[i][results_value].c_str() );
+    const std::map<std::string, double>::iterator it = baseline.find(key);
+    if( it == baseline.end() )
+      {
+      std::cout << key << ": " << value << " (no baseline)" << std::endl;
+      continue;
+      }
+    // Relative increase of the run time, negative if faster
+    double slowdown = 0.0;
+    if( it->second > 0 )
+      {
+      slowdown = (higher_is_better ? it->second / value : value / it->second) - 1.0;
+      }
+    const bool slower = slowdown > tolerance;
+    std::cout << key << ": " << value << " baseline " << it->second << " (" << (slowdown >= 0 ? "+" : "")
+              << 100.0 * slowdown << "% time)" << (slower ? " SLOWER" : "") << std::endl;
+    if( slower )
+      {
+      ++num_slower;
+      }
+    }
+
+  if( num_slower > 0 )
+    {
+    std::cout << num_slower << " of " << results_rows.size() << " results take more than " << 100.0 * tolerance
+              << "% longer than the baseline." << std::endl;
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,494 @@
+/**
+ * \file KernelBenchmark.cxx
+ * \brief Measures the kernels every tracking step runs, for every filter model and several gradient counts
+ *
+ * The inputs are synthetic: a single tensor DWI volume from SyntheticDWI and the seed state Tractography::Init
+ * estimates at the centre of it. Every kernel is repeated on the same input until it ran for at least the
+ * given time, so the numbers are the cost of one call with warm caches. The kernels are:
+ *
+ *   Filter            UnscentedKalmanFilter::Filter, one full filter step
+ *   H, F              the observation and transition functions of the model on the sigma points of the seed
+ *   Constrain         UnscentedKalmanFilter::Constrain on the sigma points, for the constrained models only
+ *   Interp3Signal     NrrdData::Interp3Signal at pseudo-random positions
+ *   Interp3ScalarMask NrrdData::Interp3ScalarMask at the same positions
+ *   UnpackTensor      the seed tensor estimation of Tractography::Init, per signal
+ *   PostProcessFibers joining synthetic half fibers, per output fiber, serially and on a thread pool
+ *
+ * Usage: KernelBenchmark [size [min_seconds [gradients...]]]
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "filter_model.h"
+#include "NrrdData.h"
+#include "thread.h"
+#include "tractography.h"
+#include "ukffiber.h"
+#include "unscented_kalman_filter.h"
+#include "SyntheticDWI.h"
+
+/** A filter model as it is selected on the command line */
+struct ModelConfig
+  {
+  const char *name;
+  int         num_tensors;
+  bool        full;
+  bool        free_water;
+  bool        noddi;
+  };
+
+/**
+ * \class KernelBenchmark
+ * \brief Times the kernels of one model on one synthetic volume
+ *
+ * The kernels are reached through the public interface of Tractography and UnscentedKalmanFilter, they are the
+ * same functions the tracking loop calls.
+*/
+class KernelBenchmark
+{
+public:
+  typedef void (KernelBenchmark::*Kernel)();
+
+  KernelBenchmark(const ModelConfig& config, const int size, const int num_gradients, const double min_seconds);
+  ~KernelBenchmark();
+
+  /** Sets up the tractography and the seed, false if the synthetic volume could not be created */
+  bool Init();
+
+  /** Times all kernels of the model and writes a CSV line for each */
+  void RunModelKernels();
+
+  /** Times the kernels that do not depend on the model, i.e. the interpolation and UnpackTensor */
+  void RunDataKernels();
+
+  /** Times PostProcessFibers with and without the thread pool */
+  static void RunPostProcessFibers(const double min_seconds, const int num_threads);
+
+private:
+  /** Calls kernel until it ran for min_seconds and writes the time per call, calls_per_run calls per kernel run */
+  void Time(const char *kernel, const char *model, Kernel run, const int calls_per_run);
+
+  static void WriteResult(const char *kernel, const char *model, const int num_gradients, const double calls,
+                          const double seconds);
+
+  void Filter();
+
+  void H();
+
+  void F();
+
+  void Constrain();
+
+  void Interp3Signal();
+
+  void Interp3ScalarMask();
+
+  void UnpackTensor();
+
+  const ModelConfig      _config;
+  const int              _size;
+  const int              _num_gradients;
+  const double           _min_seconds;
+  Tractography *         _tractography;
+  UnscentedKalmanFilter *_ukf;
+  SeedPointInfo          _seed;
+  ukfVectorType          _signal;
+  State                  _state;
+  ukfMatrixType          _covariance;
+  ukfPrecisionType       _nmse;
+  ukfMatrixType          _sigma_points;
+  ukfMatrixType          _X;
+  ukfMatrixType          _Y;
+  stdVec_t               _positions;
+  size_t                 _next_position;
+  stdEigVec_t            _signals;
+  stdEigVec_t            _tensors;
+  ukfPrecisionType       _checksum;
+};
+
+namespace
+{
+const int NUM_POSITIONS = 4096;
+const int NUM_SIGNALS = 256;
+const int NUM_FIBERS = 2000;
+
+/** The defaults ukf_parse_cli sets for a model, without any output */
+UKFSettings BenchmarkSettings(const ModelConfig& config)
+{
+  UKFSettings s;
+
+  s.record_fa = false;
+  s.record_nmse = false;
+  s.record_trace = false;
+  s.record_state = false;
+  s.record_cov = false;
+  s.record_cov_mode = COVARIANCE_PACKED;
+  s.record_cov_float = false;
+  s.record_free_water = false;
+  s.record_tensors = false;
+  s.record_Vic = false;
+  s.record_kappa = false;
+  s.record_Viso = false;
+  s.transform_position = true;
+  s.store_glyphs = false;
+  s.branches_only = false;
+  s.fa_min = 0.15;
+  s.mean_signal_min = 0.1;
+  // Keep the seed whatever the mean signal of the synthetic data is
+  s.seeding_threshold = 0.0;
+  s.num_tensors = config.num_tensors;
+  s.seeds_per_voxel = 1;
+  s.min_branching_angle = 0.0;
+  s.max_branching_angle = 0.0;
+  s.is_full_model = config.full;
+  s.free_water = config.free_water;
+  s.noddi = config.noddi;
+  s.adaptive_nmse = 0.0;
+  s.stepLength = config.num_tensors == 3 ? 0.15 : 0.3;
+  s.max_step_length = 0.0;
+  s.recordLength = config.num_tensors == 3 ? 0.45 : 0.9;
+  s.maxHalfFiberLength = 250.0;
+  s.labels.push_back(1);
+
+  if( config.noddi )
+    {
+    s.Qm = config.num_tensors == 1 ? 0.0025 : 0.001;
+    }
+  else if( config.num_tensors == 1 )
+    {
+    s.Qm = 0.005;
+    }
+  else
+    {
+    s.Qm = config.full ? 0.002 : 0.001;
+    }
+  s.Ql = config.num_tensors == 1 ? 300.0 : (config.num_tensors == 2 ? 50.0 : 100.0);
+  s.Qw = config.num_tensors == 1 ? 0.0025 : 0.0015;
+  s.Qkappa = 0.01;
+  s.Qvic = config.num_tensors == 1 ? 0.0005 : 0.004;
+  s.Rs = (config.num_tensors == 1 || config.full) ? 0.01 : 0.02;
+
+  s.p0 = P0;
+  s.sigma_signal = 0.0;
+  s.sigma_mask = SIGMA_MASK;
+  s.min_radius = MIN_RADIUS;
+  s.full_brain_mean_signal_min = FULL_BRAIN_MEAN_SIGNAL_MIN;
+  s.num_threads = 1;
+  s.numa_mode = NUMA_NONE;
+  s.seed_order = SEED_ORDER_NONE;
+  s.max_fibers = 0;
+  s.time_budget = 0.0;
+  s.progress_interval = 0.0;
+  s.stream_output = false;
+  s.vtp_compressor = VTP_COMPRESSOR_ZLIB;
+  s.compress_ukf = false;
+  s.max_position_error = 0.0;
+  s.max_scalar_error = 0.0;
+  s.writeAsciiTracts = false;
+  s.writeUncompressedTracts = false;
+  s.connectome_format = CONNECTOME_CSV;
+  return s;
+}
+}
+
+KernelBenchmark::KernelBenchmark(const ModelConfig& config, const int size, const int num_gradients,
+                                 const double min_seconds)
+  : _config(config), _size(size), _num_gradients(num_gradients), _min_seconds(min_seconds),
+  _tractography(NULL), _ukf(NULL), _nmse(0), _next_position(0), _checksum(0)
+{
+}
+
+KernelBenchmark::~KernelBenchmark()
+{
+  // The filter points to the model of the tractography
+  delete _ukf;
+  delete _tractography;
+}
+
+bool KernelBenchmark::Init()
+{
+  const int dims[3] = { _size, _size, _size };
+  Nrrd *    dwi = CreateSyntheticDWI(dims, _num_gradients, 1000.0);
+  Nrrd *    mask = CreateSyntheticMask(dims);
+  if( !dwi || !mask )
+    {
+    nrrdNuke(dwi);
+    nrrdNuke(mask);
+    return false;
+    }
+
+  // The set-up reports the model and the seeds, which would end up in the CSV
+  std::streambuf *cout_buffer = std::cout.rdbuf(NULL);
+  _tractography = new Tractography(BenchmarkSettings(_config) );
+  if( _tractography->SetData(dwi, mask, NULL, true) )
+    {
+    std::cout.rdbuf(cout_buffer);
+    return false;
+    }
+  _tractography->UpdateFilterModelType();
+  stdVec_t seeds(1, vec3_t(_size / 2, _size / 2, _size / 2) );
+  _tractography->SetSeeds(seeds);
+  std::vector<SeedPointInfo> seed_infos;
+  _tractography->Init(seed_infos);
+  std::cout.rdbuf(cout_buffer);
+
+  FilterModel *model = _tractography->GetFilterModel();
+  const int    dim = model->state_dim();
+  _ukf = new UnscentedKalmanFilter(model);
+  _seed = seed_infos[0];
+  _signal.resize(model->signal_dim() );
+  _tractography->GetSignalData()->Interp3Signal(_seed.point, _signal);
+  _state.resize(dim);
+  _covariance.resize(dim, dim);
+
+  _sigma_points.resize(dim, 2 * dim + 1);
+  _ukf->SigmaPoints(_seed.state, _seed.covariance, _sigma_points);
+  _X = _sigma_points;
+  _Y.resize(model->signal_dim(), 2 * dim + 1);
+
+  // Deterministic positions spread over the whole volume
+  const vec3_t dim_data = _tractography->GetSignalData()->dim();
+  unsigned int state = 12345u;
+  _positions.resize(NUM_POSITIONS);
+  for( int i = 0; i < NUM_POSITIONS; ++i )
+    {
+    for( int k = 0; k < 3; ++k )
+      {
+      state = state * 1664525u + 1013904223u;
+      _positions[i][k] = (state >> 8) / static_cast<ukfPrecisionType>(1 << 24) * (dim_data[k] - 1);
+      }
+    }
+
+  _signals.assign(NUM_SIGNALS, _signal);
+  for( int i = 0; i < NUM_SIGNALS; ++i )
+    {
+    _tractography->GetSignalData()->Interp3Signal(_positions[i], _signals[i]);
+    }
+  _tensors.resize(NUM_SIGNALS);
+  return true;
+}
+
+void KernelBenchmark::RunModelKernels()
+{
+  Time("Filter", _config.name, &KernelBenchmark::Filter, 1);
+  Time("H", _config.name, &KernelBenchmark::H, 1);
+  Time("F", _config.name, &KernelBenchmark::F, 1);
+  if( _tractography->GetFilterModel()->isConstrained() )
+    {
+    Time("Constrain", _config.name, &KernelBenchmark::Constrain, 1);
+    }
+}
+
+void KernelBenchmark::RunDataKernels()
+{
+  Time("Interp3Signal", "none", &KernelBenchmark::Interp3Signal, 1);
+  Time("Interp3ScalarMask", "none", &KernelBenchmark::Interp3ScalarMask, 1);
+  Time("UnpackTensor", "none", &KernelBenchmark::UnpackTensor, NUM_SIGNALS);
+}
+
+void KernelBenchmark::Time(const char *kernel, const char *model, Kernel run, const int calls_per_run)
+{
+  // Warm up, then double the number of runs until the time is long enough to measure
+  (this->*run)();
+  double seconds = 0;
+  int    runs = 1;
+  for( ; ; )
+    {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for( int i = 0; i < runs; ++i )
+      {
+      (this->*run)();
+      }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if( seconds >= _min_seconds || runs >= (1 << 30) )
+      {
+      break;
+      }
+    runs *= 2;
+    }
+  WriteResult(kernel, model, _num_gradients, static_cast<double>(runs) * calls_per_run, seconds);
+
+  // Keeps the kernels from being optimized away
+  if( _checksum < -1e300 )
+    {
+    std::cout << _checksum << std::endl;
+    }
+}
+
+void KernelBenchmark::WriteResult(const char *kernel, const char *model, const int num_gradients,
+                                  const double calls, const double seconds)
+{
+  std::cout << "kernel," << kernel << "," << model << "," << num_gradients << "," << calls << "," << seconds
+            << "," << seconds * 1e9 / calls << std::endl;
+}
+
+void KernelBenchmark::Filter()
+{
+  _ukf->Filter(_seed.state, _seed.covariance, _signal, _state, _covariance, _nmse);
+  _checksum += _nmse;
+}
+
+void KernelBenchmark::H()
+{
+  _tractography->GetFilterModel()->H(_sigma_points, _Y);
+  _checksum += _Y(0, 0);
+}
+
+void KernelBenchmark::F()
+{
+  // F only normalizes and clamps, applying it again to its own output costs the same
+  _tractography->GetFilterModel()->F(_X);
+  _checksum += _X(0, 0);
+}
+
+void KernelBenchmark::Constrain()
+{
+  // Constrain projects in place, so every call starts from the unconstrained sigma points
+  _X = _sigma_points;
+  _ukf->Constrain(_X, _seed.covariance);
+  _checksum += _X(0, 0);
+}
+
+void KernelBenchmark::Interp3Signal()
+{
+  _tractography->GetSignalData()->Interp3Signal(_positions[_next_position], _signal);
+  _next_position = (_next_position + 1) % _positions.size();
+  _checksum += _signal[0];
+}
+
+void KernelBenchmark::Interp3ScalarMask()
+{
+  _checksum += _tractography->GetSignalData()->Interp3ScalarMask(_positions[_next_position]);
+  _next_position = (_next_position + 1) % _positions.size();
+}
+
+void KernelBenchmark::UnpackTensor()
+{
+  _tractography->UnpackTensor(_tractography->GetSignalData()->GetBValues(), _tractography->GetSignalData()->gradients(),
+                              _signals, _tensors);
+  _checksum += _tensors[0][0];
+}
+
+void KernelBenchmark::RunPostProcessFibers(const double min_seconds, const int num_threads)
+{
+  // Pairs of half fibers of 1T records with FA and the state, of varying length like real fibers
+  const int  state_dim = 5;
+  FiberArena arena;
+  arena.Clear(state_dim);
+  std::vector<UKFFiber> halves(2 * NUM_FIBERS);
+  unsigned int          state = 54321u;
+  for( int f = 0; f < 2 * NUM_FIBERS; ++f )
+    {
+    state = state * 1664525u + 1013904223u;
+    const int num_points = 5 + (state >> 16) % 120;
+    halves[f].Start(&arena);
+    for( int i = 0; i < num_points; ++i )
+      {
+      const ukfPrecisionType t = (f % 2 == 0 ? -0.9 : 0.9) * i;
+      arena.position.push_back(vec3_t(t, 0.1 * f, 0.5 * t) );
+      arena.fa.push_back(0.5);
+      arena.norm.push_back(0.01);
+      for( int k = 0; k < state_dim; ++k )
+        {
+        arena.state.push_back(k);
+        }
+      ++halves[f].length;
+      }
+    }
+  const std::vector<UKFFiber>                 no_branches;
+  const std::vector<BranchingSeedAffiliation> no_affiliation;
+
+  TrackingThreadPool pool(num_threads);
+  const char *       kernels[] = { "PostProcessFibers", "PostProcessFibers_threads" };
+  for( int k = 0; k < 2; ++k )
+    {
+    FiberArena            output_arena;
+    std::vector<UKFFiber> fibers;
+    double                seconds = 0;
+    int                   runs = 1;
+    for( ; ; )
+      {
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for( int i = 0; i < runs; ++i )
+        {
+        output_arena.Clear(state_dim);
+        fibers.clear();
+        PostProcessFibers(halves, no_branches, no_affiliation, false, output_arena, fibers, k == 1 ? &pool : NULL);
+        }
+      seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if( seconds >= min_seconds || runs >= (1 << 20) )
+        {
+        break;
+        }
+      runs *= 2;
+      }
+    WriteResult(kernels[k], "none", 0, static_cast<double>(runs) * fibers.size(), seconds);
+    }
+}
+
+int main(int argc, char * *argv)
+{
+  const int        size = argc > 1 ? atoi(argv[1]) : 32;
+  const double     min_seconds = argc > 2 ? atof(argv[2]) : 0.2;
+  std::vector<int> gradient_counts;
+  for( int i = 3; i < argc; ++i )
+    {
+    gradient_counts.push_back(atoi(argv[i]) );
+    }
+  if( gradient_counts.empty() )
+    {
+    const int realistic[] = { 30, 64, 128, 288 };
+    gradient_counts.assign(realistic, realistic + 4);
+    }
+
+  if( size < 4 || min_seconds <= 0 ||
+      *std::min_element(gradient_counts.begin(), gradient_counts.end() ) < 6 )
+    {
+    std::cout << "Usage: " << argv[0] << " [size [min_seconds [gradients...]]]" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  const ModelConfig models[] =
+    {
+      { "1T", 1, false, false, false },
+      { "1T_FW", 1, false, true, false },
+      { "1T_FULL", 1, true, false, false },
+      { "1T_FW_FULL", 1, true, true, false },
+      { "2T", 2, false, false, false },
+      { "2T_FW", 2, false, true, false },
+      { "2T_FULL", 2, true, false, false },
+      { "2T_FW_FULL", 2, true, true, false },
+      { "3T", 3, false, false, false },
+      { "3T_FULL", 3, true, false, false },
+      { "NODDI1F", 1, false, false, true },
+      { "NODDI2F", 2, false, false, true }
+    };
+  const int num_models = sizeof(models) / sizeof(models[0]);
+
+  std::cout << "benchmark,kernel,model,gradients,calls,seconds,ns_per_call" << std::endl;
+  for( size_t g = 0; g < gradient_counts.size(); ++g )
+    {
+    for( int m = 0; m < num_models; ++m )
+      {
+      KernelBenchmark benchmark(models[m], size, gradient_counts[g], min_seconds);
+      if( !benchmark.Init() )
+        {
+        std::cout << "Could not set up the synthetic DWI" << std::endl;
+        return EXIT_FAILURE;
+        }
+      if( m == 0 )
+        {
+        benchmark.RunDataKernels();
+        }
+      benchmark.RunModelKernels();
+      }
+    }
+  KernelBenchmark::RunPostProcessFibers(min_seconds, std::max(1u, std::thread::hardware_concurrency() ) );
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+#-----------------------------------------------------------------------------
+# Runs a benchmark as a ctest test, see the performance tests in CMakeLists.txt
+#
+#   cmake -DBENCHMARK=<command|args...> -DRESULT=<csv> -DHISTORY=<csv> -DBASELINE=<csv>
+#         -DCOMPARE=<CompareThroughput> -DTOLERANCE=<fraction> -DCOMPARE_ARGS=<value_column|higher or lower|key_columns...>
+#         -P PerformanceTest.cmake
+#
+# The lists are separated by | because ctest would split them at ;. The CSV output of the benchmark is kept in
+# RESULT and appended with a time stamp to HISTORY for trending. The test fails if the benchmark fails or if
+# CompareThroughput finds a result slower than BASELINE. Without a baseline the results are only recorded.
+
+foreach(var BENCHMARK RESULT HISTORY BASELINE COMPARE TOLERANCE COMPARE_ARGS)
+  if(NOT DEFINED ${var})
+    message(FATAL_ERROR "${var} is not set")
+  endif()
+endforeach()
+string(REPLACE "|" ";" BENCHMARK "${BENCHMARK}")
+string(REPLACE "|" ";" COMPARE_ARGS "${COMPARE_ARGS}")
+
+execute_process(COMMAND ${BENCHMARK}
+  OUTPUT_FILE ${RESULT}
+  RESULT_VARIABLE status
+  )
+file(READ ${RESULT} output)
+message("${output}")
+if(NOT status EQUAL 0)
+  message(FATAL_ERROR "The benchmark failed: ${status}")
+endif()
+
+# Every line of the history is a line of the results with the time of the run in front
+string(TIMESTAMP now "%Y-%m-%dT%H:%M:%S")
+file(STRINGS ${RESULT} lines)
+if(NOT lines)
+  message(FATAL_ERROR "The benchmark wrote no results")
+endif()
+list(GET lines 0 header)
+if(NOT EXISTS ${HISTORY})
+  file(WRITE ${HISTORY} "time,${header}\n")
+endif()
+list(REMOVE_AT lines 0)
+foreach(line ${lines})
+  file(APPEND ${HISTORY} "${now},${line}\n")
+endforeach()
+
+if(NOT EXISTS ${BASELINE})
+  message(WARNING "There is no baseline ${BASELINE}, copy ${RESULT} there to compare the next runs with this one.")
+  return()
+endif()
+
+# The value column goes before the direction and the tolerance, the key columns after them
+list(GET COMPARE_ARGS 0 value_column)
+list(GET COMPARE_ARGS 1 direction)
+list(REMOVE_AT COMPARE_ARGS 0 1)
+execute_process(COMMAND ${COMPARE} ${BASELINE} ${RESULT} ${value_column} ${direction} ${TOLERANCE} ${COMPARE_ARGS}
+  RESULT_VARIABLE status
+  )
+if(NOT status EQUAL 0)
+  message(FATAL_ERROR "Slower than the baseline ${BASELINE}")
+endif()
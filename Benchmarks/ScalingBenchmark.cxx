@@ -0,0 +1,190 @@
+/**
+ * \file ScalingBenchmark.cxx
+ * \brief Runs UKFTractography end to end with an increasing number of threads and reports how it scales
+ *
+ * Every run is a separate process, so the wall time includes loading the data and writing the output, and the
+ * peak resident set size is that of the run alone. The thread counts are 1, 2, 4, ... and max_threads. The fiber
+ * and step rates are those of the tracking itself, taken from the final progress report of UKFTractography,
+ * which the benchmark enables with --progressInterval. Speedup and parallel efficiency refer to the wall time
+ * of the run with one thread.
+ *
+ * Usage: ScalingBenchmark UKFTractography max_threads UKFTractography-arguments...
+ *
+ * The arguments must not contain --numThreads or --progressInterval, e.g. for a phantom of SyntheticPhantom:
+ *
+ *   ScalingBenchmark ./UKFTractography 16 --dwiFile dwi.nrrd --maskFile mask.nrrd --seedsFile seeds.nrrd
+ *     --labels 1,2 --tracts /tmp/fibers.ukf
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+/** Long enough that the only report is the one at the end of the tracking */
+const char *PROGRESS_INTERVAL = "3600";
+
+/** Measurements of one run */
+struct RunResult
+  {
+  double seconds;
+  double fibers_per_second;
+  double steps_per_second;
+  double peak_rss_mb;
+  };
+
+/**
+ * Reads the rates from the last progress report in the output, e.g.
+ * "Progress: 100/100 seeds (100.0%), 0/0 branches, 12.5 fibers/s, 980.2 steps/s"
+*/
+void ParseProgress(const std::string& output, RunResult& result)
+{
+  result.fibers_per_second = 0;
+  result.steps_per_second = 0;
+  const size_t line_begin = output.rfind("Progress: ");
+  if( line_begin == std::string::npos )
+    {
+    return;
+    }
+  const std::string  line = output.substr(line_begin, output.find('\n', line_begin) - line_begin);
+  std::istringstream fields(line);
+  std::string        previous, field;
+  while( fields >> field )
+    {
+    if( field.compare(0, 8, "fibers/s") == 0 )
+      {
+      result.fibers_per_second = atof(previous.c_str() );
+      }
+    else if( field.compare(0, 7, "steps/s") == 0 )
+      {
+      result.steps_per_second = atof(previous.c_str() );
+      }
+    previous = field;
+    }
+}
+
+/**
+ * Runs the command and collects its output
+ * \return true on failure, i.e. if the command could not be run or did not exit with 0
+*/
+bool RunProcess(const std::vector<std::string>& command, RunResult& result, std::string& output)
+{
+  int pipe_fds[2];
+  if( pipe(pipe_fds) != 0 )
+    {
+    std::cout << "Could not create a pipe" << std::endl;
+    return true;
+    }
+
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  const pid_t                                 pid = fork();
+  if( pid < 0 )
+    {
+    std::cout << "Could not start " << command[0] << std::endl;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return true;
+    }
+  if( pid == 0 )
+    {
+    // The child writes stdout and stderr to the pipe
+    dup2(pipe_fds[1], STDOUT_FILENO);
+    dup2(pipe_fds[1], STDERR_FILENO);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    std::vector<char *> argv;
+    for( size_t i = 0; i < command.size(); ++i )
+      {
+      argv.push_back(const_cast<char *>(command[i].c_str() ) );
+      }
+    argv.push_back(NULL);
+    execv(argv[0], &argv[0]);
+    _exit(127);
+    }
+
+  close(pipe_fds[1]);
+  output.clear();
+  char    buffer[4096];
+  ssize_t num_read;
+  while( (num_read = read(pipe_fds[0], buffer, sizeof(buffer) ) ) > 0 )
+    {
+    output.append(buffer, num_read);
+    }
+  close(pipe_fds[0]);
+
+  int           status = 0;
+  struct rusage usage;
+  if( wait4(pid, &status, 0, &usage) != pid )
+    {
+    std::cout << "Could not wait for " << command[0] << std::endl;
+    return true;
+    }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+#ifdef __APPLE__
+  result.peak_rss_mb = usage.ru_maxrss / (1024.0 * 1024.0); // bytes
+#else
+  result.peak_rss_mb = usage.ru_maxrss / 1024.0;            // kilobytes
+#endif
+  ParseProgress(output, result);
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+}
+
+int main(int argc, char * *argv)
+{
+  const int max_threads = argc > 2 ? atoi(argv[2]) : 0;
+  if( max_threads < 1 )
+    {
+    std::cout << "Usage: " << argv[0] << " UKFTractography max_threads UKFTractography-arguments..." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::vector<int> thread_counts;
+  for( int n = 1; n < max_threads; n *= 2 )
+    {
+    thread_counts.push_back(n);
+    }
+  thread_counts.push_back(max_threads);
+
+  std::cout << "benchmark,threads,seconds,fibers_per_second,steps_per_second,speedup,efficiency,peak_rss_mb"
+            << std::endl;
+  double serial_seconds = 0;
+  for( size_t t = 0; t < thread_counts.size(); ++t )
+    {
+    std::ostringstream num_threads;
+    num_threads << thread_counts[t];
+    std::vector<std::string> command(argv + 1, argv + 2);
+    command.insert(command.end(), argv + 3, argv + argc);
+    command.push_back("--numThreads");
+    command.push_back(num_threads.str() );
+    command.push_back("--progressInterval");
+    command.push_back(PROGRESS_INTERVAL);
+
+    RunResult   result;
+    std::string output;
+    if( RunProcess(command, result, output) )
+      {
+      std::cout << "UKFTractography failed with " << thread_counts[t] << " threads:" << std::endl << output
+                << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( t == 0 )
+      {
+      serial_seconds = result.seconds;
+      }
+    const double speedup = serial_seconds / result.seconds;
+    std::cout << "scaling," << thread_counts[t] << "," << result.seconds << "," << result.fibers_per_second << ","
+              << result.steps_per_second << "," << speedup << "," << speedup / thread_counts[t] << ","
+              << result.peak_rss_mb << std::endl;
+    }
+  return EXIT_SUCCESS;
+}
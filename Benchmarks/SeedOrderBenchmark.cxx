@@ -0,0 +1,143 @@
+/**
+ * \file SeedOrderBenchmark.cxx
+ * \brief Measures the signal interpolation throughput of the tracking threads for the different seed orders
+ *
+ * Every seed walks a fixed pseudo-random path of short steps through a synthetic DWI volume and interpolates
+ * the signal at every step, which is the memory access pattern of the filter without its arithmetic. The
+ * threads claim contiguous chunks of the seed order like SeedWorkQueue does.
+ *
+ * Usage: SeedOrderBenchmark [size [gradients [threads [steps]]]]
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "NrrdData.h"
+#include "seed_order.h"
+#include "thread.h"
+#include "SyntheticDWI.h"
+
+namespace
+{
+const int SEED_STRIDE = 4;
+const int CHUNK_SIZE = 64;
+
+struct BenchmarkData
+  {
+  const NrrdData *         signal_data;
+  const stdVec_t *         seeds;
+  const std::vector<int> * order;
+  int                      num_steps;
+  std::atomic<int>         next;
+  };
+
+void WalkSeeds(int, void *arg)
+{
+  BenchmarkData *  data = static_cast<BenchmarkData *>(arg);
+  const int        num_seeds = static_cast<int>(data->seeds->size() );
+  const vec3_t     dim = data->signal_data->dim();
+  ukfVectorType    signal(data->signal_data->GetSignalDimension() * 2);
+  ukfPrecisionType checksum = 0;
+
+  for( ; ; )
+    {
+    const int begin = data->next.fetch_add(CHUNK_SIZE);
+    if( begin >= num_seeds )
+      {
+      break;
+      }
+    const int end = std::min(begin + CHUNK_SIZE, num_seeds);
+    for( int i = begin; i < end; ++i )
+      {
+      const int seed = data->order->empty() ? i : (*data->order)[i];
+      vec3_t    pos = (*data->seeds)[seed];
+      // Deterministic per seed, so that every order does exactly the same work
+      unsigned int state = 2654435761u * static_cast<unsigned int>(seed + 1);
+      for( int step = 0; step < data->num_steps; ++step )
+        {
+        data->signal_data->Interp3Signal(pos, signal);
+        checksum += signal[0];
+
+        state = state * 1664525u + 1013904223u;
+        const int axis = (state >> 16) % 3;
+        const ukfPrecisionType delta = (state & 0x8000u) ? 0.3 : -0.3;
+        pos[axis] = std::max(ukfZero, std::min(dim[axis] - 1, pos[axis] + delta) );
+        }
+      }
+    }
+  // Keeps the interpolation from being optimized away
+  if( checksum < 0 )
+    {
+    std::cout << checksum << std::endl;
+    }
+}
+}
+
+int main(int argc, char * *argv)
+{
+  const int size = argc > 1 ? atoi(argv[1]) : 96;
+  const int num_gradients = argc > 2 ? atoi(argv[2]) : 64;
+  const int num_threads = argc > 3 ? atoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency() );
+  const int num_steps = argc > 4 ? atoi(argv[4]) : 50;
+
+  if( size < 2 || num_gradients < 6 || num_threads < 1 || num_steps < 1 )
+    {
+    std::cout << "Usage: " << argv[0] << " [size [gradients [threads [steps]]]]" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  const int dims[3] = { size, size, size };
+  NrrdData  signal_data(0.0, 0.0);
+  if( signal_data.SetData(CreateSyntheticDWI(dims, num_gradients, 1000.0), CreateSyntheticMask(dims), NULL, true) )
+    {
+    std::cout << "Could not set up the synthetic DWI" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // Same scan order as NrrdData::GetSeeds produces for a label map
+  stdVec_t seeds;
+  for( int x = 0; x < size; x += SEED_STRIDE )
+    {
+    for( int y = 0; y < size; y += SEED_STRIDE )
+      {
+      for( int z = 0; z < size; z += SEED_STRIDE )
+        {
+        seeds.push_back(vec3_t(x, y, z) );
+        }
+      }
+    }
+  TrackingThreadPool pool(num_threads);
+
+  std::cout << "benchmark,order,size,gradients,threads,seeds,steps,seconds,samples_per_second" << std::endl;
+  const SeedOrder orders[] = { SEED_ORDER_NONE, SEED_ORDER_MORTON, SEED_ORDER_HILBERT };
+  const char *    order_names[] = { "none", "morton", "hilbert" };
+  for( int o = 0; o < 3; ++o )
+    {
+    std::vector<int> order;
+    if( orders[o] != SEED_ORDER_NONE )
+      {
+      SpatialSeedOrder(seeds, orders[o], order);
+      }
+
+    BenchmarkData data;
+    data.signal_data = &signal_data;
+    data.seeds = &seeds;
+    data.order = &order;
+    data.num_steps = num_steps;
+    data.next = 0;
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pool.Execute(WalkSeeds, &data);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const double samples = static_cast<double>(seeds.size() ) * num_steps;
+    std::cout << "seed_order," << order_names[o] << "," << size << "," << num_gradients << "," << num_threads
+              << "," << seeds.size() << "," << num_steps << "," << seconds << "," << samples / seconds
+              << std::endl;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+/**
+ * \file SyntheticDWI.cxx
+ * \brief implementation of SyntheticDWI.h
+*/
+
+#include "SyntheticDWI.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace
+{
+const double VOXEL_SPACING = 2.0;
+}
+
+Nrrd * AllocateSyntheticVolume(const int type, const size_t num_values, const int size[3])
+{
+  Nrrd *     nrrd = nrrdNew();
+  const bool failed = num_values > 1 ?
+    nrrdAlloc_va(nrrd, type, 4, num_values, static_cast<size_t>(size[0]), static_cast<size_t>(size[1]),
+                 static_cast<size_t>(size[2]) ) :
+    nrrdAlloc_va(nrrd, type, 3, static_cast<size_t>(size[0]), static_cast<size_t>(size[1]),
+                 static_cast<size_t>(size[2]) );
+  if( failed )
+    {
+    char *err = biffGetDone(NRRD);
+    std::cout << "Could not allocate the synthetic volume: " << err << std::endl;
+    free( err );
+    nrrdNuke(nrrd);
+    return NULL;
+    }
+  return nrrd;
+}
+
+void SetSyntheticSpatialAxes(Nrrd *nrrd, const int size[3], const double spacing)
+{
+  nrrdSpaceSet(nrrd, nrrdSpaceRightAnteriorSuperior);
+  const unsigned int first = nrrd->dim - 3;
+  for( unsigned int d = 0; d < 3; ++d )
+    {
+    nrrd->axis[first + d].kind = nrrdKindSpace;
+    for( unsigned int e = 0; e < 3; ++e )
+      {
+      nrrd->axis[first + d].spaceDirection[e] = (d == e) ? spacing : 0.0;
+      nrrd->measurementFrame[d][e] = (d == e) ? 1.0 : 0.0;
+      }
+    nrrd->spaceOrigin[d] = -0.5 * (size[d] - 1) * spacing;
+    }
+}
+
+stdVec_t SyntheticGradients(const int num_gradients)
+{
+  stdVec_t gradients(num_gradients);
+  const ukfPrecisionType golden_angle = M_PI * (3.0 - std::sqrt(5.0) );
+  for( int i = 0; i < num_gradients; ++i )
+    {
+    // z runs over (0, 1], i.e. the upper half sphere
+    const ukfPrecisionType z = 1.0 - (i + 0.5) / num_gradients;
+    const ukfPrecisionType r = std::sqrt(1.0 - z * z);
+    gradients[i] = vec3_t(r * std::cos(golden_angle * i), r * std::sin(golden_angle * i), z);
+    }
+  return gradients;
+}
+
+Nrrd * CreateSyntheticDWI(const int size[3], const int num_gradients, const ukfPrecisionType b_value)
+{
+  Nrrd *nrrd = AllocateSyntheticVolume(nrrdTypeFloat, static_cast<size_t>(num_gradients), size);
+  if( !nrrd )
+    {
+    return NULL;
+    }
+  SetSyntheticSpatialAxes(nrrd, size, VOXEL_SPACING);
+  nrrd->axis[0].kind = nrrdKindList;
+
+  const stdVec_t gradients = SyntheticGradients(num_gradients);
+
+  std::ostringstream b;
+  b << b_value;
+  nrrdKeyValueAdd(nrrd, "modality", "DWMRI");
+  nrrdKeyValueAdd(nrrd, "DWMRI_b-value", b.str().c_str() );
+  for( int i = 0; i < num_gradients; ++i )
+    {
+    std::ostringstream key, value;
+    key << "DWMRI_gradient_" << std::setfill('0') << std::setw(4) << i;
+    value << gradients[i][0] << " " << gradients[i][1] << " " << gradients[i][2];
+    nrrdKeyValueAdd(nrrd, key.str().c_str(), value.str().c_str() );
+    }
+
+  // Single tensor along x with typical white matter diffusivities, in mm^2/s
+  const ukfPrecisionType l1 = 1.7e-3;
+  const ukfPrecisionType l2 = 0.3e-3;
+  std::vector<float> voxel_signal(num_gradients);
+  for( int i = 0; i < num_gradients; ++i )
+    {
+    const vec3_t& g = gradients[i];
+    voxel_signal[i] = static_cast<float>(std::exp(-b_value * (l1 * g[0] * g[0] + l2 * (g[1] * g[1] + g[2] * g[2]) ) ) );
+    }
+
+  float *      data = static_cast<float *>(nrrd->data);
+  const size_t num_voxels = static_cast<size_t>(size[0]) * size[1] * size[2];
+  for( size_t v = 0; v < num_voxels; ++v )
+    {
+    for( int i = 0; i < num_gradients; ++i )
+      {
+      data[v * num_gradients + i] = voxel_signal[i];
+      }
+    }
+  return nrrd;
+}
+
+Nrrd * CreateSyntheticMask(const int size[3])
+{
+  Nrrd *nrrd = AllocateSyntheticVolume(nrrdTypeUChar, 1, size);
+  if( !nrrd )
+    {
+    return NULL;
+    }
+  unsigned char *data = static_cast<unsigned char *>(nrrd->data);
+  const size_t   num_voxels = static_cast<size_t>(size[0]) * size[1] * size[2];
+  for( size_t v = 0; v < num_voxels; ++v )
+    {
+    data[v] = 1;
+    }
+  return nrrd;
+}
@@ -0,0 +1,42 @@
+/**
+ * \file SyntheticDWI.h
+ * \brief In-memory diffusion volumes for the benchmarks, so that they do not depend on test data
+*/
+
+#ifndef SYNTHETICDWI_H_
+#define SYNTHETICDWI_H_
+
+#include <cstddef>
+#include <teem/nrrd.h>
+#include "linalg.h"
+
+/**
+ * Allocates a volume of size[0] x size[1] x size[2] voxels, with num_values values per voxel on a leading
+ * axis if num_values is larger than one
+ * \return a new Nrrd, or NULL on failure
+*/
+Nrrd * AllocateSyntheticVolume(const int type, const size_t num_values, const int size[3]);
+
+/**
+ * Sets RAS space, isotropic voxels of the given spacing and an origin that centres the volume on the last three
+ * axes, which are the spatial ones
+*/
+void SetSyntheticSpatialAxes(Nrrd *nrrd, const int size[3], const double spacing);
+
+/** Unit gradient directions spread evenly over the half sphere (golden spiral) */
+stdVec_t SyntheticGradients(const int num_gradients);
+
+/**
+ * \brief Creates a normalized DWI volume in the layout NrrdData expects after dwiNormalize
+ *
+ * The gradient axis is the fastest axis, the space is RAS with 2mm isotropic voxels centred on the origin. Every
+ * voxel holds the normalized signal of a single tensor along the first axis.
+ *
+ * \return a new Nrrd, owned by the NrrdData it is passed to, or NULL on failure
+*/
+Nrrd * CreateSyntheticDWI(const int size[3], const int num_gradients, const ukfPrecisionType b_value);
+
+/** Creates an unsigned char brain mask of the given size that covers the whole volume */
+Nrrd * CreateSyntheticMask(const int size[3]);
+
+#endif // SYNTHETICDWI_H_
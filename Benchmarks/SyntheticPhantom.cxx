@@ -0,0 +1,326 @@
+/**
+ * \file SyntheticPhantom.cxx
+ * \brief Writes a DWI volume of two crossing fiber bundles, with a mask and seeds, for end-to-end benchmarks
+ *
+ * The bundles are straight cylinders through the centre of the volume. The signal of every voxel class
+ * (background, either bundle, crossing) is computed once with the H function of a filter model, so the phantom
+ * holds exactly what the filter expects to see; only the noise differs between voxels.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <teem/nrrd.h>
+#include "filter_NODDI1F.h"
+#include "filter_Simple2T.h"
+#include "SyntheticDWI.h"
+#include "SyntheticPhantomCLP.h"
+
+namespace
+{
+/** Mean b=0 signal, leaves room for the noise in a short */
+const ukfPrecisionType BASELINE_SIGNAL = 1000.0;
+
+/** Voxel classes of the phantom, also the index of their signal */
+enum PhantomClass
+  {
+  PHANTOM_BACKGROUND,
+  PHANTOM_BUNDLE1,
+  PHANTOM_BUNDLE2,
+  PHANTOM_CROSSING
+  };
+
+/**
+ * \class PhantomProtocol
+ * \brief The gradients and b-values of the phantom, which is all the forward models read from the signal data
+ *
+ * Holds the reversed gradients as well, like NrrdData after loading.
+*/
+class PhantomProtocol : public ISignalData
+{
+public:
+  PhantomProtocol(const stdVec_t& gradients, const std::vector<ukfPrecisionType>& b_values)
+    : ISignalData(ukfZero, ukfZero), _num_gradients(static_cast<int>(gradients.size() ) )
+  {
+    _gradients = gradients;
+    _b_values.resize(2 * _num_gradients);
+    for( int i = 0; i < _num_gradients; ++i )
+      {
+      _gradients.push_back(-gradients[i]);
+      _b_values[i] = _b_values[i + _num_gradients] = b_values[i];
+      }
+  }
+
+  virtual void Interp3Signal(const vec3_t &, ukfVectorType & signal) const
+  {
+    signal.setZero();
+  }
+
+  virtual ukfPrecisionType Interp3ScalarMask(const vec3_t &) const
+  {
+    return ukfZero;
+  }
+
+  virtual ukfPrecisionType ScalarMaskValue(const vec3_t &) const
+  {
+    return ukfZero;
+  }
+
+  virtual void GetSeeds(const std::vector<int> &, stdVec_t &) const
+  {
+  }
+
+  virtual const stdVec_t & gradients() const
+  {
+    return _gradients;
+  }
+
+  virtual const ukfVectorType & GetBValues() const
+  {
+    return _b_values;
+  }
+
+  virtual int GetSignalDimension() const
+  {
+    return _num_gradients;
+  }
+
+  virtual bool LoadData(const std::string &, const std::string &, const std::string &, const bool, const bool)
+  {
+    return true;
+  }
+
+  virtual vec3_t dim() const
+  {
+    return vec3_t(0, 0, 0);
+  }
+
+private:
+  const int     _num_gradients;
+  stdVec_t      _gradients;
+  ukfVectorType _b_values;
+};
+
+/** Evaluates H for one state, the signal is returned without the reversed gradients */
+void ForwardModel(const FilterModel& model, const State& state, const int num_gradients, ukfVectorType& signal)
+{
+  ukfMatrixType X(state.size(), 1);
+  X.col(0) = state;
+  ukfMatrixType Y(2 * num_gradients, 1);
+  model.H(X, Y);
+  signal = Y.col(0).head(num_gradients);
+}
+
+/**
+ * The normalized signal of every PhantomClass, with the 2-tensor simple model or the NODDI 1-fiber model
+ * \param[in] directions The directions of the two bundles
+*/
+void PhantomSignals(const bool noddi, const PhantomProtocol& protocol, const vec3_t directions[2],
+                    std::vector<ukfVectorType>& signals)
+{
+  const int num_gradients = protocol.GetSignalDimension();
+  signals.resize(4);
+  if( !noddi )
+    {
+    // Typical white matter and grey matter diffusivities, in the units of the filter state
+    const ukfPrecisionType l_parallel = 1700.0;
+    const ukfPrecisionType l_perpendicular = 300.0;
+    const ukfPrecisionType l_isotropic = 900.0;
+
+    ukfVectorType weights(2);
+    weights << ukfHalf, ukfHalf;
+    Simple2T model(ukfZero, ukfZero, ukfZero, weights, false);
+    model.set_signal_data(const_cast<PhantomProtocol *>(&protocol) );
+    model.set_signal_dim(2 * num_gradients);
+
+    for( int c = 0; c < 4; ++c )
+      {
+      // A single bundle is a crossing of the bundle with itself, the background has no direction
+      const vec3_t& m1 = directions[c == PHANTOM_BUNDLE2 ? 1 : 0];
+      const vec3_t& m2 = directions[c == PHANTOM_BUNDLE1 ? 0 : 1];
+      const ukfPrecisionType l1 = c == PHANTOM_BACKGROUND ? l_isotropic : l_parallel;
+      const ukfPrecisionType l2 = c == PHANTOM_BACKGROUND ? l_isotropic : l_perpendicular;
+      State state(10);
+      state << m1[0], m1[1], m1[2], l1, l2, m2[0], m2[1], m2[2], l1, l2;
+      ForwardModel(model, state, num_gradients, signals[c]);
+      }
+    return;
+    }
+
+  // Intra-cellular volume fraction, concentration and isotropic fraction of the bundles
+  const ukfPrecisionType vic = 0.6;
+  const ukfPrecisionType kappa = 8.0;
+  const ukfPrecisionType viso = 0.1;
+
+  ukfVectorType weights(1);
+  weights << ukfOne;
+  NODDI1F model(ukfZero, ukfZero, ukfZero, ukfZero, weights, false);
+  model.set_signal_data(const_cast<PhantomProtocol *>(&protocol) );
+  model.set_signal_dim(2 * num_gradients);
+
+  ukfVectorType bundles[2];
+  for( int b = 0; b < 2; ++b )
+    {
+    State state(6);
+    state << directions[b][0], directions[b][1], directions[b][2], vic, kappa, viso;
+    ForwardModel(model, state, num_gradients, bundles[b]);
+    }
+  // Free water only
+  State state(6);
+  state << ukfOne, ukfZero, ukfZero, vic, kappa, ukfOne;
+  ForwardModel(model, state, num_gradients, signals[PHANTOM_BACKGROUND]);
+  signals[PHANTOM_BUNDLE1] = bundles[0];
+  signals[PHANTOM_BUNDLE2] = bundles[1];
+  signals[PHANTOM_CROSSING] = ukfHalf * (bundles[0] + bundles[1]);
+}
+
+/** Saves and frees a volume, true on failure */
+bool SaveVolume(Nrrd *nrrd, const std::string& file_name)
+{
+  const bool failed = nrrdSave(file_name.c_str(), nrrd, NULL) != 0;
+  if( failed )
+    {
+    char *txt = biffGetDone(NRRD);
+    std::cout << "Could not write " << file_name << ": " << txt << std::endl;
+    free( txt );
+    }
+  nrrdNuke(nrrd);
+  return failed;
+}
+}
+
+int main(int argc, char * *argv)
+{
+  PARSE_ARGS;
+
+  if( dwiFile.empty() || maskFile.empty() || seedsFile.empty() )
+    {
+    std::cout << "Error! Must indicate the DWI, mask and seeds output files!" << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( size.size() != 3 || size[0] < 1 || size[1] < 1 || size[2] < 1 )
+    {
+    std::cout << "Error! The size must have three positive components!" << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( bValues.empty() )
+    {
+    std::cout << "Error! At least one b-value is needed!" << std::endl;
+    return EXIT_FAILURE;
+    }
+  ukfPrecisionType max_b_value = 0;
+  for( size_t s = 0; s < bValues.size(); ++s )
+    {
+    if( bValues[s] <= 0 )
+      {
+      std::cout << "Error! The b-values must be positive!" << std::endl;
+      return EXIT_FAILURE;
+      }
+    max_b_value = std::max(max_b_value, static_cast<ukfPrecisionType>(bValues[s]) );
+    }
+
+  // Every shell has the same directions
+  const stdVec_t                directions = SyntheticGradients(numGradients);
+  stdVec_t                      gradients;
+  std::vector<ukfPrecisionType> b_values;
+  for( size_t s = 0; s < bValues.size(); ++s )
+    {
+    gradients.insert(gradients.end(), directions.begin(), directions.end() );
+    b_values.insert(b_values.end(), directions.size(), bValues[s]);
+    }
+  const PhantomProtocol protocol(gradients, b_values);
+
+  const ukfPrecisionType angle = crossingAngle * M_PI / 180.0;
+  const vec3_t           bundle_directions[2] = { vec3_t(1, 0, 0), vec3_t(std::cos(angle), std::sin(angle), 0) };
+  std::vector<ukfVectorType> signals;
+  PhantomSignals(model == "noddi", protocol, bundle_directions, signals);
+
+  const size_t num_values = numBaselines + gradients.size();
+  Nrrd *       dwi = AllocateSyntheticVolume(nrrdTypeShort, num_values, &size[0]);
+  Nrrd *       mask = AllocateSyntheticVolume(nrrdTypeUChar, 1, &size[0]);
+  Nrrd *       seeds = AllocateSyntheticVolume(nrrdTypeUChar, 1, &size[0]);
+  if( !dwi || !mask || !seeds )
+    {
+    nrrdNuke(dwi);
+    nrrdNuke(mask);
+    nrrdNuke(seeds);
+    return EXIT_FAILURE;
+    }
+  SetSyntheticSpatialAxes(dwi, &size[0], spacing);
+  SetSyntheticSpatialAxes(mask, &size[0], spacing);
+  SetSyntheticSpatialAxes(seeds, &size[0], spacing);
+  dwi->axis[0].kind = nrrdKindList;
+
+  // The b-value of the header belongs to unit gradients, the other shells have shorter gradients
+  std::ostringstream b;
+  b << max_b_value;
+  nrrdKeyValueAdd(dwi, "modality", "DWMRI");
+  nrrdKeyValueAdd(dwi, "DWMRI_b-value", b.str().c_str() );
+  for( size_t i = 0; i < num_values; ++i )
+    {
+    std::ostringstream key, value;
+    key << "DWMRI_gradient_" << std::setfill('0') << std::setw(4) << i;
+    if( i < static_cast<size_t>(numBaselines) )
+      {
+      value << "0 0 0";
+      }
+    else
+      {
+      const size_t k = i - numBaselines;
+      const vec3_t g = gradients[k] * std::sqrt(b_values[k] / max_b_value);
+      value << std::setprecision(10) << g[0] << " " << g[1] << " " << g[2];
+      }
+    nrrdKeyValueAdd(dwi, key.str().c_str(), value.str().c_str() );
+    }
+
+  // Rician noise: Gaussian noise on the real and the imaginary part of the signal
+  std::mt19937                             generator(randomSeed);
+  std::normal_distribution<ukfPrecisionType> gaussian(ukfZero, noise * BASELINE_SIGNAL);
+  short *                                  dwi_data = static_cast<short *>(dwi->data);
+  unsigned char *                          mask_data = static_cast<unsigned char *>(mask->data);
+  unsigned char *                          seeds_data = static_cast<unsigned char *>(seeds->data);
+  size_t                                   voxel = 0;
+  for( int z = 0; z < size[2]; ++z )
+    {
+    for( int y = 0; y < size[1]; ++y )
+      {
+      for( int x = 0; x < size[0]; ++x, ++voxel )
+        {
+        // Distance of the voxel centre to the axis of each bundle
+        const vec3_t p = spacing * vec3_t(x - 0.5 * (size[0] - 1), y - 0.5 * (size[1] - 1), z - 0.5 * (size[2] - 1) );
+        const bool   in1 = (p - p.dot(bundle_directions[0]) * bundle_directions[0]).norm() <= bundleRadius;
+        const bool   in2 = (p - p.dot(bundle_directions[1]) * bundle_directions[1]).norm() <= bundleRadius;
+        const int    c = in1 ? (in2 ? PHANTOM_CROSSING : PHANTOM_BUNDLE1) : (in2 ? PHANTOM_BUNDLE2 : PHANTOM_BACKGROUND);
+
+        mask_data[voxel] = 1;
+        seeds_data[voxel] = c == PHANTOM_BACKGROUND ? 0 : (c == PHANTOM_CROSSING ? 2 : 1);
+        for( size_t i = 0; i < num_values; ++i )
+          {
+          const ukfPrecisionType clean =
+            BASELINE_SIGNAL * (i < static_cast<size_t>(numBaselines) ? ukfOne : signals[c][i - numBaselines]);
+          ukfPrecisionType value = clean;
+          if( noise > 0 )
+            {
+            const ukfPrecisionType real = clean + gaussian(generator);
+            const ukfPrecisionType imaginary = gaussian(generator);
+            value = std::sqrt(real * real + imaginary * imaginary);
+            }
+          dwi_data[voxel * num_values + i] = static_cast<short>(std::min(std::floor(value + 0.5), 32767.0) );
+          }
+        }
+      }
+    }
+
+  // All three are saved, or at least freed, even if one fails
+  const bool dwi_failed = SaveVolume(dwi, dwiFile);
+  const bool mask_failed = SaveVolume(mask, maskFile);
+  const bool seeds_failed = SaveVolume(seeds, seedsFile);
+  return (dwi_failed || mask_failed || seeds_failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
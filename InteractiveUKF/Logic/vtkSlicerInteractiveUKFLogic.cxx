@@ -40,6 +40,7 @@
 #endif
 
 // VTK includes
+#include <vtkCommand.h>
 #include <vtkNew.h>
 #include <vtkIntArray.h>
 #include <vtkObjectFactory.h>
@@ -54,6 +55,7 @@
 #include "teem/nrrd.h"
 
 // STD includes
+#include <algorithm>
 #include <cassert>
 
 // UKF includes
@@ -84,6 +86,14 @@ void vtkSlicerInteractiveUKFLogic::PrintSelf(ostream& os, vtkIndent indent)
   this->Superclass::PrintSelf(os, indent);
 }
 
+// Forwards the progress of Tractography::Run to the observers of the logic
+static void ProgressCallback(const TractographyProgress& progress, void* client_data)
+{
+  vtkSlicerInteractiveUKFLogic* logic = static_cast<vtkSlicerInteractiveUKFLogic*>(client_data);
+  double fraction = static_cast<double>(progress.seeds_done) / std::max(progress.seeds_total, 1L);
+  logic->InvokeEvent(vtkCommand::ProgressEvent, &fraction);
+}
+
 static int CLILoader(int argc, char** argv)
 {
   UKFSettings ukf_settings;
@@ -292,7 +302,9 @@ void vtkSlicerInteractiveUKFLogic::RunFromSeedPoints
   tract->SetSeeds(seeds);
 
   tract->SetOutputPolyData(pd);
+  tract->SetProgressCallback(ProgressCallback, this);
   tract->Run();
+  tract->SetProgressCallback(NULL, NULL);
 
   // TODO fix
   // work around https://issues.slicer.org/view.php?id=3786
@@ -300,6 +312,13 @@ void vtkSlicerInteractiveUKFLogic::RunFromSeedPoints
   this->producer->Modified();
 }
 
+//---------------------------------------------------------------------------
+void vtkSlicerInteractiveUKFLogic::CancelTractography()
+{
+  if (!g_tracto) return;
+  g_tracto->Cancel();
+}
+
 void vtkSlicerInteractiveUKFLogic::set_seedsPerVoxel(double val) {
   if (!g_tracto) return;
   g_tracto->_seeds_per_voxel = val;
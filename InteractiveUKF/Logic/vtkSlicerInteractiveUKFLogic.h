@@ -62,6 +62,11 @@ public:
                          vtkMRMLMarkupsFiducialNode*);
                          // int pointId);
 
+  /// Stops a running RunFromSeedPoints, no fibers are output. Can be called from a
+  /// vtkCommand::ProgressEvent observer, which RunFromSeedPoints invokes with the fraction of
+  /// the seeds traced every progressInterval seconds.
+  void CancelTractography();
+
   void set_seedsPerVoxel(double val);
   void set_stoppingFA(double val);
   void set_seedingThreshold(double val);
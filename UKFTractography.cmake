@@ -61,6 +61,15 @@ endif()
 
 find_package(ZLIB REQUIRED)
 
+option(UKF_USE_LZ4 "Compress .vtp output with LZ4 on several threads (needs liblz4)" OFF)
+if(UKF_USE_LZ4)
+  find_path(LZ4_INCLUDE_DIR lz4.h)
+  find_library(LZ4_LIBRARY lz4)
+  if(NOT LZ4_INCLUDE_DIR OR NOT LZ4_LIBRARY)
+    message(FATAL_ERROR "UKF_USE_LZ4 is set but lz4.h or the lz4 library was not found")
+  endif()
+endif()
+
 #
 #-----------------------------------------------------------------------------
 find_package(Teem REQUIRED)
@@ -92,6 +101,10 @@ if(NOT ${PRIMARY_PROJECT_NAME}_BUILD_SLICER_EXTENSION)
   if(USE_fibertractdispersion)
     add_subdirectory(fibertractdispersion)
   endif()
+  option(USE_Benchmarks "Build the performance benchmarks" OFF)
+  if(USE_Benchmarks)
+    add_subdirectory(Benchmarks)
+  endif()
   option(USE_CompressedSensing "Build the CompressedSensing program" OFF)
   if(USE_CompressedSensing)
     add_subdirectory(CompressedSensing)
@@ -2,6 +2,9 @@
 #include "vtkSmartPointer.h"
 #include "vtkPolyData.h"
 #include "vtkPolyDataIO.h"
+#include "vtp_block_writer.h"
+#include "tract_file.h"
+#include <thread>
 
 int main(int argc, char *argv[])
 {
@@ -17,15 +20,68 @@ int main(int argc, char *argv[])
     std::cerr << "Missing output filename" << std::endl;
     return EXIT_FAILURE;
     }
+  VtpCompressor vtp_compressor;
+  if( ParseVtpCompressor(compressor, vtp_compressor) )
+    {
+    return EXIT_FAILURE;
+    }
+  const int num_threads = numThreads > 0 ? numThreads : static_cast<int>(std::thread::hardware_concurrency() );
+
   vtkSmartPointer<vtkPolyData> pd;
-  try
+  if( itksys::SystemTools::GetFilenameExtension(inputFile) == ".ukf" )
     {
-    pd = vtkPolyDataIO::Read(inputFile.c_str());
+    TractFile file;
+    pd = vtkSmartPointer<vtkPolyData>::New();
+    if( file.Open(inputFile) || TractFileToPolyData(file, pd) )
+      {
+      std::cerr << "Failed reading " << inputFile << std::endl;
+      return EXIT_FAILURE;
+      }
     }
-  catch(...)
+  else
     {
-    std::cerr << "Failed reading " << inputFile << std::endl;
-    return EXIT_FAILURE;
+    try
+      {
+      pd = vtkPolyDataIO::Read(inputFile.c_str());
+      }
+    catch(...)
+      {
+      std::cerr << "Failed reading " << inputFile << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  const std::string ext(itksys::SystemTools::GetFilenameExtension(outputFile));
+  if( ext == ".ukf" )
+    {
+    TractFileWriter writer;
+    writer.SetWriteCompressed(!writeUnCompressed);
+    writer.SetCompressor(vtp_compressor);
+    writer.SetNumberOfThreads(num_threads);
+    writer.SetMaximumError(maxPositionError, maxScalarError);
+    if( writer.Write(pd, outputFile) )
+      {
+      std::cerr << "Failed writing " << outputFile << std::endl;
+      return EXIT_FAILURE;
+      }
+    return EXIT_SUCCESS;
+    }
+  // Compressed VTP files are written with the blocks compressed in parallel when the data allows it
+  if( ext == ".vtp" && !writeAscii && !writeUnCompressed &&
+      VtpBlockWriter::IsCompressorAvailable(vtp_compressor) && VtpBlockWriter::CanWrite(pd) )
+    {
+    VtpBlockWriter writer;
+    writer.SetNumberOfThreads(num_threads);
+    writer.SetCompressor(vtp_compressor);
+    if( writer.Write(pd, outputFile) )
+      {
+      std::cerr << "Failed writing " << outputFile << std::endl;
+      return EXIT_FAILURE;
+      }
+    return EXIT_SUCCESS;
+    }
+  if( vtp_compressor != VTP_COMPRESSOR_ZLIB )
+    {
+    std::cout << "LZ4 compression is not available for this output, writing zlib compressed data." << std::endl;
     }
   try
     {
@@ -9,6 +9,7 @@
 #include "itksys/SystemTools.hxx"
 #include <iostream>
 #include <cmath>
+#include <cstdlib>
 
 #ifndef EXIT_FAILURE
 #define EXIT_FAILURE 1
@@ -45,9 +46,11 @@ int main(int argc, char *argv[])
   if( argc < 3 )
     {
     std::cerr << "Usage:" << std::endl;
-    std::cerr << argv[0] << "testFiber compareFiber" << std::endl;
+    std::cerr << argv[0] << "testFiber compareFiber [pointTolerance [scalarTolerance]]" << std::endl;
     return EXIT_FAILURE;
     }
+  // Allow for a cummulative 100th of a voxel error by default
+  const ukfPrecisionType TOLERANCE = argc > 3 ? atof(argv[3]) : 1.0E-1;
 
   vtkSmartPointer<vtkPolyData> input1 = ReadPolyData(argv[1]);
   vtkSmartPointer<vtkPolyData> input2 = ReadPolyData(argv[2]);
@@ -82,7 +85,6 @@ int main(int argc, char *argv[])
     const ukfPrecisionType distance = sqrt( ((pt1[0] - pt2[0]) * (pt1[0] - pt2[0]))
                             + ((pt1[1] - pt2[1]) * (pt1[1] - pt2[1]))
                             + ((pt1[2] - pt2[2]) * (pt1[2] - pt2[2])));
-    const ukfPrecisionType TOLERANCE=1.0E-1; // Allow for a cummulative 100th of a voxel error
     if(distance > TOLERANCE)
       {
       std::cerr << "Difference in Points is above tolerance (" << TOLERANCE << "): " << distance << std::endl;
@@ -123,7 +125,12 @@ int main(int argc, char *argv[])
     if(array2 == 0)
       {
       std::cerr << "component " << curname << " missing in second file" << std::endl;
-      rval = EXIT_FAILURE;
+      // Only the arrays of compareFiber are checked when a scalar tolerance is given, so that a run that
+      // records more can be compared with a baseline
+      if(argc <= 4)
+        {
+        rval = EXIT_FAILURE;
+        }
       continue;
       }
     vtkFloatArray *farray1 = vtkFloatArray::SafeDownCast(array1);
@@ -151,6 +158,42 @@ int main(int argc, char *argv[])
       }
     }
 
+  // With a scalar tolerance every value of every numeric array of compareFiber is checked, e.g. to bound the
+  // error of lossy output against the lossless one
+  if(argc > 4)
+    {
+    const double SCALAR_TOLERANCE = atof(argv[4]);
+    for(int i = 0; i < pd2->GetNumberOfArrays(); ++i)
+      {
+      vtkDataArray *array2 = pd2->GetArray(i);
+      if(array2 == 0)
+        {
+        continue;
+        }
+      vtkDataArray *array1 = pd1->GetArray(array2->GetName());
+      if(array1 == 0 ||
+         array1->GetNumberOfTuples() != array2->GetNumberOfTuples() ||
+         array1->GetNumberOfComponents() != array2->GetNumberOfComponents())
+        {
+        std::cerr << "Array " << array2->GetName() << " is missing or differs in size" << std::endl;
+        return EXIT_FAILURE;
+        }
+      for(vtkIdType j = 0; j < array1->GetNumberOfTuples(); ++j)
+        {
+        for(int c = 0; c < array1->GetNumberOfComponents(); ++c)
+          {
+          const double difference = fabs(array1->GetComponent(j, c) - array2->GetComponent(j, c));
+          if(difference > SCALAR_TOLERANCE)
+            {
+            std::cerr << "Difference in " << array2->GetName() << " is above tolerance ("
+                      << SCALAR_TOLERANCE << "): " << difference << std::endl;
+            return EXIT_FAILURE;
+            }
+          }
+        }
+      }
+    }
+
   if(rval == EXIT_SUCCESS)
     {
     std::cout << "Test succeded!\n";
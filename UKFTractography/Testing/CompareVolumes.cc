@@ -0,0 +1,80 @@
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageRegionConstIterator.h"
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+
+typedef itk::Image<float, 3>                      VolumeType;
+typedef itk::ImageFileReader<VolumeType>          ReaderType;
+typedef itk::ImageRegionConstIterator<VolumeType> IteratorType;
+
+VolumeType::Pointer
+ReadVolume(const char *filename)
+{
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(filename);
+  reader->Update();
+  return reader->GetOutput();
+}
+
+// Compares the voxels of two volumes of the same size, e.g. a map written while tracking with the one
+// vtk2mask makes from the tract file
+int main(int argc, char *argv[])
+{
+  if( argc < 3 )
+    {
+    std::cerr << "Usage:" << std::endl;
+    std::cerr << argv[0] << " testVolume compareVolume [tolerance]" << std::endl;
+    return EXIT_FAILURE;
+    }
+  const double TOLERANCE = argc > 3 ? atof(argv[3]) : 1.0E-4;
+
+  VolumeType::Pointer volume1;
+  VolumeType::Pointer volume2;
+  try
+    {
+    volume1 = ReadVolume(argv[1]);
+    volume2 = ReadVolume(argv[2]);
+    }
+  catch( itk::ExceptionObject & e )
+    {
+    std::cerr << e << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  const VolumeType::RegionType region = volume1->GetLargestPossibleRegion();
+  if( region.GetSize() != volume2->GetLargestPossibleRegion().GetSize() )
+    {
+    std::cerr << "Size mismatch: " << region.GetSize() << " "
+              << volume2->GetLargestPossibleRegion().GetSize() << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  IteratorType it1(volume1, region);
+  IteratorType it2(volume2, region);
+  long         nonzero = 0;
+  for( it1.GoToBegin(), it2.GoToBegin(); !it1.IsAtEnd(); ++it1, ++it2 )
+    {
+    const double difference = fabs(it1.Get() - it2.Get() );
+    if( difference > TOLERANCE )
+      {
+      std::cerr << "Difference at " << it1.GetIndex() << " is above tolerance (" << TOLERANCE << "): "
+                << it1.Get() << " " << it2.Get() << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( it2.Get() != 0 )
+      {
+      ++nonzero;
+      }
+    }
+  std::cerr << "Non-zero voxels " << nonzero << std::endl;
+  if( nonzero == 0 )
+    {
+    std::cerr << "The volumes are empty" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test succeded!\n";
+  return EXIT_SUCCESS;
+}
@@ -20,6 +20,19 @@
 #include "vtkPolyData.h"
 
 
+namespace
+{
+/** Reports the tracking progress to Slicer, which reads the filter-progress tags from the CLI output */
+void SlicerProgressCallback(const TractographyProgress& progress, void *)
+{
+  if( progress.seeds_total > 0 )
+    {
+    std::cout << "<filter-progress>" << static_cast<double>(progress.seeds_done) / progress.seeds_total
+              << "</filter-progress>" << std::endl;
+    }
+}
+}
+
 extern "C" {
 
 int ModuleEntryPoint(int argc, char **argv)
@@ -58,6 +71,7 @@ int ModuleEntryPoint(int argc, char **argv)
   // if specified on command line, write out binary tract file
   tract->SetWriteBinary(!ukf_settings.writeAsciiTracts);
   tract->SetWriteCompressed(!ukf_settings.writeUncompressedTracts);
+  tract->SetProgressCallback(SlicerProgressCallback, NULL);
 
   int writeStatus = 0;
   try
@@ -96,6 +110,11 @@ int ModuleEntryPoint(int argc, char **argv)
     writeStatus = EXIT_FAILURE;
     }
 
+  if( tract->WriteRunReport(writeStatus) )
+    {
+    writeStatus = EXIT_FAILURE;
+    }
+
   // Clean up.
   delete tract;
 
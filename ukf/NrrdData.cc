@@ -6,19 +6,23 @@
 #include "NrrdData.h"
 #include "ISignalData.h"
 #include "dwi_normalize.h"
+#include "run_report.h"
 #include <iostream>
 #include <cassert>
+#include <algorithm>
 #include "itkMacro.h"
 
 NrrdData::NrrdData(ukfPrecisionType sigma_signal, ukfPrecisionType sigma_mask)
   : ISignalData(sigma_signal, sigma_mask),
-    _data(NULL), _seed_data(NULL), _mask_data(NULL), _data_nrrd(NULL)
+    _data(NULL), _seed_data(NULL), _mask_data(NULL), _data_nrrd(NULL), _label_nrrd(NULL), _roi_nrrd(NULL),
+    _run_report(NULL)
 {
 
 }
 
 NrrdData::~NrrdData()
 {
+  ResetReplicas(0);
   if( _data_nrrd )
     {
     nrrdNuke(_data_nrrd);
@@ -31,6 +35,14 @@ NrrdData::~NrrdData()
       nrrdNuke(_mask_nrrd);
       }
     }
+  if( _label_nrrd )
+    {
+    nrrdNuke(_label_nrrd);
+    }
+  if( _roi_nrrd )
+    {
+    nrrdNuke(_roi_nrrd);
+    }
 }
 
 void NrrdData::Interp3Signal(const vec3_t& pos,
@@ -51,6 +63,14 @@ void NrrdData::Interp3Signal(const vec3_t& pos,
 
   assert(signal.size() == static_cast<unsigned int>(_num_gradients * 2) );
   assert(_data);
+
+  // Threads pinned to a NUMA node read the copy on their own node, if there is one
+  const float *data = _data;
+  const int    node = GetCurrentThreadNumaNode();
+  if( node >= 0 && node < static_cast<int>(_replicas.size() ) && _replicas[node] )
+    {
+    data = _replicas[node];
+    }
   // Is this really necessary?
   for( int i = 0; i < 2 * _num_gradients; ++i )
     {
@@ -95,7 +115,7 @@ void NrrdData::Interp3Signal(const vec3_t& pos,
         for( int i = 0; i < _num_gradients; ++i )
           {
           // interpolate from all six directions
-          signal[i] += w * _data[step1 * x + step2 * y + z * _num_gradients + i];
+          signal[i] += w * data[step1 * x + step2 * y + z * _num_gradients + i];
           }
         // sum of all weights
         w_sum += w;
@@ -408,16 +428,188 @@ bool NrrdData::LoadData(const std::string& data_file,
   return status;
 }
 
+namespace
+{
+/**
+ * Loads a label map of the size dim into label_nrrd, replacing the map loaded before
+ * \return true on failure
+*/
+bool LoadLabelMap(const std::string& label_file, const vec3_t& dim, Nrrd *& label_nrrd)
+{
+  Nrrd* loaded_nrrd = nrrdNew();
+  if( nrrdLoad(loaded_nrrd, label_file.c_str(), NULL) )
+    {
+    char *err = biffGetDone(NRRD);
+    std::cout << "Trouble reading " << label_file << ": " << err << std::endl;
+    free( err );
+    nrrdNuke(loaded_nrrd);
+    return true;
+    }
+  if( loaded_nrrd->type < 1 || loaded_nrrd->type > 6 )
+    {
+    std::cout << "This implementation only accepts label maps of integer types up to 'unsigned int'" << std::endl;
+    nrrdNuke(loaded_nrrd);
+    return true;
+    }
+  if( loaded_nrrd->dim != 3 || loaded_nrrd->axis[2].size != dim[0] || loaded_nrrd->axis[1].size != dim[1] ||
+      loaded_nrrd->axis[0].size != dim[2] )
+    {
+    std::cout << "Label map volume dimensions DO NOT match DWI dimensions" << std::endl;
+    nrrdNuke(loaded_nrrd);
+    return true;
+    }
+
+  if( label_nrrd )
+    {
+    nrrdNuke(label_nrrd);
+    }
+  label_nrrd = loaded_nrrd;
+  return false;
+}
+
+/** Label at a flat index of the label map, by the nrrd type of the map */
+int LabelAt(const Nrrd *label_nrrd, const size_t index)
+{
+  switch( label_nrrd->type )
+    {
+    case 1:
+      return static_cast<signed char *>(label_nrrd->data)[index];
+    case 2:
+      return static_cast<unsigned char *>(label_nrrd->data)[index];
+    case 3:
+      return static_cast<short *>(label_nrrd->data)[index];
+    case 4:
+      return static_cast<unsigned short *>(label_nrrd->data)[index];
+    case 5:
+      return static_cast<int *>(label_nrrd->data)[index];
+    default:
+      return static_cast<int>(static_cast<unsigned int *>(label_nrrd->data)[index]);
+    }
+}
+
+/** Label of the voxel nearest to pos in a label map of the size dim, 0 outside the volume or without a map */
+int LabelNearest(const Nrrd *label_nrrd, const vec3_t& dim, const vec3_t& pos)
+{
+  if( !label_nrrd )
+    {
+    return 0;
+    }
+  const int nx = static_cast<const int>(dim[0]);
+  const int ny = static_cast<const int>(dim[1]);
+  const int nz = static_cast<const int>(dim[2]);
+
+  const int x = static_cast<const int>(round(pos[0]));
+  const int y = static_cast<const int>(round(pos[1]));
+  const int z = static_cast<const int>(round(pos[2]));
+
+  if( (x < 0 || nx <= x) ||
+      (y < 0 || ny <= y) ||
+      (z < 0 || nz <= z)  )
+    {
+    return 0;
+    }
+  return LabelAt(label_nrrd, static_cast<size_t>(nz) * ny * x + nz * y + z);
+}
+}
+
+bool NrrdData::LoadLabels(const std::string& label_file)
+{
+  assert(_data_nrrd);
+  return LoadLabelMap(label_file, _dim, _label_nrrd);
+}
+
+bool NrrdData::LoadRoiLabels(const std::string& label_file)
+{
+  assert(_data_nrrd);
+  return LoadLabelMap(label_file, _dim, _roi_nrrd);
+}
+
+int NrrdData::LabelValue(const vec3_t& pos) const
+{
+  return LabelNearest(_label_nrrd, _dim, pos);
+}
+
+int NrrdData::RoiLabelValue(const vec3_t& pos) const
+{
+  return LabelNearest(_roi_nrrd, _dim, pos);
+}
+
+void NrrdData::GetLabelValues(std::vector<int>& labels) const
+{
+  labels.clear();
+  if( !_label_nrrd )
+    {
+    return;
+    }
+  const size_t num_voxels = nrrdElementNumber(_label_nrrd);
+  for( size_t i = 0; i < num_voxels; ++i )
+    {
+    // Label maps are piecewise constant, so most duplicates are skipped right away
+    const int value = LabelAt(_label_nrrd, i);
+    if( value != 0 && (labels.empty() || labels.back() != value) )
+      {
+      labels.push_back(value);
+      }
+    }
+  std::sort(labels.begin(), labels.end() );
+  labels.erase(std::unique(labels.begin(), labels.end() ), labels.end() );
+}
+
+void NrrdData::ResetReplicas(const int num_nodes)
+{
+  for( size_t i = 0; i < _replicas.size(); ++i )
+    {
+    delete[] _replicas[i];
+    }
+  _replicas.assign(num_nodes, static_cast<float *>(NULL) );
+}
+
+void NrrdData::ReplicateSignal(const int node)
+{
+  assert(_data && node >= 0 && node < static_cast<int>(_replicas.size() ) );
+  const size_t num_values = nrrdElementNumber(_data_nrrd);
+  // The copy is written by the calling thread, so its pages are first touched on that thread's node
+  float *replica = new float[num_values];
+  std::copy(_data, _data + num_values, replica);
+  _replicas[node] = replica;
+}
+
+bool NrrdData::HasReplicas(const int num_nodes) const
+{
+  if( static_cast<int>(_replicas.size() ) != num_nodes )
+    {
+    return false;
+    }
+  for( size_t i = 0; i < _replicas.size(); ++i )
+    {
+    if( !_replicas[i] )
+      {
+      return false;
+      }
+    }
+  return true;
+}
+
+bool NrrdData::InterleaveSignal(const std::vector<NumaNode>& nodes)
+{
+  assert(_data);
+  return InterleaveMemory(_data, nrrdElementNumber(_data_nrrd) * sizeof(float), nodes);
+}
+
 bool NrrdData::LoadSignal(Nrrd* input_nrrd, const bool normalizedDWIData)
 {
   assert(input_nrrd);
 
+  // Copies of the previous signal are stale now
+  ResetReplicas(0);
+
   if( normalizedDWIData )
     {
     this->_data_nrrd = input_nrrd;
     }
   else
     {
+    RunReportPhase phase(_run_report, "dwi_normalize");
     this->_data_nrrd = nrrdNew();
     dwiNormalize(input_nrrd, _data_nrrd);   // Do preprocessing on the data
     }
@@ -13,6 +13,9 @@
 #include <vector>
 #include <teem/nrrd.h>
 #include "linalg.h"
+#include "numa_utilities.h"
+
+class RunReport;
 
 /**
  * \class NrrdData
@@ -20,7 +23,7 @@
  * \brief Class wrapping teem nrrd for loading nrrd files.
 */
 
-class NrrdData : public ISignalData
+class NrrdData final : public ISignalData
 {
 public:
 
@@ -90,12 +93,58 @@ public:
 
   virtual bool SetData(Nrrd* data, Nrrd* seed, Nrrd* mask, bool normalizedDWIData);
 
+  /** Frees the per-node copies of the signal and makes room for num_nodes new ones */
+  void ResetReplicas(const int num_nodes);
+
+  /**
+   * \brief Makes a copy of the signal for one NUMA node
+   *
+   * Must be called from a thread pinned to that node, after ResetReplicas, so that the copy is first touched
+   * on the node. Interp3Signal then reads the copy of the node the calling thread is pinned to.
+  */
+  void ReplicateSignal(const int node);
+
+  /** True if each of the num_nodes nodes has its own copy of the signal */
+  bool HasReplicas(const int num_nodes) const;
+
+  /** Spreads the pages of the signal round-robin over the NUMA nodes. Returns true on failure. */
+  bool InterleaveSignal(const std::vector<NumaNode>& nodes);
+
   /** Returns the dimensions of the signal in each directions as a vector */
   vec3_t dim() const
   {
     return _dim;
   }
 
+  /**
+   * Loads a label map of the size of the signal, e.g. the atlas regions of a connectome. Must be called
+   * after LoadData.
+   * \return true on failure
+  */
+  bool LoadLabels(const std::string& label_file);
+
+  /** Label of the voxel nearest to pos, 0 outside the volume or if no label map is loaded */
+  int LabelValue(const vec3_t& pos) const;
+
+  /** The distinct non-zero labels of the label map in ascending order */
+  void GetLabelValues(std::vector<int>& labels) const;
+
+  /**
+   * Loads the label map of the regions of interest the fibers are filtered with, see RoiFilter. It has the size
+   * of the signal like the map of LoadLabels. Must be called after LoadData.
+   * \return true on failure
+  */
+  bool LoadRoiLabels(const std::string& label_file);
+
+  /** Label of the voxel nearest to pos in the map of LoadRoiLabels, 0 outside the volume or if none is loaded */
+  int RoiLabelValue(const vec3_t& pos) const;
+
+  /** Times the normalization of the signal in report, NULL for none */
+  void SetRunReport(RunReport *report)
+  {
+    _run_report = report;
+  }
+
 private:
   /**
     * Load the signal, called by LoadData
@@ -115,6 +164,8 @@ private:
 
   /** pointer diffusion data as float */
   float *_data;
+  /** copies of _data local to each NUMA node, only used in NUMA_REPLICATE mode */
+  std::vector<float *> _replicas;
   /** pointer to seed data, is casted at runtime */
   void *_seed_data;
   /** seed type is needed for correct casting type */
@@ -130,6 +181,12 @@ private:
   Nrrd *_seed_nrrd;
   /** The actual mask data */
   Nrrd *_mask_nrrd;
+  /** Label map loaded by LoadLabels, NULL if there is none */
+  Nrrd *_label_nrrd;
+  /** Label map loaded by LoadRoiLabels, NULL if there is none */
+  Nrrd *_roi_nrrd;
+
+  RunReport *_run_report;
 };
 
 #endif  // NRRDDATA_H_
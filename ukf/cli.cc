@@ -78,11 +78,22 @@ int ukf_parse_cli(int argc, char** argv, UKFSettings& s)
   ukfPrecisionType SIGMA_SIGNAL = sigmaSignal;
 
   // HANDLE ERRORNOUS INPUT
-  if (dwiFile.empty() || maskFile.empty() || tracts.empty()) {
-    std::cout << "Error! Must indicate DWI data, mask and tracts output files!" << std::endl << std::endl ;
+  if (dwiFile.empty() || maskFile.empty() ||
+      (tracts.empty() && densityMap.empty() && scalarMapPrefix.empty() && connectomePrefix.empty())) {
+    std::cout << "Error! Must indicate DWI data, mask and tracts, voxel map or connectome output files!" << std::endl << std::endl ;
     return 1 ;	//This is to indicate that the module returns with error
   }
 
+  if (!connectomePrefix.empty() && connectomeLabels.empty()) {
+    std::cout << "Error! The connectome needs a label map of the regions!" << std::endl ;
+    return 1 ;
+  }
+
+  if ((!roiInclude.empty() || !roiExclude.empty() || !roiEnd.empty()) && roiLabels.empty()) {
+    std::cout << "Error! The ROI filter needs a label map of the regions (\"--roiLabels\")!" << std::endl ;
+    return 1 ;
+  }
+
   if (numTensor == 1) {
     tractsWithSecondTensor.clear() ;	//Reassure the string is empty
   }
@@ -108,6 +119,16 @@ int ukf_parse_cli(int argc, char** argv, UKFSettings& s)
     return 1 ;
   }
 
+  if (adaptiveNMSE > 0 && (numTensor == 1 || noddi)) {
+    std::cout << "The \"--adaptiveNMSE\" flag can only be used with the tensor model and more than one tensor (\"--numTensor\")." << std::endl;
+    return 1 ;
+  }
+
+  if (maxFibers < 0 || timeBudget < 0) {
+    std::cout << "The fiber and time budgets (\"--maxFibers\", \"--timeBudget\") must not be negative!" << std::endl ;
+    return 1 ;
+  }
+
   if (l_recordLength < l_stepLength) {
     std::cout << "recordLength should be greater than stepLength" << std::endl;
     return 1 ;
@@ -228,6 +249,17 @@ int ukf_parse_cli(int argc, char** argv, UKFSettings& s)
     ukf_tell(l_recordLength, "recordLength");
   }
 
+  if (maxStepLength > 0 && maxStepLength < l_stepLength) {
+    std::cout << "maxStepLength should be greater than stepLength" << std::endl;
+    return 1 ;
+  }
+
+  // An adaptive step never passes the next recorded point
+  if (maxStepLength > 0 && (maxStepLength > l_recordLength || l_recordLength <= l_stepLength)) {
+    std::cout << "maxStepLength should not be greater than recordLength, which should be greater than stepLength" << std::endl;
+    return 1 ;
+  }
+
   if (noddi){
     if (l_Qvic == 0.0)
       if (numTensor == 1)
@@ -266,6 +298,11 @@ int ukf_parse_cli(int argc, char** argv, UKFSettings& s)
     s.record_trace = recordTrace;
     s.record_state = recordState;
     s.record_cov = recordCovariance;
+    if( ParseCovarianceMode(covarianceMode, s.record_cov_mode) )
+      {
+      return EXIT_FAILURE;
+      }
+    s.record_cov_float = covarianceFloat;
     s.record_free_water = recordFreeWater;
     s.record_tensors = recordTensors;
     s.record_Vic = recordVic;
@@ -284,11 +321,37 @@ int ukf_parse_cli(int argc, char** argv, UKFSettings& s)
     s.is_full_model = fullTensorModel;
     s.free_water = freeWater;
     s.noddi = noddi;
+    s.adaptive_nmse = adaptiveNMSE;
     s.stepLength = l_stepLength;
+    s.max_step_length = maxStepLength;
     s.recordLength = l_recordLength;
     s.maxHalfFiberLength = maxHalfFiberLength;
     s.labels = labels;
     s.num_threads = numThreads;
+    if( ParseNumaMode(numaMode, s.numa_mode) )
+      {
+      return EXIT_FAILURE;
+      }
+    if( ParseSeedOrder(seedOrder, s.seed_order) )
+      {
+      return EXIT_FAILURE;
+      }
+    s.max_fibers = maxFibers;
+    s.time_budget = timeBudget;
+    s.progress_interval = progressInterval;
+    s.stream_output = streamOutput;
+    if( ParseVtpCompressor(vtpCompressor, s.vtp_compressor) )
+      {
+      return EXIT_FAILURE;
+      }
+    if( !VtpBlockWriter::IsCompressorAvailable(s.vtp_compressor) )
+      {
+      std::cout << "LZ4 compression is not available in this build (\"--vtpCompressor\")." << std::endl;
+      return EXIT_FAILURE;
+      }
+    s.compress_ukf = compressUKF;
+    s.max_position_error = maxPositionError;
+    s.max_scalar_error = maxScalarError;
 
     s.Qm = l_Qm;
     s.Ql = l_Ql;
@@ -305,6 +368,20 @@ int ukf_parse_cli(int argc, char** argv, UKFSettings& s)
 
     s.output_file = tracts;
     s.output_file_with_second_tensor = tractsWithSecondTensor;
+    s.density_map = densityMap;
+    s.scalar_map_prefix = scalarMapPrefix;
+    s.connectome_labels = connectomeLabels;
+    s.connectome_prefix = connectomePrefix;
+    if( ParseConnectomeFormat(connectomeFormat, s.connectome_format) )
+      {
+      return EXIT_FAILURE;
+      }
+    s.connectome_scalar = connectomeScalar;
+    s.roi_labels = roiLabels;
+    s.roi_include = roiInclude;
+    s.roi_exclude = roiExclude;
+    s.roi_end = roiEnd;
+    s.run_report = runReport;
     s.dwiFile = dwiFile;
     s.seedsFile = seedsFile;
     s.maskFile = maskFile;
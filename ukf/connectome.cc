@@ -0,0 +1,227 @@
+/**
+ * \file connectome.cc
+ * \brief implementation of connectome.h
+*/
+
+#include "connectome.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <teem/nrrd.h>
+#include "NrrdData.h"
+
+bool ParseConnectomeFormat(const std::string& name, ConnectomeFormat& format)
+{
+  if( name == "csv" )
+    {
+    format = CONNECTOME_CSV;
+    }
+  else if( name == "binary" )
+    {
+    format = CONNECTOME_BINARY;
+    }
+  else
+    {
+    std::cout << "Unknown connectome format " << name << std::endl;
+    return true;
+    }
+  return false;
+}
+
+ConnectomeAccumulator::ConnectomeAccumulator()
+  : _label_data(NULL), _scalar_recorded(false), _num_fibers(0), _unassigned(0)
+{
+  _scalar.column = NULL;
+  _step_to_mm.setIdentity();
+}
+
+void ConnectomeAccumulator::Reset(const NrrdData *label_data, const std::vector<int>& labels,
+                                  const VoxelMapScalar& scalar)
+{
+  _label_data = label_data;
+  _labels = labels;
+  _scalar = scalar;
+  _scalar_recorded = false;
+
+  // The fiber positions are ijk in reverse axis order, so the columns of the ijk-to-RAS matrix are swapped
+  const ukfMatrixType i2r = label_data->i2r();
+  for( int axis = 0; axis < 3; ++axis )
+    {
+    for( int k = 0; k < 3; ++k )
+      {
+      _step_to_mm(k, axis) = i2r(k, 2 - axis);
+      }
+    }
+
+  const size_t num_entries = labels.size() * labels.size();
+  _count.assign(num_entries, 0.0);
+  _length.assign(num_entries, 0.0);
+  _scalar_sum.assign(_scalar.column ? num_entries : 0, 0.0);
+  _num_fibers = 0;
+  _unassigned = 0;
+}
+
+int ConnectomeAccumulator::Node(const int label) const
+{
+  const std::vector<int>::const_iterator it = std::lower_bound(_labels.begin(), _labels.end(), label);
+  if( label == 0 || it == _labels.end() || *it != label )
+    {
+    return -1;
+    }
+  return static_cast<int>(it - _labels.begin() );
+}
+
+void ConnectomeAccumulator::AddFiber(const UKFFiber& fiber)
+{
+  if( fiber.size() == 0 )
+    {
+    return;
+    }
+  ++_num_fibers;
+  int a = Node(_label_data->LabelValue(fiber.position(0) ) );
+  int b = Node(_label_data->LabelValue(fiber.position(fiber.size() - 1) ) );
+  if( a < 0 || b < 0 )
+    {
+    ++_unassigned;
+    return;
+    }
+  if( a > b )
+    {
+    std::swap(a, b);
+    }
+  const size_t entry = static_cast<size_t>(a) * _labels.size() + b;
+
+  ukfPrecisionType length = ukfZero;
+  for( size_t i = 1; i < fiber.size(); ++i )
+    {
+    length += (_step_to_mm * (fiber.position(i) - fiber.position(i - 1) ) ).norm();
+    }
+  _count[entry] += 1.0;
+  _length[entry] += length;
+
+  if( _scalar.column )
+    {
+    const std::vector<ukfPrecisionType>& column = fiber.arena->*_scalar.column;
+    if( !column.empty() )
+      {
+      double sum = 0.0;
+      for( size_t i = 0; i < fiber.size(); ++i )
+        {
+        sum += column[fiber.begin + i];
+        }
+      _scalar_sum[entry] += sum / fiber.size();
+      _scalar_recorded = true;
+      }
+    }
+}
+
+void ConnectomeAccumulator::Merge(const ConnectomeAccumulator& other)
+{
+  for( size_t i = 0; i < _count.size(); ++i )
+    {
+    _count[i] += other._count[i];
+    _length[i] += other._length[i];
+    }
+  for( size_t i = 0; i < _scalar_sum.size(); ++i )
+    {
+    _scalar_sum[i] += other._scalar_sum[i];
+    }
+  _scalar_recorded = _scalar_recorded || other._scalar_recorded;
+  _num_fibers += other._num_fibers;
+  _unassigned += other._unassigned;
+}
+
+bool ConnectomeAccumulator::Write(const std::string& prefix, const ConnectomeFormat format) const
+{
+  // Sums to means, empty connections stay 0
+  std::vector<double> mean_length(_length.size(), 0.0);
+  std::vector<double> mean_scalar(_scalar_sum.size(), 0.0);
+  for( size_t i = 0; i < _count.size(); ++i )
+    {
+    if( _count[i] > 0 )
+      {
+      mean_length[i] = _length[i] / _count[i];
+      if( !mean_scalar.empty() )
+        {
+        mean_scalar[i] = _scalar_sum[i] / _count[i];
+        }
+      }
+    }
+
+  if( WriteMatrix(prefix + "count", format, _count) || WriteMatrix(prefix + "length", format, mean_length) )
+    {
+    return true;
+    }
+  if( _scalar_recorded && WriteMatrix(prefix + _scalar.name, format, mean_scalar) )
+    {
+    return true;
+    }
+  return false;
+}
+
+bool ConnectomeAccumulator::WriteMatrix(const std::string& file_name, const ConnectomeFormat format,
+                                        const std::vector<double>& matrix) const
+{
+  const size_t        n = _labels.size();
+  std::vector<double> full(matrix);
+  for( size_t a = 0; a < n; ++a )
+    {
+    for( size_t b = 0; b < a; ++b )
+      {
+      full[a * n + b] = full[b * n + a];
+      }
+    }
+
+  if( format == CONNECTOME_CSV )
+    {
+    const std::string path = file_name + ".csv";
+    std::ofstream     out(path.c_str() );
+    out.precision(9);
+    out << "label";
+    for( size_t b = 0; b < n; ++b )
+      {
+      out << ',' << _labels[b];
+      }
+    out << '\n';
+    for( size_t a = 0; a < n; ++a )
+      {
+      out << _labels[a];
+      for( size_t b = 0; b < n; ++b )
+        {
+        out << ',' << full[a * n + b];
+        }
+      out << '\n';
+      }
+    out.close();
+    if( !out )
+      {
+      std::cout << "Could not write " << path << std::endl;
+      return true;
+      }
+    return false;
+    }
+
+  const std::string  path = file_name + ".nrrd";
+  std::ostringstream labels;
+  for( size_t a = 0; a < n; ++a )
+    {
+    labels << (a > 0 ? " " : "") << _labels[a];
+    }
+  Nrrd *nrrd = nrrdNew();
+  if( nrrdWrap_va(nrrd, n > 0 ? &full[0] : NULL, nrrdTypeDouble, 2, n, n) ||
+      nrrdKeyValueAdd(nrrd, "labels", labels.str().c_str() ) ||
+      nrrdSave(path.c_str(), nrrd, NULL) )
+    {
+    char *txt = biffGetDone(NRRD);
+    std::cout << "Could not write " << path << ": " << txt << std::endl;
+    free( txt );
+    nrrdNix(nrrd);
+    return true;
+    }
+  // The values belong to full
+  nrrdNix(nrrd);
+  return false;
+}
@@ -0,0 +1,98 @@
+/**
+ * \file connectome.h
+ * \brief Structural connectome accumulated from the end points of the fibers while they are traced
+*/
+
+#ifndef CONNECTOME_H_
+#define CONNECTOME_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "ukffiber.h"
+#include "voxel_maps.h"
+
+class NrrdData;
+
+/** File format of the connectome matrices */
+enum ConnectomeFormat
+  {
+  CONNECTOME_CSV,   // Text, a header row and a first column with the labels
+  CONNECTOME_BINARY // 2D NRRD of doubles, the labels are stored in the "labels" key
+  };
+
+/** Converts "csv" or "binary" to a ConnectomeFormat. Returns true on failure. */
+bool ParseConnectomeFormat(const std::string& name, ConnectomeFormat& format);
+
+/**
+ * \class ConnectomeAccumulator
+ * \brief Sums over the fibers connecting each pair of atlas regions
+ *
+ * A fiber connects the regions labelled at its two end points, in the label map loaded with
+ * NrrdData::LoadLabels; fibers ending outside all regions are only counted as unassigned. Every tracking thread
+ * adds the fibers it finishes to its own accumulator, and the accumulators are merged at the end. The matrices
+ * are symmetric and have one row per label, in ascending label order:
+ *
+ *   count    number of fibers
+ *   length   mean length of the fibers in mm
+ *   <scalar> mean over the fibers of the mean of the scalar along each fiber, if the fibers record it
+*/
+class ConnectomeAccumulator
+{
+public:
+  ConnectomeAccumulator();
+
+  /**
+   * Removes all sums
+   * \param[in] label_data The signal data holding the label map
+   * \param[in] labels The labels of the regions in ascending order, see NrrdData::GetLabelValues
+   * \param[in] scalar The scalar to average, no scalar matrix is written if its column is NULL
+  */
+  void Reset(const NrrdData *label_data, const std::vector<int>& labels, const VoxelMapScalar& scalar);
+
+  void AddFiber(const UKFFiber& fiber);
+
+  /** Adds the sums of another accumulator with the same labels */
+  void Merge(const ConnectomeAccumulator& other);
+
+  /** Number of fibers added, including the unassigned ones */
+  uint64_t NumberOfFibers() const
+  {
+    return _num_fibers;
+  }
+
+  /** Number of fibers with an end point outside all regions */
+  uint64_t NumberOfUnassignedFibers() const
+  {
+    return _unassigned;
+  }
+
+  /**
+   * Writes <prefix>count, <prefix>length and <prefix><scalar> with the extension of the format
+   * \return true on failure
+  */
+  bool Write(const std::string& prefix, const ConnectomeFormat format) const;
+
+private:
+  /** Row of a label, -1 for the background and for labels that are not regions */
+  int Node(const int label) const;
+
+  /** Writes one symmetric matrix, of which only the upper triangle is filled */
+  bool WriteMatrix(const std::string& file_name, const ConnectomeFormat format,
+                   const std::vector<double>& matrix) const;
+
+  const NrrdData *      _label_data;
+  std::vector<int>      _labels;
+  VoxelMapScalar        _scalar;
+  bool                  _scalar_recorded;
+  // Converts a step between two fiber positions, ijk in reverse axis order, to mm
+  mat33_t               _step_to_mm;
+  // Row-major, node pairs (a, b) with a <= b only
+  std::vector<double>   _count;
+  std::vector<double>   _length;
+  std::vector<double>   _scalar_sum;
+  uint64_t              _num_fibers;
+  uint64_t              _unassigned;
+};
+
+#endif // CONNECTOME_H_
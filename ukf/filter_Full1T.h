@@ -9,7 +9,7 @@
  * Model describing 1-tensor tractography with the full tensor representation
  * (3 angles, 3 eigenvalues).
 */
-class Full1T : public FilterModel
+class Full1T final : public FilterModel
 {
 public:
   Full1T(ukfPrecisionType qs, ukfPrecisionType ql, ukfPrecisionType rs, const ukfVectorType& weights_on_tensors,
@@ -9,7 +9,7 @@
  * Model describing 1-tensor tractography with the full tensor representation (3 angles, 3 eigenvalues)
  * and free water estimation.
 */
-class Full1T_FW : public FilterModel
+class Full1T_FW final : public FilterModel
 {
 public:
   Full1T_FW(ukfPrecisionType qs, ukfPrecisionType ql, ukfPrecisionType qw, ukfPrecisionType rs,
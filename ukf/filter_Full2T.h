@@ -9,7 +9,7 @@
  * Model describing 2-tensor tractography with the full tensor representation
  * (3 angles, 3 eigenvalues).
 */
-class Full2T : public FilterModel
+class Full2T final : public FilterModel
 {
 public:
   Full2T(ukfPrecisionType qs, ukfPrecisionType ql, ukfPrecisionType rs, const ukfVectorType& weights_on_tensors,
@@ -10,7 +10,7 @@
  * Model describing 2-tensor tractography with the full tensor representation (3 angles, 3 eigenvalues)
  * and free water estimation.
 */
-class Full2T_FW : public FilterModel
+class Full2T_FW final : public FilterModel
 {
 public:
   Full2T_FW(ukfPrecisionType qs, ukfPrecisionType ql, ukfPrecisionType qw, ukfPrecisionType rs,
@@ -9,7 +9,7 @@
  * Model describing 3-tensor tractography with the full tensor representation
  * (3 angles, 3 eigenvalues).
 */
-class Full3T : public FilterModel
+class Full3T final : public FilterModel
 {
 public:
   Full3T(ukfPrecisionType qs, ukfPrecisionType ql, ukfPrecisionType rs, const ukfVectorType& weights_on_tensors,
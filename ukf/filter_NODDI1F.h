@@ -8,7 +8,7 @@
  *
  * Model describing 1-fiber tractography with the NODDI representation
 */
-class NODDI1F : public FilterModel
+class NODDI1F final : public FilterModel
 {
 public:
   NODDI1F(ukfPrecisionType qs, ukfPrecisionType qkappa, ukfPrecisionType qvic, ukfPrecisionType rs,
@@ -7,7 +7,7 @@
 *
 * Model describing 2-tensor tractography with the simplified tensor representation (two minor eigenvalues are equal).
 */
-class NODDI2F : public FilterModel
+class NODDI2F final : public FilterModel
 {
 public:
   NODDI2F(ukfPrecisionType qs, ukfPrecisionType qkappa, ukfPrecisionType qvic, ukfPrecisionType rs,
@@ -7,7 +7,7 @@
  *
  * Model describing 1-tensor tractography with the simplified tensor representation (two minor eigenvalues are equal)
 */
-class Simple1T : public FilterModel
+class Simple1T final : public FilterModel
 {
 public:
   Simple1T(ukfPrecisionType qs, ukfPrecisionType ql, ukfPrecisionType rs, const ukfVectorType& weights_on_tensors,
@@ -9,7 +9,7 @@
  * Model describing 1-tensor tractography with the simplified tensor representation (two minor eigenvalues are equal)
  * and free water estimation
 */
-class Simple1T_FW : public FilterModel
+class Simple1T_FW final : public FilterModel
 {
 public:
   Simple1T_FW(ukfPrecisionType qs, ukfPrecisionType ql, ukfPrecisionType qw, ukfPrecisionType rs,
@@ -7,7 +7,7 @@
  *
  * Model describing 2-tensor tractography with the simplified tensor representation (two minor eigenvalues are equal).
 */
-class Simple2T : public FilterModel
+class Simple2T final : public FilterModel
 {
 public:
   Simple2T(ukfPrecisionType qs, ukfPrecisionType ql, ukfPrecisionType rs, const ukfVectorType& weights_on_tensors,
@@ -9,7 +9,7 @@
  * Model describing 2-tensor tractography with the simplified tensor representation (two minor eigenvalues are equal)
  * and free water estimation
 */
-class Simple2T_FW : public FilterModel
+class Simple2T_FW final : public FilterModel
 {
 public:
   Simple2T_FW(ukfPrecisionType qs, ukfPrecisionType ql, ukfPrecisionType qw, ukfPrecisionType rs,
@@ -7,7 +7,7 @@
  *
  * Model describing 3-tensor tractography with the simplified tensor representation (two minor eigenvalues are equal)
 */
-class Simple3T : public FilterModel
+class Simple3T final : public FilterModel
 {
 public:
   Simple3T(ukfPrecisionType qs, ukfPrecisionType ql, ukfPrecisionType rs, const ukfVectorType& weights_on_tensors,
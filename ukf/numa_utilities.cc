@@ -0,0 +1,173 @@
+/**
+ * \file numa_utilities.cc
+ * \brief implementation of numa_utilities.h
+ *
+ * Only Linux is supported. The topology is read from sysfs and the placement is done with the plain system
+ * calls, so there is no dependency on libnuma. On other platforms no nodes are reported and the NUMA modes
+ * fall back to the default placement.
+*/
+
+#include "numa_utilities.h"
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+namespace
+{
+#if defined(__linux__)
+/** Parses a sysfs cpu list such as "0-7,16-23" */
+std::vector<int> ParseCpuList(const std::string& list)
+{
+  std::vector<int>  cpus;
+  std::stringstream stream(list);
+  std::string       range;
+
+  while( std::getline(stream, range, ',') )
+    {
+    int first = 0;
+    int last = 0;
+    const size_t dash = range.find('-');
+    if( dash == std::string::npos )
+      {
+      if( !(std::istringstream(range) >> first) )
+        {
+        continue;
+        }
+      last = first;
+      }
+    else if( !(std::istringstream(range.substr(0, dash) ) >> first) ||
+             !(std::istringstream(range.substr(dash + 1) ) >> last) )
+      {
+      continue;
+      }
+    for( int cpu = first; cpu <= last; ++cpu )
+      {
+      cpus.push_back(cpu);
+      }
+    }
+  return cpus;
+}
+#endif
+
+// Node index of the calling thread, set when the thread is pinned
+thread_local int t_numa_node = -1;
+}
+
+bool ParseNumaMode(const std::string& name, NumaMode& mode)
+{
+  if( name == "none" )
+    {
+    mode = NUMA_NONE;
+    }
+  else if( name == "replicate" )
+    {
+    mode = NUMA_REPLICATE;
+    }
+  else if( name == "interleave" )
+    {
+    mode = NUMA_INTERLEAVE;
+    }
+  else
+    {
+    std::cout << "Unknown NUMA mode " << name << std::endl;
+    return true;
+    }
+  return false;
+}
+
+std::vector<NumaNode> GetNumaNodes()
+{
+  std::vector<NumaNode> nodes;
+#if defined(__linux__)
+  // Node ids do not have to be contiguous, so probe a generous range
+  const int MAX_NUMA_NODE_ID = 64;
+  for( int id = 0; id < MAX_NUMA_NODE_ID; ++id )
+    {
+    std::ostringstream path;
+    path << "/sys/devices/system/node/node" << id << "/cpulist";
+    std::ifstream file(path.str().c_str() );
+    std::string   list;
+    if( !file || !std::getline(file, list) )
+      {
+      continue;
+      }
+    NumaNode node;
+    node.id = id;
+    node.cpus = ParseCpuList(list);
+    if( !node.cpus.empty() ) // memory-only nodes cannot run threads
+      {
+      nodes.push_back(node);
+      }
+    }
+#endif
+  return nodes;
+}
+
+bool PinCurrentThreadToNode(const int node_index, const NumaNode& node)
+{
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for( size_t i = 0; i < node.cpus.size(); ++i )
+    {
+    if( node.cpus[i] < CPU_SETSIZE )
+      {
+      CPU_SET(node.cpus[i], &set);
+      }
+    }
+  if( sched_setaffinity(0, sizeof(set), &set) != 0 )
+    {
+    return true;
+    }
+  t_numa_node = node_index;
+  return false;
+#else
+  (void)node_index;
+  (void)node;
+  return true;
+#endif
+}
+
+int GetCurrentThreadNumaNode()
+{
+  return t_numa_node;
+}
+
+bool InterleaveMemory(void *data, const size_t num_bytes, const std::vector<NumaNode>& nodes)
+{
+#if defined(__linux__)
+  unsigned long mask = 0;
+  for( size_t i = 0; i < nodes.size(); ++i )
+    {
+    if( nodes[i].id >= static_cast<int>(8 * sizeof(mask) ) )
+      {
+      return true;
+      }
+    mask |= 1UL << nodes[i].id;
+    }
+
+  // mbind works on whole pages, the partial pages at both ends keep their placement
+  const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE) );
+  const size_t begin = (reinterpret_cast<size_t>(data) + page - 1) / page * page;
+  const size_t end = (reinterpret_cast<size_t>(data) + num_bytes) / page * page;
+  if( end <= begin )
+    {
+    return false;
+    }
+  return syscall(SYS_mbind, begin, end - begin, MPOL_INTERLEAVE, &mask, 8 * sizeof(mask) + 1,
+                 MPOL_MF_MOVE) != 0;
+#else
+  (void)data;
+  (void)num_bytes;
+  (void)nodes;
+  return true;
+#endif
+}
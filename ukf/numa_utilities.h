@@ -0,0 +1,50 @@
+/**
+ * \file numa_utilities.h
+ * \brief Helpers for placing the tracking threads and the diffusion data on machines with several NUMA nodes
+*/
+
+#ifndef NUMA_UTILITIES_H_
+#define NUMA_UTILITIES_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/** How the tracking threads and the diffusion data are placed on multi-socket machines */
+enum NumaMode
+  {
+  NUMA_NONE,       // Threads float, the data stays on the node of the thread that loaded it
+  NUMA_REPLICATE,  // Threads are pinned and each node reads its own copy of the data
+  NUMA_INTERLEAVE  // Threads are pinned and the pages of the data are spread round-robin over the nodes
+  };
+
+/**
+ * \struct NumaNode
+ * \brief Operating system id of a NUMA node and the CPUs belonging to it
+*/
+struct NumaNode
+  {
+  int              id;
+  std::vector<int> cpus;
+  };
+
+/** Converts "none", "replicate" or "interleave" to a NumaMode. Returns true on failure. */
+bool ParseNumaMode(const std::string& name, NumaMode& mode);
+
+/** Returns the NUMA nodes that have CPUs. Empty if the topology is not available on this platform. */
+std::vector<NumaNode> GetNumaNodes();
+
+/**
+ * Binds the calling thread to the CPUs of a node and remembers the node for GetCurrentThreadNumaNode.
+ * \param node_index Index into the vector returned by GetNumaNodes
+ * \return true on failure
+*/
+bool PinCurrentThreadToNode(const int node_index, const NumaNode& node);
+
+/** Index of the node the calling thread was pinned to, or -1 if it is not pinned */
+int GetCurrentThreadNumaNode();
+
+/** Spreads the pages of a buffer round-robin over the nodes. Returns true on failure. */
+bool InterleaveMemory(void *data, const size_t num_bytes, const std::vector<NumaNode>& nodes);
+
+#endif // NUMA_UTILITIES_H_
@@ -0,0 +1,26 @@
+/**
+ * \file roi_filter.cc
+ * \brief implementation of roi_filter.h
+*/
+
+#include "roi_filter.h"
+
+#include <algorithm>
+#include "NrrdData.h"
+
+RoiFilter::RoiFilter(const std::vector<int>& include, const std::vector<int>& exclude, const std::vector<int>& end)
+  : _label_data(NULL)
+{
+  _labels[ROI_INCLUDE] = include;
+  _labels[ROI_EXCLUDE] = exclude;
+  _labels[ROI_END] = end;
+  for( int i = 0; i < NUM_ROI_REGIONS; ++i )
+    {
+    std::sort(_labels[i].begin(), _labels[i].end() );
+    }
+}
+
+bool RoiFilter::HasLabel(const RoiRegion region, const vec3_t& pos) const
+{
+  return std::binary_search(_labels[region].begin(), _labels[region].end(), _label_data->RoiLabelValue(pos) );
+}
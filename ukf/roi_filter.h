@@ -0,0 +1,76 @@
+/**
+ * \file roi_filter.h
+ * \brief Regions of interest the fibers have to pass, end in or avoid, checked while they are traced
+*/
+
+#ifndef ROI_FILTER_H_
+#define ROI_FILTER_H_
+
+#include <vector>
+#include "ukf_types.h"
+
+class NrrdData;
+
+/** The regions of a RoiFilter */
+enum RoiRegion
+  {
+  ROI_INCLUDE, // the fiber has to pass through it
+  ROI_EXCLUDE, // the fiber must not enter it, checked after every step
+  ROI_END,     // one end of the fiber has to lie in it
+  NUM_ROI_REGIONS
+  };
+
+/** Number of points at either end of a fiber that are checked for ROI_END */
+const int ROI_END_POINTS = 3;
+
+/**
+ * \class RoiFilter
+ * \brief Labels of the map loaded with NrrdData::LoadRoiLabels that make up each region
+ *
+ * A region is the set of voxels carrying one of its labels, like a Region of vtkFilter. A fiber passes the include
+ * region if any of its points lies in it, like in the PASS mode of vtkFilter, and it ends in the end region if
+ * one of the ROI_END_POINTS points at either of its two ends lies in it. vtkFilter's END mode only checks the
+ * last points, but the start of a joined fiber is as much an end as its last point. Fibers entering the
+ * exclude region are stopped at once and rejected, together with the fibers joined from them; the include and
+ * the end region are checked by PostProcessFibers on the joined fibers. A region without labels does not
+ * restrict the fibers.
+*/
+class RoiFilter
+{
+public:
+  /** Sets the labels of the regions, in any order */
+  RoiFilter(const std::vector<int>& include, const std::vector<int>& exclude, const std::vector<int>& end);
+
+  /** Sets the signal data holding the ROI label map. Must be called before Contains if a region has labels. */
+  void SetLabelData(const NrrdData *label_data)
+  {
+    _label_data = label_data;
+  }
+
+  /** Whether the region has labels */
+  bool IsSet(const RoiRegion region) const
+  {
+    return !_labels[region].empty();
+  }
+
+  /** Whether the voxel nearest to pos belongs to the region, false if the region has no labels */
+  bool Contains(const RoiRegion region, const vec3_t& pos) const
+  {
+    return IsSet(region) && HasLabel(region, pos);
+  }
+
+  /** Whether the fibers are checked when they are joined */
+  bool ChecksJoinedFibers() const
+  {
+    return IsSet(ROI_INCLUDE) || IsSet(ROI_END);
+  }
+
+private:
+  bool HasLabel(const RoiRegion region, const vec3_t& pos) const;
+
+  const NrrdData * _label_data;
+  // In ascending order
+  std::vector<int> _labels[NUM_ROI_REGIONS];
+};
+
+#endif // ROI_FILTER_H_
@@ -0,0 +1,261 @@
+/**
+ * \file run_report.cc
+ * \brief implementation of run_report.h
+ *
+ * The CPU time and the peak resident set size come from getrusage, and on Windows from GetProcessTimes. The
+ * bytes read and written are those of all read and write calls of the process, i.e. including the page cache,
+ * and are only available on Linux (/proc/self/io) and Windows.
+*/
+
+#include "run_report.h"
+
+#include <fstream>
+#include <iostream>
+#include "git_version.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+/** CPU time of all threads of the process in seconds */
+double ProcessCpuSeconds()
+{
+#if defined(_WIN32)
+  FILETIME creation, exit_time, kernel, user;
+  if( !GetProcessTimes(GetCurrentProcess(), &creation, &exit_time, &kernel, &user) )
+    {
+    return 0.0;
+    }
+  // 100 ns units
+  const double kernel_time = (static_cast<uint64_t>(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) * 1e-7;
+  const double user_time = (static_cast<uint64_t>(user.dwHighDateTime) << 32 | user.dwLowDateTime) * 1e-7;
+  return kernel_time + user_time;
+#else
+  struct rusage usage;
+  if( getrusage(RUSAGE_SELF, &usage) != 0 )
+    {
+    return 0.0;
+    }
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+#endif
+}
+
+/** Peak resident set size in bytes. Returns false if it is not available. */
+bool PeakResidentSetSize(uint64_t& bytes)
+{
+#if defined(_WIN32)
+  (void)bytes;
+  return false;
+#else
+  struct rusage usage;
+  if( getrusage(RUSAGE_SELF, &usage) != 0 )
+    {
+    return false;
+    }
+#if defined(__APPLE__)
+  bytes = static_cast<uint64_t>(usage.ru_maxrss);        // bytes
+#else
+  bytes = static_cast<uint64_t>(usage.ru_maxrss) * 1024; // kilobytes
+#endif
+  return true;
+#endif
+}
+
+/** Bytes read and written by the process so far. Returns false if they are not available. */
+bool ProcessIo(uint64_t& bytes_read, uint64_t& bytes_written)
+{
+#if defined(_WIN32)
+  IO_COUNTERS counters;
+  if( !GetProcessIoCounters(GetCurrentProcess(), &counters) )
+    {
+    return false;
+    }
+  bytes_read = counters.ReadTransferCount;
+  bytes_written = counters.WriteTransferCount;
+  return true;
+#elif defined(__linux__)
+  std::ifstream io("/proc/self/io");
+  std::string   key;
+  uint64_t      value;
+  int           found = 0;
+  while( io >> key >> value )
+    {
+    if( key == "rchar:" )
+      {
+      bytes_read = value;
+      ++found;
+      }
+    else if( key == "wchar:" )
+      {
+      bytes_written = value;
+      ++found;
+      }
+    }
+  return found == 2;
+#else
+  (void)bytes_read;
+  (void)bytes_written;
+  return false;
+#endif
+}
+}
+
+RunReport::RunReport()
+  : _start(std::chrono::steady_clock::now() ), _cpu_start(ProcessCpuSeconds() )
+{
+}
+
+size_t RunReport::StartPhase(const std::string& name)
+{
+  Phase phase;
+  phase.name = name;
+  phase.start = std::chrono::steady_clock::now();
+  phase.cpu_start = ProcessCpuSeconds();
+  phase.wall_seconds = -1.0;
+  phase.cpu_seconds = -1.0;
+  _phases.push_back(phase);
+  return _phases.size() - 1;
+}
+
+void RunReport::EndPhase(const size_t index)
+{
+  Phase& phase = _phases[index];
+  phase.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - phase.start).count();
+  phase.cpu_seconds = ProcessCpuSeconds() - phase.cpu_start;
+}
+
+void RunReport::SetCount(const std::string& name, const uint64_t value)
+{
+  for( size_t i = 0; i < _counts.size(); ++i )
+    {
+    if( _counts[i].first == name )
+      {
+      _counts[i].second = value;
+      return;
+      }
+    }
+  _counts.push_back(std::make_pair(name, value) );
+}
+
+void RunReport::AddCount(const std::string& name, const uint64_t value)
+{
+  for( size_t i = 0; i < _counts.size(); ++i )
+    {
+    if( _counts[i].first == name )
+      {
+      _counts[i].second += value;
+      return;
+      }
+    }
+  _counts.push_back(std::make_pair(name, value) );
+}
+
+void RunReport::SetHistogram(const std::string& name, const std::vector<uint64_t>& lower_bounds,
+                             const std::vector<uint64_t>& counts)
+{
+  Histogram histogram;
+  histogram.name = name;
+  histogram.lower_bounds = lower_bounds;
+  histogram.counts = counts;
+  for( size_t i = 0; i < _histograms.size(); ++i )
+    {
+    if( _histograms[i].name == name )
+      {
+      _histograms[i] = histogram;
+      return;
+      }
+    }
+  _histograms.push_back(histogram);
+}
+
+bool RunReport::Write(const std::string& file_name, const int exit_status) const
+{
+  const double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+  const double cpu_seconds = ProcessCpuSeconds() - _cpu_start;
+
+  std::ofstream out(file_name.c_str() );
+  out.precision(9);
+  out << "{\n";
+  out << "  \"version\": \"" << UKF_GIT_HASH << "\",\n";
+  out << "  \"exit_status\": " << exit_status << ",\n";
+  out << "  \"wall_seconds\": " << wall_seconds << ",\n";
+  out << "  \"cpu_seconds\": " << cpu_seconds << ",\n";
+
+  uint64_t peak_rss = 0;
+  out << "  \"peak_rss_bytes\": ";
+  if( PeakResidentSetSize(peak_rss) )
+    {
+    out << peak_rss << ",\n";
+    }
+  else
+    {
+    out << "null,\n";
+    }
+  uint64_t bytes_read = 0;
+  uint64_t bytes_written = 0;
+  if( ProcessIo(bytes_read, bytes_written) )
+    {
+    out << "  \"bytes_read\": " << bytes_read << ",\n";
+    out << "  \"bytes_written\": " << bytes_written << ",\n";
+    }
+  else
+    {
+    out << "  \"bytes_read\": null,\n";
+    out << "  \"bytes_written\": null,\n";
+    }
+
+  // Phases that are still running have no times yet
+  out << "  \"phases\": [";
+  for( size_t i = 0; i < _phases.size(); ++i )
+    {
+    const Phase& phase = _phases[i];
+    out << (i > 0 ? ",\n" : "\n") << "    { \"name\": \"" << phase.name << "\", ";
+    if( phase.wall_seconds < 0 )
+      {
+      out << "\"wall_seconds\": null, \"cpu_seconds\": null }";
+      }
+    else
+      {
+      out << "\"wall_seconds\": " << phase.wall_seconds << ", \"cpu_seconds\": " << phase.cpu_seconds << " }";
+      }
+    }
+  out << (_phases.empty() ? "],\n" : "\n  ],\n");
+
+  out << "  \"counts\": {";
+  for( size_t i = 0; i < _counts.size(); ++i )
+    {
+    out << (i > 0 ? ",\n" : "\n") << "    \"" << _counts[i].first << "\": " << _counts[i].second;
+    }
+  out << (_counts.empty() ? "},\n" : "\n  },\n");
+
+  out << "  \"histograms\": {";
+  for( size_t i = 0; i < _histograms.size(); ++i )
+    {
+    const Histogram& histogram = _histograms[i];
+    out << (i > 0 ? ",\n" : "\n") << "    \"" << histogram.name << "\": {\n      \"lower_bounds\": [";
+    for( size_t j = 0; j < histogram.lower_bounds.size(); ++j )
+      {
+      out << (j > 0 ? ", " : "") << histogram.lower_bounds[j];
+      }
+    out << "],\n      \"counts\": [";
+    for( size_t j = 0; j < histogram.counts.size(); ++j )
+      {
+      out << (j > 0 ? ", " : "") << histogram.counts[j];
+      }
+    out << "]\n    }";
+    }
+  out << (_histograms.empty() ? "}\n" : "\n  }\n");
+  out << "}\n";
+
+  out.close();
+  if( !out )
+    {
+    std::cout << "Could not write " << file_name << std::endl;
+    return true;
+    }
+  return false;
+}
@@ -0,0 +1,119 @@
+/**
+ * \file run_report.h
+ * \brief Wall and CPU time of the phases of a run and the resources it used, written as JSON
+*/
+
+#ifndef RUN_REPORT_H_
+#define RUN_REPORT_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * \class RunReport
+ * \brief Collects the timings and counts of one UKFTractography run
+ *
+ * The phases are listed in the order they started. They may nest, e.g. the DWI normalization is part of the
+ * loading, so the times of the phases do not add up to the total. CPU time is that of the whole process,
+ * i.e. of all threads. The report is written as
+ *
+ *   {
+ *     "version": "<git hash>",
+ *     "exit_status": 0,
+ *     "wall_seconds": 12.3, "cpu_seconds": 45.6,
+ *     "peak_rss_bytes": 123456789, "bytes_read": 1234, "bytes_written": 5678,
+ *     "phases": [ { "name": "load", "wall_seconds": 1.2, "cpu_seconds": 1.1 }, ... ],
+ *     "counts": { "seed_points": 1000, ... },
+ *     "histograms": { "steps_per_fiber": { "lower_bounds": [0, 1, 2, 4], "counts": [0, 3, 5, 2] }, ... }
+ *   }
+ *
+ * Resources the platform does not report are null.
+*/
+class RunReport
+{
+public:
+  /** The total times are measured from here */
+  RunReport();
+
+  /** Starts a phase, returns the index to pass to EndPhase */
+  size_t StartPhase(const std::string& name);
+
+  void EndPhase(const size_t index);
+
+  /** Sets or adds to a named count, the counts are written in the order they were first set */
+  void SetCount(const std::string& name, const uint64_t value);
+  void AddCount(const std::string& name, const uint64_t value);
+
+  /** Sets a histogram, given by the smallest value of every bin and the number of values in it */
+  void SetHistogram(const std::string& name, const std::vector<uint64_t>& lower_bounds,
+                    const std::vector<uint64_t>& counts);
+
+  /**
+   * Writes the report
+   * \param exit_status The exit status of the run
+   * \return true on failure
+  */
+  bool Write(const std::string& file_name, const int exit_status) const;
+
+private:
+  struct Phase
+    {
+    std::string                           name;
+    std::chrono::steady_clock::time_point start;
+    double                                cpu_start;
+    double                                wall_seconds; // negative until the phase ends
+    double                                cpu_seconds;
+    };
+
+  std::vector<Phase>                             _phases;
+  struct Histogram
+    {
+    std::string           name;
+    std::vector<uint64_t> lower_bounds;
+    std::vector<uint64_t> counts;
+    };
+
+  std::vector<std::pair<std::string, uint64_t> > _counts;
+  std::vector<Histogram>                         _histograms;
+  const std::chrono::steady_clock::time_point    _start;
+  const double                                   _cpu_start;
+};
+
+/**
+ * \class RunReportPhase
+ * \brief Times a phase from construction until End or destruction. Does nothing if the report is NULL.
+*/
+class RunReportPhase
+{
+public:
+  RunReportPhase(RunReport *report, const char *name)
+    : _report(report), _index(report ? report->StartPhase(name) : 0)
+  {
+  }
+
+  ~RunReportPhase()
+  {
+    End();
+  }
+
+  void End()
+  {
+    if( _report )
+      {
+      _report->EndPhase(_index);
+      _report = NULL;
+      }
+  }
+
+private:
+  RunReportPhase(const RunReportPhase&);
+  RunReportPhase& operator=(const RunReportPhase&);
+
+  RunReport *  _report;
+  const size_t _index;
+};
+
+#endif  // RUN_REPORT_H_
@@ -0,0 +1,161 @@
+/**
+ * \file seed_order.cc
+ * \brief implementation of seed_order.h
+*/
+
+#include "seed_order.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <utility>
+
+bool ParseSeedOrder(const std::string& name, SeedOrder& order)
+{
+  if( name == "none" )
+    {
+    order = SEED_ORDER_NONE;
+    }
+  else if( name == "morton" )
+    {
+    order = SEED_ORDER_MORTON;
+    }
+  else if( name == "hilbert" )
+    {
+    order = SEED_ORDER_HILBERT;
+    }
+  else
+    {
+    std::cout << "Unknown seed order " << name << std::endl;
+    return true;
+    }
+  return false;
+}
+
+unsigned long long MortonKey(unsigned int x, unsigned int y, unsigned int z, const int bits)
+{
+  unsigned long long key = 0;
+  for( int b = bits - 1; b >= 0; --b )
+    {
+    key = (key << 3) | ( ( (x >> b) & 1u) << 2) | ( ( (y >> b) & 1u) << 1) | ( (z >> b) & 1u);
+    }
+  return key;
+}
+
+unsigned long long HilbertKey(unsigned int x, unsigned int y, unsigned int z, const int bits)
+{
+  // J. Skilling, "Programming the Hilbert curve", AIP Conf. Proc. 707, 2004: converts the coordinates to the
+  // transposed Hilbert index, whose interleaved bits are the index along the curve.
+  unsigned int X[3] = { x, y, z };
+  const unsigned int M = 1u << (bits - 1);
+
+  for( unsigned int Q = M; Q > 1; Q >>= 1 )
+    {
+    const unsigned int P = Q - 1;
+    for( int i = 0; i < 3; ++i )
+      {
+      if( X[i] & Q )
+        {
+        X[0] ^= P;
+        }
+      else
+        {
+        const unsigned int t = (X[0] ^ X[i]) & P;
+        X[0] ^= t;
+        X[i] ^= t;
+        }
+      }
+    }
+
+  // Gray encode
+  X[1] ^= X[0];
+  X[2] ^= X[1];
+  unsigned int t = 0;
+  for( unsigned int Q = M; Q > 1; Q >>= 1 )
+    {
+    if( X[2] & Q )
+      {
+      t ^= Q - 1;
+      }
+    }
+  for( int i = 0; i < 3; ++i )
+    {
+    X[i] ^= t;
+    }
+
+  return MortonKey(X[0], X[1], X[2], bits);
+}
+
+void SpatialSeedOrder(const stdVec_t& points, const SeedOrder seed_order, std::vector<int>& order)
+{
+  order.clear();
+  if( seed_order == SEED_ORDER_NONE || points.empty() )
+    {
+    return;
+    }
+
+  // Bits needed for the largest voxel index
+  unsigned int max_index = 0;
+  for( size_t i = 0; i < points.size(); ++i )
+    {
+    for( int d = 0; d < 3; ++d )
+      {
+      max_index = std::max(max_index, static_cast<unsigned int>(std::max(0.0, std::floor(points[i][d]) ) ) );
+      }
+    }
+  int bits = 1;
+  while( bits < 21 && (max_index >> bits) != 0 )
+    {
+    ++bits;
+    }
+
+  std::vector<std::pair<unsigned long long, int> > keys(points.size() );
+  for( size_t i = 0; i < points.size(); ++i )
+    {
+    const unsigned int x = static_cast<unsigned int>(std::max(0.0, std::floor(points[i][0]) ) );
+    const unsigned int y = static_cast<unsigned int>(std::max(0.0, std::floor(points[i][1]) ) );
+    const unsigned int z = static_cast<unsigned int>(std::max(0.0, std::floor(points[i][2]) ) );
+    keys[i].first = seed_order == SEED_ORDER_HILBERT ? HilbertKey(x, y, z, bits) : MortonKey(x, y, z, bits);
+    keys[i].second = static_cast<int>(i);
+    }
+  // Sorting the (key, index) pairs keeps points of the same voxel in their original order
+  std::sort(keys.begin(), keys.end() );
+
+  order.resize(keys.size() );
+  for( size_t i = 0; i < keys.size(); ++i )
+    {
+    order[i] = keys[i].second;
+    }
+}
+
+void ShuffleChunks(const int num_seeds, const int chunk_size, std::vector<int>& order)
+{
+  if( order.empty() )
+    {
+    order.resize(num_seeds);
+    for( int i = 0; i < num_seeds; ++i )
+      {
+      order[i] = i;
+      }
+    }
+  const int        size = std::max(chunk_size, 1);
+  const int        num_chunks = (num_seeds + size - 1) / size;
+  std::vector<int> chunks(num_chunks);
+  for( int i = 0; i < num_chunks; ++i )
+    {
+    chunks[i] = i;
+    }
+  // Fixed seed, so that runs with the same budget trace the same seeds
+  std::mt19937 generator(0);
+  std::shuffle(chunks.begin(), chunks.end(), generator);
+
+  std::vector<int> shuffled;
+  shuffled.reserve(num_seeds);
+  for( int i = 0; i < num_chunks; ++i )
+    {
+    const int begin = chunks[i] * size;
+    shuffled.insert(shuffled.end(), order.begin() + begin, order.begin() + std::min(begin + size, num_seeds) );
+    }
+  order.swap(shuffled);
+}
@@ -0,0 +1,51 @@
+/**
+ * \file seed_order.h
+ * \brief Orders the seed points along a space-filling curve so that seeds traced at the same time by
+ * different threads read neighbouring parts of the DWI volume
+*/
+
+#ifndef SEED_ORDER_H_
+#define SEED_ORDER_H_
+
+#include <string>
+#include <vector>
+#include "ukf_types.h"
+
+/** Order in which the primary seeds are handed to the tracking threads */
+enum SeedOrder
+  {
+  SEED_ORDER_NONE,   // The order of Init, i.e. the voxel order of the seed image
+  SEED_ORDER_MORTON, // Z-order curve
+  SEED_ORDER_HILBERT // Hilbert curve, better locality than Morton at slightly higher cost
+  };
+
+/** Converts "none", "morton" or "hilbert" to a SeedOrder. Returns true on failure. */
+bool ParseSeedOrder(const std::string& name, SeedOrder& order);
+
+/** Interleaves the lowest bits bits of x, y and z */
+unsigned long long MortonKey(unsigned int x, unsigned int y, unsigned int z, const int bits);
+
+/** Index of the cell (x, y, z) along a 3D Hilbert curve covering a cube of side 2^bits */
+unsigned long long HilbertKey(unsigned int x, unsigned int y, unsigned int z, const int bits);
+
+/**
+ * \brief Computes the tracing order of the seed points
+ *
+ * The points are given in ijk coordinates and are binned by voxel. Points in the same voxel keep their
+ * relative order, so the forward and backward seed of one seed point stay next to each other.
+ *
+ * \param[out] order Indices into points in tracing order, empty for SEED_ORDER_NONE
+*/
+void SpatialSeedOrder(const stdVec_t& points, const SeedOrder seed_order, std::vector<int>& order);
+
+/**
+ * \brief Shuffles the chunks of chunk_size consecutive positions of a tracing order
+ *
+ * The seeds within a chunk stay in order, so a spatial order keeps its locality within every chunk. The
+ * shuffle is the same in every run.
+ *
+ * \param[in,out] order Indices of num_seeds seeds in tracing order, the seed index order if empty
+*/
+void ShuffleChunks(const int num_seeds, const int chunk_size, std::vector<int>& order);
+
+#endif // SEED_ORDER_H_
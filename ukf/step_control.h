@@ -0,0 +1,101 @@
+/**
+ * \file step_control.h
+ * \brief Length of the steps along a fiber and the steps after which its points are recorded
+*/
+
+#ifndef STEP_CONTROL_H_
+#define STEP_CONTROL_H_
+
+#include <algorithm>
+#include <cmath>
+#include "ukf_types.h"
+
+/** Direction change of an adaptive step, in radians (about 6 degrees) */
+const ukfPrecisionType ADAPTIVE_STEP_ANGLE = 0.1;
+
+/**
+ * \class StepControl
+ * \brief Step length and recording of one half fiber
+ *
+ * With a fixed step length every steps_per_record-th step is recorded. The adaptive step length grows by up to a
+ * factor of two from step to step where the direction hardly changes and shrinks where the fiber bends, so that
+ * every step turns by about ADAPTIVE_STEP_ANGLE. It never steps past the next recorded point, so the recorded
+ * points are always steps_per_record fixed steps apart.
+*/
+class StepControl
+{
+public:
+  /**
+   * \param step_length The fixed step length, and the minimum of the adaptive one
+   * \param max_step_length The maximum of the adaptive step length, 0 for a fixed step length
+   * \param max_steps The number of fixed steps after which the fiber is too long
+  */
+  StepControl(const ukfPrecisionType step_length, const ukfPrecisionType max_step_length,
+              const int steps_per_record, const int max_steps)
+    : _adaptive(max_step_length > 0), _min_length(step_length), _max_length(max_step_length),
+    _steps_per_record(steps_per_record), _max_steps(max_steps), _record_spacing(steps_per_record * step_length),
+    _length(step_length), _steps(0), _traveled(0), _to_record(steps_per_record * step_length), _record(false)
+  {
+  }
+
+  /** Length of the next step */
+  ukfPrecisionType Length() const
+  {
+    return _length;
+  }
+
+  /** Called after every step with the directions the fiber had before and after it */
+  void Advance(const vec3_t& old_dir, const vec3_t& new_dir)
+  {
+    ++_steps;
+    if( !_adaptive )
+      {
+      return;
+      }
+    _traveled += _length;
+    _to_record -= _length;
+    _record = _to_record <= 1e-6 * _record_spacing;
+    if( _record )
+      {
+      _to_record += _record_spacing;
+      }
+
+    const ukfPrecisionType angle = std::acos(std::max(std::min(old_dir.dot(new_dir), ukfOne), -ukfOne) );
+    const ukfPrecisionType factor = angle > 0 ? ADAPTIVE_STEP_ANGLE / angle : 2;
+    _length = std::min(std::max(_length * std::min(std::max(factor, ukfPrecisionType(0.5) ), ukfPrecisionType(2) ),
+                                _min_length), _max_length);
+    // End the step on the next recorded point instead of leaving a remainder shorter than the minimum
+    if( _to_record - _length < _min_length )
+      {
+      _length = _to_record <= _max_length ? _to_record : _to_record - _min_length;
+      }
+  }
+
+  /** Whether the point reached by the last step is recorded */
+  bool Record() const
+  {
+    return _adaptive ? _record : (_steps + 1) % _steps_per_record == 0;
+  }
+
+  /** Whether the fiber is longer than the maximal half fiber length */
+  bool TooLong() const
+  {
+    return _adaptive ? _traveled > _max_steps * _min_length : _steps > _max_steps;
+  }
+
+private:
+  const bool             _adaptive;
+  const ukfPrecisionType _min_length;
+  const ukfPrecisionType _max_length;
+  const int              _steps_per_record;
+  const int              _max_steps;
+  const ukfPrecisionType _record_spacing;
+
+  ukfPrecisionType _length;
+  int              _steps;
+  ukfPrecisionType _traveled;
+  ukfPrecisionType _to_record;
+  bool             _record;
+};
+
+#endif  // STEP_CONTROL_H_
@@ -5,110 +5,550 @@
 */
 
 #include "thread.h"
-#include <itkMacro.h> // needed for ITK_VERSION_MAJOR
-#if ITK_VERSION_MAJOR < 5
-#include "itkMultiThreader.h"
-#else
-#include "itkMultiThreaderBase.h"
-#include <thread>
-#include "itkPlatformMultiThreader.h"
-#endif
+#include "vtk_stream_writer.h"
 
 #include <cassert>
+#include <algorithm>
+#include <iostream>
 
-WorkDistribution GenerateWorkDistribution(const int num_threads, const int total_num_works)
+SeedWorkQueue::SeedWorkQueue(const int num_primary_seeds, const int num_workers,
+                             const std::vector<int>& order, const int chunk_size)
+  : _num_primary_seeds(num_primary_seeds),
+  _order(order),
+  _chunk_size(std::max(chunk_size, 1) ),
+  _next_primary(0),
+  _cancelled(false),
+  _max_fibers(0),
+  _max_seconds(0),
+  _accepted_fibers(0),
+  _budget_reached(false),
+  _workers(num_workers),
+  _start(std::chrono::steady_clock::now() ),
+  _primaries_in_flight(num_primary_seeds),
+  _next_branch(0)
 {
-  WorkDistribution distribution;
+}
 
-  distribution.resize(num_threads);
-  for( int i = 0; i < num_threads; i++ )
+bool SeedWorkQueue::NextPrimary(const int thread_id, int& seed_index)
+{
+  if( _cancelled || BudgetReached() )
+    {
+    return false;
+    }
+
+  WorkerProgress& worker = _workers[thread_id];
+  if( worker.chunk_begin == worker.chunk_end )
     {
-    int iter = i;
-    while( iter < total_num_works )
+    // Checking first keeps the counter from growing once the seeds are used up
+    if( _next_primary.load(std::memory_order_relaxed) >= _num_primary_seeds )
       {
-      distribution[i].push_back(iter);
-      iter += num_threads;
+      return false;
       }
+    const int begin = _next_primary.fetch_add(_chunk_size);
+    if( begin >= _num_primary_seeds )
+      {
+      return false;
+      }
+    worker.chunk_begin = begin;
+    worker.chunk_end = std::min(begin + _chunk_size, _num_primary_seeds);
+    }
+
+  const int position = worker.chunk_begin++;
+  seed_index = _order.empty() ? position : _order[position];
+  return true;
+}
+
+void SeedWorkQueue::SetBudget(const long max_fibers, const double max_seconds)
+{
+  _max_fibers = max_fibers;
+  _max_seconds = max_seconds;
+}
+
+bool SeedWorkQueue::BudgetReached()
+{
+  if( _budget_reached.load(std::memory_order_relaxed) )
+    {
+    return true;
+    }
+  if( (_max_fibers > 0 && _accepted_fibers.load(std::memory_order_relaxed) >= _max_fibers) ||
+      (_max_seconds > 0 &&
+       std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count() >= _max_seconds) )
+    {
+    _budget_reached = true;
+    return true;
+    }
+  return false;
+}
+
+void SeedWorkQueue::PrimaryDone()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  --_primaries_in_flight;
+  if( _primaries_in_flight == 0 )
+    {
+    // Nothing can push any more branches, release the waiting workers
+    _cond.notify_all();
+    }
+}
+
+void SeedWorkQueue::PushBranch(const int thread_id, const SeedPointInfo& seed,
+                               const BranchingSeedAffiliation& affiliation)
+{
+  _workers[thread_id].branches_found.fetch_add(1, std::memory_order_relaxed);
+    {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _branches.push_back(BranchWork() );
+    BranchWork& work = _branches.back();
+    work.seed = seed;
+    work.affiliation = affiliation;
+    }
+  _cond.notify_one();
+}
+
+BranchWork * SeedWorkQueue::NextBranch(const bool wait)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  if( wait )
+    {
+    while( _next_branch == _branches.size() && _primaries_in_flight > 0 && !_cancelled )
+      {
+      _cond.wait(lock);
+      }
+    }
+  if( _next_branch == _branches.size() || _cancelled )
+    {
+    return NULL;
+    }
+  // Elements of a deque are not moved by push_back, so the reference stays valid after unlocking.
+  return &_branches[_next_branch++];
+}
+
+void SeedWorkQueue::Cancel()
+{
+    {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cancelled = true;
     }
+  _cond.notify_all();
+}
+
+void SeedWorkQueue::GetProgress(TractographyProgress& progress) const
+{
+  progress.seeds_total = _num_primary_seeds;
+  progress.seeds_done = 0;
+  progress.branches_found = 0;
+  progress.branches_done = 0;
+  progress.steps = 0;
+  for( size_t i = 0; i < _workers.size(); ++i )
+    {
+    progress.seeds_done += _workers[i].seeds_done.load(std::memory_order_relaxed);
+    progress.branches_found += _workers[i].branches_found.load(std::memory_order_relaxed);
+    progress.branches_done += _workers[i].branches_done.load(std::memory_order_relaxed);
+    progress.steps += _workers[i].steps.load(std::memory_order_relaxed);
+    }
+
+  progress.elapsed =
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+  const long fibers = progress.seeds_done + progress.branches_done;
+  progress.fibers_per_second = progress.elapsed > 0 ? fibers / progress.elapsed : 0;
+  progress.steps_per_second = progress.elapsed > 0 ? progress.steps / progress.elapsed : 0;
+  progress.eta = -1;
+  if( progress.seeds_done > 0 )
+    {
+    progress.eta = progress.elapsed * (progress.seeds_total - progress.seeds_done) / progress.seeds_done;
+    }
+}
+
+namespace
+{
+struct BranchOrder
+  {
+  const std::deque<BranchWork>& branches;
+  explicit BranchOrder(const std::deque<BranchWork>& b) : branches(b)
+  {
+  }
+
+  bool operator()(const size_t a, const size_t b) const
+  {
+    return branches[a].affiliation.fiber_index_ < branches[b].affiliation.fiber_index_;
+  }
+  };
+}
+
+void SeedWorkQueue::TakeBranches(std::vector<UKFFiber>& raw_branch,
+                                 std::vector<BranchingSeedAffiliation>& affiliation)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  assert(_cancelled || (_primaries_in_flight == 0 && _next_branch == _branches.size() ) );
+
+  // A fiber is traced by a single thread which pushes its branches in emission order, so a stable sort on
+  // the originating fiber gives the same order regardless of the number of threads.
+  std::vector<size_t> order(_branches.size() );
+  for( size_t i = 0; i < order.size(); ++i )
+    {
+    order[i] = i;
+    }
+  std::stable_sort(order.begin(), order.end(), BranchOrder(_branches) );
+
+  raw_branch.resize(order.size() );
+  affiliation.resize(order.size() );
+  for( size_t i = 0; i < order.size(); ++i )
+    {
+    BranchWork& work = _branches[order[i]];
+    std::swap(raw_branch[i], work.fiber);
+    affiliation[i] = work.affiliation;
+    }
+  _branches.clear();
+  _next_branch = 0;
+}
 
-  return distribution;
+FiberOutputStream::FiberOutputStream(VtkStreamWriter& writer, const int max_batches)
+  : _writer(writer),
+  _finishing(false),
+  _failed(false)
+{
+  assert(max_batches > 0);
+  _batches.resize(max_batches);
+  for( int i = 0; i < max_batches; ++i )
+    {
+    _batches[i] = new FiberBatch;
+    }
+  _free = _batches;
+  _thread = std::thread(&FiberOutputStream::WriterLoop, this);
+}
+
+FiberOutputStream::~FiberOutputStream()
+{
+  Finish();
+  for( size_t i = 0; i < _batches.size(); ++i )
+    {
+    delete _batches[i];
+    }
+}
+
+FiberBatch * FiberOutputStream::GetBatch()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  while( _free.empty() )
+    {
+    _cond.wait(lock);
+    }
+  FiberBatch *batch = _free.back();
+  _free.pop_back();
+  return batch;
+}
+
+void FiberOutputStream::Submit(FiberBatch *batch)
+{
+    {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _pending.push_back(batch);
+    }
+  _cond.notify_all();
+}
+
+bool FiberOutputStream::Finish()
+{
+    {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _finishing = true;
+    }
+  _cond.notify_all();
+  if( _thread.joinable() )
+    {
+    _thread.join();
+    }
+  return _failed;
 }
 
-// void ProgressThread::operator()()
-// {
-// const int num_work_threads = static_cast<int>(work_threads_.size()) ;
+void FiberOutputStream::WriterLoop()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  for( ;; )
+    {
+    while( _pending.empty() && !_finishing )
+      {
+      _cond.wait(lock);
+      }
+    if( _pending.empty() )
+      {
+      break;
+      }
+    FiberBatch *batch = _pending.front();
+    _pending.pop_front();
+    const bool failed = _failed;
 
-// int total_num_works = 0 ;
-// for (size_t i = 0; i < work_threads_.size(); i++) {
-// total_num_works += work_threads_[i]->get_num_works() ;
-// }
+    lock.unlock();
+    const bool write_failed = !failed && _writer.Append(batch->arena, batch->fibers);
+    batch->fibers.clear();
+    batch->arena.Clear(0);
+    lock.lock();
 
-// std::cout << "Number of threads: " << num_work_threads << std::endl ;
-// std::cout << "Work distributed: " << total_num_works << std::endl ;
+    _failed = _failed || write_failed;
+    _free.push_back(batch);
+    _cond.notify_all();
+    }
+}
 
-// boost::progress_display disp(static_cast<unsigned long>(total_num_works)) ;
+namespace
+{
+/** Points collected in a batch before it is handed to the output thread */
+const size_t STREAM_BATCH_POINTS = 1 << 16;
 
-// int num_works_completed = 0 ;
+int FollowSeed(thread_struct *str, const int id_, const size_t seed_index, const SeedPointInfo& seed,
+               UKFFiber& fiber, const bool is_branching, SeedWorkQueue& branching_seeds)
+{
+  return str->tractography_->Follow(id_, seed_index, seed, fiber, is_branching, branching_seeds);
+}
 
-// while (num_works_completed < total_num_works) {
-// boost::this_thread::sleep(boost::posix_time::seconds(PROGRESS_REPORT_INTERVAL)) ;
+/**
+ * Worker loop of the streaming output and of the runs that only write voxel maps or a connectome. A thread
+ * traces both halves of a seed pair and all their branches itself, so that it can join them right away and
+ * reuse its arena for the next pair.
+*/
+void StreamSeedPairs(const int id_, thread_struct *str)
+{
+  std::vector<SeedPointInfo>& seed_infos_ = *str->seed_infos_;
+  SeedWorkQueue&              work_queue = *str->work_queue_;
+  WorkerProgress&             progress = work_queue.GetWorkerProgress(id_);
+  FiberOutputStream *         output = str->output_stream_;
+  FiberBatch *                kept = str->kept_batches_ ? &(*str->kept_batches_)[id_] : NULL;
 
-// int temp = 0 ;
-// for (size_t i = 0; i < work_threads_.size(); i++) {
-// temp += work_threads_[i]->get_index() ;
-// }
+  SeedWorkQueue                         branch_queue(0, work_queue.GetNumberOfWorkers() );
+  std::vector<UKFFiber>                 halves(2);
+  std::vector<UKFFiber>                 raw_branch;
+  std::vector<BranchingSeedAffiliation> affiliation;
+  FiberBatch *                          batch = NULL;
+  FiberBatch                            unwritten;
 
-// disp += temp - num_works_completed ;
+  for( ;; )
+    {
+    if( str->tractography_->IsCancelled() )
+      {
+      work_queue.Cancel();
+      break;
+      }
+    int pair_index = 0;
+    if( !work_queue.NextPrimary(id_, pair_index) )
+      {
+      break;
+      }
 
-// num_works_completed = temp ;
-// }
-// }
+    str->tractography_->ClearFiberArena(id_);
+    int steps = 0;
+    for( int half = 0; half < 2; ++half )
+      {
+      const int seed_index = 2 * pair_index + half;
+      if( half == 1 && halves[0].excluded && !str->branching_ )
+        {
+        // The pair is rejected with its excluded first half. Branches would still be joined with the second half.
+        halves[1] = UKFFiber();
+        break;
+        }
+      steps += FollowSeed(str, id_, seed_index, seed_infos_[seed_index], halves[half], str->branching_,
+                          branch_queue);
+      }
+    for( BranchWork *branch = branch_queue.NextBranch(false); branch != NULL;
+         branch = branch_queue.NextBranch(false) )
+      {
+      steps += FollowSeed(str, id_, branch->affiliation.fiber_index_, branch->seed, branch->fiber, false,
+                          branch_queue);
+      }
+    branch_queue.TakeBranches(raw_branch, affiliation);
+    // The branches refer to the halves by seed index
+    for( size_t i = 0; i < affiliation.size(); ++i )
+      {
+      affiliation[i].fiber_index_ -= 2 * pair_index;
+      }
+
+    if( batch == NULL )
+      {
+      batch = output ? output->GetBatch() : kept ? kept : &unwritten;
+      }
+    const size_t first_fiber = batch->fibers.size();
+    PostProcessFibers(halves, raw_branch, affiliation, str->branches_only_, batch->arena, batch->fibers, NULL,
+                      str->roi_filter_);
+    work_queue.AddAcceptedFibers(static_cast<long>(batch->fibers.size() - first_fiber) );
+    if( str->fiber_maps_ )
+      {
+      for( size_t i = first_fiber; i < batch->fibers.size(); ++i )
+        {
+        str->fiber_maps_->AddFiber(id_, batch->fibers[i]);
+        }
+      }
+    if( output == NULL && kept == NULL )
+      {
+      batch->fibers.clear();
+      batch->arena.Clear(0);
+      }
+    // A kept batch grows until the end of the run, only the batches of the output stream are handed on
+    else if( output != NULL && batch->arena.NumberOfPoints() >= STREAM_BATCH_POINTS )
+      {
+      output->Submit(batch);
+      batch = NULL;
+      }
+
+    progress.seeds_done.fetch_add(1, std::memory_order_relaxed);
+    progress.branches_found.fetch_add(static_cast<long>(raw_branch.size() ), std::memory_order_relaxed);
+    progress.branches_done.fetch_add(static_cast<long>(raw_branch.size() ), std::memory_order_relaxed);
+    progress.steps.fetch_add(steps, std::memory_order_relaxed);
+    }
+  if( batch != NULL && output != NULL )
+    {
+    output->Submit(batch);
+    }
+}
+}
 
-#if ITK_VERSION_MAJOR >= 5
-itk::ITK_THREAD_RETURN_TYPE ThreadCallback(int id_, thread_struct * str)
-#else
-ITK_THREAD_RETURN_TYPE ThreadCallback(void *arg)
-#endif
+void ThreadCallback(int id_, void *arg)
 {
+  thread_struct *str = static_cast<thread_struct *>(arg);
+  if( str->seed_pairs_ )
+    {
+    StreamSeedPairs(id_, str);
+    return;
+    }
+  std::vector<UKFFiber>&      output_fiber_group_ = *str->output_fiber_group_;
+  std::vector<SeedPointInfo>& seed_infos_ = *str->seed_infos_;
+  SeedWorkQueue&              work_queue = *str->work_queue_;
+  WorkerProgress&             progress = work_queue.GetWorkerProgress(id_);
+
+  for( ;; )
+    {
+    // Cancellation is checked between fibers, the fiber being traced is always finished
+    if( str->tractography_->IsCancelled() )
+      {
+      work_queue.Cancel();
+      break;
+      }
+
+    // Pending branches are traced first so that the queue stays short. Once the primary seeds are used up
+    // the thread waits for branches still to be emitted by the other threads.
+    int         seed_index = 0;
+    BranchWork *branch = work_queue.NextBranch(false);
+    if( branch == NULL && !work_queue.NextPrimary(id_, seed_index) )
+      {
+      branch = work_queue.NextBranch(true);
+      if( branch == NULL )
+        {
+        break;
+        }
+      }
+
+    int steps = 0;
+    if( branch != NULL )
+      {
+      steps = str->tractography_->Follow(id_, branch->affiliation.fiber_index_, branch->seed, branch->fiber, false,
+                                         work_queue);
+      progress.branches_done.fetch_add(1, std::memory_order_relaxed);
+      progress.steps.fetch_add(steps, std::memory_order_relaxed);
+      continue;
+      }
 
-#if ITK_VERSION_MAJOR >= 5
-#else
-  int id_ =
-    ( (itk::MultiThreader::ThreadInfoStruct *)( arg ) )->ThreadID;
-  thread_struct *str =
-    (thread_struct *)( ( (itk::MultiThreader::ThreadInfoStruct *)( arg ) )->UserData );
-#endif
-  WorkDistribution                                     work_distribution = *str->work_distribution;
-  WorkList &                                           work_list_ = work_distribution[id_];
-  std::vector<UKFFiber>&                                  output_fiber_group_ = *str->output_fiber_group_;
-  std::vector<SeedPointInfo>&                          seed_infos_ = *str->seed_infos_;
-  std::vector<std::vector<SeedPointInfo> >&            branching_seed_info_vec = *str->branching_seed_info_vec;
-  std::vector<std::vector<BranchingSeedAffiliation> >& branching_seed_affiliation_vec =
-    *str->branching_seed_affiliation_vec;
+    steps = str->tractography_->Follow(id_, seed_index, seed_infos_[seed_index], output_fiber_group_[seed_index],
+                                       str->branching_, work_queue);
+    progress.seeds_done.fetch_add(1, std::memory_order_relaxed);
+    progress.steps.fetch_add(steps, std::memory_order_relaxed);
+    work_queue.PrimaryDone();
+    }
+}
 
-  for( WorkList::const_iterator it = work_list_.begin(); it != work_list_.end(); it++ )
+TrackingThreadPool::TrackingThreadPool(const int num_threads, const std::vector<NumaNode>& nodes)
+  : _nodes(nodes),
+  _callback(NULL),
+  _data(NULL),
+  _generation(0),
+  _num_busy(0),
+  _shutdown(false)
+{
+  assert(num_threads > 0);
+  _threads.reserve(num_threads);
+  for( int i = 0; i < num_threads; i++ )
     {
+    _threads.push_back(std::thread(&TrackingThreadPool::WorkerLoop, this, i) );
+    }
+}
 
-    if( str->num_tensors_ == 3 )
+TrackingThreadPool::~TrackingThreadPool()
+{
+    {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _shutdown = true;
+    }
+  _start_cond.notify_all();
+  for( size_t i = 0; i < _threads.size(); i++ )
+    {
+    if( _threads[i].joinable() )
       {
-      str->tractography_->Follow3T(id_, *it, seed_infos_[*it], output_fiber_group_[*it],
-                                   str->branching_, branching_seed_info_vec[id_], branching_seed_affiliation_vec[id_]);
+      _threads[i].join();
       }
-    else if( str->num_tensors_ == 2 )
+    }
+}
+
+void TrackingThreadPool::Execute(Callback callback, void *data, Monitor monitor, const double interval)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  assert(_num_busy == 0);
+  _callback = callback;
+  _data = data;
+  _num_busy = static_cast<int>(_threads.size() );
+  ++_generation;
+  _start_cond.notify_all();
+  while( _num_busy > 0 )
+    {
+    if( !monitor || interval <= 0 )
       {
-      str->tractography_->Follow2T(id_, *it, seed_infos_[*it], output_fiber_group_[*it],
-                                   str->branching_, branching_seed_info_vec[id_], branching_seed_affiliation_vec[id_]);
+      _done_cond.wait(lock);
       }
-    else
+    else if( _done_cond.wait_for(lock, std::chrono::duration<double>(interval) ) == std::cv_status::timeout &&
+             _num_busy > 0 )
       {
-      str->tractography_->Follow1T(id_, seed_infos_[*it], output_fiber_group_[*it]);
+      lock.unlock();
+      monitor(data);
+      lock.lock();
       }
+    }
+  _callback = NULL;
+  _data = NULL;
+}
 
-    assert(branching_seed_info_vec[id_].size() == branching_seed_affiliation_vec[id_].size() );
+void TrackingThreadPool::WorkerLoop(const int id)
+{
+  if( !_nodes.empty() )
+    {
+    const int node = id % static_cast<int>(_nodes.size() );
+    if( PinCurrentThreadToNode(node, _nodes[node]) )
+      {
+      std::cout << "Could not pin tracking thread " << id << " to NUMA node " << _nodes[node].id << std::endl;
+      }
+    }
+
+  unsigned long seen_generation = 0;
+  for( ;; )
+    {
+    Callback callback = NULL;
+    void *   data = NULL;
+      {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while( !_shutdown && _generation == seen_generation )
+        {
+        _start_cond.wait(lock);
+        }
+      if( _shutdown )
+        {
+        return;
+        }
+      seen_generation = _generation;
+      callback = _callback;
+      data = _data;
+      }
+
+    callback(id, data);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if( --_num_busy == 0 )
+      {
+      _done_cond.notify_one();
+      }
     }
-#if ITK_VERSION_MAJOR >= 5
-  return itk::ITK_THREAD_RETURN_DEFAULT_VALUE;
-#else
-  return ITK_THREAD_RETURN_VALUE;
-#endif
 }
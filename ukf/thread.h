@@ -8,48 +8,323 @@
 #define THREAD_H_
 
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 #include "tractography.h"
-#include "itkMacro.h"
+#include "numa_utilities.h"
+#include "voxel_maps.h"
+#include "connectome.h"
 
-#if ITK_VERSION_MAJOR < 5
-#  include "itkMultiThreader.h"
-#else
-#  include "itkMultiThreaderBase.h"
-#endif
+/**
+ * \struct WorkerProgress
+ * \brief Counters of one tracking thread
+ *
+ * Only the owning thread writes its counters and the progress reporter reads them, so relaxed atomics are
+ * enough. The padding keeps the counters of different threads on different cache lines.
+*/
+struct WorkerProgress
+  {
+  WorkerProgress() : seeds_done(0), branches_found(0), branches_done(0), steps(0), chunk_begin(0), chunk_end(0)
+  {
+  }
+
+  std::atomic<long> seeds_done;
+  std::atomic<long> branches_found;
+  std::atomic<long> branches_done;
+  std::atomic<long> steps;
+  // Range of positions in the seed order claimed by this thread but not traced yet. Owner only.
+  int               chunk_begin;
+  int               chunk_end;
+  char              padding[64];
+  };
+
+/**
+ * \struct BranchWork
+ * \brief A branch seed emitted during primary tracing together with the fiber traced from it
+*/
+struct BranchWork
+  {
+  SeedPointInfo            seed;
+  BranchingSeedAffiliation affiliation;
+  UKFFiber                 fiber;
+  };
+
+/**
+ * \class SeedWorkQueue
+ * \brief Shared work queue for primary seeds and the branch seeds they spawn
+ *
+ * Primary seeds are handed out through an atomic counter, in chunks of consecutive positions of an optional
+ * tracing order. With a spatial order (seed_order.h) this keeps every thread in one part of the volume while
+ * the output stays indexed by seed. Branch seeds are pushed by Follow2T/Follow3T as soon
+ * as they are found and are picked up by whichever worker is free, so branches no longer wait for the slowest
+ * primary fiber. The branches are stored in a deque so that references handed to the workers stay valid while
+ * other workers keep pushing.
+*/
+class SeedWorkQueue
+{
+public:
+  /**
+   * \param order Tracing order of the primary seeds, empty for the seed index order
+   * \param chunk_size Number of consecutive positions in the order a thread claims at once
+  */
+  SeedWorkQueue(const int num_primary_seeds, const int num_workers,
+                const std::vector<int>& order = std::vector<int>(), const int chunk_size = 1);
+
+  /**
+   * Claims the next primary seed for thread_id. Returns false once all primary seeds have been handed out or
+   * on Cancel.
+  */
+  bool NextPrimary(const int thread_id, int& seed_index);
+
+  /** Marks one primary fiber as finished. The workers stop waiting for branches when the last one is done. */
+  void PrimaryDone();
+
+  /** Queues a branch seed found by thread_id for tracing */
+  void PushBranch(const int thread_id, const SeedPointInfo& seed, const BranchingSeedAffiliation& affiliation);
 
-typedef std::vector<int>      WorkList;
-typedef std::vector<WorkList> WorkDistribution;
+  /**
+   * Claims the next pending branch.
+   * \param[in] wait If true, block until a branch is available or no more branches can be produced
+   * \return NULL if no branch is available or on Cancel
+  */
+  BranchWork * NextBranch(const bool wait);
 
-// class ProgressThread: public Thread
-// {
-// protected:
-// const std::vector<TractographyThread *>& work_threads_ ;
-// public:
-// ProgressThread(const std::vector<TractographyThread *>& work_threads) ;
-// void operator()() ;
-// ~ProgressThread() ;
-// } ;
+  /** Stops handing out work and wakes up the waiting workers. Fibers already being traced are finished. */
+  void Cancel();
 
-// const int PROGRESS_REPORT_INTERVAL = 2 ;	//Report progress once per 2 seconds
+  bool IsCancelled() const
+  {
+    return _cancelled;
+  }
+
+  /**
+   * Stops handing out primary seeds once max_fibers fibers have been accepted or max_seconds have passed since
+   * the construction of the queue, 0 for no limit. The seeds already handed out are finished. Only for queues
+   * whose workers do not wait for branches, since the skipped primaries are never marked as done.
+  */
+  void SetBudget(const long max_fibers, const double max_seconds);
+
+  /** Counts fibers that passed all filters, for the fiber budget */
+  void AddAcceptedFibers(const long count)
+  {
+    _accepted_fibers.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  long NumberOfAcceptedFibers() const
+  {
+    return _accepted_fibers.load(std::memory_order_relaxed);
+  }
+
+  /** Whether primary seeds were left untraced because the budget was reached */
+  bool IsBudgetReached() const
+  {
+    return _budget_reached;
+  }
+
+  int GetNumberOfWorkers() const
+  {
+    return static_cast<int>(_workers.size() );
+  }
+
+  /** Counters of one worker, written by that worker only */
+  WorkerProgress & GetWorkerProgress(const int thread_id)
+  {
+    return _workers[thread_id];
+  }
+
+  /** Sums the worker counters, elapsed is measured from the construction of the queue */
+  void GetProgress(TractographyProgress& progress) const;
+
+  /**
+   * Moves the traced branches out of the queue. The branches are ordered by the primary fiber they originate
+   * from and, within a fiber, by emission order, which is the order a single-threaded run produces.
+  */
+  void TakeBranches(std::vector<UKFFiber>& raw_branch, std::vector<BranchingSeedAffiliation>& affiliation);
 
-WorkDistribution GenerateWorkDistribution(const int num_threads, const int total_num_works);
+private:
+  bool BudgetReached();
+
+  const int               _num_primary_seeds;
+  const std::vector<int>  _order;
+  const int               _chunk_size;
+  std::atomic<int>        _next_primary;
+  std::atomic<bool>       _cancelled;
+  long                    _max_fibers;
+  double                  _max_seconds;
+  std::atomic<long>       _accepted_fibers;
+  std::atomic<bool>       _budget_reached;
+  std::vector<WorkerProgress> _workers;
+  const std::chrono::steady_clock::time_point _start;
+  int                     _primaries_in_flight;
+  std::deque<BranchWork>  _branches;
+  size_t                  _next_branch;
+  std::mutex              _mutex;
+  std::condition_variable _cond;
+};
+
+class VtkStreamWriter;
+
+/**
+ * \struct FiberMaps
+ * \brief Accumulators the workers add the fibers they finish to, one of each kind per worker
+ *
+ * The kinds that are not requested stay empty.
+*/
+struct FiberMaps
+  {
+  std::vector<VoxelMapAccumulator>   voxel_maps;
+  std::vector<ConnectomeAccumulator> connectomes;
+
+  bool empty() const
+  {
+    return voxel_maps.empty() && connectomes.empty();
+  }
+
+  void AddFiber(const int thread_id, const UKFFiber& fiber)
+  {
+    if( !voxel_maps.empty() )
+      {
+      voxel_maps[thread_id].AddFiber(fiber);
+      }
+    if( !connectomes.empty() )
+      {
+      connectomes[thread_id].AddFiber(fiber);
+      }
+  }
+  };
+
+/**
+ * \struct FiberBatch
+ * \brief Joined fibers handed from a tracking thread to the output thread
+*/
+struct FiberBatch
+  {
+  FiberArena            arena;
+  std::vector<UKFFiber> fibers;
+  };
+
+/**
+ * \class FiberOutputStream
+ * \brief Writes batches of finished fibers on a background thread while the tracking goes on
+ *
+ * There is a fixed number of batches. A tracking thread that gets ahead of the writer waits in GetBatch(), so
+ * the memory used for the output depends on the number of threads instead of the number of fibers.
+*/
+class FiberOutputStream
+{
+public:
+  FiberOutputStream(VtkStreamWriter& writer, const int max_batches);
+
+  /** Calls Finish() */
+  ~FiberOutputStream();
+
+  /** Returns an empty batch to fill, waits while all batches are in use */
+  FiberBatch * GetBatch();
+
+  /** Queues a filled batch for writing */
+  void Submit(FiberBatch *batch);
+
+  /**
+   * Writes the queued batches and stops the output thread
+   * \return true if writing failed, later batches are dropped after a failure
+  */
+  bool Finish();
+
+private:
+  FiberOutputStream(const FiberOutputStream &);
+  FiberOutputStream & operator=(const FiberOutputStream &);
+
+  void WriterLoop();
+
+  VtkStreamWriter &         _writer;
+  std::vector<FiberBatch *> _batches;
+  std::vector<FiberBatch *> _free;
+  std::deque<FiberBatch *>  _pending;
+  bool                      _finishing;
+  bool                      _failed;
+  std::mutex                _mutex;
+  std::condition_variable   _cond;
+  std::thread               _thread;
+};
 
 struct thread_struct
   {
   Tractography *tractography_;
-  WorkDistribution* work_distribution;
   std::vector<SeedPointInfo>* seed_infos_;
   bool branching_;
-  int num_tensors_;
+  bool branches_only_;
   std::vector<UKFFiber>* output_fiber_group_;
-  std::vector<std::vector<SeedPointInfo> >* branching_seed_info_vec;
-  std::vector<std::vector<BranchingSeedAffiliation> >* branching_seed_affiliation_vec;
+  SeedWorkQueue* work_queue_;
+  // If set, the work queue hands out seed pairs, which are joined as soon as they are traced
+  bool seed_pairs_;
+  // If set, the joined seed pairs are written to it, otherwise they are dropped once they are mapped
+  FiberOutputStream* output_stream_;
+  // If set, every worker adds the seed pairs it joins to its own accumulators
+  FiberMaps* fiber_maps_;
+  // The regions the joined seed pairs are filtered with
+  const RoiFilter* roi_filter_;
+  // If set, worker i keeps the seed pairs it joins in batch i instead of writing or dropping them
+  std::vector<FiberBatch>* kept_batches_;
   };
 
-#if ITK_VERSION_MAJOR >= 5
-extern itk::ITK_THREAD_RETURN_TYPE ThreadCallback(int id_, thread_struct *str);
-#else
-extern ITK_THREAD_RETURN_TYPE ThreadCallback(void *arg);
-#endif
+/** Traces the seeds of a thread_struct, run by every worker of the pool */
+extern void ThreadCallback(int id_, void *arg);
+
+/**
+ * \class TrackingThreadPool
+ * \brief Fixed set of tracking threads that is kept alive between calls to Tractography::Run
+ *
+ * Starting and joining threads for every run dominates the latency of small interactive runs, so the workers
+ * are created once and then sleep until the next batch of work is handed to them. If NUMA nodes are given,
+ * worker i is pinned to node i % nodes.size(), i.e. the workers are spread evenly over the sockets.
+*/
+class TrackingThreadPool
+{
+public:
+  typedef void (*Callback)(int worker_id, void *data);
+  typedef void (*Monitor)(void *data);
+
+  explicit TrackingThreadPool(const int num_threads,
+                              const std::vector<NumaNode>& nodes = std::vector<NumaNode>() );
+  ~TrackingThreadPool();
+
+  int GetNumberOfThreads() const
+  {
+    return static_cast<int>(_threads.size() );
+  }
+
+  /** Number of NUMA nodes the workers are pinned to, 0 if they are not pinned */
+  int GetNumberOfNodes() const
+  {
+    return static_cast<int>(_nodes.size() );
+  }
+
+  /**
+   * Runs callback(worker_id, data) on every worker and returns once all of them are done. If a monitor is
+   * given, the calling thread runs monitor(data) every interval seconds while it waits.
+  */
+  void Execute(Callback callback, void *data, Monitor monitor = NULL, const double interval = 0);
+
+private:
+  TrackingThreadPool(const TrackingThreadPool &);
+  TrackingThreadPool & operator=(const TrackingThreadPool &);
+
+  void WorkerLoop(const int id);
+
+  std::vector<std::thread> _threads;
+  std::vector<NumaNode>    _nodes;
+  std::mutex               _mutex;
+  std::condition_variable  _start_cond;
+  std::condition_variable  _done_cond;
+  Callback                 _callback;
+  void *                   _data;
+  unsigned long            _generation;
+  int                      _num_busy;
+  bool                     _shutdown;
+};
 
 #endif
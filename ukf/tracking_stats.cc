@@ -0,0 +1,100 @@
+/**
+ * \file tracking_stats.cc
+ * \brief implementation of tracking_stats.h
+*/
+
+#include "tracking_stats.h"
+
+#include <string>
+#include <vector>
+#include "run_report.h"
+
+namespace
+{
+/** Names of the stop reasons in the run report, in the order of StopReason */
+const char *STOP_REASON_NAMES[NUM_STOP_REASONS] =
+  {
+  "stop_outside_mask",
+  "stop_low_signal",
+  "stop_low_fa",
+  "stop_max_length",
+  "stop_curvature",
+  "stop_low_kappa",
+  "stop_roi_exclude"
+  };
+}
+
+void CountHistogram::Reset()
+{
+  for( int i = 0; i < NUM_BINS; ++i )
+    {
+    _bins[i] = 0;
+    }
+  _sum = 0;
+}
+
+void CountHistogram::Merge(const CountHistogram& other)
+{
+  for( int i = 0; i < NUM_BINS; ++i )
+    {
+    _bins[i] += other._bins[i];
+    }
+  _sum += other._sum;
+}
+
+void CountHistogram::Record(RunReport& report, const char *name) const
+{
+  int num_bins = NUM_BINS;
+  while( num_bins > 0 && _bins[num_bins - 1] == 0 )
+    {
+    --num_bins;
+    }
+  std::vector<uint64_t> lower_bounds(num_bins);
+  std::vector<uint64_t> counts(num_bins);
+  for( int i = 0; i < num_bins; ++i )
+    {
+    lower_bounds[i] = i == 0 ? 0 : uint64_t(1) << (i - 1);
+    counts[i] = _bins[i];
+    }
+  report.SetHistogram(name, lower_bounds, counts);
+}
+
+void TrackingStats::Reset()
+{
+  for( int i = 0; i < NUM_STOP_REASONS; ++i )
+    {
+    _stops[i] = 0;
+    }
+  _swaps = 0;
+  _single_tensor_steps = 0;
+  _model_switches = 0;
+  _steps_per_fiber.Reset();
+  _qp_per_step.Reset();
+}
+
+void TrackingStats::Merge(const TrackingStats& other)
+{
+  for( int i = 0; i < NUM_STOP_REASONS; ++i )
+    {
+    _stops[i] += other._stops[i];
+    }
+  _swaps += other._swaps;
+  _single_tensor_steps += other._single_tensor_steps;
+  _model_switches += other._model_switches;
+  _steps_per_fiber.Merge(other._steps_per_fiber);
+  _qp_per_step.Merge(other._qp_per_step);
+}
+
+void TrackingStats::Record(RunReport& report) const
+{
+  for( int i = 0; i < NUM_STOP_REASONS; ++i )
+    {
+    report.SetCount(STOP_REASON_NAMES[i], _stops[i]);
+    }
+  report.SetCount("tensor_swaps", _swaps);
+  report.SetCount("single_tensor_steps", _single_tensor_steps);
+  report.SetCount("model_switches", _model_switches);
+  report.SetCount("qp_solves", _qp_per_step.Sum() );
+  _steps_per_fiber.Record(report, "steps_per_fiber");
+  _qp_per_step.Record(report, "qp_solves_per_step");
+}
@@ -0,0 +1,141 @@
+/**
+ * \file tracking_stats.h
+ * \brief Counters of why the fibers stop and where the filter steps go, collected while tracking
+*/
+
+#ifndef TRACKING_STATS_H_
+#define TRACKING_STATS_H_
+
+#include <stdint.h>
+
+class RunReport;
+
+/** Why Tractography::Follow stopped a fiber, the first one that applies in this order */
+enum StopReason
+  {
+  STOP_OUTSIDE_MASK, // left the brain mask
+  STOP_LOW_SIGNAL,   // mean signal of the estimated state below the stopping threshold
+  STOP_LOW_FA,       // FA below the stopping FA, or the first tensor no longer the principal one
+  STOP_MAX_LENGTH,   // maximal half fiber length reached
+  STOP_CURVATURE,    // radius of curvature below the minimum
+  STOP_LOW_KAPPA,    // NODDI orientation concentration too low
+  STOP_ROI_EXCLUDE,  // entered the exclude region of the RoiFilter
+  NUM_STOP_REASONS
+  };
+
+/** First stop reason of the checks done after every step, STOP_CURVATURE if none of the others applies */
+inline StopReason GetStopReason(const bool is_brain, const bool low_signal, const bool low_fa, const bool too_long)
+{
+  return !is_brain ? STOP_OUTSIDE_MASK :
+         low_signal ? STOP_LOW_SIGNAL :
+         low_fa ? STOP_LOW_FA :
+         too_long ? STOP_MAX_LENGTH : STOP_CURVATURE;
+}
+
+/**
+ * \class CountHistogram
+ * \brief Histogram of non-negative counts in power-of-two bins: 0, 1, 2-3, 4-7, ...
+*/
+class CountHistogram
+{
+public:
+  enum { NUM_BINS = 32 };
+
+  CountHistogram()
+  {
+    Reset();
+  }
+
+  void Reset();
+
+  void Add(const uint64_t value)
+  {
+    int bin = 0;
+    for( uint64_t v = value; v > 0 && bin < NUM_BINS - 1; v >>= 1 )
+      {
+      ++bin;
+      }
+    ++_bins[bin];
+    _sum += value;
+  }
+
+  void Merge(const CountHistogram& other);
+
+  /** Sum of the values added */
+  uint64_t Sum() const
+  {
+    return _sum;
+  }
+
+  /** Adds the bins up to the last non-empty one to the report */
+  void Record(RunReport& report, const char *name) const;
+
+private:
+  uint64_t _bins[NUM_BINS];
+  uint64_t _sum;
+};
+
+/**
+ * \class TrackingStats
+ * \brief Statistics of the fibers traced by one thread
+ *
+ * Every tracking thread owns one, so nothing is synchronized; they are merged once all fibers are traced.
+*/
+class TrackingStats
+{
+public:
+  TrackingStats()
+  {
+    Reset();
+  }
+
+  void Reset();
+
+  /** Called once for every fiber when it stops */
+  void AddFiber(const StopReason reason, const int steps)
+  {
+    ++_stops[reason];
+    _steps_per_fiber.Add(steps);
+  }
+
+  /** Called for every filter step with the number of quadratic programs the constrained filter solved */
+  void AddStep(const uint64_t qp_solves)
+  {
+    _qp_per_step.Add(qp_solves);
+  }
+
+  /** Called when the tensors of the state are swapped because the principal direction switched */
+  void AddSwap()
+  {
+    ++_swaps;
+  }
+
+  /** Called for every step of the adaptive model order taken with the single tensor model */
+  void AddSingleTensorStep()
+  {
+    ++_single_tensor_steps;
+  }
+
+  /** Called when the adaptive model order switches between the single tensor and all tensors */
+  void AddModelSwitch()
+  {
+    ++_model_switches;
+  }
+
+  void Merge(const TrackingStats& other);
+
+  /** Adds the stop reasons, the swaps, the model order switches and the histograms to the report */
+  void Record(RunReport& report) const;
+
+private:
+  uint64_t       _stops[NUM_STOP_REASONS];
+  uint64_t       _swaps;
+  uint64_t       _single_tensor_steps;
+  uint64_t       _model_switches;
+  CountHistogram _steps_per_fiber;
+  CountHistogram _qp_per_step;
+  // Keeps the counters of different threads on different cache lines
+  char           _padding[64];
+};
+
+#endif  // TRACKING_STATS_H_
@@ -0,0 +1,753 @@
+/**
+ * \file tract_file.cc
+ * \brief implementation of tract_file.h
+*/
+
+#include "tract_file.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "vtkSmartPointer.h"
+#include "vtkPolyData.h"
+#include "vtkPoints.h"
+#include "vtkCellArray.h"
+#include "vtkDataArray.h"
+#include "vtkFloatArray.h"
+#include "vtkIdTypeArray.h"
+#include "vtkStringArray.h"
+#include "vtkPointData.h"
+#include "vtkFieldData.h"
+
+static_assert(sizeof(TractFileHeader) == 128, "TractFileHeader must match the file layout");
+static_assert(sizeof(TractColumn) == 112, "TractColumn must match the file layout");
+
+namespace
+{
+const char TRACT_FILE_MAGIC[8] = { 'U', 'K', 'F', 'T', 'R', 'A', 'C', 'T' };
+
+/** Uncompressed size of a block of a compressed column */
+const uint64_t TRACT_BLOCK_SIZE = 1 << 20;
+
+/** Largest block size a reader accepts, guards against corrupt files */
+const uint64_t TRACT_MAX_BLOCK_SIZE = 1 << 26;
+
+/** Largest multiple of the quantum that a float column is quantized to, doubles hold it exactly */
+const double TRACT_MAX_QUANTIZED = 1e15;
+
+uint64_t Align(const uint64_t position)
+{
+  return (position + TRACT_FILE_ALIGNMENT - 1) / TRACT_FILE_ALIGNMENT * TRACT_FILE_ALIGNMENT;
+}
+
+bool IsLittleEndian()
+{
+  const int one = 1;
+
+  return *reinterpret_cast<const char *>(&one) == 1;
+}
+
+/** Copies text into a zero terminated field of the file, cutting it if it does not fit */
+template <size_t N>
+void CopyName(const std::string& text, char (&field)[N])
+{
+  std::memset(field, 0, N);
+  std::memcpy(field, text.c_str(), std::min(text.size(), N - 1) );
+}
+
+template <size_t N>
+std::string ReadName(const char (&field)[N])
+{
+  return std::string(field, std::find(field, field + N, '\0') );
+}
+
+void WritePadding(std::ofstream& output, const uint64_t position)
+{
+  static const char zeros[TRACT_FILE_ALIGNMENT] = { 0 };
+
+  output.write(zeros, Align(position) - position);
+}
+
+/**
+ * Rounds the values of a column to multiples of quantum and writes the differences of the multiples along every
+ * fiber as zigzag varints
+ * \return true if a value is not finite or too large to quantize, the column is then stored lossless
+*/
+bool QuantizeColumn(const float *values, const int components, const std::vector<uint64_t>& fiber_offsets,
+                    const double quantum, std::vector<unsigned char>& encoded)
+{
+  encoded.clear();
+  encoded.reserve(static_cast<size_t>(fiber_offsets.back() ) * components);
+  std::vector<int64_t> previous(components);
+  for( size_t f = 0; f + 1 < fiber_offsets.size(); ++f )
+    {
+    std::fill(previous.begin(), previous.end(), 0);
+    for( uint64_t p = fiber_offsets[f]; p < fiber_offsets[f + 1]; ++p )
+      {
+      for( int c = 0; c < components; ++c )
+        {
+        const double multiple = values[p * components + c] / quantum;
+        if( !(std::fabs(multiple) < TRACT_MAX_QUANTIZED) )
+          {
+          return true;
+          }
+        const int64_t quantized = static_cast<int64_t>(std::floor(multiple + 0.5) );
+        const int64_t delta = quantized - previous[c];
+        previous[c] = quantized;
+        uint64_t zigzag = (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63);
+        while( zigzag >= 0x80 )
+          {
+          encoded.push_back(static_cast<unsigned char>(zigzag | 0x80) );
+          zigzag >>= 7;
+          }
+        encoded.push_back(static_cast<unsigned char>(zigzag) );
+        }
+      }
+    }
+  return false;
+}
+
+/**
+ * Inverse of QuantizeColumn
+ * \return true if the varints do not match the fibers
+*/
+bool DequantizeColumn(const std::vector<unsigned char>& encoded, const int components, const uint64_t *fiber_offsets,
+                      const uint64_t num_fibers, const double quantum, float *values)
+{
+  std::vector<int64_t> previous(components);
+  size_t               position = 0;
+  for( uint64_t f = 0; f < num_fibers; ++f )
+    {
+    std::fill(previous.begin(), previous.end(), 0);
+    for( uint64_t p = fiber_offsets[f]; p < fiber_offsets[f + 1]; ++p )
+      {
+      for( int c = 0; c < components; ++c )
+        {
+        uint64_t zigzag = 0;
+        for( int shift = 0;; shift += 7 )
+          {
+          if( position == encoded.size() || shift > 63 )
+            {
+            return true;
+            }
+          const unsigned char byte = encoded[position++];
+          zigzag |= static_cast<uint64_t>(byte & 0x7f) << shift;
+          if( !(byte & 0x80) )
+            {
+            break;
+            }
+          }
+        previous[c] += static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+        values[p * components + c] = static_cast<float>(previous[c] * quantum);
+        }
+      }
+    }
+  return position != encoded.size();
+}
+
+/** Points or point data array converted to floats, in place if possible */
+struct FloatColumn
+  {
+  std::vector<float> converted;
+  const float *      values;
+  };
+
+void ToFloat(vtkDataArray *array, FloatColumn& column)
+{
+  if( vtkFloatArray *floats = vtkFloatArray::SafeDownCast(array) )
+    {
+    column.values = floats->GetPointer(0);
+    return;
+    }
+  const vtkIdType tuples = array->GetNumberOfTuples();
+  const int       components = array->GetNumberOfComponents();
+  column.converted.resize(static_cast<size_t>(tuples) * components);
+  for( vtkIdType t = 0; t < tuples; ++t )
+    {
+    for( int c = 0; c < components; ++c )
+      {
+      column.converted[t * components + c] = static_cast<float>(array->GetComponent(t, c) );
+      }
+    }
+  column.values = column.converted.empty() ? NULL : &column.converted[0];
+}
+}
+
+TractFile::TractFile() :
+  _data(NULL),
+  _size(0),
+#ifdef _WIN32
+  _file(INVALID_HANDLE_VALUE),
+  _mapping(NULL),
+#else
+  _fd(-1),
+#endif
+  _header(NULL),
+  _columns(NULL),
+  _fiber_offsets(NULL)
+{
+}
+
+TractFile::~TractFile()
+{
+  Close();
+}
+
+bool TractFile::Open(const std::string& file_name)
+{
+  Close();
+  if( !IsLittleEndian() )
+    {
+    std::cout << "Reading .ukf files is only supported on little-endian machines." << std::endl;
+    return true;
+    }
+
+#ifdef _WIN32
+  _file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                      FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER file_size;
+  if( _file == INVALID_HANDLE_VALUE || !GetFileSizeEx(_file, &file_size) )
+    {
+    std::cout << "Cannot open " << file_name << std::endl;
+    Close();
+    return true;
+    }
+  _size = static_cast<size_t>(file_size.QuadPart);
+  if( _size >= sizeof(TractFileHeader) )
+    {
+    _mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if( _mapping != NULL )
+      {
+      _data = static_cast<const unsigned char *>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0) );
+      }
+    }
+#else
+  _fd = open(file_name.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if( _fd < 0 || fstat(_fd, &file_stat) != 0 )
+    {
+    std::cout << "Cannot open " << file_name << std::endl;
+    Close();
+    return true;
+    }
+  _size = static_cast<size_t>(file_stat.st_size);
+  if( _size >= sizeof(TractFileHeader) )
+    {
+    void *data = mmap(NULL, _size, PROT_READ, MAP_SHARED, _fd, 0);
+    if( data != MAP_FAILED )
+      {
+      _data = static_cast<const unsigned char *>(data);
+      }
+    }
+#endif
+  if( _data == NULL )
+    {
+    std::cout << "Cannot map " << file_name << " into memory." << std::endl;
+    Close();
+    return true;
+    }
+
+  // Check the header and the tables, so that the accessors need no checks
+  _header = reinterpret_cast<const TractFileHeader *>(_data);
+  if( std::memcmp(_header->magic, TRACT_FILE_MAGIC, sizeof(TRACT_FILE_MAGIC) ) != 0 )
+    {
+    std::cout << file_name << " is not a .ukf file." << std::endl;
+    Close();
+    return true;
+    }
+  if( _header->version > TRACT_FILE_VERSION )
+    {
+    std::cout << file_name << " has version " << _header->version << ", this program reads up to version "
+              << TRACT_FILE_VERSION << "." << std::endl;
+    Close();
+    return true;
+    }
+  const uint64_t num_fibers = _header->num_fibers;
+  const uint64_t num_points = _header->num_points;
+  const uint64_t columns_end = sizeof(TractFileHeader) + uint64_t(_header->num_columns) * sizeof(TractColumn);
+  if( _header->num_columns == 0 || columns_end > _size || _header->fiber_offsets < columns_end ||
+      _header->fiber_offsets % sizeof(uint64_t) != 0 || num_fibers >= _size / sizeof(uint64_t) ||
+      _header->fiber_offsets + (num_fibers + 1) * sizeof(uint64_t) > _size )
+    {
+    std::cout << file_name << " is truncated or corrupt." << std::endl;
+    Close();
+    return true;
+    }
+  _columns = reinterpret_cast<const TractColumn *>(_data + sizeof(TractFileHeader) );
+  _fiber_offsets = reinterpret_cast<const uint64_t *>(_data + _header->fiber_offsets);
+  bool corrupt = _fiber_offsets[0] != 0 || _fiber_offsets[num_fibers] != num_points;
+  for( uint64_t i = 0; i < num_fibers && !corrupt; ++i )
+    {
+    corrupt = _fiber_offsets[i] > _fiber_offsets[i + 1];
+    }
+  for( uint32_t i = 0; i < _header->num_columns && !corrupt; ++i )
+    {
+    const TractColumn& column = _columns[i];
+    corrupt = column.components == 0 || column.offset > _size || column.size > _size - column.offset ||
+      column.compression > TRACT_COMPRESSION_QUANTIZED_LZ4;
+    if( !corrupt && column.compression == TRACT_COMPRESSION_NONE )
+      {
+      corrupt = column.offset % sizeof(float) != 0 ||
+        num_points > column.size / sizeof(float) / column.components ||
+        column.size != num_points * column.components * sizeof(float);
+      }
+    }
+  if( corrupt || _columns[0].components != 3 )
+    {
+    std::cout << file_name << " is truncated or corrupt." << std::endl;
+    Close();
+    return true;
+    }
+  _decompressed.resize(_header->num_columns);
+  return false;
+}
+
+void TractFile::Close()
+{
+#ifdef _WIN32
+  if( _data != NULL )
+    {
+    UnmapViewOfFile(_data);
+    }
+  if( _mapping != NULL )
+    {
+    CloseHandle(_mapping);
+    }
+  if( _file != INVALID_HANDLE_VALUE )
+    {
+    CloseHandle(_file);
+    }
+  _file = INVALID_HANDLE_VALUE;
+  _mapping = NULL;
+#else
+  if( _data != NULL )
+    {
+    munmap(const_cast<unsigned char *>(_data), _size);
+    }
+  if( _fd >= 0 )
+    {
+    close(_fd);
+    }
+  _fd = -1;
+#endif
+  _data = NULL;
+  _size = 0;
+  _header = NULL;
+  _columns = NULL;
+  _fiber_offsets = NULL;
+  _decompressed.clear();
+}
+
+int TractFile::FindColumn(const std::string& name) const
+{
+  for( size_t i = 0; i < GetNumberOfColumns(); ++i )
+    {
+    if( ReadName(_columns[i].name) == name )
+      {
+      return static_cast<int>(i);
+      }
+    }
+  return -1;
+}
+
+std::string TractFile::GetGenerator() const
+{
+  return ReadName(_header->generator);
+}
+
+const float * TractFile::GetColumnData(const size_t column)
+{
+  const TractColumn& description = _columns[column];
+  const size_t       num_values = static_cast<size_t>(_header->num_points) * description.components;
+  if( description.compression == TRACT_COMPRESSION_NONE )
+    {
+    return num_values == 0 ? NULL : reinterpret_cast<const float *>(_data + description.offset);
+    }
+  std::vector<float>& values = _decompressed[column];
+  if( !values.empty() || num_values == 0 )
+    {
+    return values.empty() ? NULL : &values[0];
+    }
+
+  // A quantized column starts with the size of its varints, then all compressed columns continue with the
+  // number of blocks and their compressed sizes
+  const bool           quantized = description.compression >= TRACT_COMPRESSION_QUANTIZED_ZLIB;
+  const size_t         prefix = quantized ? sizeof(uint64_t) : 0;
+  const unsigned char *data = _data + description.offset + prefix;
+  const uint64_t *     block_table = reinterpret_cast<const uint64_t *>(data);
+  const size_t         block_size = static_cast<size_t>(description.block_size);
+  if( description.offset % sizeof(uint64_t) != 0 || description.size < prefix + sizeof(uint64_t) ||
+      block_size == 0 || block_size > TRACT_MAX_BLOCK_SIZE || (quantized && !(description.quantum > 0) ) )
+    {
+    std::cout << "Column " << ReadName(description.name) << " is corrupt." << std::endl;
+    return NULL;
+    }
+  const size_t   data_size = static_cast<size_t>(description.size - prefix);
+  const uint64_t total_size = quantized ? block_table[-1] : num_values * sizeof(float);
+  const uint64_t num_blocks = block_table[0];
+  if( num_blocks != (total_size + block_size - 1) / block_size ||
+      num_blocks > (data_size - sizeof(uint64_t) ) / sizeof(uint64_t) )
+    {
+    std::cout << "Column " << ReadName(description.name) << " is corrupt." << std::endl;
+    return NULL;
+    }
+  values.resize(num_values);
+  std::vector<unsigned char> encoded(quantized ? total_size : 0);
+  unsigned char *            target = quantized ? &encoded[0] : reinterpret_cast<unsigned char *>(&values[0]);
+  const VtpCompressor        compressor =
+    description.compression == TRACT_COMPRESSION_ZLIB ||
+    description.compression == TRACT_COMPRESSION_QUANTIZED_ZLIB ? VTP_COMPRESSOR_ZLIB : VTP_COMPRESSOR_LZ4;
+  uint64_t position = (num_blocks + 1) * sizeof(uint64_t);
+  for( uint64_t b = 0; b < num_blocks; ++b )
+    {
+    const uint64_t compressed_size = block_table[b + 1];
+    const size_t   begin = static_cast<size_t>(b) * block_size;
+    if( compressed_size > data_size - position ||
+        DecompressBlock(compressor, data + position, static_cast<size_t>(compressed_size), target + begin,
+                        std::min(block_size, static_cast<size_t>(total_size) - begin) ) )
+      {
+      std::cout << "Column " << ReadName(description.name) << " cannot be decompressed." << std::endl;
+      values.clear();
+      return NULL;
+      }
+    position += compressed_size;
+    }
+  if( quantized && DequantizeColumn(encoded, description.components, _fiber_offsets, _header->num_fibers,
+                                    description.quantum, &values[0]) )
+    {
+    std::cout << "Column " << ReadName(description.name) << " is corrupt." << std::endl;
+    values.clear();
+    return NULL;
+    }
+  return &values[0];
+}
+
+TractFileWriter::TractFileWriter() :
+  _compressed(false),
+  _compressor(VTP_COMPRESSOR_ZLIB),
+  _num_threads(1),
+  _position_error(0),
+  _scalar_error(0)
+{
+}
+
+bool TractFileWriter::Write(const std::string& file_name, const std::vector<uint64_t>& fiber_offsets,
+                            const std::vector<TractColumnData>& columns) const
+{
+  if( !IsLittleEndian() )
+    {
+    std::cout << "Writing .ukf files is only supported on little-endian machines." << std::endl;
+    return true;
+    }
+  if( fiber_offsets.empty() || columns.empty() || columns[0].components != 3 )
+    {
+    std::cout << "A .ukf file needs the fiber offsets and the points as first column." << std::endl;
+    return true;
+    }
+  const bool quantize = _position_error > 0 || _scalar_error > 0;
+  if( (_compressed || quantize) && !VtpBlockWriter::IsCompressorAvailable(_compressor) )
+    {
+    std::cout << "LZ4 compression is not available in this build." << std::endl;
+    return true;
+    }
+  const uint64_t num_points = fiber_offsets.back();
+
+  // Quantize the points and the scalars if asked to, then compress the blocks of all columns at once. Columns
+  // that are stored as they are get an empty buffer.
+  std::vector<double>                      quanta(columns.size(), 0);
+  std::vector<std::vector<unsigned char> > encoded(columns.size() );
+  std::vector<CompressionBuffer>           buffers;
+  for( size_t i = 0; i < columns.size(); ++i )
+    {
+    const double error = i == 0 ? _position_error : columns[i].components == 1 ? _scalar_error : 0;
+    if( error > 0 && !QuantizeColumn(columns[i].values, columns[i].components, fiber_offsets, 2 * error,
+                                     encoded[i]) )
+      {
+      quanta[i] = 2 * error;
+      buffers.push_back(CompressionBuffer(encoded[i].empty() ? NULL : &encoded[i][0], encoded[i].size() ) );
+      }
+    else if( _compressed )
+      {
+      buffers.push_back(CompressionBuffer(reinterpret_cast<const unsigned char *>(columns[i].values),
+                                          num_points * columns[i].components * sizeof(float) ) );
+      }
+    else
+      {
+      buffers.push_back(CompressionBuffer(NULL, 0) );
+      }
+    }
+  std::vector<std::vector<unsigned char> > blocks;
+  if( CompressBlocks(_compressor, buffers, TRACT_BLOCK_SIZE, _num_threads, blocks) )
+    {
+    std::cout << "Compressing the data of " << file_name << " failed." << std::endl;
+    return true;
+    }
+
+  // Lay out the file
+  TractFileHeader header;
+  std::memset(&header, 0, sizeof(header) );
+  std::memcpy(header.magic, TRACT_FILE_MAGIC, sizeof(TRACT_FILE_MAGIC) );
+  header.version = TRACT_FILE_VERSION;
+  header.num_columns = static_cast<uint32_t>(columns.size() );
+  header.num_fibers = fiber_offsets.size() - 1;
+  header.num_points = num_points;
+  header.fiber_offsets = Align(sizeof(TractFileHeader) + columns.size() * sizeof(TractColumn) );
+  CopyName(_generator, header.generator);
+
+  std::vector<TractColumn> table(columns.size() );
+  std::vector<size_t>      first_block(columns.size() + 1, 0);
+  uint64_t                 position = header.fiber_offsets + fiber_offsets.size() * sizeof(uint64_t);
+  for( size_t i = 0; i < columns.size(); ++i )
+    {
+    TractColumn& column = table[i];
+    std::memset(&column, 0, sizeof(column) );
+    CopyName(columns[i].name, column.name);
+    column.components = columns[i].components;
+    column.attribute = columns[i].attribute;
+    column.offset = Align(position);
+    const size_t num_blocks = (buffers[i].second + TRACT_BLOCK_SIZE - 1) / TRACT_BLOCK_SIZE;
+    first_block[i + 1] = first_block[i] + num_blocks;
+    if( quanta[i] > 0 )
+      {
+      column.compression = _compressor == VTP_COMPRESSOR_ZLIB ? TRACT_COMPRESSION_QUANTIZED_ZLIB :
+        TRACT_COMPRESSION_QUANTIZED_LZ4;
+      column.quantum = quanta[i];
+      }
+    else if( _compressed )
+      {
+      column.compression = _compressor == VTP_COMPRESSOR_ZLIB ? TRACT_COMPRESSION_ZLIB : TRACT_COMPRESSION_LZ4;
+      }
+    if( column.compression != TRACT_COMPRESSION_NONE )
+      {
+      column.block_size = TRACT_BLOCK_SIZE;
+      column.size = (num_blocks + 1 + (quanta[i] > 0 ? 1 : 0) ) * sizeof(uint64_t);
+      for( size_t b = first_block[i]; b < first_block[i + 1]; ++b )
+        {
+        column.size += blocks[b].size();
+        }
+      }
+    else
+      {
+      column.compression = TRACT_COMPRESSION_NONE;
+      column.size = num_points * columns[i].components * sizeof(float);
+      }
+    position = column.offset + column.size;
+    }
+
+  std::ofstream output(file_name.c_str(), std::ios::binary);
+  output.write(reinterpret_cast<const char *>(&header), sizeof(header) );
+  output.write(reinterpret_cast<const char *>(&table[0]), table.size() * sizeof(TractColumn) );
+  WritePadding(output, sizeof(TractFileHeader) + table.size() * sizeof(TractColumn) );
+  output.write(reinterpret_cast<const char *>(&fiber_offsets[0]), fiber_offsets.size() * sizeof(uint64_t) );
+  position = header.fiber_offsets + fiber_offsets.size() * sizeof(uint64_t);
+  for( size_t i = 0; i < columns.size(); ++i )
+    {
+    WritePadding(output, position);
+    if( table[i].compression != TRACT_COMPRESSION_NONE )
+      {
+      std::vector<uint64_t> block_table;
+      if( quanta[i] > 0 )
+        {
+        block_table.push_back(encoded[i].size() );
+        }
+      block_table.push_back(first_block[i + 1] - first_block[i]);
+      for( size_t b = first_block[i]; b < first_block[i + 1]; ++b )
+        {
+        block_table.push_back(blocks[b].size() );
+        }
+      output.write(reinterpret_cast<const char *>(&block_table[0]), block_table.size() * sizeof(uint64_t) );
+      for( size_t b = first_block[i]; b < first_block[i + 1]; ++b )
+        {
+        output.write(reinterpret_cast<const char *>(&blocks[b][0]), blocks[b].size() );
+        }
+      }
+    else if( table[i].size > 0 )
+      {
+      output.write(reinterpret_cast<const char *>(columns[i].values), table[i].size);
+      }
+    position = table[i].offset + table[i].size;
+    }
+  output.close();
+  if( output.fail() )
+    {
+    std::cout << "Writing " << file_name << " failed." << std::endl;
+    return true;
+    }
+  return false;
+}
+
+bool TractFileWriter::Write(vtkPolyData *polyData, const std::string& file_name) const
+{
+  if( polyData == NULL || polyData->GetPoints() == NULL )
+    {
+    std::cout << "No points to write to " << file_name << std::endl;
+    return true;
+    }
+
+  // Every point data array with a name becomes a column
+  vtkPointData *               pointData = polyData->GetPointData();
+  std::vector<vtkDataArray *>  arrays(1, polyData->GetPoints()->GetData() );
+  std::vector<TractColumnData> columns(1);
+  columns[0].name = "points";
+  columns[0].components = 3;
+  columns[0].attribute = TRACT_ATTRIBUTE_NONE;
+  for( int i = 0; i < pointData->GetNumberOfArrays(); ++i )
+    {
+    vtkDataArray *array = pointData->GetArray(i);
+    if( array == NULL || array->GetName() == NULL )
+      {
+      continue;
+      }
+    TractColumnData column;
+    column.name = array->GetName();
+    column.components = array->GetNumberOfComponents();
+    column.attribute = array == pointData->GetTensors() ? TRACT_ATTRIBUTE_TENSORS :
+      array == pointData->GetScalars() ? TRACT_ATTRIBUTE_SCALARS : TRACT_ATTRIBUTE_NONE;
+    arrays.push_back(array);
+    columns.push_back(column);
+    }
+  std::vector<FloatColumn> values(arrays.size() );
+  for( size_t i = 0; i < arrays.size(); ++i )
+    {
+    ToFloat(arrays[i], values[i]);
+    }
+
+  // The tractography writes the points of each fiber one after the other, other files are gathered line by line
+  std::vector<uint64_t>  fiber_offsets(1, 0);
+  std::vector<vtkIdType> point_ids;
+  bool                   in_order = true;
+  vtkCellArray *         lines = polyData->GetLines();
+  if( lines != NULL )
+    {
+    vtkIdType npts = 0;
+#if VTK_MAJOR_VERSION >= 9
+    const vtkIdType *pts = NULL;
+#else
+    vtkIdType *pts = NULL;
+#endif
+    lines->InitTraversal();
+    while( lines->GetNextCell(npts, pts) )
+      {
+      for( vtkIdType j = 0; j < npts; ++j )
+        {
+        if( pts[j] < 0 || pts[j] >= polyData->GetNumberOfPoints() )
+          {
+          std::cout << "A line refers to a point that does not exist." << std::endl;
+          return true;
+          }
+        in_order = in_order && pts[j] == static_cast<vtkIdType>(point_ids.size() );
+        point_ids.push_back(pts[j]);
+        }
+      fiber_offsets.push_back(point_ids.size() );
+      }
+    }
+  in_order = in_order && static_cast<vtkIdType>(point_ids.size() ) == polyData->GetNumberOfPoints();
+  std::vector<std::vector<float> > gathered(in_order ? 0 : arrays.size() );
+  for( size_t i = 0; i < arrays.size(); ++i )
+    {
+    columns[i].values = values[i].values;
+    if( in_order )
+      {
+      continue;
+      }
+    const int components = columns[i].components;
+    gathered[i].resize(point_ids.size() * components);
+    for( size_t p = 0; p < point_ids.size(); ++p )
+      {
+      std::copy(values[i].values + point_ids[p] * components, values[i].values + (point_ids[p] + 1) * components,
+                gathered[i].begin() + p * components);
+      }
+    columns[i].values = gathered[i].empty() ? NULL : &gathered[i][0];
+    }
+
+  TractFileWriter writer(*this);
+  vtkStringArray *version_info = vtkStringArray::SafeDownCast(
+      polyData->GetFieldData()->GetAbstractArray("UKF_VERSION_INFO") );
+  if( version_info != NULL && version_info->GetNumberOfValues() > 0 )
+    {
+    writer.SetGenerator(version_info->GetValue(0) );
+    }
+  return writer.Write(file_name, fiber_offsets, columns);
+}
+
+bool TractFileToPolyData(TractFile& file, vtkPolyData *polyData)
+{
+  const vtkIdType num_points = static_cast<vtkIdType>(file.GetNumberOfPoints() );
+  const vtkIdType num_fibers = static_cast<vtkIdType>(file.GetNumberOfFibers() );
+
+  std::vector<vtkSmartPointer<vtkFloatArray> > arrays;
+  for( size_t i = 0; i < file.GetNumberOfColumns(); ++i )
+    {
+    const TractColumn& column = file.GetColumn(i);
+    const float *      values = file.GetColumnData(i);
+    if( values == NULL && num_points > 0 )
+      {
+      return true;
+      }
+    vtkSmartPointer<vtkFloatArray> array = vtkSmartPointer<vtkFloatArray>::New();
+    array->SetNumberOfComponents(column.components);
+    array->SetNumberOfTuples(num_points);
+    array->SetName(ReadName(column.name).c_str() );
+    if( num_points > 0 )
+      {
+      std::memcpy(array->GetPointer(0), values, static_cast<size_t>(num_points) * column.components * sizeof(float) );
+      }
+    arrays.push_back(array);
+    }
+
+  vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+  points->SetData(arrays[0]);
+  polyData->SetPoints(points);
+
+  vtkSmartPointer<vtkIdTypeArray> ids = vtkSmartPointer<vtkIdTypeArray>::New();
+  ids->SetNumberOfValues(num_fibers + num_points);
+  vtkIdType *      cells = ids->GetPointer(0);
+  const uint64_t * fiber_offsets = file.GetFiberOffsets();
+  for( vtkIdType i = 0; i < num_fibers; ++i )
+    {
+    *cells++ = static_cast<vtkIdType>(fiber_offsets[i + 1] - fiber_offsets[i]);
+    for( uint64_t p = fiber_offsets[i]; p < fiber_offsets[i + 1]; ++p )
+      {
+      *cells++ = static_cast<vtkIdType>(p);
+      }
+    }
+  vtkSmartPointer<vtkCellArray> lines = vtkSmartPointer<vtkCellArray>::New();
+  lines->SetCells(num_fibers, ids);
+  polyData->SetLines(lines);
+
+  vtkPointData *pointData = polyData->GetPointData();
+  for( size_t i = 1; i < arrays.size(); ++i )
+    {
+    const int idx = pointData->AddArray(arrays[i]);
+    if( file.GetColumn(i).attribute == TRACT_ATTRIBUTE_SCALARS )
+      {
+      pointData->SetActiveAttribute(idx, vtkDataSetAttributes::SCALARS);
+      }
+    else if( file.GetColumn(i).attribute == TRACT_ATTRIBUTE_TENSORS )
+      {
+      pointData->SetActiveAttribute(idx, vtkDataSetAttributes::TENSORS);
+      }
+    }
+
+  if( !file.GetGenerator().empty() )
+    {
+    vtkSmartPointer<vtkStringArray> version_info = vtkSmartPointer<vtkStringArray>::New();
+    version_info->SetNumberOfValues(1);
+    version_info->SetValue(0, file.GetGenerator() );
+    version_info->SetName("UKF_VERSION_INFO");
+    polyData->GetFieldData()->AddArray(version_info);
+    }
+  return false;
+}
@@ -0,0 +1,249 @@
+/**
+ * \file tract_file.h
+ * \brief Reading and writing of .ukf files, the native binary tract format
+ *
+ * A .ukf file is laid out so that readers can map it into memory and use the data in place:
+ *
+ *   TractFileHeader
+ *   TractColumn[num_columns]
+ *   uint64 fiber_offsets[num_fibers + 1]    index of the first point of every fiber, then num_points
+ *   column data                             num_points * components float32 values per column
+ *
+ * The fiber offsets and every column start at a multiple of TRACT_FILE_ALIGNMENT bytes. All values are
+ * little-endian. The first column holds the point coordinates, the others the values attached to the points,
+ * named like the point data arrays of the VTK output. A column may be split into blocks that are compressed
+ * independently; it then starts with the number of blocks and the compressed size of every block, each as
+ * uint64, followed by the blocks. Uncompressed columns can be used straight from the mapping.
+ *
+ * Points and scalar columns can be stored lossy instead. Their values are rounded to multiples of the column's
+ * quantum, and the difference of every multiple to the one of the previous point on the same fiber is written
+ * as a zigzag varint. Along a fiber the points are recordLength apart and the scalars change slowly, so the
+ * differences are small and compress well. The varints of a column are preceded by their total size as uint64
+ * and compressed in blocks like any other column.
+*/
+
+#ifndef TRACT_FILE_H_
+#define TRACT_FILE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "vtp_block_writer.h"
+
+class vtkPolyData;
+
+/** Alignment of the fiber offsets and the columns in the file */
+const uint64_t TRACT_FILE_ALIGNMENT = 64;
+
+/** Version of the layout, readers reject files with a newer version */
+const uint32_t TRACT_FILE_VERSION = 1;
+
+/** Compression of a column */
+enum TractCompression
+  {
+  TRACT_COMPRESSION_NONE = 0,
+  TRACT_COMPRESSION_ZLIB = 1,
+  TRACT_COMPRESSION_LZ4 = 2,
+  TRACT_COMPRESSION_QUANTIZED_ZLIB = 3,
+  TRACT_COMPRESSION_QUANTIZED_LZ4 = 4
+  };
+
+/** VTK attribute a column is converted to */
+enum TractAttribute
+  {
+  TRACT_ATTRIBUTE_NONE = 0,
+  TRACT_ATTRIBUTE_SCALARS = 1,
+  TRACT_ATTRIBUTE_TENSORS = 2
+  };
+
+/** The first bytes of a .ukf file */
+struct TractFileHeader
+  {
+  char     magic[8];          // "UKFTRACT"
+  uint32_t version;
+  uint32_t num_columns;
+  uint64_t num_fibers;
+  uint64_t num_points;
+  uint64_t fiber_offsets;     // Position of the fiber offset table in the file
+  uint64_t reserved;
+  char     generator[80];     // Version of the writing program, e.g. UKF_GIT_HASH:<hash>, zero terminated
+  };
+
+/** Description of a column, the column table follows the header */
+struct TractColumn
+  {
+  char     name[64];          // Zero terminated
+  uint32_t components;
+  uint32_t compression;       // TractCompression
+  uint32_t attribute;         // TractAttribute
+  uint32_t reserved;
+  uint64_t offset;            // Position of the column data in the file
+  uint64_t size;              // Bytes of the column data in the file
+  uint64_t block_size;        // Uncompressed bytes per block of a compressed column
+  double   quantum;           // Step of the values of a quantized column, the error is at most half of it
+  };
+
+/**
+ * \struct TractColumnData
+ * \brief Values of one column to write, num_points * components floats
+*/
+struct TractColumnData
+  {
+  std::string    name;
+  int            components;
+  TractAttribute attribute;
+  const float *  values;
+  };
+
+/**
+ * \class TractFile
+ * \brief Maps a .ukf file into memory
+ *
+ * Opening only checks the header and the tables, the column data is read by the operating system when it is
+ * first touched. Compressed columns are decompressed on their first GetColumnData() and kept until Close().
+*/
+class TractFile
+{
+public:
+  TractFile();
+  ~TractFile();
+
+  /**
+   * Maps file_name into memory
+   * \return true on failure
+  */
+  bool Open(const std::string& file_name);
+
+  /** Unmaps the file, pointers returned before become invalid */
+  void Close();
+
+  uint64_t GetNumberOfFibers() const
+  {
+    return _header->num_fibers;
+  }
+
+  uint64_t GetNumberOfPoints() const
+  {
+    return _header->num_points;
+  }
+
+  /** num_fibers + 1 point indices, the points of fiber i are [offsets[i], offsets[i + 1]) */
+  const uint64_t * GetFiberOffsets() const
+  {
+    return _fiber_offsets;
+  }
+
+  size_t GetNumberOfColumns() const
+  {
+    return _header->num_columns;
+  }
+
+  const TractColumn& GetColumn(const size_t column) const
+  {
+    return _columns[column];
+  }
+
+  /** Index of the column called name, -1 if there is none */
+  int FindColumn(const std::string& name) const;
+
+  std::string GetGenerator() const;
+
+  /**
+   * The num_points * components values of a column, in place for uncompressed columns
+   * \return NULL if a compressed column cannot be decompressed
+  */
+  const float * GetColumnData(const size_t column);
+
+private:
+  TractFile(const TractFile&);
+  TractFile& operator=(const TractFile&);
+
+  const unsigned char *   _data;
+  size_t                  _size;
+#ifdef _WIN32
+  void *_file;
+  void *_mapping;
+#else
+  int _fd;
+#endif
+  const TractFileHeader * _header;
+  const TractColumn *     _columns;
+  const uint64_t *        _fiber_offsets;
+  // Values of the compressed columns that have been read, empty for the others
+  std::vector<std::vector<float> > _decompressed;
+};
+
+/**
+ * \class TractFileWriter
+ * \brief Writes .ukf files, optionally with the blocks of the columns compressed on several threads
+*/
+class TractFileWriter
+{
+public:
+  TractFileWriter();
+
+  /** Compress the columns, off by default to keep them usable in place */
+  void SetWriteCompressed(const bool compressed)
+  {
+    _compressed = compressed;
+  }
+
+  void SetCompressor(const VtpCompressor compressor)
+  {
+    _compressor = compressor;
+  }
+
+  /** Number of threads compressing blocks, values below 1 use one thread */
+  void SetNumberOfThreads(const int num_threads)
+  {
+    _num_threads = num_threads;
+  }
+
+  /**
+   * Stores the points and the scalar columns quantized, so that no value is off by more than the given error.
+   * Multi-component columns such as tensors, state and covariance stay lossless. 0 keeps the values lossless.
+  */
+  void SetMaximumError(const double position_error, const double scalar_error)
+  {
+    _position_error = position_error;
+    _scalar_error = scalar_error;
+  }
+
+  void SetGenerator(const std::string& generator)
+  {
+    _generator = generator;
+  }
+
+  /**
+   * Writes the fibers to file_name
+   * \param[in] fiber_offsets num_fibers + 1 point indices, the last one is the number of points
+   * \param[in] columns The point coordinates, followed by the values attached to the points
+   * \return true on failure
+  */
+  bool Write(const std::string& file_name, const std::vector<uint64_t>& fiber_offsets,
+             const std::vector<TractColumnData>& columns) const;
+
+  /**
+   * Writes the lines and the numeric point data arrays of polyData to file_name. The generator is taken from
+   * the UKF_VERSION_INFO field data if it is set.
+   * \return true on failure
+  */
+  bool Write(vtkPolyData *polyData, const std::string& file_name) const;
+
+private:
+  bool          _compressed;
+  VtpCompressor _compressor;
+  int           _num_threads;
+  double        _position_error;
+  double        _scalar_error;
+  std::string   _generator;
+};
+
+/**
+ * Converts an open .ukf file to polydata with one line per fiber, one point data array per column and the
+ * generator as UKF_VERSION_INFO field data
+ * \return true on failure
+*/
+bool TractFileToPolyData(TractFile& file, vtkPolyData *polyData);
+
+#endif // TRACT_FILE_H_
@@ -3,15 +3,6 @@
  * \brief implementation of tractography.h
 */
 
-#include <itkMacro.h> // needed for ITK_VERSION_MAJOR
-#if ITK_VERSION_MAJOR >= 5
-#include "itkMultiThreaderBase.h"
-#include "itkPlatformMultiThreader.h"
-#else
-
-#include "itkMultiThreader.h"
-#endif
-
 // System includes
 #include <fstream>
 #include <iostream>
@@ -20,7 +11,7 @@
 #include <iomanip>
 
 // VTK includes
-#include "vtkNew.h"
+#include "itksys/SystemTools.hxx"
 #include "vtkPolyData.h"
 
 // UKF includes
@@ -30,7 +21,14 @@
 #include "NrrdData.h"
 #include "utilities.h"
 #include "vtk_writer.h"
+#include "vtk_stream_writer.h"
 #include "thread.h"
+#include "seed_order.h"
+#include "voxel_maps.h"
+#include "connectome.h"
+#include "run_report.h"
+#include "tracking_stats.h"
+#include "step_control.h"
 #include "math_utilities.h"
 
 // filters
@@ -50,6 +48,44 @@
 // TODO implement this switch
 //#include "config.h"
 
+namespace
+{
+void ProgressMonitorCallback(void *data)
+{
+  thread_struct *str = static_cast<thread_struct *>(data);
+  str->tractography_->ReportProgress(*str->work_queue_);
+}
+
+/** Worker i of the pool is pinned to node i % num_nodes, so the first num_nodes workers each copy the signal
+ * to their own node */
+void ReplicateSignalCallback(int id, void *data)
+{
+  NrrdData *signal_data = static_cast<NrrdData *>(data);
+  if( GetCurrentThreadNumaNode() == id )
+    {
+    signal_data->ReplicateSignal(id);
+    }
+}
+
+/** Fibers to add to the accumulators of the workers */
+struct FiberMapWork
+  {
+  const std::vector<UKFFiber> *fibers;
+  FiberMaps *                  fiber_maps;
+  int                          num_workers;
+  };
+
+void FiberMapCallback(int id, void *data)
+{
+  FiberMapWork *work = static_cast<FiberMapWork *>(data);
+  // Interleaved, so that long and short fibers are spread evenly over the workers
+  for( size_t i = id; i < work->fibers->size(); i += work->num_workers )
+    {
+    work->fiber_maps->AddFiber(id, (*work->fibers)[i]);
+    }
+}
+}
+
 Tractography::Tractography(UKFSettings s) :
 
     // begin initializer list
@@ -60,12 +96,24 @@ Tractography::Tractography(UKFSettings s) :
 
     _output_file(s.output_file),
     _output_file_with_second_tensor(s.output_file_with_second_tensor),
+    _density_map(s.density_map),
+    _scalar_map_prefix(s.scalar_map_prefix),
+    _connectome_labels(s.connectome_labels),
+    _connectome_prefix(s.connectome_prefix),
+    _connectome_format(s.connectome_format),
+    _connectome_scalar(s.connectome_scalar),
+    _roi_labels(s.roi_labels),
+    _roi_filter(s.roi_include, s.roi_exclude, s.roi_end),
+    _run_report_file(s.run_report),
+    _run_report(s.run_report.empty() ? NULL : new RunReport),
 
     _record_fa    (s.record_fa),
     _record_nmse  (s.record_nmse),
     _record_trace (s.record_trace),
     _record_state (s.record_state),
     _record_cov   (s.record_cov),
+    _record_cov_mode(s.record_cov_mode),
+    _record_cov_float(s.record_cov_float),
     _record_free_water(s.record_free_water),
     _record_Vic   (s.record_Vic),
     _record_kappa (s.record_kappa),
@@ -90,7 +138,9 @@ Tractography::Tractography(UKFSettings s) :
     _cos_theta_max(std::cos(DegToRad(s.max_branching_angle))),
     _is_full_model(s.is_full_model),
     _free_water(s.free_water),
+    _adaptive_nmse(s.adaptive_nmse),
     _stepLength(s.stepLength),
+    _max_step_length(s.max_step_length),
     _steps_per_record(s.recordLength/s.stepLength),
     _labels(s.labels),
 
@@ -105,10 +155,26 @@ Tractography::Tractography(UKFSettings s) :
     _writeCompressed(true),
 
     _num_threads(s.num_threads),
+    _numa_mode(s.numa_mode),
+    _seed_order(s.seed_order),
+    _max_fibers(s.max_fibers),
+    _time_budget(s.time_budget),
+    _stream_output(s.stream_output),
+    _vtp_compressor(s.vtp_compressor),
+    _compress_ukf(s.compress_ukf),
+    _max_position_error(s.max_position_error),
+    _max_scalar_error(s.max_scalar_error),
+    _progress_interval(s.progress_interval),
+    _progress_callback(NULL),
+    _progress_client_data(NULL),
+    _cancel_requested(false),
     _outputPolyData(NULL),
 
     _filter_model_type(Tractography::_1T),
     _model(NULL),
+    _single_model(NULL),
+    _follow(NULL),
+    _thread_pool(NULL),
     debug(false)
     // end initializer list
 {
@@ -116,6 +182,16 @@ Tractography::Tractography(UKFSettings s) :
 
 Tractography::~Tractography()
 {
+  delete this->_thread_pool;
+  ReleaseFilters();
+  for( size_t i = 0; i < _fiber_arenas.size(); i++ )
+    {
+    delete _fiber_arenas[i];
+    }
+  for( size_t i = 0; i < _tracking_stats.size(); i++ )
+    {
+    delete _tracking_stats[i];
+    }
   if( this->_signal_data )
     {
     delete this->_signal_data;
@@ -124,6 +200,22 @@ Tractography::~Tractography()
   {
     delete this->_model; // TODO smartpointer
   }
+  delete _single_model;
+  delete _run_report;
+}
+
+void Tractography::ReleaseFilters()
+{
+  for( size_t i = 0; i < _ukf.size(); i++ )
+    {
+    delete _ukf[i];
+    }
+  _ukf.clear();
+  for( size_t i = 0; i < _single_ukf.size(); i++ )
+    {
+    delete _single_ukf[i];
+    }
+  _single_ukf.clear();
 }
 
 void Tractography::UpdateFilterModelType()
@@ -133,9 +225,13 @@ void Tractography::UpdateFilterModelType()
     return;
     }
 
+  // The Kalman filters point to the old model
+  ReleaseFilters();
   if (this->_model) {
     delete this->_model; // TODO smartpointer
   }
+  delete _single_model;
+  _single_model = NULL;
 
   this->_filter_model_type = Tractography::_1T;
   bool simpleTensorModel = !(this->_is_full_model);
@@ -273,39 +369,51 @@ void Tractography::UpdateFilterModelType()
   // TODO refactor this NODDI switch
   if (this->_filter_model_type == _1T_FW && this->_noddi && this->_num_tensors == 1) {
     _model = new NODDI1F(Qm, Qkappa, Qvic, Rs, this->weights_on_tensors, this->_noddi);
+    _follow = &Tractography::Follow1T<NODDI1F>;
   }
   else if (this->_filter_model_type == _2T_FW && this->_noddi && this->_num_tensors == 2) {
     _model = new NODDI2F(Qm, Qkappa, Qvic, Rs, this->weights_on_tensors, this->_noddi);
+    _follow = &Tractography::Follow2T<NODDI2F, false>;
   }
   else if (this->_filter_model_type == _1T) {
     _model = new Simple1T(Qm, Ql, Rs, this->weights_on_tensors, this->_free_water);
+    _follow = &Tractography::Follow1T<Simple1T>;
   }
   else if (this->_filter_model_type == _1T_FW) {
     _model = new Simple1T_FW(Qm, Ql, Qw, Rs, this->weights_on_tensors, this->_free_water, D_ISO);
+    _follow = &Tractography::Follow1T<Simple1T_FW>;
   }
   else if (this->_filter_model_type == _1T_FULL) {
     _model = new Full1T(Qm, Ql, Rs, this->weights_on_tensors, this->_free_water);
+    _follow = &Tractography::Follow1T<Full1T>;
   }
   else if (this->_filter_model_type == _1T_FW_FULL) {
     _model = new Full1T(Qm, Ql, Rs, this->weights_on_tensors, this->_free_water);
+    _follow = &Tractography::Follow1T<Full1T>;
   }
   else if (this->_filter_model_type == _2T) {
     _model = new Simple2T(Qm, Ql, Rs, this->weights_on_tensors, this->_free_water);
+    _follow = &Tractography::Follow2T<Simple2T, false>;
   }
   else if (this->_filter_model_type == _2T_FW) {
     _model = new Simple2T_FW(Qm, Ql, Qw, Rs, this->weights_on_tensors, this->_free_water, D_ISO);
+    _follow = &Tractography::Follow2T<Simple2T_FW, false>;
   }
   else if (this->_filter_model_type == _2T_FULL) {
     _model = new Full2T(Qm, Ql, Rs, this->weights_on_tensors, this->_free_water);
+    _follow = &Tractography::Follow2T<Full2T, false>;
   }
   else if (this->_filter_model_type == _2T_FW_FULL) {
     _model = new Full2T_FW(Qm, Ql, Qw, Rs, this->weights_on_tensors, this->_free_water, D_ISO);
+    _follow = &Tractography::Follow2T<Full2T_FW, false>;
   }
   else if (this->_filter_model_type == _3T) {
     _model = new Simple3T(Qm, Ql, Rs, this->weights_on_tensors, this->_free_water);
+    _follow = &Tractography::Follow3T<Simple3T, false>;
   }
   else if (this->_filter_model_type == _3T_FULL) {
     _model = new Full3T(Qm, Ql, Rs, this->weights_on_tensors, this->_free_water);
+    _follow = &Tractography::Follow3T<Full3T, false>;
   }
   else {
     std::cerr << "Unknown filter type!" << std::endl;
@@ -314,6 +422,46 @@ void Tractography::UpdateFilterModelType()
 
   _model->set_signal_data(_signal_data);
   _model->set_signal_dim(_signal_data->GetSignalDimension() * 2);
+
+  // The adaptive model order traces with the single tensor model of the same kind until it no longer explains
+  // the signal. Its only tensor has all the weight.
+  if( _adaptive_nmse > 0 )
+    {
+    if( _noddi || _num_tensors < 2 )
+      {
+      std::cout << "The adaptive model order can only be used with the tensor model with 2 or 3 tensors." << std::endl;
+      throw;
+      }
+    ukfVectorType single_weight(1);
+    single_weight[0] = ukfOne;
+    if( this->_filter_model_type == _2T ) {
+      _single_model = new Simple1T(Qm, Ql, Rs, single_weight, this->_free_water);
+      _follow = &Tractography::Follow2T<Simple2T, true>;
+    }
+    else if( this->_filter_model_type == _2T_FW ) {
+      _single_model = new Simple1T_FW(Qm, Ql, Qw, Rs, single_weight, this->_free_water, D_ISO);
+      _follow = &Tractography::Follow2T<Simple2T_FW, true>;
+    }
+    else if( this->_filter_model_type == _2T_FULL ) {
+      _single_model = new Full1T(Qm, Ql, Rs, single_weight, this->_free_water);
+      _follow = &Tractography::Follow2T<Full2T, true>;
+    }
+    else if( this->_filter_model_type == _2T_FW_FULL ) {
+      _single_model = new Full1T_FW(Qm, Ql, Qw, Rs, single_weight, this->_free_water, D_ISO);
+      _follow = &Tractography::Follow2T<Full2T_FW, true>;
+    }
+    else if( this->_filter_model_type == _3T ) {
+      _single_model = new Simple1T(Qm, Ql, Rs, single_weight, this->_free_water);
+      _follow = &Tractography::Follow3T<Simple3T, true>;
+    }
+    else {
+      _single_model = new Full1T(Qm, Ql, Rs, single_weight, this->_free_water);
+      _follow = &Tractography::Follow3T<Full3T, true>;
+    }
+    _single_model->set_signal_data(_signal_data);
+    _single_model->set_signal_dim(_signal_data->GetSignalDimension() * 2);
+    std::cout << "Adaptive model order: single tensor where its NMSE is below " << _adaptive_nmse << std::endl;
+    }
 }
 
 bool Tractography::SetData(void* data, void* mask, void* seed,
@@ -343,7 +491,9 @@ bool Tractography::LoadFiles(const std::string& data_file,
                              const bool output_normalized_DWI_data
                              )
 {
+  RunReportPhase phase(_run_report, "load");
   _signal_data = new NrrdData(_sigma_signal, _sigma_mask);
+  _signal_data->SetRunReport(_run_report);
 
   if( seed_file.empty() )
     {
@@ -357,6 +507,15 @@ bool Tractography::LoadFiles(const std::string& data_file,
     _signal_data = NULL;
     return true;
     }
+  if( !_connectome_labels.empty() && _signal_data->LoadLabels(_connectome_labels) )
+    {
+    return true;
+    }
+  if( !_roi_labels.empty() && _signal_data->LoadRoiLabels(_roi_labels) )
+    {
+    return true;
+    }
+  _roi_filter.SetLabelData(_signal_data);
   return false;
 }
 
@@ -367,6 +526,7 @@ void Tractography::Init(std::vector<SeedPointInfo>& seed_infos)
     throw;
   }
 
+  RunReportPhase init_phase(_run_report, "init");
   int signal_dim = _signal_data->GetSignalDimension();
 
   stdVec_t seeds;
@@ -376,6 +536,7 @@ void Tractography::Init(std::vector<SeedPointInfo>& seed_infos)
     throw;
     }
 
+  RunReportPhase seed_phase(_run_report, "seed_extraction");
   if(!_ext_seeds.empty())
     {
     seeds = _ext_seeds;
@@ -403,6 +564,7 @@ void Tractography::Init(std::vector<SeedPointInfo>& seed_infos)
         }
       }
     }
+  seed_phase.End();
 
   if (! (seeds.size() > 0)) {
 	std::cout << "No matching label ROI seeds found! Please verify label selection.";
@@ -447,6 +609,7 @@ void Tractography::Init(std::vector<SeedPointInfo>& seed_infos)
   int num_less_than_zero = 0;
   int num_invalid = 0;
   int num_mean_signal_too_low = 0;
+  int num_excluded = 0;
 
   int tmp_counter = 1;
   for( stdVec_t::const_iterator cit = seeds.begin(); cit != seeds.end(); ++cit )
@@ -455,6 +618,13 @@ void Tractography::Init(std::vector<SeedPointInfo>& seed_infos)
       {
       vec3_t point = *cit + *jt;
 
+      // Fibers from the exclude region would be rejected anyway
+      if( _roi_filter.Contains(ROI_EXCLUDE, point) )
+        {
+        ++num_excluded;
+        continue;
+        }
+
       _signal_data->Interp3Signal(point, signal); // here and in every step
       tmp_counter++;
 
@@ -502,6 +672,15 @@ void Tractography::Init(std::vector<SeedPointInfo>& seed_infos)
         }
       }
     }
+  if( _run_report )
+    {
+    _run_report->SetCount("seed_voxels", seeds.size() );
+    _run_report->SetCount("seed_points", seeds.size() * rand_dirs.size() );
+    _run_report->SetCount("seeds_rejected_negative_signal", num_less_than_zero);
+    _run_report->SetCount("seeds_rejected_invalid_signal", num_invalid);
+    _run_report->SetCount("seeds_rejected_low_mean_signal", num_mean_signal_too_low);
+    _run_report->SetCount("seeds_rejected_roi_exclude", num_excluded);
+    }
   stdEigVec_t starting_params(starting_points.size() );
 
   UnpackTensor(_signal_data->GetBValues(), _signal_data->gradients(),
@@ -707,6 +886,11 @@ void Tractography::Init(std::vector<SeedPointInfo>& seed_infos)
     seed_infos.push_back(info_inv);   // NOTE that the seed in reverse direction is put directly after the seed in
                                       // original direction
     }
+  if( _run_report )
+    {
+    _run_report->SetCount("seeds_rejected_low_fa", fa_too_low);
+    _run_report->SetCount("seeds", seed_infos.size() / 2);
+    }
 }
 
 bool Tractography::Run()
@@ -715,11 +899,9 @@ bool Tractography::Run()
   // Thus Run() must be invoked after LoadFiles()
   // Initialize and prepare seeds.
 
-  std::vector<SeedPointInfo>            primary_seed_infos;
-  std::vector<SeedPointInfo>            branch_seed_infos;       // The info of branching seeds
-  std::vector<BranchingSeedAffiliation> branch_seed_affiliation; // Which fiber originated from the main seeds is this
-                                                                 // branch attached
+  std::vector<SeedPointInfo> primary_seed_infos;
 
+  _cancel_requested = false;
   Init(primary_seed_infos);
   if (primary_seed_infos.size() < 1)
     {
@@ -727,147 +909,210 @@ bool Tractography::Run()
     return false;
     }
 
-  const int num_of_threads = std::min(_num_threads, static_cast<int>(primary_seed_infos.size() ) );
-  // const int num_of_threads = 8;
-
-  assert(num_of_threads > 0);
-  _ukf.reserve(num_of_threads); //Allocate, but do not assign
-  for( int i = 0; i < num_of_threads; i++ )
+  // The thread pool and the Kalman filters are kept between runs so that repeated runs with few seeds
+  // (InteractiveUKF) do not pay for thread start-up and filter allocation every time. The pool always has
+  // _num_threads workers; the ones without work return immediately.
+  if( !_thread_pool )
     {
-    _ukf.push_back(new UnscentedKalmanFilter(_model) );   // Create one Kalman filter for each thread
+    std::vector<NumaNode> nodes;
+    if( _numa_mode != NUMA_NONE )
+      {
+      nodes = GetNumaNodes();
+      if( nodes.size() < 2 )
+        {
+        std::cout << "Only one NUMA node found, tracking threads are not pinned." << std::endl;
+        nodes.clear();
+        }
+      }
+    _thread_pool = new TrackingThreadPool(std::max(_num_threads, 1), nodes);
     }
-
-  std::vector<UKFFiber> raw_primary;
-
+  if( _run_report )
     {
-    if (this->debug) std::cout << "Tracing " << primary_seed_infos.size() << " primary fibers:" << std::endl;
-
-    raw_primary.resize(primary_seed_infos.size() );
+    _run_report->SetCount("threads", _thread_pool->GetNumberOfThreads() );
+    }
 
-    WorkDistribution work_distribution = GenerateWorkDistribution(num_of_threads,
-                                                                  static_cast<int>(primary_seed_infos.size() ) );
-#if ITK_VERSION_MAJOR >= 5
-    itk::PlatformMultiThreader::Pointer threader = itk::PlatformMultiThreader::New();
-    threader->SetNumberOfWorkUnits( num_of_threads );
-    std::vector<std::thread> vectorOfThreads;
-    vectorOfThreads.reserve(num_of_threads);
-#else
-    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
-    threader->SetNumberOfThreads( num_of_threads );
-#endif
-    thread_struct str;
-    str.tractography_ = this;
-    str.seed_infos_ = &primary_seed_infos;
-    str.work_distribution = &work_distribution;
-    str.branching_ = _is_branching;
-    str.num_tensors_ = _num_tensors;
-    str.output_fiber_group_ = &raw_primary;
-    str.branching_seed_info_vec = new std::vector<std::vector<SeedPointInfo> >(num_of_threads);
-    str.branching_seed_affiliation_vec = new std::vector<std::vector<BranchingSeedAffiliation> >(num_of_threads);
-    for( int i = 0; i < num_of_threads; i++ )
-      {
-#if ITK_VERSION_MAJOR >= 5
-      vectorOfThreads.push_back( std::thread(ThreadCallback, i, &str ) );
-#else
-      threader->SetMultipleMethod(i, ThreadCallback, &str);
-#endif
-      }
-#if ITK_VERSION_MAJOR < 5
-    threader->SetGlobalDefaultNumberOfThreads(num_of_threads);
-#else
-    itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(num_of_threads);
-#endif
-
-#if ITK_VERSION_MAJOR >= 5
-    for(auto & li : vectorOfThreads )
-      {
-      if(li.joinable())
+  // The signal is read by every step of every fiber, so keep it on the node of the thread reading it
+  if( _thread_pool->GetNumberOfNodes() > 1 )
+    {
+    const int num_nodes = _thread_pool->GetNumberOfNodes();
+    // Only the nodes a worker is pinned to get a replica, the others would never be filled
+    const int num_replicas = std::min(num_nodes, _thread_pool->GetNumberOfThreads() );
+    if( _numa_mode == NUMA_REPLICATE && !_signal_data->HasReplicas(num_replicas) )
+      {
+      _signal_data->ResetReplicas(num_replicas);
+      _thread_pool->Execute(ReplicateSignalCallback, _signal_data);
+      }
+    else if( _numa_mode == NUMA_INTERLEAVE )
+      {
+      // Pages that are already interleaved are not moved again, so this is cheap on repeated runs
+      std::vector<NumaNode> nodes = GetNumaNodes();
+      if( _signal_data->InterleaveSignal(nodes) )
         {
-        li.join();
+        std::cout << "Could not interleave the signal over the NUMA nodes." << std::endl;
         }
       }
-#else
-    threader->MultipleMethodExecute();
-#endif
-
-    // Unpack the branch seeds and their affiliation
-    int num_branch_seeds = 0;
-    for( int i = 0; i < num_of_threads; i++ )
+    }
+  if( static_cast<int>(_ukf.size() ) != _thread_pool->GetNumberOfThreads() )
+    {
+    ReleaseFilters();
+    _ukf.reserve(_thread_pool->GetNumberOfThreads() ); //Allocate, but do not assign
+    for( int i = 0; i < _thread_pool->GetNumberOfThreads(); i++ )
       {
-      num_branch_seeds += static_cast<int>(str.branching_seed_info_vec->at(i).size() );
+      _ukf.push_back(new UnscentedKalmanFilter(_model) );   // Create one Kalman filter for each thread
+      if( _single_model )
+        {
+        _single_ukf.push_back(new UnscentedKalmanFilter(_single_model) );
+        }
       }
+    }
+  // Every thread records its fibers in its own arena, which keeps its memory between runs
+  while( static_cast<int>(_fiber_arenas.size() ) < _thread_pool->GetNumberOfThreads() )
+    {
+    _fiber_arenas.push_back(new FiberArena);
+    }
+  for( size_t i = 0; i < _fiber_arenas.size(); i++ )
+    {
+    _fiber_arenas[i]->Clear(_model->state_dim() );
+    _fiber_arenas[i]->covariance_mode = _record_cov_mode;
+    _fiber_arenas[i]->covariance_single = _record_cov_float;
+    }
+  while( static_cast<int>(_tracking_stats.size() ) < _thread_pool->GetNumberOfThreads() )
+    {
+    _tracking_stats.push_back(new TrackingStats);
+    }
+  for( size_t i = 0; i < _tracking_stats.size(); i++ )
+    {
+    _tracking_stats[i]->Reset();
+    }
 
-    if (this->debug) std::cout << "branch_seeds size: " << num_branch_seeds << std::endl;
-    branch_seed_infos.resize(num_branch_seeds);
-    branch_seed_affiliation.resize(num_branch_seeds);
+  // Every worker adds the fibers it finishes to its own voxel maps and connectome, they are merged once all
+  // fibers are traced
+  FiberMaps  fiber_maps;
+  if( InitFiberMaps(fiber_maps) )
+    {
+    return EXIT_FAILURE;
+    }
+  FiberMaps *maps = fiber_maps.empty() ? NULL : &fiber_maps;
 
-    int counter = 0;
-    for( int i = 0; i < num_of_threads; i++ )
+  if( _output_file.empty() && _outputPolyData == NULL )
+    {
+    // Only maps are written, so no fiber needs to be kept once it is mapped
+    const int status = StreamFibers(primary_seed_infos, maps);
+    return status == EXIT_SUCCESS ? WriteFiberMaps(fiber_maps) : status;
+    }
+  if( _stream_output )
+    {
+    const std::string ext = itksys::SystemTools::GetFilenameExtension(_output_file);
+    if( _outputPolyData != NULL || ext != ".vtk" || _store_glyphs || !_output_file_with_second_tensor.empty() )
       {
-      for( size_t j = 0; j < str.branching_seed_info_vec->at(i).size(); j++ )
-        {
-        branch_seed_infos[counter] = str.branching_seed_info_vec->at(i).at(j);
-        branch_seed_affiliation[counter] = str.branching_seed_affiliation_vec->at(i).at(j);
-        counter++;
-        }
+      std::cout << "Streaming output needs a .vtk output file without glyphs or second tensor output, "
+                << "the fibers are written at the end." << std::endl;
+      }
+    else
+      {
+      const int status = StreamFibers(primary_seed_infos, maps);
+      return status != EXIT_SUCCESS || maps == NULL ? status : WriteFiberMaps(fiber_maps);
       }
     }
 
-  std::vector<UKFFiber> raw_branch;
-  if( _is_branching )
+  if( _max_fibers > 0 || _time_budget > 0 )
     {
-    assert(_num_tensors == 2 || _num_tensors == 3);
-    if (this->debug) std::cout << "Tracing " << branch_seed_infos.size() << " branches:" << std::endl;
+    // The budget counts joined fibers, so the seed pairs are joined and mapped while they are traced. Every
+    // worker keeps the fibers it joins until they are all written at the end.
+    std::vector<FiberBatch> kept_batches(_thread_pool->GetNumberOfThreads() );
+    const int               status = StreamFibers(primary_seed_infos, maps, &kept_batches);
+    if( status != EXIT_SUCCESS )
+      {
+      return status;
+      }
+    std::vector<UKFFiber> fibers;
+    for( size_t i = 0; i < kept_batches.size(); ++i )
+      {
+      fibers.insert(fibers.end(), kept_batches[i].fibers.begin(), kept_batches[i].fibers.end() );
+      }
+    return WriteFibers(fibers, fiber_maps, false);
+    }
 
-    raw_branch.resize(branch_seed_infos.size() );
+  std::vector<UKFFiber>                 raw_primary;
+  std::vector<UKFFiber>                 raw_branch;
+  std::vector<BranchingSeedAffiliation> branch_seed_affiliation; // Which fiber originated from the main seeds is this
+                                                                 // branch attached
 
-    WorkDistribution work_distribution =
-      GenerateWorkDistribution(num_of_threads, static_cast<int>(branch_seed_infos.size() ) );
+    {
+    if (this->debug) std::cout << "Tracing " << primary_seed_infos.size() << " primary fibers:" << std::endl;
 
-    thread_struct str;
-    str.tractography_ = this;
-    str.work_distribution = &work_distribution;
-    str.seed_infos_ = &branch_seed_infos;
-    str.branching_ = false;
-    str.num_tensors_ = _num_tensors;
-    str.output_fiber_group_ = &raw_branch;
-    str.branching_seed_info_vec = new std::vector<std::vector<SeedPointInfo> >(num_of_threads);
-    str.branching_seed_affiliation_vec = new std::vector<std::vector<BranchingSeedAffiliation> >(num_of_threads);
+    raw_primary.resize(primary_seed_infos.size() );
 
-#if ITK_VERSION_MAJOR >= 5
-    itk::PlatformMultiThreader::Pointer threader = itk::PlatformMultiThreader::New();
-    threader->SetNumberOfWorkUnits( num_of_threads );
-    std::vector<std::thread> vectorOfThreads;
-    vectorOfThreads.reserve(num_of_threads);
-#else
-    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
-    threader->SetNumberOfThreads( num_of_threads );
-#endif
+    // Primary fibers and branches are traced in a single pass. Branch seeds are queued as soon as they are
+    // found and traced by whichever thread is free.
+    assert(!_is_branching || _num_tensors == 2 || _num_tensors == 3);
+    std::vector<int> seed_order;
+    int              chunk_size = 1;
+    if( _seed_order != SEED_ORDER_NONE )
+      {
+      stdVec_t seed_points(primary_seed_infos.size() );
+      for( size_t i = 0; i < primary_seed_infos.size(); ++i )
+        {
+        seed_points[i] = primary_seed_infos[i].point;
+        }
+      TracingOrder(seed_points, seed_order, chunk_size);
+      }
 
+    SeedWorkQueue work_queue(static_cast<int>(primary_seed_infos.size() ), _thread_pool->GetNumberOfThreads(),
+                             seed_order, chunk_size);
 
-    for( int i = 0; i < num_of_threads; i++ )
+    thread_struct str;
+    str.tractography_ = this;
+    str.seed_infos_ = &primary_seed_infos;
+    str.branching_ = _is_branching;
+    str.branches_only_ = _branches_only;
+    str.output_fiber_group_ = &raw_primary;
+    str.work_queue_ = &work_queue;
+    str.seed_pairs_ = false;
+    str.output_stream_ = NULL;
+    str.fiber_maps_ = NULL;
+    str.roi_filter_ = NULL;
+    str.kept_batches_ = NULL;
+    RunReportPhase tracing_phase(_run_report, "tracing");
+    _thread_pool->Execute(ThreadCallback, &str, ProgressMonitorCallback, _progress_interval);
+    tracing_phase.End();
+    RecordTracking(work_queue);
+
+    if( work_queue.IsCancelled() )
       {
-#if ITK_VERSION_MAJOR >= 5
-      vectorOfThreads.push_back( std::thread( ThreadCallback, i, &str ) );
-#else
-      threader->SetMultipleMethod(i, ThreadCallback, &str);
-#endif
+      std::cout << "Tractography was cancelled, no fibers are written." << std::endl;
+      return EXIT_FAILURE;
       }
-#if ITK_VERSION_MAJOR >= 5
-    for(auto & li : vectorOfThreads )
-    {
-      if(li.joinable())
+    if( _progress_interval > 0 )
       {
-      li.join();
+      ReportProgress(work_queue);
       }
-    }
-#else
-    threader->MultipleMethodExecute();
-#endif
+
+    work_queue.TakeBranches(raw_branch, branch_seed_affiliation);
+    if (this->debug) std::cout << "branch_seeds size: " << raw_branch.size() << std::endl;
     }
 
+  FiberArena            output_arena;
   std::vector<UKFFiber> fibers;
-  PostProcessFibers(raw_primary, raw_branch, branch_seed_affiliation, _branches_only, fibers);
+  RunReportPhase        post_process_phase(_run_report, "post_process");
+  PostProcessFibers(raw_primary, raw_branch, branch_seed_affiliation, _branches_only, output_arena, fibers,
+                    _thread_pool, &_roi_filter);
+  post_process_phase.End();
+  return WriteFibers(fibers, fiber_maps, true);
+}
+
+int Tractography::WriteFibers(std::vector<UKFFiber>& fibers, FiberMaps& fiber_maps, const bool add_to_maps)
+{
+  if( _run_report )
+    {
+    size_t num_points = 0;
+    for( size_t i = 0; i < fibers.size(); ++i )
+      {
+      num_points += fibers[i].size();
+      }
+    _run_report->SetCount("fibers", fibers.size() );
+    _run_report->SetCount("points", num_points);
+    }
 
   if (this->debug) std::cout << "fiber size after PostProcessFibers: " << fibers.size() << std::endl;
 
@@ -877,44 +1122,324 @@ bool Tractography::Run()
     return EXIT_FAILURE;
   }
 
+  FiberMaps *maps = fiber_maps.empty() ? NULL : &fiber_maps;
+  if( maps != NULL && add_to_maps )
+    {
+    FiberMapWork work;
+    work.fibers = &fibers;
+    work.fiber_maps = maps;
+    work.num_workers = _thread_pool->GetNumberOfThreads();
+    RunReportPhase maps_phase(_run_report, "fiber_maps");
+    _thread_pool->Execute(FiberMapCallback, &work);
+    }
+
   // Write the fiber data to the output vtk file.
   VtkWriter writer(_signal_data, this->_filter_model_type, _record_tensors);
   writer.set_transform_position(_transform_position);
+  writer.SetThreadPool(_thread_pool);
+  writer.SetCompressor(_vtp_compressor);
+  writer.SetCompressTractFile(_compress_ukf);
+  writer.SetMaximumError(_max_position_error, _max_scalar_error);
+  writer.SetRunReport(_run_report);
 
   int writeStatus = EXIT_SUCCESS;
   if (this->_outputPolyData != NULL)
   // TODO refactor this is bad control flow
     {
+    RunReportPhase populate_phase(_run_report, "populate");
     writer.PopulateFibersAndTensors(this->_outputPolyData, fibers);
     this->_outputPolyData->Modified();
     }
   else
     {
-    vtkNew<vtkPolyData> pd;
-    this->SetOutputPolyData(pd.GetPointer());
-    writer.PopulateFibersAndTensors(this->_outputPolyData, fibers);
-    this->_outputPolyData->Modified();
-
+    // Write populates its own polydata, so the fibers are converted only once
     // possibly write binary VTK file.
     writer.SetWriteBinary(this->_writeBinary);
     writer.SetWriteCompressed(this->_writeCompressed);
 
     writeStatus = writer.Write(_output_file, _output_file_with_second_tensor,
                                          fibers, _record_state, _store_glyphs, _noddi);
-
-    // TODO refactor!
-    this->SetOutputPolyData(NULL);
     }
 
-  // Clear up the kalman filters
-  for( size_t i = 0; i < _ukf.size(); i++ )
+  if( writeStatus == EXIT_SUCCESS && maps != NULL )
     {
-    delete _ukf[i];
+    writeStatus = WriteFiberMaps(fiber_maps);
     }
-  _ukf.clear();
   return writeStatus;
 }
 
+void Tractography::TracingOrder(const stdVec_t& seed_points, std::vector<int>& order, int& chunk_size) const
+{
+  // Optionally trace the seeds along a space-filling curve. Each thread then claims a run of neighbouring
+  // seeds at a time, so the threads share the DWI neighbourhoods they read in the last level cache.
+  SpatialSeedOrder(seed_points, _seed_order, order);
+
+  // Enough chunks per thread to balance the load at the end of the run
+  const int SEED_CHUNKS_PER_THREAD = 32;
+  const int MAX_SEED_CHUNK_SIZE = 256;
+  chunk_size = static_cast<int>(seed_points.size() ) / (SEED_CHUNKS_PER_THREAD * _thread_pool->GetNumberOfThreads() );
+  chunk_size = std::max(1, std::min(chunk_size, MAX_SEED_CHUNK_SIZE) );
+}
+
+int Tractography::StreamFibers(std::vector<SeedPointInfo>& primary_seed_infos, FiberMaps *fiber_maps,
+                               std::vector<FiberBatch> *kept_batches)
+{
+  const bool      write_tracts = !_output_file.empty() && kept_batches == NULL;
+  VtkStreamWriter writer(_signal_data, this->_filter_model_type, _record_tensors);
+  writer.set_transform_position(_transform_position);
+  writer.SetWriteBinary(this->_writeBinary);
+  if( write_tracts && writer.Open(_output_file, _record_state, _noddi) )
+    {
+    return EXIT_FAILURE;
+    }
+
+  // The work items are the seed pairs, i.e. the two opposite half fibers from one seed point
+  const int        num_pairs = static_cast<int>(primary_seed_infos.size() / 2);
+  const bool       budget = _max_fibers > 0 || _time_budget > 0;
+  std::vector<int> pair_order;
+  int              chunk_size = 1;
+  if( _seed_order != SEED_ORDER_NONE || budget )
+    {
+    stdVec_t pair_points(num_pairs);
+    for( int i = 0; i < num_pairs; ++i )
+      {
+      pair_points[i] = primary_seed_infos[2 * i].point;
+      }
+    TracingOrder(pair_points, pair_order, chunk_size);
+    }
+  if( budget )
+    {
+    // The pairs traced until the budget is used up are spread over the whole seed region
+    ShuffleChunks(num_pairs, chunk_size, pair_order);
+    }
+  SeedWorkQueue work_queue(num_pairs, _thread_pool->GetNumberOfThreads(), pair_order, chunk_size);
+  work_queue.SetBudget(_max_fibers, _time_budget);
+
+  thread_struct str;
+  str.tractography_ = this;
+  str.seed_infos_ = &primary_seed_infos;
+  str.branching_ = _is_branching;
+  str.branches_only_ = _branches_only;
+  str.output_fiber_group_ = NULL;
+  str.work_queue_ = &work_queue;
+  str.seed_pairs_ = true;
+  str.fiber_maps_ = fiber_maps;
+  str.roi_filter_ = &_roi_filter;
+  str.kept_batches_ = kept_batches;
+  bool write_failed = false;
+  RunReportPhase tracing_phase(_run_report, "tracing");
+  if( write_tracts )
+    {
+    // Two batches per thread, so that every thread can fill one while the other is written
+    FiberOutputStream output(writer, 2 * _thread_pool->GetNumberOfThreads() );
+    str.output_stream_ = &output;
+    _thread_pool->Execute(ThreadCallback, &str, ProgressMonitorCallback, _progress_interval);
+    write_failed = output.Finish();
+    }
+  else
+    {
+    // The workers drop the fibers as soon as they are added to the maps, or keep them in kept_batches
+    str.output_stream_ = NULL;
+    _thread_pool->Execute(ThreadCallback, &str, ProgressMonitorCallback, _progress_interval);
+    }
+  tracing_phase.End();
+  RecordTracking(work_queue);
+
+  if( work_queue.IsCancelled() )
+    {
+    if( write_tracts )
+      {
+      std::cout << "Tractography was cancelled, the output file only holds the fibers finished so far." << std::endl;
+      writer.Close();
+      }
+    else
+      {
+      std::cout << "Tractography was cancelled, no fibers or maps are written." << std::endl;
+      }
+    return EXIT_FAILURE;
+    }
+  if( _progress_interval > 0 )
+    {
+    ReportProgress(work_queue);
+    }
+  if( work_queue.IsBudgetReached() )
+    {
+    TractographyProgress progress;
+    work_queue.GetProgress(progress);
+    std::cout << "The " << (_max_fibers > 0 && work_queue.NumberOfAcceptedFibers() >= _max_fibers ? "fiber" : "time")
+              << " budget was reached after " << progress.seeds_done << " of " << num_pairs << " seed pairs, "
+              << work_queue.NumberOfAcceptedFibers() << " fibers were kept." << std::endl;
+    }
+  if( !write_tracts )
+    {
+    return EXIT_SUCCESS;
+    }
+  if (this->debug) std::cout << "fibers written: " << writer.GetNumberOfFibers() << std::endl;
+  if( _run_report )
+    {
+    _run_report->SetCount("fibers", writer.GetNumberOfFibers() );
+    _run_report->SetCount("points", writer.GetNumberOfPoints() );
+    }
+
+  // The fibers were written while tracing, this only appends the spilled data and fills in the header
+  RunReportPhase write_phase(_run_report, "write");
+  const int      writeStatus = writer.Close();
+  return write_failed ? EXIT_FAILURE : writeStatus;
+}
+
+bool Tractography::InitFiberMaps(FiberMaps& fiber_maps) const
+{
+  const int num_workers = _thread_pool->GetNumberOfThreads();
+  if( !_density_map.empty() || !_scalar_map_prefix.empty() )
+    {
+    std::vector<VoxelMapScalar> scalars;
+    if( !_scalar_map_prefix.empty() )
+      {
+      GetVoxelMapScalars(_noddi, scalars);
+      }
+    fiber_maps.voxel_maps.resize(num_workers);
+    for( int i = 0; i < num_workers; i++ )
+      {
+      fiber_maps.voxel_maps[i].Reset(_signal_data->dim(), scalars);
+      }
+    }
+
+  if( !_connectome_prefix.empty() )
+    {
+    std::vector<int> labels;
+    _signal_data->GetLabelValues(labels);
+    if( labels.empty() )
+      {
+      std::cout << "The connectome needs a label map with at least one non-zero label." << std::endl;
+      return true;
+      }
+    // The scalar is looked up by the name of its array in the tract output
+    VoxelMapScalar              scalar;
+    std::vector<VoxelMapScalar> scalars;
+    GetVoxelMapScalars(_noddi, scalars);
+    scalar.column = NULL;
+    for( size_t i = 0; i < scalars.size(); i++ )
+      {
+      if( scalars[i].name == _connectome_scalar )
+        {
+        scalar = scalars[i];
+        }
+      }
+    if( !_connectome_scalar.empty() && scalar.column == NULL )
+      {
+      std::cout << "Unknown connectome scalar " << _connectome_scalar << std::endl;
+      return true;
+      }
+    fiber_maps.connectomes.resize(num_workers);
+    for( int i = 0; i < num_workers; i++ )
+      {
+      fiber_maps.connectomes[i].Reset(_signal_data, labels, scalar);
+      }
+    }
+  return false;
+}
+
+int Tractography::WriteFiberMaps(FiberMaps& fiber_maps)
+{
+  RunReportPhase phase(_run_report, "write_maps");
+  std::vector<VoxelMapAccumulator>& voxel_maps = fiber_maps.voxel_maps;
+  if( !voxel_maps.empty() )
+    {
+    for( size_t i = 1; i < voxel_maps.size(); i++ )
+      {
+      voxel_maps[0].Merge(voxel_maps[i]);
+      }
+    if (this->debug) std::cout << "voxels reached by fibers: " << voxel_maps[0].NumberOfVoxels() << std::endl;
+
+    const ukfMatrixType i2r = _signal_data->i2r();
+    if( !_density_map.empty() && voxel_maps[0].WriteDensity(_density_map, i2r) )
+      {
+      return EXIT_FAILURE;
+      }
+    if( !_scalar_map_prefix.empty() && voxel_maps[0].WriteScalarMaps(_scalar_map_prefix, i2r) )
+      {
+      return EXIT_FAILURE;
+      }
+    }
+
+  std::vector<ConnectomeAccumulator>& connectomes = fiber_maps.connectomes;
+  if( !connectomes.empty() )
+    {
+    for( size_t i = 1; i < connectomes.size(); i++ )
+      {
+      connectomes[0].Merge(connectomes[i]);
+      }
+    std::cout << "Connectome: " << connectomes[0].NumberOfFibers() - connectomes[0].NumberOfUnassignedFibers()
+              << " of " << connectomes[0].NumberOfFibers() << " fibers end in two labelled regions." << std::endl;
+    if( connectomes[0].Write(_connectome_prefix, _connectome_format) )
+      {
+      return EXIT_FAILURE;
+      }
+    }
+  return EXIT_SUCCESS;
+}
+
+void Tractography::ClearFiberArena(const int thread_id)
+{
+  _fiber_arenas[thread_id]->Clear(_model->state_dim() );
+}
+
+bool Tractography::WriteRunReport(const int exit_status) const
+{
+  if( !_run_report )
+    {
+    return false;
+    }
+  return _run_report->Write(_run_report_file, exit_status);
+}
+
+void Tractography::RecordTracking(const SeedWorkQueue& work_queue)
+{
+  if( !_run_report )
+    {
+    return;
+    }
+  TractographyProgress progress;
+  work_queue.GetProgress(progress);
+  _run_report->SetCount("seeds_traced", progress.seeds_done);
+  _run_report->SetCount("budget_reached", work_queue.IsBudgetReached() ? 1 : 0);
+  _run_report->SetCount("branches_found", progress.branches_found);
+  _run_report->SetCount("branches_traced", progress.branches_done);
+  _run_report->SetCount("steps", progress.steps);
+
+  TrackingStats stats;
+  for( size_t i = 0; i < _tracking_stats.size(); i++ )
+    {
+    stats.Merge(*_tracking_stats[i]);
+    }
+  stats.Record(*_run_report);
+}
+
+void Tractography::ReportProgress(const SeedWorkQueue& work_queue)
+{
+  TractographyProgress progress;
+  work_queue.GetProgress(progress);
+
+  std::cout << "Progress: " << progress.seeds_done << "/" << progress.seeds_total << " seeds ("
+            << std::fixed << std::setprecision(1)
+            << 100.0 * progress.seeds_done / std::max(progress.seeds_total, 1L) << "%), "
+            << progress.branches_done << "/" << progress.branches_found << " branches, "
+            << progress.fibers_per_second << " fibers/s, "
+            << progress.steps_per_second << " steps/s";
+  if( progress.eta >= 0 )
+    {
+    std::cout << ", ETA " << progress.eta << " s";
+    }
+  std::cout << std::endl;
+  std::cout.unsetf(std::ios_base::floatfield);
+  std::cout << std::setprecision(6);
+
+  if( _progress_callback )
+    {
+    _progress_callback(progress, _progress_client_data);
+    }
+}
+
 // FIXME: not clear why gradientStrength and pulseSeparation are passed as arguments when
 //        they are already class members.
 void Tractography::createProtocol(const ukfVectorType& _b_values,
@@ -1091,17 +1616,129 @@ void Tractography::UnpackTensor(const ukfVectorType& b,       // b - bValues
     }
 }
 
-void Tractography::Follow3T(const int thread_id,
+namespace
+{
+/** Whether the model is one of the NODDI models, whose state holds Vic and kappa instead of a tensor */
+template <class Model>
+struct IsNoddiModel
+{
+  enum { value = false };
+};
+
+template <>
+struct IsNoddiModel<NODDI1F>
+{
+  enum { value = true };
+};
+
+template <>
+struct IsNoddiModel<NODDI2F>
+{
+  enum { value = true };
+};
+
+/** Whether the model is a simple model without free water, whose directions are normalized before recording */
+template <class Model>
+struct IsSimpleModel
+{
+  enum { value = false };
+};
+
+template <>
+struct IsSimpleModel<Simple1T>
+{
+  enum { value = true };
+};
+
+template <>
+struct IsSimpleModel<Simple2T>
+{
+  enum { value = true };
+};
+
+template <>
+struct IsSimpleModel<Simple3T>
+{
+  enum { value = true };
+};
+
+/** Single tensor model of the same kind as a multi tensor model, used by the adaptive model order */
+template <class Model>
+struct SingleTensorModel;
+
+template <>
+struct SingleTensorModel<Simple2T>
+{
+  typedef Simple1T type;
+};
+
+template <>
+struct SingleTensorModel<Simple2T_FW>
+{
+  typedef Simple1T_FW type;
+};
+
+template <>
+struct SingleTensorModel<Full2T>
+{
+  typedef Full1T type;
+};
+
+template <>
+struct SingleTensorModel<Full2T_FW>
+{
+  typedef Full1T_FW type;
+};
+
+template <>
+struct SingleTensorModel<Simple3T>
+{
+  typedef Simple1T type;
+};
+
+template <>
+struct SingleTensorModel<Full3T>
+{
+  typedef Full1T type;
+};
+
+// The NODDI models are never adaptive, this only lets Follow2T compile for them
+template <>
+struct SingleTensorModel<NODDI2F>
+{
+  typedef NODDI1F type;
+};
+
+/**
+ * The adaptive model order only goes back to the single tensor once the error of all tensors is below this
+ * fraction of the threshold, so that it does not switch back and forth at every step near the threshold
+*/
+const ukfPrecisionType ADAPTIVE_HYSTERESIS = 0.5;
+
+/** Cosine of 20 degrees. Step2T treats tensors closer than that as the same fiber population. */
+const ukfPrecisionType COS_SAME_POPULATION = 0.93969262078590838;
+
+/**
+ * Whether a minor tensor of a multi tensor fit no longer describes a fiber population of its own, because it
+ * is nearly parallel to the major tensor m1 or not anisotropic enough to be followed
+*/
+bool IsSamePopulation(const vec3_t& m1, const vec3_t& m, const vec3_t& l, const ukfPrecisionType fa_min)
+{
+  return std::abs(m1.dot(m) ) > COS_SAME_POPULATION || l2fa(l[0], l[1], l[2]) < fa_min;
+}
+}
+
+template <class Model, bool ADAPTIVE>
+int Tractography::Follow3T(const int thread_id,
                             const size_t seed_index,
                             const SeedPointInfo& fiberStartSeed,
                             UKFFiber& fiber,
                             bool is_branching,
-                            std::vector<SeedPointInfo>& branching_seeds,
-                            std::vector<BranchingSeedAffiliation>& branching_seed_affiliation)
+                            SeedWorkQueue& branching_seeds)
 {
-  int fiber_size = 100;
-  int fiber_length = 0;
-  assert(_model->signal_dim() == _signal_data->GetSignalDimension() * 2);
+  // The model is final, so its functions are called without virtual dispatch
+  Model& model = static_cast<Model&>(*_model);
+  assert(model.signal_dim() == _signal_data->GetSignalDimension() * 2);
 
   // Unpack the fiberStartSeed information.
   vec3_t              x = fiberStartSeed.point;
@@ -1113,25 +1750,66 @@ void Tractography::Follow3T(const int thread_id,
   ukfPrecisionType             trace = fiberStartSeed.trace;
   ukfPrecisionType             trace2 = fiberStartSeed.trace2;
 
-  //  Reserving fiber array memory so as to avoid resizing at every step
-  FiberReserve(fiber, fiber_size);
+  // The points are appended to the arena of this thread
+  fiber.Start(_fiber_arenas[thread_id]);
 
   // Record start point.
-  Record(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
+  Record<3, IsSimpleModel<Model>::value>(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
 
   vec3_t m1 = fiberStartSeed.start_dir;
   vec3_t l1, m2, l2, m3, l3;
 
   // Tract the fiber.
-  ukfMatrixType signal_tmp(_model->signal_dim(), 1);
-  ukfMatrixType state_tmp(_model->state_dim(), 1);
+  ukfMatrixType signal_tmp(model.signal_dim(), 1);
+  ukfMatrixType state_tmp(model.state_dim(), 1);
+
+  TrackingStats&               stats = *_tracking_stats[thread_id];
+  const UnscentedKalmanFilter& filter = *_ukf[thread_id];
+
+  // With the adaptive model order the fiber starts with the single tensor model and only switches to all
+  // tensors where that does not explain the signal. The state of all tensors is kept up to date for the
+  // checks and the recording.
+  typedef typename SingleTensorModel<Model>::type SingleModel;
+  SingleModel           *single_model = static_cast<SingleModel *>(_single_model);
+  UnscentedKalmanFilter *single_filter = ADAPTIVE ? _single_ukf[thread_id] : NULL;
+  State                  single_state;
+  ukfMatrixType          single_p;
+  bool                   single = false;
+  if( ADAPTIVE )
+    {
+    ToSingleTensor(*single_model, state, p, m1, single_state, single_p);
+    single = true;
+    }
+
+  StepControl step_control(_stepLength, _max_step_length, _steps_per_record, _max_length);
+  vec3_t      dir = m1; // direction of the last step
 
   int stepnr = 0;
   while( true )
     {
     ++stepnr;
 
-    Step3T(thread_id, x, m1, l1, m2, l2, m3, l3, fa, fa2, state, p, dNormMSE, trace, trace2);
+    const vec3_t old_dir = dir;
+    if( ADAPTIVE && single )
+      {
+      const uint64_t qp_solves = single_filter->GetNumberOfQPSolves();
+      Step1T(*single_model, *single_filter, step_control.Length(), x, dir, fa, single_state, single_p, dNormMSE,
+             trace);
+      stats.AddStep(single_filter->GetNumberOfQPSolves() - qp_solves);
+      stats.AddSingleTensorStep();
+      FromSingleTensor(single_state, single_p, state, p);
+      fa2 = fa;
+      trace2 = trace;
+      }
+    else
+      {
+      const uint64_t qp_solves = filter.GetNumberOfQPSolves();
+      Step3T(model, thread_id, step_control.Length(), x, m1, l1, m2, l2, m3, l3, fa, fa2, state, p, dNormMSE, trace,
+             trace2);
+      stats.AddStep(filter.GetNumberOfQPSolves() - qp_solves);
+      dir = m1;
+      }
+    step_control.Advance(old_dir, dir);
 
     // Check if we should abort following this fiber. We abort if we reach the
     // CSF, if FA or GA get too small, if the curvature get's too high or if
@@ -1139,38 +1817,55 @@ void Tractography::Follow3T(const int thread_id,
     const bool is_brain = _signal_data->ScalarMaskValue(x) > 0; //_signal_data->Interp3ScalarMask(x) > 0.1;
 
     state_tmp.col(0) = state;
-    _model->H(state_tmp, signal_tmp);
+    model.H(state_tmp, signal_tmp);
 
     const ukfPrecisionType mean_signal = s2adc(signal_tmp);
-    const bool in_csf = (mean_signal < _mean_signal_min) ||
-                        (fa < _fa_min);
+    const bool low_signal = mean_signal < _mean_signal_min;
+    const bool low_fa = fa < _fa_min;
+    const bool in_csf = low_signal || low_fa;
 
-    bool is_curving = curve_radius(fiber.position) < _min_radius;
+    bool is_curving = curve_radius(&fiber.position(0), fiber.size() ) < _min_radius;
 
     if( !is_brain || in_csf
-        || stepnr > _max_length  // Stop if the fiber is too long
+        || step_control.TooLong()  // Stop if the fiber is too long
         || is_curving )
       {
-
+      stats.AddFiber(GetStopReason(is_brain, low_signal, low_fa, step_control.TooLong() ), stepnr);
       break;
+      }
 
+    if( _roi_filter.Contains(ROI_EXCLUDE, x) )
+      {
+      fiber.excluded = true;
+      stats.AddFiber(STOP_ROI_EXCLUDE, stepnr);
+      break;
       }
 
-    if(fiber_length>=fiber_size)
+    if( step_control.Record() )
       {
-        // If fibersize is more than initally allocated size resizing further
-        fiber_size += 100;
-        FiberReserve(fiber, fiber_size);
+        Record<3, IsSimpleModel<Model>::value>(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
       }
 
-    if((stepnr+1)%_steps_per_record == 0)
+    if( ADAPTIVE )
       {
-        fiber_length++;
-        Record(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
+      if( single && dNormMSE > _adaptive_nmse )
+        {
+        // Continue with all tensors, starting from the direction the single tensor model stepped in
+        single_model->State2Tensor1T(single_state, m1, l1);
+        single = false;
+        stats.AddModelSwitch();
+        }
+      else if( !single && dNormMSE < ADAPTIVE_HYSTERESIS * _adaptive_nmse && IsSamePopulation(m1, m2, l2, _fa_min)
+               && IsSamePopulation(m1, m3, l3, _fa_min) )
+        {
+        ToSingleTensor(*single_model, state, p, m1, single_state, single_p);
+        single = true;
+        stats.AddModelSwitch();
+        }
       }
 
-    // Record branch if necessary.
-    if( is_branching )
+    // Record branch if necessary. A single tensor has no branches.
+    if( is_branching && !single )
       {
       const ukfPrecisionType fa_1 = l2fa(l1[0], l1[1], l1[2]);
       const bool is_one = ( l1[0] > l1[1] ) && (l1[0] > l1[2]) && ( fa_1 > _fa_min );
@@ -1193,7 +1888,7 @@ void Tractography::Follow3T(const int thread_id,
         dotval = m2.dot(m3);
         const bool is_branch3 = dotval < _cos_theta_min;
 
-        int state_dim = _model->state_dim();
+        int state_dim = model.state_dim();
         // If there is a branch between m1 and m2.
         if( is_two && is_branch1 )
           {
@@ -1239,13 +1934,11 @@ void Tractography::Follow3T(const int thread_id,
         // second tensor we swap the state and covariance.
         if( add_m2 )
           {
-          branching_seeds.push_back(SeedPointInfo() );
-          SeedPointInfo& local_seed = branching_seeds[branching_seeds.size() - 1];
-          branching_seed_affiliation.push_back(BranchingSeedAffiliation() );
-          BranchingSeedAffiliation& affiliation = branching_seed_affiliation[branching_seed_affiliation.size() - 1];
+          SeedPointInfo            local_seed;
+          BranchingSeedAffiliation affiliation;
 
           affiliation.fiber_index_ = seed_index;
-          affiliation.position_on_fiber_ = stepnr;
+          affiliation.position_on_fiber_ = static_cast<int>(fiber.size() );
 
           local_seed.state.resize(state_dim);
           local_seed.state = state;
@@ -1257,17 +1950,17 @@ void Tractography::Follow3T(const int thread_id,
           local_seed.point = x;
           local_seed.start_dir = m2;
           local_seed.fa = fa_2;
+
+          branching_seeds.PushBranch(thread_id, local_seed, affiliation);
           }
         // Same for the third tensor.
         if( add_m3 )
           {
-          branching_seeds.push_back(SeedPointInfo() );
-          SeedPointInfo& local_seed = branching_seeds[branching_seeds.size() - 1];
-          branching_seed_affiliation.push_back(BranchingSeedAffiliation() );
-          BranchingSeedAffiliation& affiliation = branching_seed_affiliation[branching_seed_affiliation.size() - 1];
+          SeedPointInfo            local_seed;
+          BranchingSeedAffiliation affiliation;
 
           affiliation.fiber_index_ = seed_index;
-          affiliation.position_on_fiber_ = stepnr;
+          affiliation.position_on_fiber_ = static_cast<int>(fiber.size() );
 
           local_seed.state.resize(state_dim);
           local_seed.state = state;
@@ -1277,23 +1970,25 @@ void Tractography::Follow3T(const int thread_id,
           local_seed.point = x;
           local_seed.start_dir = m3;
           local_seed.fa = fa_3;
+
+          branching_seeds.PushBranch(thread_id, local_seed, affiliation);
           }
         }
       }
     }
-  FiberReserve(fiber, fiber_length);
+  return stepnr;
 }
 
-void Tractography::Follow2T(const int thread_id,
+template <class Model, bool ADAPTIVE>
+int Tractography::Follow2T(const int thread_id,
                             const size_t seed_index,
                             const SeedPointInfo& fiberStartSeed,
                             UKFFiber& fiber,
                             bool is_branching,
-                            std::vector<SeedPointInfo>& branching_seeds,
-                            std::vector<BranchingSeedAffiliation>& branching_seed_affiliation)
+                            SeedWorkQueue& branching_seeds)
 {
-  int fiber_size = 100;
-  int fiber_length = 0;
+  Model& model = static_cast<Model&>(*_model);
+
   // Unpack the fiberStartSeed information.
   vec3_t x = fiberStartSeed.point;   // NOTICE that the x here is in ijk coordinate system
   State state = fiberStartSeed.state;
@@ -1306,18 +2001,39 @@ void Tractography::Follow2T(const int thread_id,
   ukfPrecisionType trace = fiberStartSeed.trace;
   ukfPrecisionType trace2 = fiberStartSeed.trace2;
 
-  //  Reserving fiber array memory so as to avoid resizing at every step
-  FiberReserve(fiber, fiber_size);
+  // The points are appended to the arena of this thread
+  fiber.Start(_fiber_arenas[thread_id]);
 
-  // Record start point.
-  Record(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2); // writes state to fiber.state
+  // Record start point, writes state to the arena of fiber.
+  Record<2, IsSimpleModel<Model>::value>(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
 
   vec3_t m1, l1, m2, l2;
   m1 = fiberStartSeed.start_dir;
 
   // Track the fiber.
-  ukfMatrixType signal_tmp(_model->signal_dim(), 1);
-  ukfMatrixType state_tmp(_model->state_dim(), 1);
+  ukfMatrixType signal_tmp(model.signal_dim(), 1);
+  ukfMatrixType state_tmp(model.state_dim(), 1);
+
+  TrackingStats&               stats = *_tracking_stats[thread_id];
+  const UnscentedKalmanFilter& filter = *_ukf[thread_id];
+
+  // With the adaptive model order the fiber starts with the single tensor model and only switches to all
+  // tensors where that does not explain the signal. The state of all tensors is kept up to date for the
+  // checks and the recording.
+  typedef typename SingleTensorModel<Model>::type SingleModel;
+  SingleModel           *single_model = static_cast<SingleModel *>(_single_model);
+  UnscentedKalmanFilter *single_filter = ADAPTIVE ? _single_ukf[thread_id] : NULL;
+  State                  single_state;
+  ukfMatrixType          single_p;
+  bool                   single = false;
+  if( ADAPTIVE )
+    {
+    ToSingleTensor(*single_model, state, p, m1, single_state, single_p);
+    single = true;
+    }
+
+  StepControl step_control(_stepLength, _max_step_length, _steps_per_record, _max_length);
+  vec3_t      dir = m1; // direction of the last step
 
   int stepnr = 0;
 
@@ -1329,7 +2045,26 @@ void Tractography::Follow2T(const int thread_id,
     {
     ++stepnr;
 
-    Step2T(thread_id, x, m1, l1, m2, l2, fa, fa2, state, p, dNormMSE, trace, trace2);
+    const vec3_t old_dir = dir;
+    if( ADAPTIVE && single )
+      {
+      const uint64_t qp_solves = single_filter->GetNumberOfQPSolves();
+      Step1T(*single_model, *single_filter, step_control.Length(), x, dir, fa, single_state, single_p, dNormMSE,
+             trace);
+      stats.AddStep(single_filter->GetNumberOfQPSolves() - qp_solves);
+      stats.AddSingleTensorStep();
+      FromSingleTensor(single_state, single_p, state, p);
+      fa2 = fa;
+      trace2 = trace;
+      }
+    else
+      {
+      const uint64_t qp_solves = filter.GetNumberOfQPSolves();
+      Step2T(model, thread_id, step_control.Length(), x, m1, l1, m2, l2, fa, fa2, state, p, dNormMSE, trace, trace2);
+      stats.AddStep(filter.GetNumberOfQPSolves() - qp_solves);
+      dir = m1;
+      }
+    step_control.Advance(old_dir, dir);
 
     // Check if we should abort following this fiber. We abort if we reach the
     // CSF, if FA or GA get too small, if the curvature get's too high or if
@@ -1340,44 +2075,65 @@ void Tractography::Follow2T(const int thread_id,
 
     state_tmp.col(0) = state;
 
-    _model->H(state_tmp, signal_tmp); // signal_tmp is written, but only used to calculate mean signal
+    model.H(state_tmp, signal_tmp); // signal_tmp is written, but only used to calculate mean signal
 
     const ukfPrecisionType mean_signal = s2adc(signal_tmp);
-    const bool in_csf = (_noddi) ? ( mean_signal < _mean_signal_min ) :
-                                   ( mean_signal < _mean_signal_min || fa < _fa_min);
+    const bool low_signal = mean_signal < _mean_signal_min;
+    const bool low_fa = !IsNoddiModel<Model>::value && fa < _fa_min;
+    const bool in_csf = low_signal || low_fa;
 
-    const bool is_curving = curve_radius(fiber.position) < _min_radius;
+    const bool is_curving = curve_radius(&fiber.position(0), fiber.size() ) < _min_radius;
 
     if( !is_brain
         || in_csf
-        || stepnr > _max_length  // Stop when the fiber is too long
+        || step_control.TooLong()  // Stop when the fiber is too long
         || is_curving)
       {
+      stats.AddFiber(GetStopReason(is_brain, low_signal, low_fa, step_control.TooLong() ), stepnr);
       break;
       }
 
-    if (_noddi)
+    if (IsNoddiModel<Model>::value)
       if (state[4] < 0.6 || state[9] < 0.6) // kappa1 and kappa2 break conditions
+        {
+        stats.AddFiber(STOP_LOW_KAPPA, stepnr);
         break;
+        }
 
-    if(fiber_length>=fiber_size)
+    if( _roi_filter.Contains(ROI_EXCLUDE, x) )
       {
-        // If fibersize is more than initally allocated size resizing further
-        fiber_size += 100;
-        FiberReserve(fiber, fiber_size);
+      fiber.excluded = true;
+      stats.AddFiber(STOP_ROI_EXCLUDE, stepnr);
+      break;
       }
 
-    if((stepnr+1)%_steps_per_record == 0)
+    if( step_control.Record() )
       {
-        fiber_length++;
-        if(_noddi)
-          Record(x, state[3], state[8], state, p, fiber, dNormMSE, state[4], state[9]);
+        if(IsNoddiModel<Model>::value)
+          Record<2, IsSimpleModel<Model>::value>(x, state[3], state[8], state, p, fiber, dNormMSE, state[4], state[9]);
         else
-          Record(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
+          Record<2, IsSimpleModel<Model>::value>(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
       }
 
-    // Record branch if necessary.
-    if( is_branching )
+    if( ADAPTIVE )
+      {
+      if( single && dNormMSE > _adaptive_nmse )
+        {
+        // Continue with both tensors, starting from the direction the single tensor model stepped in
+        single_model->State2Tensor1T(single_state, m1, l1);
+        single = false;
+        stats.AddModelSwitch();
+        }
+      else if( !single && dNormMSE < ADAPTIVE_HYSTERESIS * _adaptive_nmse && IsSamePopulation(m1, m2, l2, _fa_min) )
+        {
+        ToSingleTensor(*single_model, state, p, m1, single_state, single_p);
+        single = true;
+        stats.AddModelSwitch();
+        }
+      }
+
+    // Record branch if necessary. A single tensor has no branches.
+    if( is_branching && !single )
       {
       const ukfPrecisionType fa_1 = l2fa(l1[0], l1[1], l1[2]);
       const ukfPrecisionType fa_2 = l2fa(l2[0], l2[1], l2[2]);
@@ -1391,15 +2147,13 @@ void Tractography::Follow2T(const int thread_id,
       // second tensor we swap the state and covariance.
       if( is_two && is_branch )
         {
-        branching_seeds.push_back(SeedPointInfo() );
-        SeedPointInfo& local_seed = branching_seeds[branching_seeds.size() - 1];
-        branching_seed_affiliation.push_back(BranchingSeedAffiliation() );
-        BranchingSeedAffiliation& affiliation = branching_seed_affiliation[branching_seed_affiliation.size() - 1];
+        SeedPointInfo            local_seed;
+        BranchingSeedAffiliation affiliation;
 
         affiliation.fiber_index_ = seed_index;
-        affiliation.position_on_fiber_ = stepnr;
+        affiliation.position_on_fiber_ = static_cast<int>(fiber.size() );
 
-        int state_dim = _model->state_dim();
+        int state_dim = model.state_dim();
         local_seed.state.resize(state_dim);
         local_seed.state = state;
         local_seed.covariance.resize(state_dim, state_dim);
@@ -1408,22 +2162,27 @@ void Tractography::Follow2T(const int thread_id,
         local_seed.point = x;
         local_seed.start_dir = m2;
         local_seed.fa = fa_2;
+
+        branching_seeds.PushBranch(thread_id, local_seed, affiliation);
         }
       }
     }
-    FiberReserve(fiber, fiber_length);
 //   stateFile.close();
+    return stepnr;
 }
 
 // Also read the comments to Follow2T above, it's documented better than this
 // function here.
-void Tractography::Follow1T(const int thread_id,
+template <class Model>
+int Tractography::Follow1T(const int thread_id,
+                            const size_t,
                             const SeedPointInfo& fiberStartSeed,
-                            UKFFiber& fiber)
+                            UKFFiber& fiber,
+                            bool,
+                            SeedWorkQueue&)
 {
-  int fiber_size = 100;
-  int fiber_length = 0;
-  assert(_model->signal_dim() == _signal_data->GetSignalDimension() * 2);
+  Model& model = static_cast<Model&>(*_model);
+  assert(model.signal_dim() == _signal_data->GetSignalDimension() * 2);
 
   vec3_t x = fiberStartSeed.point;
   State state = fiberStartSeed.state;
@@ -1444,72 +2203,86 @@ void Tractography::Follow1T(const int thread_id,
 
   ukfPrecisionType dNormMSE = 0; // no error at the fiberStartSeed
 
-  //  Reserving fiber array memory so as to avoid resizing at every step
-  FiberReserve(fiber, fiber_size);
+  // The points are appended to the arena of this thread
+  fiber.Start(_fiber_arenas[thread_id]);
 
   // Record start point.
-  Record(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
+  Record<1, IsSimpleModel<Model>::value>(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
 
   // Tract the fiber.
-  ukfMatrixType signal_tmp(_model->signal_dim(), 1);
-  ukfMatrixType state_tmp(_model->state_dim(), 1);
+  ukfMatrixType signal_tmp(model.signal_dim(), 1);
+  ukfMatrixType state_tmp(model.state_dim(), 1);
+
+  TrackingStats&         stats = *_tracking_stats[thread_id];
+  UnscentedKalmanFilter& filter = *_ukf[thread_id];
+
+  StepControl step_control(_stepLength, _max_step_length, _steps_per_record, _max_length);
+  vec3_t      dir = fiberStartSeed.start_dir; // direction of the last step
 
   int stepnr = 0;
   while( true )
     {
     ++stepnr;
 
-    Step1T(thread_id, x, fa, state, p, dNormMSE, trace);
+    const vec3_t   old_dir = dir;
+    const uint64_t qp_solves = filter.GetNumberOfQPSolves();
+    Step1T(model, filter, step_control.Length(), x, dir, fa, state, p, dNormMSE, trace);
+    stats.AddStep(filter.GetNumberOfQPSolves() - qp_solves);
+    step_control.Advance(old_dir, dir);
 
     // Terminate if off brain or in CSF.
     const bool is_brain = _signal_data->ScalarMaskValue(x) > 0; //_signal_data->Interp3ScalarMask(x) > 0.1; // x is the seed point
     state_tmp.col(0) = state;
 
-    _model->H(state_tmp, signal_tmp);
+    model.H(state_tmp, signal_tmp);
 
     // Check mean_signal threshold
     const ukfPrecisionType mean_signal = s2adc(signal_tmp);
-    bool in_csf;
-    if(_noddi)
-      in_csf = mean_signal < _mean_signal_min;
-    else
-      in_csf = mean_signal < _mean_signal_min || fa < _fa_min;
+    const bool low_signal = mean_signal < _mean_signal_min;
+    const bool low_fa = !IsNoddiModel<Model>::value && fa < _fa_min;
+    const bool in_csf = low_signal || low_fa;
 
-    bool is_curving = curve_radius(fiber.position) < _min_radius;
+    bool is_curving = curve_radius(&fiber.position(0), fiber.size() ) < _min_radius;
 
     if( !is_brain
         || in_csf
-        || stepnr > _max_length  // Stop when fiber is too long
+        || step_control.TooLong()  // Stop when fiber is too long
         || is_curving )
       {
+      stats.AddFiber(GetStopReason(is_brain, low_signal, low_fa, step_control.TooLong() ), stepnr);
       break;
       }
-    if (_noddi)
+    if (IsNoddiModel<Model>::value)
       if( state[4]<1.2) // checking kappa
+        {
+        stats.AddFiber(STOP_LOW_KAPPA, stepnr);
         break;
+        }
 
-    if(fiber_length>=fiber_size)
+    if( _roi_filter.Contains(ROI_EXCLUDE, x) )
       {
-        // If fibersize is more than initally allocated size resizing further
-        fiber_size += 100;
-        FiberReserve(fiber, fiber_size);
+      fiber.excluded = true;
+      stats.AddFiber(STOP_ROI_EXCLUDE, stepnr);
+      break;
       }
 
-    if((stepnr+1)%_steps_per_record == 0)
+    if( step_control.Record() )
       {
-        fiber_length++;
-        if(_noddi)
-          Record(x, state[3], fa2, state, p, fiber, dNormMSE, state[4], trace2);
+        if(IsNoddiModel<Model>::value)
+          Record<1, IsSimpleModel<Model>::value>(x, state[3], fa2, state, p, fiber, dNormMSE, state[4], trace2);
         else
-          Record(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
+          Record<1, IsSimpleModel<Model>::value>(x, fa, fa2, state, p, fiber, dNormMSE, trace, trace2);
       }
 
 
     }
-    FiberReserve(fiber, fiber_length);
+    return stepnr;
 }
 
-void Tractography::Step3T(const int thread_id,
+template <class Model>
+void Tractography::Step3T(Model& model,
+                          const int thread_id,
+                          const ukfPrecisionType step_length,
                           vec3_t& x,
                           vec3_t& m1,
                           vec3_t& l1,
@@ -1527,12 +2300,12 @@ void Tractography::Step3T(const int thread_id,
                           )
 {
 
-  assert(static_cast<int>(covariance.cols() ) == _model->state_dim() &&
-         static_cast<int>(covariance.rows() ) == _model->state_dim() );
-  assert(static_cast<int>(state.size() ) == _model->state_dim() );
-  State state_new(_model->state_dim() );
+  assert(static_cast<int>(covariance.cols() ) == model.state_dim() &&
+         static_cast<int>(covariance.rows() ) == model.state_dim() );
+  assert(static_cast<int>(state.size() ) == model.state_dim() );
+  State state_new(model.state_dim() );
 
-  ukfMatrixType covariance_new(_model->state_dim(), _model->state_dim() );
+  ukfMatrixType covariance_new(model.state_dim(), model.state_dim() );
 
   // Use the Unscented Kalman Filter to get the next estimate.
   ukfVectorType signal(_signal_data->GetSignalDimension() * 2);
@@ -1544,7 +2317,7 @@ void Tractography::Step3T(const int thread_id,
 
   vec3_t old_dir = m1;
 
-  _model->State2Tensor3T(state, old_dir, m1, l1, m2, l2, m3, l3);
+  model.State2Tensor3T(state, old_dir, m1, l1, m2, l2, m3, l3);
   trace = l1[0] + l1[1] + l1[2];
   trace2 = l2[0] + l2[1] + l2[2];
 
@@ -1564,6 +2337,7 @@ void Tractography::Step3T(const int thread_id,
     // Swap state.
 
     SwapState3T(state, covariance, 2);
+    _tracking_stats[thread_id]->AddSwap();
 
     }
   else if( dot1 < dot3 )
@@ -1578,6 +2352,7 @@ void Tractography::Step3T(const int thread_id,
 
     // Swap state.
     SwapState3T(state, covariance, 3);
+    _tracking_stats[thread_id]->AddSwap();
     }
 
   // Update FA. If the first lamba is not the largest anymore the FA is set to
@@ -1599,10 +2374,13 @@ void Tractography::Step3T(const int thread_id,
   dx << m1[2] / voxel[0],
     m1[1] / voxel[1],
     m1[0] / voxel[2];
-  x = x + dx * _stepLength;
+  x = x + dx * step_length;
 }
 
-void Tractography::Step2T(const int thread_id,
+template <class Model>
+void Tractography::Step2T(Model& model,
+                          const int thread_id,
+                          const ukfPrecisionType step_length,
                           vec3_t& x,
                           vec3_t& m1,
                           vec3_t& l1,
@@ -1617,12 +2395,12 @@ void Tractography::Step2T(const int thread_id,
                           ukfPrecisionType& trace2
                           )
 {
-  assert(static_cast<int>(covariance.cols() ) == _model->state_dim() &&
-    static_cast<int>(covariance.rows() ) == _model->state_dim() );
-  assert(static_cast<int>(state.size() ) == _model->state_dim() );
+  assert(static_cast<int>(covariance.cols() ) == model.state_dim() &&
+    static_cast<int>(covariance.rows() ) == model.state_dim() );
+  assert(static_cast<int>(state.size() ) == model.state_dim() );
 
-  State              state_new(_model->state_dim() );
-  ukfMatrixType covariance_new(_model->state_dim(), _model->state_dim() );
+  State              state_new(model.state_dim() );
+  ukfMatrixType covariance_new(model.state_dim(), model.state_dim() );
   covariance_new.setConstant(ukfZero);
 
   // Use the Unscented Kalman Filter to get the next estimate.
@@ -1637,7 +2415,7 @@ void Tractography::Step2T(const int thread_id,
   const vec3_t old_dir = m1;   // Direction in last step
   ukfPrecisionType fa_tensor_1 = ukfZero;
   ukfPrecisionType fa_tensor_2 = ukfZero;
-  if(_noddi)
+  if(IsNoddiModel<Model>::value)
     {
     initNormalized(m1, state[0], state[1], state[2]);
     initNormalized(m2, state[5], state[6], state[7]);
@@ -1652,7 +2430,7 @@ void Tractography::Step2T(const int thread_id,
     }
   else
     {
-    _model->State2Tensor2T(state, old_dir, m1, l1, m2, l2);   // The returned m1 and m2 are unit vector here
+    model.State2Tensor2T(state, old_dir, m1, l1, m2, l2);   // The returned m1 and m2 are unit vector here
     trace = l1[0] + l1[1] + l1[2];
     trace2 = l2[0] + l2[1] + l2[2];
     fa_tensor_1 = l2fa(l1[0], l1[1], l1[2]);
@@ -1678,11 +2456,12 @@ void Tractography::Step2T(const int thread_id,
     trace2=tmpScalar;
     ukfMatrixType old = covariance;
     SwapState2T(state, covariance);   // Swap the two tensors
+    _tracking_stats[thread_id]->AddSwap();
     }
 
   if(tensor_angle <= 20)
     {
-    if(_noddi)
+    if(IsNoddiModel<Model>::value)
       {
       vec3_t tmp = m1;
       m1 = m2;
@@ -1690,6 +2469,7 @@ void Tractography::Step2T(const int thread_id,
       ukfMatrixType old = covariance;
 
       SwapState2T(state, covariance);   // Swap the two tensors
+      _tracking_stats[thread_id]->AddSwap();
       }
     else if (std::min(fa_tensor_1, fa_tensor_2) <= 0.2 )
       {
@@ -1711,6 +2491,7 @@ void Tractography::Step2T(const int thread_id,
         ukfMatrixType old = covariance;
 
         SwapState2T(state, covariance);   // Swap the two tensors
+        _tracking_stats[thread_id]->AddSwap();
         }
       }
     }
@@ -1737,7 +2518,7 @@ void Tractography::Step2T(const int thread_id,
        // outputted
        dir[0] / voxel[2];
 
-    x = x + dx * _stepLength; // The x here is in ijk coordinate system.
+    x = x + dx * step_length; // The x here is in ijk coordinate system.
     }
   // NOTICE that the coordinate order of x is in reverse order with respect to the axis order in the original signal
   // file.
@@ -1746,8 +2527,12 @@ void Tractography::Step2T(const int thread_id,
   // throw;
 }
 
-void Tractography::Step1T(const int thread_id,
+template <class Model>
+void Tractography::Step1T(Model& model,
+                          UnscentedKalmanFilter& filter,
+                          const ukfPrecisionType step_length,
                           vec3_t& x,
+                          vec3_t& dir,
                           ukfPrecisionType& fa,
                           State& state,
                           ukfMatrixType& covariance,
@@ -1756,29 +2541,28 @@ void Tractography::Step1T(const int thread_id,
                           )
 {
 
-  assert(static_cast<int>(covariance.cols() ) == _model->state_dim() &&
-         static_cast<int>(covariance.rows() ) == _model->state_dim() );
-  assert(static_cast<int>(state.size() ) == _model->state_dim() );
-  State              state_new(_model->state_dim() );
-  ukfMatrixType covariance_new(_model->state_dim(), _model->state_dim() );
+  assert(static_cast<int>(covariance.cols() ) == model.state_dim() &&
+         static_cast<int>(covariance.rows() ) == model.state_dim() );
+  assert(static_cast<int>(state.size() ) == model.state_dim() );
+  State              state_new(model.state_dim() );
+  ukfMatrixType covariance_new(model.state_dim(), model.state_dim() );
 
   ukfVectorType signal(_signal_data->GetSignalDimension() * 2);
   _signal_data->Interp3Signal(x, signal);
 
-  _ukf[thread_id]->Filter(state, covariance, signal, state_new, covariance_new, dNormMSE);
+  filter.Filter(state, covariance, signal, state_new, covariance_new, dNormMSE);
 
   state = state_new;
   covariance = covariance_new;
 
-  vec3_t dir;
-  if (_noddi)
+  if (IsNoddiModel<Model>::value)
   {
     dir << state[0], state[1], state[2];
   }
   else
   {
     vec3_t l;
-    _model->State2Tensor1T(state, dir, l);
+    model.State2Tensor1T(state, dir, l);
 
     trace = l[0] + l[1] + l[2];
 
@@ -1799,7 +2583,7 @@ void Tractography::Step1T(const int thread_id,
   dx << dir[2] / voxel[0],
     dir[1] / voxel[1],
     dir[0] / voxel[2];
-  x = x + dx * _stepLength;
+  x = x + dx * step_length;
 
 }
 
@@ -1877,8 +2661,82 @@ void Tractography::SwapState2T( State& state,
   state.segment(0,state_dim) = tmp_vec.segment(state_dim, state_dim);
 }
 
+void Tractography::FromSingleTensor(const State& single_state,
+                                    const ukfMatrixType& single_covariance,
+                                    State& state,
+                                    ukfMatrixType& covariance) const
+{
+  const int state_dim = _model->state_dim();
+  // The free water weight follows the tensors
+  const int tensor_dim = _free_water ? single_state.size() - 1 : single_state.size();
+  const int num_tensors = state_dim / tensor_dim;
+  const int weight = state_dim - 1;
+
+  state.resize(state_dim);
+  covariance.resize(state_dim, state_dim);
+  covariance.setConstant(ukfZero);
+  for( int i = 0; i < num_tensors; ++i )
+    {
+    // The tensors are uncorrelated, as in the seeds, so that the covariance stays positive definite
+    state.segment(i * tensor_dim, tensor_dim) = single_state.segment(0, tensor_dim);
+    covariance.block(i * tensor_dim, i * tensor_dim, tensor_dim, tensor_dim) =
+      single_covariance.block(0, 0, tensor_dim, tensor_dim);
+    }
+  if( _free_water )
+    {
+    state[weight] = single_state[tensor_dim];
+    covariance(weight, weight) = single_covariance(tensor_dim, tensor_dim);
+    covariance.block(weight, 0, 1, tensor_dim) = single_covariance.block(tensor_dim, 0, 1, tensor_dim);
+    covariance.block(0, weight, tensor_dim, 1) = single_covariance.block(0, tensor_dim, tensor_dim, 1);
+    }
+}
+
+template <class SingleModel>
+void Tractography::ToSingleTensor(SingleModel& single_model,
+                                  const State& state,
+                                  const ukfMatrixType& covariance,
+                                  const vec3_t& dir,
+                                  State& single_state,
+                                  ukfMatrixType& single_covariance) const
+{
+  const int single_dim = single_model.state_dim();
+  const int tensor_dim = _free_water ? single_dim - 1 : single_dim;
+  const int weight = state.size() - 1;
+
+  single_state.resize(single_dim);
+  single_covariance.resize(single_dim, single_dim);
+  single_state.segment(0, tensor_dim) = state.segment(0, tensor_dim);
+  single_covariance.block(0, 0, tensor_dim, tensor_dim) = covariance.block(0, 0, tensor_dim, tensor_dim);
+  if( _free_water )
+    {
+    single_state[tensor_dim] = state[weight];
+    single_covariance(tensor_dim, tensor_dim) = covariance(weight, weight);
+    single_covariance.block(tensor_dim, 0, 1, tensor_dim) = covariance.block(weight, 0, 1, tensor_dim);
+    single_covariance.block(0, tensor_dim, tensor_dim, 1) = covariance.block(0, weight, tensor_dim, 1);
+    }
+
+  // Step1T steps along the principal direction of the state, which may point backwards
+  vec3_t m, l;
+  single_model.State2Tensor1T(single_state, m, l);
+  if( m.dot(dir) < 0 )
+    {
+    if( _is_full_model )
+      {
+      // Switch psi angle, as for the seeds in the opposite direction
+      single_state[2] = single_state[2] < ukfZero ? single_state[2] + UKF_PI : single_state[2] - UKF_PI;
+      }
+    else
+      {
+      single_state.segment(0, 3) = -single_state.segment(0, 3);
+      single_covariance.block(0, 3, 3, single_dim - 3) = -single_covariance.block(0, 3, 3, single_dim - 3);
+      single_covariance.block(3, 0, single_dim - 3, 3) = -single_covariance.block(3, 0, single_dim - 3, 3);
+      }
+    }
+}
+
+template <int NUM_TENSORS, bool NORMALIZE_DIRECTIONS>
 void Tractography::Record(const vec3_t& x, const ukfPrecisionType fa, const ukfPrecisionType fa2, const State& state,
-                          const ukfMatrixType p,
+                          const ukfMatrixType& p,
                           UKFFiber& fiber, const ukfPrecisionType dNormMSE, const ukfPrecisionType trace, const ukfPrecisionType trace2)
 {
   // if Noddi model is used Kappa is stored in trace, Vic in fa and Viso in freewater
@@ -1886,30 +2744,34 @@ void Tractography::Record(const vec3_t& x, const ukfPrecisionType fa, const ukfP
   assert(p.rows() == static_cast<unsigned int>(state.size() ) &&
          p.cols() == static_cast<unsigned int>(state.size() ) );
 
+  // Points can only be added to the fiber at the end of its arena
+  FiberArena& arena = *fiber.arena;
+  assert(fiber.begin + fiber.length == arena.NumberOfPoints() );
+
   // std::cout << "x: " << x[0] << " " << x[1] << " " << x[2] << std::endl;
-  fiber.position.push_back(x);
-  fiber.norm.push_back(p.norm());
+  arena.position.push_back(x);
+  arena.norm.push_back(p.norm());
 
   if( _record_nmse )
     {
-    fiber.normMSE.push_back(dNormMSE);
+    arena.normMSE.push_back(dNormMSE);
     }
 
   if( _record_trace || _record_kappa)
     {
-    fiber.trace.push_back(2*(atan(1/trace)/3.14));
-    if( _num_tensors >= 2 )
+    arena.trace.push_back(2*(atan(1/trace)/3.14));
+    if( NUM_TENSORS >= 2 )
       {
-      fiber.trace2.push_back(2*(atan(1/trace2)/3.14));
+      arena.trace2.push_back(2*(atan(1/trace2)/3.14));
       }
     }
 
   if( _record_fa || _record_Vic)
     {
-    fiber.fa.push_back(fa);
-    if( _num_tensors >= 2 )
+    arena.fa.push_back(fa);
+    if( NUM_TENSORS >= 2 )
       {
-      fiber.fa2.push_back(fa2);
+      arena.fa2.push_back(fa2);
       }
     }
 
@@ -1928,7 +2790,7 @@ void Tractography::Record(const vec3_t& x, const ukfPrecisionType fa, const ukfP
         throw;
         }
       }
-    fiber.free_water.push_back(viso);
+    arena.free_water.push_back(viso);
     }
 
   if( _record_free_water )
@@ -1949,11 +2811,11 @@ void Tractography::Record(const vec3_t& x, const ukfPrecisionType fa, const ukfP
         throw;
         }
       }
-    fiber.free_water.push_back(fw);
+    arena.free_water.push_back(fw);
     }
 
   // Record the state
-  if( state.size() == 5 || state.size() == 10 || state.size() == 15 )   // i.e. simple model
+  if( NORMALIZE_DIRECTIONS )
     { // Normalize direction before storing it;
     State store_state(state);
     vec3_t dir;
@@ -1962,70 +2824,32 @@ void Tractography::Record(const vec3_t& x, const ukfPrecisionType fa, const ukfP
     store_state[1] = dir[1];
     store_state[2] = dir[2];
 
-    if( state.size() == 10 )
+    if( NUM_TENSORS == 2 )
       {
       initNormalized(dir,store_state[5], store_state[6], store_state[7]);
       store_state[5] = dir[0];
       store_state[6] = dir[1];
       store_state[7] = dir[2];
       }
-    if( state.size() == 15 )
+    if( NUM_TENSORS == 3 )
       {
       initNormalized(dir,store_state[10], store_state[11], store_state[12]);
       store_state[10] = dir[0];
       store_state[11] = dir[1];
       store_state[12] = dir[2];
       }
-    fiber.state.push_back(store_state);
+    arena.state.insert(arena.state.end(), store_state.data(), store_state.data() + store_state.size() );
 
     }
   else
     {
     // Normal state
-    fiber.state.push_back(state);
+    arena.state.insert(arena.state.end(), state.data(), state.data() + state.size() );
     }
 
   if( _record_cov )
     {
-    fiber.covariance.push_back(p);
-    }
-}
-
-
-void Tractography::FiberReserve(UKFFiber& fiber, int fiber_size)
-{
-  // Reserving space for fiber
-  fiber.position.reserve(fiber_size);
-  fiber.norm.reserve(fiber_size);
-  fiber.state.reserve(fiber_size);
-  if( _record_nmse )
-    {
-    fiber.normMSE.reserve(fiber_size);
-    }
-
-  if( _record_trace || _record_kappa)
-    {
-    fiber.trace.reserve(fiber_size);
-    if( _num_tensors >= 2 )
-      {
-      fiber.trace2.reserve(fiber_size);
-      }
-    }
-
-  if( _record_fa || _record_Vic)
-    {
-    fiber.fa.reserve(fiber_size);
-    if( _num_tensors >= 2 )
-      {
-      fiber.fa2.reserve(fiber_size);
-      }
-    }
-  if( _record_free_water || _record_Viso)
-    {
-    fiber.free_water.reserve(fiber_size);
-    }
-  if( _record_cov)
-    {
-      fiber.covariance.reserve(fiber_size);
+    arena.RecordCovariance(p);
     }
+  ++fiber.length;
 }
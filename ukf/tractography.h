@@ -8,14 +8,26 @@
 
 #include <string>
 #include <vector>
+#include <atomic>
 #include "ukffiber.h"
 #include "seed.h"
 #include "ukf_types.h"
 #include "ukf_exports.h"
+#include "numa_utilities.h"
+#include "seed_order.h"
+#include "vtp_block_writer.h"
+#include "connectome.h"
+#include "roi_filter.h"
 
 class NrrdData;
 class vtkPolyData;
 class Tractography;
+class SeedWorkQueue;
+class TrackingThreadPool;
+class RunReport;
+class TrackingStats;
+struct FiberMaps;
+struct FiberBatch;
 
 // Internal constants
 const ukfPrecisionType SIGMA_MASK                 = 0.5;
@@ -24,12 +36,37 @@ const ukfPrecisionType MIN_RADIUS                 = 0.87;
 const ukfPrecisionType FULL_BRAIN_MEAN_SIGNAL_MIN = 0.18;
 const ukfPrecisionType D_ISO                      = 0.003; // Diffusion coefficient of free water
 
+/**
+ * \struct TractographyProgress
+ * \brief Snapshot of a running Tractography::Run, passed to the progress callback
+*/
+struct TractographyProgress
+  {
+  long   seeds_total;       // number of primary seeds
+  long   seeds_done;        // primary fibers traced
+  long   branches_found;    // branch seeds emitted so far
+  long   branches_done;     // branch fibers traced
+  long   steps;             // filter steps of all fibers
+  double elapsed;           // seconds since tracking started
+  double fibers_per_second; // primary and branch fibers
+  double steps_per_second;
+  double eta;               // estimated seconds until all primary seeds are traced, negative if unknown
+  };
+
+/**
+ * Called by Run every progress interval on the thread that called Run. Tractography::Cancel may be called
+ * from the callback.
+*/
+typedef void (*ProgressCallback)(const TractographyProgress& progress, void *client_data);
+
 struct UKFSettings {
   bool record_fa;
   bool record_nmse;
   bool record_trace;
   bool record_state;
   bool record_cov;
+  CovarianceMode record_cov_mode;
+  bool record_cov_float;
   bool record_free_water;
   bool record_tensors;
   bool record_Vic;
@@ -48,7 +85,9 @@ struct UKFSettings {
   bool is_full_model;
   bool free_water;
   bool noddi;
+  ukfPrecisionType adaptive_nmse;
   ukfPrecisionType stepLength;
+  ukfPrecisionType max_step_length;
   ukfPrecisionType recordLength;
   ukfPrecisionType maxHalfFiberLength;
   std::vector<int> labels;
@@ -66,6 +105,16 @@ struct UKFSettings {
   ukfPrecisionType min_radius;
   ukfPrecisionType full_brain_mean_signal_min;
   size_t num_threads;
+  NumaMode numa_mode;
+  SeedOrder seed_order;
+  int max_fibers;
+  ukfPrecisionType time_budget;
+  ukfPrecisionType progress_interval;
+  bool stream_output;
+  VtpCompressor vtp_compressor;
+  bool compress_ukf;
+  ukfPrecisionType max_position_error;
+  ukfPrecisionType max_scalar_error;
 
   /*
   *  TODO refactor
@@ -76,6 +125,17 @@ struct UKFSettings {
   // TODO MRMLID support?
   std::string output_file;
   std::string output_file_with_second_tensor;
+  std::string density_map;
+  std::string scalar_map_prefix;
+  std::string connectome_labels;
+  std::string connectome_prefix;
+  ConnectomeFormat connectome_format;
+  std::string connectome_scalar;
+  std::string roi_labels;
+  std::vector<int> roi_include;
+  std::vector<int> roi_exclude;
+  std::vector<int> roi_end;
+  std::string run_report;
   std::string dwiFile;
   std::string seedsFile;
   std::string maskFile;
@@ -140,29 +200,67 @@ public:
   */
   void Init(std::vector<SeedPointInfo>& seed_infos);
 
+  /**
+   * Calculate six tensor coefficients by solving B * d = log(s), where d are
+   * tensor coefficients, B is gradient weighting, s is signal.
+  */
+  void UnpackTensor(const ukfVectorType& b, const stdVec_t& u, stdEigVec_t& s,
+                    stdEigVec_t& ret);
+
   /** \breif Performs the tractography
       \return true if files written successfully, else false
   */
   bool Run();
 
   /**
-   * Follows one seed point for the 3 Tensor case
+   * Registers a function that is called with the tracking progress every progress interval.
+   * The interval is given by the progressInterval setting, and nothing is reported if it is 0.
+  */
+  void SetProgressCallback(ProgressCallback callback, void *client_data)
+    {
+    _progress_callback = callback;
+    _progress_client_data = client_data;
+    }
+
+  /**
+   * Asks a running Run() to stop. The fibers being traced are finished, no new seeds are started and nothing
+   * is written. Can be called from any thread and from the progress callback.
   */
-  void Follow3T(const int thread_id, const size_t seed_index, const SeedPointInfo& seed, UKFFiber& fiber,
-                bool is_branching, std::vector<SeedPointInfo>& branching_seeds,
-                std::vector<BranchingSeedAffiliation>& branching_seed_affiliation);
+  void Cancel()
+    {
+    _cancel_requested = true;
+    }
+
+  /** True if Cancel was called since the start of the last Run() */
+  bool IsCancelled() const
+    {
+    return _cancel_requested;
+    }
 
   /**
-   * Follows one seed point for the 2 Tensor case
+   * Writes the timings and counts of LoadFiles and Run to the runReport file, if it is set
+   * \param exit_status The exit status of the run
+   * \return true on failure
   */
-  void Follow2T(const int thread_id, const size_t seed_index, const SeedPointInfo& seed, UKFFiber& fiber,
-                bool is_branching, std::vector<SeedPointInfo>& branching_seeds,
-                std::vector<BranchingSeedAffiliation>& branching_seed_affiliation);
+  bool WriteRunReport(const int exit_status) const;
+
+  /** Reports the progress of the fibers traced from work_queue. Called periodically during Run. */
+  void ReportProgress(const SeedWorkQueue& work_queue);
+
+  /** Drops the fibers recorded by a thread, e.g. once they have been written */
+  void ClearFiberArena(const int thread_id);
 
   /**
-   * Follows one seed point for the 1 Tensor case
+   * Follows one seed point with the tracking loop of the filter model. The loop is a template instantiated for
+   * every model; UpdateFilterModelType picks the instance once, so the steps do not branch on the model.
+   * \param seed_index, is_branching, branching_seeds Only used by the 2 and 3 Tensor models to push branches
+   * \return the number of filter steps taken
   */
-  void Follow1T(const int thread_id, const SeedPointInfo& seed, UKFFiber& fiber);
+  int Follow(const int thread_id, const size_t seed_index, const SeedPointInfo& seed, UKFFiber& fiber,
+             bool is_branching, SeedWorkQueue& branching_seeds)
+  {
+    return (this->*_follow)(thread_id, seed_index, seed, fiber, is_branching, branching_seeds);
+  }
 
   /*
   * Update filter model type
@@ -176,35 +274,73 @@ public:
   void SetWriteBinary(bool wb) { this->_writeBinary = wb; }
   void SetWriteCompressed(bool wb) { this->_writeCompressed = wb; }
   void SetOutputPolyData(vtkPolyData* pd) { this->_outputPolyData = pd; }
+  NrrdData* GetSignalData() const { return this->_signal_data; }
+  FilterModel* GetFilterModel() const { return this->_model; }
 
   void SetDebug(bool v) { this->debug = v; }
 
 private:
-  /**
-   * Calculate six tensor coefficients by solving B * d = log(s), where d are
-   * tensor coefficients, B is gradient weighting, s is signal.
-  */
-  void UnpackTensor(const ukfVectorType& b, const stdVec_t& u, stdEigVec_t& s,
-                    stdEigVec_t& ret);
-
   /**
   * Creates necessary variable for noddi
   */
   void createProtocol(const ukfVectorType& b, ukfVectorType& gradientStrength,
                                   ukfVectorType& pulseSeparation);
 
-  /** One step along the fiber for the 3-tensor case. */
-  void Step3T(const int thread_id, vec3_t& x, vec3_t& m1, vec3_t& l1, vec3_t& m2, vec3_t& l2, vec3_t& m3, vec3_t& l3,
-              ukfPrecisionType& fa, ukfPrecisionType& fa2, State& state, ukfMatrixType& covariance, ukfPrecisionType& dNormMSE, ukfPrecisionType& trace,
+  /**
+   * Follows one seed point for the 3 Tensor case
+   * \tparam ADAPTIVE Whether the fiber is traced with the single tensor model where it explains the signal, see
+   * adaptive_nmse
+  */
+  template <class Model, bool ADAPTIVE>
+  int Follow3T(const int thread_id, const size_t seed_index, const SeedPointInfo& seed, UKFFiber& fiber,
+               bool is_branching, SeedWorkQueue& branching_seeds);
+
+  /** Follows one seed point for the 2 Tensor case, see Follow3T */
+  template <class Model, bool ADAPTIVE>
+  int Follow2T(const int thread_id, const size_t seed_index, const SeedPointInfo& seed, UKFFiber& fiber,
+               bool is_branching, SeedWorkQueue& branching_seeds);
+
+  /** Follows one seed point for the 1 Tensor case, which never branches */
+  template <class Model>
+  int Follow1T(const int thread_id, const size_t seed_index, const SeedPointInfo& seed, UKFFiber& fiber,
+               bool is_branching, SeedWorkQueue& branching_seeds);
+
+  /** One step of step_length along the fiber for the 3-tensor case. */
+  template <class Model>
+  void Step3T(Model& model, const int thread_id, const ukfPrecisionType step_length, vec3_t& x, vec3_t& m1, vec3_t& l1, vec3_t& m2, vec3_t& l2,
+              vec3_t& m3, vec3_t& l3, ukfPrecisionType& fa, ukfPrecisionType& fa2, State& state,
+              ukfMatrixType& covariance, ukfPrecisionType& dNormMSE, ukfPrecisionType& trace,
               ukfPrecisionType& trace2);
 
-  /** One step along the fiber for the 2-tensor case. */
-  void Step2T(const int thread_id, vec3_t& x, vec3_t& m1, vec3_t& l1, vec3_t& m2, vec3_t& l2, ukfPrecisionType& fa, ukfPrecisionType& fa2,
-              State& state, ukfMatrixType& covariance, ukfPrecisionType& dNormMSE, ukfPrecisionType& trace, ukfPrecisionType& trace2);
+  /** One step of step_length along the fiber for the 2-tensor case. */
+  template <class Model>
+  void Step2T(Model& model, const int thread_id, const ukfPrecisionType step_length, vec3_t& x, vec3_t& m1, vec3_t& l1, vec3_t& m2, vec3_t& l2,
+              ukfPrecisionType& fa, ukfPrecisionType& fa2, State& state, ukfMatrixType& covariance,
+              ukfPrecisionType& dNormMSE, ukfPrecisionType& trace, ukfPrecisionType& trace2);
+
+  /**
+   * One step of step_length along the fiber for the 1-tensor case, with the filter of model
+   * \param dir The direction of the step
+  */
+  template <class Model>
+  void Step1T(Model& model, UnscentedKalmanFilter& filter, const ukfPrecisionType step_length, vec3_t& x,
+              vec3_t& dir, ukfPrecisionType& fa, State& state, ukfMatrixType& covariance,
+              ukfPrecisionType& dNormMSE, ukfPrecisionType& trace);
+
+  /**
+   * Builds the state and covariance of the multi tensor model from those of _single_model, with every tensor
+   * a copy of the single one. The seeds start the same way.
+  */
+  void FromSingleTensor(const State& single_state, const ukfMatrixType& single_covariance, State& state,
+                        ukfMatrixType& covariance) const;
 
-  /** One step along the fiber for the 1-tensor case. */
-  void Step1T(const int thread_id, vec3_t& x, ukfPrecisionType& fa, State& state, ukfMatrixType& covariance, ukfPrecisionType& dNormMSE,
-              ukfPrecisionType& trace);
+  /**
+   * Takes the first tensor of the multi tensor state as the state of the single tensor model. The tensor is
+   * turned around if needed, so that the single tensor model keeps stepping in direction dir.
+  */
+  template <class SingleModel>
+  void ToSingleTensor(SingleModel& single_model, const State& state, const ukfMatrixType& covariance,
+                      const vec3_t& dir, State& single_state, ukfMatrixType& single_covariance) const;
 
   /**
    * Swaps the first tensor with the i-th tensor in state and covariance matrix for the 3 Tensor case.
@@ -220,22 +356,88 @@ private:
 
   /**
    * Saves one point along the fiber so that everything can be written to a
-   * file at the end.
+   * file at the end. The fields that depend on the model are chosen at compile time.
+   * \tparam NUM_TENSORS The number of tensors of the model, the second fa and trace are recorded from 2 on
+   * \tparam NORMALIZE_DIRECTIONS Whether the state holds unnormalized directions, i.e. is of a simple model
   */
+  template <int NUM_TENSORS, bool NORMALIZE_DIRECTIONS>
   void Record(const vec3_t& x, const ukfPrecisionType fa, const ukfPrecisionType fa2,
-              const State& state, const ukfMatrixType p, UKFFiber& fiber,
+              const State& state, const ukfMatrixType& p, UKFFiber& fiber,
               const ukfPrecisionType dNormMSE, const ukfPrecisionType trace, const ukfPrecisionType trace2);
 
-  /**  Reserving fiber array memory so as to avoid resizing at every step*/
-  void FiberReserve(UKFFiber& fiber, int fiber_size);
+  /** Order in which the seeds are handed to the threads, and how many consecutive seeds a thread claims */
+  void TracingOrder(const stdVec_t& seed_points, std::vector<int>& order, int& chunk_size) const;
+
+  /**
+   * Traces the seeds pair by pair and writes the fibers of each pair as soon as it is done, so that the
+   * fibers never have to be kept in memory all at once. Without an output file the fibers are only added
+   * to the maps. With a fiber or time budget the seed pairs are traced in a shuffled order until the
+   * budget is used up.
+   * \param fiber_maps The accumulators of the workers, or NULL
+   * \param kept_batches If set, one batch per worker that keeps the fibers instead of writing them
+   * \return EXIT_FAILURE or EXIT_SUCCESS
+  */
+  int StreamFibers(std::vector<SeedPointInfo>& primary_seed_infos, FiberMaps *fiber_maps,
+                   std::vector<FiberBatch> *kept_batches = NULL);
+
+  /**
+   * Writes the joined fibers to the output file or polydata, followed by the maps
+   * \param add_to_maps Whether the fibers still have to be added to fiber_maps
+   * \return EXIT_FAILURE or EXIT_SUCCESS
+  */
+  int WriteFibers(std::vector<UKFFiber>& fibers, FiberMaps& fiber_maps, const bool add_to_maps);
+
+  /**
+   * Sets up one accumulator per worker for each requested voxel map and connectome
+   * \return true on failure
+  */
+  bool InitFiberMaps(FiberMaps& fiber_maps) const;
+
+  /**
+   * Merges the accumulators of the workers and writes the voxel maps and the connectome
+   * \return EXIT_FAILURE or EXIT_SUCCESS
+  */
+  int WriteFiberMaps(FiberMaps& fiber_maps);
+
+  /** Adds the branch and step counts of the finished work_queue and the merged tracking statistics to the run report */
+  void RecordTracking(const SeedWorkQueue& work_queue);
+
+  /** Deletes the Kalman filters, e.g. because the filter model they point to is replaced */
+  void ReleaseFilters();
 
   /** Vector of Pointers to Unscented Kalaman Filters. One for each thread. */
   std::vector<UnscentedKalmanFilter *> _ukf;
 
+  /** Filters of _single_model, one for each thread. Empty unless the model order is adaptive. */
+  std::vector<UnscentedKalmanFilter *> _single_ukf;
+
+  /** Storage of the traced fibers. One for each thread. */
+  std::vector<FiberArena *> _fiber_arenas;
+
+  /** Stop reasons and step statistics of the fibers traced in the current run. One for each thread. */
+  std::vector<TrackingStats *> _tracking_stats;
+
   /** Output file for tracts generated with first tensor */
   const std::string _output_file;
   /** Output file for tracts generated with second tensor */
   const std::string _output_file_with_second_tensor;
+  /** Output file for the number of fibers per voxel */
+  const std::string _density_map;
+  /** Prefix of the output files for the mean and standard deviation of the scalars per voxel */
+  const std::string _scalar_map_prefix;
+  /** Label map of the regions the connectome connects */
+  const std::string _connectome_labels;
+  /** Prefix of the connectome matrix files, the connectome is only accumulated if it is set */
+  const std::string _connectome_prefix;
+  const ConnectomeFormat _connectome_format;
+  /** Name of the scalar averaged over the fibers of each connection, empty for none */
+  const std::string _connectome_scalar;
+  /** Label map of the regions of _roi_filter */
+  const std::string _roi_labels;
+  RoiFilter _roi_filter;
+  /** Output file of the run report, the report is only collected if it is set */
+  const std::string _run_report_file;
+  RunReport *_run_report;
 
   /** Pointer to generic diffusion data */
   NrrdData *_signal_data;
@@ -253,6 +455,9 @@ private:
   const bool _record_state;
   /** Switch for attaching the covariance to the fiber at each point of the tractography */
   const bool _record_cov;
+  /** Which part of the covariance is recorded, and whether in single precision */
+  const CovarianceMode _record_cov_mode;
+  const bool _record_cov_float;
   /** Switch for attaching the free water percentage to the fiber at each point of the tractography */
   const bool _record_free_water;
   // Noddi Model parameters
@@ -303,7 +508,11 @@ private:
   ukfPrecisionType  _cos_theta_max;
   bool              _is_full_model;
   bool              _free_water;
+  /** NMSE of the single tensor model above which the fiber continues with all tensors, 0 if not adaptive */
+  const ukfPrecisionType _adaptive_nmse;
   ukfPrecisionType  _stepLength;
+  /** Maximal length of the adaptive steps, 0 for steps of _stepLength, see StepControl */
+  const ukfPrecisionType _max_step_length;
   int               _steps_per_record;
   std::vector<int>  _labels;
   stdVec_t _ext_seeds;
@@ -319,12 +528,43 @@ private:
   bool _writeCompressed;
   // Threading control
   const int _num_threads;
+  const NumaMode _numa_mode;
+  const SeedOrder _seed_order;
+
+  // Stop tracing once this many fibers are kept or this many seconds have passed, 0 for no limit
+  const int _max_fibers;
+  const ukfPrecisionType _time_budget;
+
+  // Join and write the fibers while tracking, see StreamFibers
+  const bool _stream_output;
+  const VtpCompressor _vtp_compressor;
+  // .ukf output is uncompressed unless requested, so that it can be mapped into memory
+  const bool _compress_ukf;
+  // Lossy quantization of .ukf output
+  const ukfPrecisionType _max_position_error;
+  const ukfPrecisionType _max_scalar_error;
+
+  // Progress reporting and cancellation
+  ukfPrecisionType  _progress_interval;
+  ProgressCallback  _progress_callback;
+  void *            _progress_client_data;
+  std::atomic<bool> _cancel_requested;
 
   vtkPolyData* _outputPolyData;
 
   // TODO smartpointer
   model_type _filter_model_type;
   FilterModel *_model;
+  /** Single tensor model of the same kind as _model for the adaptive model order, otherwise NULL */
+  FilterModel *_single_model;
+
+  /** Instance of Follow1T/2T/3T for _model, set by UpdateFilterModelType */
+  typedef int (Tractography::*FollowFunction)(const int, const size_t, const SeedPointInfo&, UKFFiber&, bool,
+                                              SeedWorkQueue&);
+  FollowFunction _follow;
+
+  /** Tracking threads, created on the first call to Run and reused afterwards */
+  TrackingThreadPool *_thread_pool;
 
   bool debug;
 };
@@ -5,25 +5,293 @@
 */
 
 #include "ukffiber.h"
+#include "thread.h"
+#include "roi_filter.h"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 
+namespace
+{
+/** Overwrites the points from target_begin on with the points [begin, end) of a column with width values per point */
+template <class TColumn>
+void CopyColumn(const TColumn& source, const size_t width, const size_t begin, const size_t end,
+                const bool reversed, TColumn& target, const size_t target_begin)
+{
+  if( target.empty() )
+    {
+    // Not recorded
+    return;
+    }
+  assert(source.size() >= end * width && target.size() >= (target_begin + end - begin) * width);
+  typename TColumn::iterator out = target.begin() + target_begin * width;
+  if( !reversed )
+    {
+    std::copy(source.begin() + begin * width, source.begin() + end * width, out);
+    }
+  else if( width == 1 )
+    {
+    std::reverse_copy(source.begin() + begin, source.begin() + end, out);
+    }
+  else
+    {
+    for( size_t i = end; i > begin; --i )
+      {
+      out = std::copy(source.begin() + (i - 1) * width, source.begin() + i * width, out);
+      }
+    }
+}
+
+template <class TColumn>
+void ResizeColumn(const TColumn& recorded, const size_t size, TColumn& column)
+{
+  if( !recorded.empty() )
+    {
+    column.resize(size);
+    }
+}
+
+/** Points [begin, end) of a half fiber or branch, which become part of a joined fiber */
+struct FiberPiece
+  {
+  const UKFFiber *fiber;
+  size_t begin;
+  size_t end;
+  bool reversed;
+  };
+
+/** A joined fiber, assembled from up to three pieces that are copied one after the other */
+struct FiberJoin
+  {
+  FiberPiece pieces[3];
+  int num_pieces;
+  size_t output_begin;
+  };
+
+/** The joins shared by the workers of the pool, which claim them in chunks */
+struct JoinWork
+  {
+  const std::vector<FiberJoin> *joins;
+  FiberArena *output;
+  std::atomic<size_t> next;
+  };
+
+/** Fibers claimed at once by a worker */
+const size_t JOIN_CHUNK_SIZE = 256;
+
+void AddPiece(FiberJoin& join, const UKFFiber& fiber, const size_t begin, const size_t end, const bool reversed)
+{
+  FiberPiece& piece = join.pieces[join.num_pieces++];
+  piece.fiber = &fiber;
+  piece.begin = begin;
+  piece.end = end;
+  piece.reversed = reversed;
+}
+
+void CopyJoins(const std::vector<FiberJoin>& joins, const size_t begin, const size_t end, FiberArena& output)
+{
+  for( size_t i = begin; i < end; ++i )
+    {
+    size_t target = joins[i].output_begin;
+    for( int j = 0; j < joins[i].num_pieces; ++j )
+      {
+      const FiberPiece& piece = joins[i].pieces[j];
+      output.CopyPoints(*piece.fiber->arena, piece.fiber->begin + piece.begin, piece.fiber->begin + piece.end,
+                        piece.reversed, target);
+      target += piece.end - piece.begin;
+      }
+    }
+}
+
+void JoinCallback(int, void *data)
+{
+  JoinWork&    work = *static_cast<JoinWork *>(data);
+  const size_t num_joins = work.joins->size();
+  for( ;; )
+    {
+    const size_t begin = work.next.fetch_add(JOIN_CHUNK_SIZE);
+    if( begin >= num_joins )
+      {
+      break;
+      }
+    CopyJoins(*work.joins, begin, std::min(begin + JOIN_CHUNK_SIZE, num_joins), *work.output);
+    }
+}
+
+/** Number of points of a joined fiber */
+size_t JoinSize(const FiberJoin& join)
+{
+  size_t size = 0;
+  for( int j = 0; j < join.num_pieces; ++j )
+    {
+    size += join.pieces[j].end - join.pieces[j].begin;
+    }
+  return size;
+}
+
+/** Position of point i of a joined fiber, read from the piece it will be copied from */
+const vec3_t & JoinPosition(const FiberJoin& join, size_t i)
+{
+  for( int j = 0; j + 1 < join.num_pieces; ++j )
+    {
+    const FiberPiece& piece = join.pieces[j];
+    if( i < piece.end - piece.begin )
+      {
+      return piece.fiber->position(piece.reversed ? piece.end - 1 - i : piece.begin + i);
+      }
+    i -= piece.end - piece.begin;
+    }
+  const FiberPiece& last = join.pieces[join.num_pieces - 1];
+  return last.fiber->position(last.reversed ? last.end - 1 - i : last.begin + i);
+}
+
+/** Whether a joined fiber passes through the include region and ends in the end region of roi */
+bool RoiAccepts(const RoiFilter& roi, const FiberJoin& join)
+{
+  const size_t size = JoinSize(join);
+  if( roi.IsSet(ROI_INCLUDE) )
+    {
+    size_t i = 0;
+    while( i < size && !roi.Contains(ROI_INCLUDE, JoinPosition(join, i) ) )
+      {
+      ++i;
+      }
+    if( i == size )
+      {
+      return false;
+      }
+    }
+  if( roi.IsSet(ROI_END) )
+    {
+    const size_t num_end_points = std::min(static_cast<size_t>(ROI_END_POINTS), size);
+    for( size_t i = 0; i < num_end_points; ++i )
+      {
+      if( roi.Contains(ROI_END, JoinPosition(join, i) ) || roi.Contains(ROI_END, JoinPosition(join, size - 1 - i) ) )
+        {
+        return true;
+        }
+      }
+    return false;
+    }
+  return true;
+}
+}
+
+bool ParseCovarianceMode(const std::string& name, CovarianceMode& mode)
+{
+  if( name == "packed" )
+    {
+    mode = COVARIANCE_PACKED;
+    }
+  else if( name == "diagonal" )
+    {
+    mode = COVARIANCE_DIAGONAL;
+    }
+  else
+    {
+    std::cout << "Unknown covariance mode " << name << std::endl;
+    return true;
+    }
+  return false;
+}
+
+void FiberArena::Clear(const int new_state_dim)
+{
+  state_dim = new_state_dim;
+  position.clear();
+  fa.clear();
+  fa2.clear();
+  norm.clear();
+  state.clear();
+  covariance.clear();
+  covariance_float.clear();
+  free_water.clear();
+  normMSE.clear();
+  trace.clear();
+  trace2.clear();
+}
+
+void FiberArena::RecordCovariance(const ukfMatrixType& p)
+{
+  assert(p.rows() == state_dim && p.cols() == state_dim);
+  for( int r = 0; r < state_dim; ++r )
+    {
+    const int end = covariance_mode == COVARIANCE_DIAGONAL ? r + 1 : state_dim;
+    for( int c = r; c < end; ++c )
+      {
+      if( covariance_single )
+        {
+        covariance_float.push_back(static_cast<float>(p(r, c) ) );
+        }
+      else
+        {
+        covariance.push_back(p(r, c) );
+        }
+      }
+    }
+}
+
+void FiberArena::Resize(const size_t num_points, const FiberArena& columns)
+{
+  assert(columns.state_dim == state_dim && columns.covariance_mode == covariance_mode);
+  const size_t dim = static_cast<size_t>(state_dim);
+  const size_t cov_size = static_cast<size_t>(CovarianceSize() );
+
+  // position is always recorded
+  position.resize(num_points);
+  ResizeColumn(columns.fa, num_points, fa);
+  ResizeColumn(columns.fa2, num_points, fa2);
+  ResizeColumn(columns.norm, num_points, norm);
+  ResizeColumn(columns.state, num_points * dim, state);
+  ResizeColumn(columns.covariance, num_points * cov_size, covariance);
+  ResizeColumn(columns.covariance_float, num_points * cov_size, covariance_float);
+  ResizeColumn(columns.free_water, num_points, free_water);
+  ResizeColumn(columns.normMSE, num_points, normMSE);
+  ResizeColumn(columns.trace, num_points, trace);
+  ResizeColumn(columns.trace2, num_points, trace2);
+}
+
+void FiberArena::CopyPoints(const FiberArena& source, const size_t begin, const size_t end, const bool reversed,
+                            const size_t target_begin)
+{
+  assert(source.state_dim == state_dim && source.covariance_mode == covariance_mode);
+  assert(begin <= end && end <= source.NumberOfPoints() );
+  assert(target_begin + end - begin <= NumberOfPoints() );
+  const size_t dim = static_cast<size_t>(state_dim);
+  const size_t cov_size = static_cast<size_t>(CovarianceSize() );
+
+  CopyColumn(source.position, 1, begin, end, reversed, position, target_begin);
+  CopyColumn(source.fa, 1, begin, end, reversed, fa, target_begin);
+  CopyColumn(source.fa2, 1, begin, end, reversed, fa2, target_begin);
+  CopyColumn(source.norm, 1, begin, end, reversed, norm, target_begin);
+  CopyColumn(source.state, dim, begin, end, reversed, state, target_begin);
+  CopyColumn(source.covariance, cov_size, begin, end, reversed, covariance, target_begin);
+  CopyColumn(source.covariance_float, cov_size, begin, end, reversed, covariance_float, target_begin);
+  CopyColumn(source.free_water, 1, begin, end, reversed, free_water, target_begin);
+  CopyColumn(source.normMSE, 1, begin, end, reversed, normMSE, target_begin);
+  CopyColumn(source.trace, 1, begin, end, reversed, trace, target_begin);
+  CopyColumn(source.trace2, 1, begin, end, reversed, trace2, target_begin);
+}
+
 void PostProcessFibers( const std::vector<UKFFiber>& raw_primary,
                         const std::vector<UKFFiber>& raw_branch,
                         const std::vector<BranchingSeedAffiliation>& branching_seed_affiliation,
                         const bool branches_only,
-                        std::vector<UKFFiber>& fibers)
+                        FiberArena& output_arena,
+                        std::vector<UKFFiber>& fibers,
+                        TrackingThreadPool *thread_pool,
+                        const RoiFilter *roi)
 {
-  assert(fibers.empty() );
   const int num_half_fibers = static_cast<int>(raw_primary.size() );
   assert( (num_half_fibers > 0) && (num_half_fibers % 2 == 0) );
-  // if Noddi model is used Kappa is stored in trace, Vic in fa and Viso in freewater
-  const bool record_fa = !raw_primary[0].fa.empty();
-  const bool record_fa2 = !raw_primary[0].fa2.empty();
-  const bool record_trace = !raw_primary[0].trace.empty();
-  const bool record_trace2 = !raw_primary[0].trace2.empty();
-  const bool record_free_water = !raw_primary[0].free_water.empty();
-  const bool record_normMSE = !raw_primary[0].normMSE.empty();
-  const bool record_cov = !raw_primary[0].covariance.empty();
+  // if Noddi model is used Kappa is stored in trace, Vic in fa and Viso in freewater.
+  // The recorded columns are the same in all arenas, so the output records the same ones.
+  if( output_arena.NumberOfPoints() == 0 )
+    {
+    output_arena.Clear(raw_primary[0].arena->state_dim);
+    output_arena.covariance_mode = raw_primary[0].arena->covariance_mode;
+    output_arena.covariance_single = raw_primary[0].arena->covariance_single;
+    }
 
   const int num_primary_fibers = branches_only ? 0 : num_half_fibers / 2;
   const int num_branches = static_cast<int>(raw_branch.size() );
@@ -36,7 +304,7 @@ void PostProcessFibers( const std::vector<UKFFiber>& raw_primary,
   for( int i = 0; i < num_primary_fibers; i++ )
     {
     num_points_on_primary_fiber[i] =
-      static_cast<int>(raw_primary[2 * i].position.size() + raw_primary[2 * i + 1].position.size() ) - 1;
+      static_cast<int>(raw_primary[2 * i].size() + raw_primary[2 * i + 1].size() ) - 1;
     // The two fibers share the same seed point
     }
   // Compute the numbers of points on full branches
@@ -47,50 +315,25 @@ void PostProcessFibers( const std::vector<UKFFiber>& raw_primary,
 
     if( fiber_index % 2 == 0 )
       {
-      num_points_on_branch[i] = static_cast<int>(raw_primary[fiber_index + 1].position.size()
-                                                 + raw_branch[i].position.size() )
+      num_points_on_branch[i] = static_cast<int>(raw_primary[fiber_index + 1].size()
+                                                 + raw_branch[i].size() )
         + position_on_fiber - 1;
       }
     else
       {
-      num_points_on_branch[i] = static_cast<int>(raw_primary[fiber_index - 1].position.size()
-                                                 + raw_branch[i].position.size() )
+      num_points_on_branch[i] = static_cast<int>(raw_primary[fiber_index - 1].size()
+                                                 + raw_branch[i].size() )
         + position_on_fiber - 1;
       }
     }
 
-  // Compute the number of valid full primary fibers and the number of valid full branches
-  int num_valid_primary_fibers = 0;
-  int num_valid_branch = 0;
+  // Plan the valid full primary fibers and the valid full branches. The prefix sum over their numbers of points
+  // gives the position of every fiber in the output, so the points can be copied independently.
+  std::vector<FiberJoin> joins;
+  joins.reserve(num_primary_fibers + num_branches);
+  size_t num_output_points = output_arena.NumberOfPoints();
   for( int i = 0; i < num_primary_fibers; i++ )
     {
-    if( num_points_on_primary_fiber[i] >= MINIMUM_NUM_POINTS_ON_FIBER )
-      {
-      num_valid_primary_fibers++;
-      }
-    }
-  for( int i = 0; i < num_branches; i++ )
-    {
-    const size_t fiber_index = branching_seed_affiliation[i].fiber_index_;
-    const int    position_on_fiber = branching_seed_affiliation[i].position_on_fiber_;
-
-    if( (num_points_on_branch[i] >= MINIMUM_NUM_POINTS_ON_FIBER) &&
-        (position_on_fiber + FIBER_TAIL_THRESHOLD < static_cast<int>(raw_primary[fiber_index].position.size() ) )
-        // NOTE that when a branch originates near the end of a primary fiber, it's very probable that this branch
-        // will contain lots of error, so this kind of branch is deemed as invalid
-        )
-      {
-      num_valid_branch++;
-      }
-    }
-
-  fibers.resize(num_valid_primary_fibers + num_valid_branch);
-
-  // Join half fibers to full fibers
-  int counter = 0;
-  for( int i = 0; i < num_primary_fibers; i++ )
-    {
-
     if( num_points_on_primary_fiber[i] < MINIMUM_NUM_POINTS_ON_FIBER )
       {
       continue;
@@ -98,130 +341,37 @@ void PostProcessFibers( const std::vector<UKFFiber>& raw_primary,
 
     const UKFFiber& first_half = raw_primary[2 * i];
     const UKFFiber& second_half = raw_primary[2 * i + 1];
-
-    fibers[counter].position.resize(num_points_on_primary_fiber[i]);
-    if( record_fa )
-      {
-      fibers[counter].fa.resize(num_points_on_primary_fiber[i]);
-      }
-    if( record_fa2 )
-      {
-      fibers[counter].fa2.resize(num_points_on_primary_fiber[i]);
-      }
-    if( record_trace )
+    if( first_half.excluded || second_half.excluded )
       {
-      fibers[counter].trace.resize(num_points_on_primary_fiber[i]);
-      }
-    if( record_trace2 )
-      {
-      fibers[counter].trace2.resize(num_points_on_primary_fiber[i]);
-      }
-    if( record_free_water )
-      {
-      fibers[counter].free_water.resize(num_points_on_primary_fiber[i]);
-      }
-    if( record_normMSE )
-      {
-      fibers[counter].normMSE.resize(num_points_on_primary_fiber[i]);
-      }
-    fibers[counter].norm.resize(num_points_on_primary_fiber[i]);
-    fibers[counter].state.resize(num_points_on_primary_fiber[i]);
-    if( record_cov )
-      {
-      fibers[counter].covariance.resize(num_points_on_primary_fiber[i]);
+      continue;
       }
 
-    int k = 0;
+    FiberJoin join;
+    join.num_pieces = 0;
+    join.output_begin = num_output_points;
     // The first point in the first_half, namely the seed point in the first half, is excluded
-    for( int j = static_cast<int>(first_half.position.size() ) - 1; j > 0; j-- )
+    AddPiece(join, first_half, 1, first_half.size(), true);
+    AddPiece(join, second_half, 0, second_half.size(), false);
+    if( roi && roi->ChecksJoinedFibers() && !RoiAccepts(*roi, join) )
       {
-      fibers[counter].position[k] = first_half.position[j];
-      if( record_fa )
-        {
-        fibers[counter].fa[k] = first_half.fa[j];
-        }
-      if( record_fa2 )
-        {
-        fibers[counter].fa2[k] = first_half.fa2[j];
-        }
-      if( record_trace )
-        {
-        fibers[counter].trace[k] = first_half.trace[j];
-        }
-      if( record_trace2 )
-        {
-        fibers[counter].trace2[k] = first_half.trace2[j];
-        }
-      if( record_free_water )
-        {
-        fibers[counter].free_water[k] = first_half.free_water[j];
-        }
-      if( record_normMSE )
-        {
-        fibers[counter].normMSE[k] = first_half.normMSE[j];
-        }
-      fibers[counter].norm[k] = first_half.norm[j];
-      fibers[counter].state[k] = first_half.state[j];
-      if( record_cov )
-        {
-        fibers[counter].covariance[k] = first_half.covariance[j];
-        }
-      k++;
-      }
-    for( int j = 0; j < static_cast<int>(second_half.position.size() ); j++ )
-      {
-      fibers[counter].position[k] = second_half.position[j];
-      if( record_fa )
-        {
-        fibers[counter].fa[k] = second_half.fa[j];
-        }
-      if( record_fa2 )
-        {
-        fibers[counter].fa2[k] = second_half.fa2[j];
-        }
-      if( record_trace )
-        {
-        fibers[counter].trace[k] = second_half.trace[j];
-        }
-      if( record_trace2 )
-        {
-        fibers[counter].trace2[k] = second_half.trace2[j];
-        }
-      if( record_free_water )
-        {
-        fibers[counter].free_water[k] = second_half.free_water[j];
-        }
-      if( record_normMSE )
-        {
-        fibers[counter].normMSE[k] = second_half.normMSE[j];
-        }
-      fibers[counter].norm[k] = second_half.norm[j];
-      fibers[counter].state[k] = second_half.state[j];
-      if( record_cov )
-        {
-        fibers[counter].covariance[k] = second_half.covariance[j];
-        }
-      k++;
+      continue;
       }
+    joins.push_back(join);
 
-    assert(k == num_points_on_primary_fiber[i]);
-
-    counter++;
+    num_output_points += num_points_on_primary_fiber[i];
     }
 
-  assert(counter == num_valid_primary_fibers);
   // Backtrace the branches
   for( int i = 0; i < num_branches; i++ )
     {
-
-    if( num_points_on_branch[i] < MINIMUM_NUM_POINTS_ON_FIBER )
-      {
-      continue;
-      }
-
     const size_t fiber_index = branching_seed_affiliation[i].fiber_index_;
     const int    position_on_fiber = branching_seed_affiliation[i].position_on_fiber_;
-    if( position_on_fiber + FIBER_TAIL_THRESHOLD >= static_cast<int>(raw_primary[fiber_index].position.size() ) )
+
+    if( (num_points_on_branch[i] < MINIMUM_NUM_POINTS_ON_FIBER) ||
+        (position_on_fiber + FIBER_TAIL_THRESHOLD >= static_cast<int>(raw_primary[fiber_index].size() ) )
+        // NOTE that when a branch originates near the end of a primary fiber, it's very probable that this branch
+        // will contain lots of error, so this kind of branch is deemed as invalid
+        )
       {
       continue;
       }
@@ -242,152 +392,67 @@ void PostProcessFibers( const std::vector<UKFFiber>& raw_primary,
     const UKFFiber& first_half = raw_primary[first_half_index];
     const UKFFiber& second_half = raw_primary[second_half_index];
     const UKFFiber& branch = raw_branch[i];  // This is the un-back-traced branch
-
-    fibers[counter].position.resize(num_points_on_branch[i]);
-    if( record_fa )
-      {
-      fibers[counter].fa.resize(num_points_on_branch[i]);
-      }
-    if( record_fa2 )
-      {
-      fibers[counter].fa2.resize(num_points_on_branch[i]);
-      }
-    if( record_trace )
-      {
-      fibers[counter].trace.resize(num_points_on_branch[i]);
-      }
-    if( record_trace2 )
-      {
-      fibers[counter].trace2.resize(num_points_on_branch[i]);
-      }
-    if( record_free_water )
-      {
-      fibers[counter].free_water.resize(num_points_on_branch[i]);
-      }
-    if( record_normMSE )
-      {
-      fibers[counter].normMSE.resize(num_points_on_branch[i]);
-      }
-    fibers[counter].norm.resize(num_points_on_branch[i]);
-    fibers[counter].state.resize(num_points_on_branch[i]);
-    if( record_cov )
+    // Only the part of the second_half before the branch is used, which never entered the exclude region
+    if( first_half.excluded || branch.excluded )
       {
-      fibers[counter].covariance.resize(num_points_on_branch[i]);
+      continue;
       }
 
-    int k = 0;
+    FiberJoin join;
+    join.num_pieces = 0;
+    join.output_begin = num_output_points;
     // The first point in the first_half, namely the seed point in the first half, is excluded
-    for( int j = static_cast<int>(first_half.position.size() ) - 1; j > 0; j-- )
-      {
-      fibers[counter].position[k] = first_half.position[j];
-      if( record_fa )
-        {
-        fibers[counter].fa[k] = first_half.fa[j];
-        }
-      if( record_fa2 )
-        {
-        fibers[counter].fa2[k] = first_half.fa2[j];
-        }
-      if( record_trace )
-        {
-        fibers[counter].trace[k] = first_half.trace[j];
-        }
-      if( record_trace2 )
-        {
-        fibers[counter].trace2[k] = first_half.trace2[j];
-        }
-      if( record_free_water )
-        {
-        fibers[counter].free_water[k] = first_half.free_water[j];
-        }
-      if( record_normMSE )
-        {
-        fibers[counter].normMSE[k] = first_half.normMSE[j];
-        }
-      fibers[counter].norm[k] = first_half.norm[j];
-      fibers[counter].state[k] = first_half.state[j];
-      if( record_cov )
-        {
-        fibers[counter].covariance[k] = first_half.covariance[j];
-        }
-      k++;
-      }
+    AddPiece(join, first_half, 1, first_half.size(), true);
     // The point in the second_half where the branch originates is also excluded
-    for( int j = 0; j < position_on_fiber; j++ )
-      {
-      fibers[counter].position[k] = second_half.position[j];
-      if( record_fa )
-        {
-        fibers[counter].fa[k] = second_half.fa[j];
-        }
-      if( record_fa2 )
-        {
-        fibers[counter].fa2[k] = second_half.fa2[j];
-        }
-      if( record_trace )
-        {
-        fibers[counter].trace[k] = second_half.trace[j];
-        }
-      if( record_trace2 )
-        {
-        fibers[counter].trace2[k] = second_half.trace2[j];
-        }
-      if( record_free_water )
-        {
-        fibers[counter].free_water[k] = second_half.free_water[j];
-        }
-      if( record_normMSE )
-        {
-        fibers[counter].normMSE[k] = second_half.normMSE[j];
-        }
-      fibers[counter].norm[k] = second_half.norm[j];
-      fibers[counter].state[k] = second_half.state[j];
-      if( record_cov )
-        {
-        fibers[counter].covariance[k] = second_half.covariance[j];
-        }
-      k++;
-      }
-    for( int j = 0; j < static_cast<int>(branch.position.size() ); j++ )
+    AddPiece(join, second_half, 0, position_on_fiber, false);
+    AddPiece(join, branch, 0, branch.size(), false);
+    if( roi && roi->ChecksJoinedFibers() && !RoiAccepts(*roi, join) )
       {
-      fibers[counter].position[k] = branch.position[j];
-      if( record_fa )
-        {
-        fibers[counter].fa[k] = branch.fa[j];
-        }
-      if( record_fa2 )
-        {
-        fibers[counter].fa2[k] = branch.fa2[j];
-        }
-      if( record_trace )
-        {
-        fibers[counter].trace[k] = branch.trace[j];
-        }
-      if( record_trace2 )
-        {
-        fibers[counter].trace2[k] = branch.trace2[j];
-        }
-      if( record_free_water )
-        {
-        fibers[counter].free_water[k] = branch.free_water[j];
-        }
-      if( record_normMSE )
-        {
-        fibers[counter].normMSE[k] = branch.normMSE[j];
-        }
-      fibers[counter].norm[k] = branch.norm[j];
-      fibers[counter].state[k] = branch.state[j];
-      if( record_cov )
-        {
-        fibers[counter].covariance[k] = branch.covariance[j];
-        }
-      k++;
+      continue;
       }
+    joins.push_back(join);
 
-    assert(k == num_points_on_branch[i]);
+    num_output_points += num_points_on_branch[i];
+    }
 
-    counter++;
+  if( joins.empty() )
+    {
+    return;
     }
 
-  assert(counter == num_valid_primary_fibers + num_valid_branch);
+  const size_t num_previous_fibers = fibers.size();
+  fibers.resize(num_previous_fibers + joins.size() );
+  for( size_t i = 0; i < joins.size(); ++i )
+    {
+    UKFFiber& fiber = fibers[num_previous_fibers + i];
+    fiber.arena = &output_arena;
+    fiber.begin = joins[i].output_begin;
+    fiber.length = (i + 1 < joins.size() ? joins[i + 1].output_begin : num_output_points) - fiber.begin;
+    assert(static_cast<int>(fiber.length) >= MINIMUM_NUM_POINTS_ON_FIBER);
+    }
+  // Sizing the output once avoids reallocation while the fibers are copied. An arena holding points has every
+  // recorded column filled, so it tells which columns the output needs.
+  const FiberArena *recorded_columns = &output_arena;
+  for( int j = 0; output_arena.NumberOfPoints() == 0 && j < joins[0].num_pieces; ++j )
+    {
+    if( joins[0].pieces[j].fiber->size() > 0 )
+      {
+      recorded_columns = joins[0].pieces[j].fiber->arena;
+      break;
+      }
+    }
+  output_arena.Resize(num_output_points, *recorded_columns);
+
+  if( thread_pool && thread_pool->GetNumberOfThreads() > 1 && joins.size() > JOIN_CHUNK_SIZE )
+    {
+    JoinWork work;
+    work.joins = &joins;
+    work.output = &output_arena;
+    work.next = 0;
+    thread_pool->Execute(JoinCallback, &work);
+    }
+  else
+    {
+    CopyJoins(joins, 0, joins.size(), output_arena);
+    }
 }
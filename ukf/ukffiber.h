@@ -7,21 +7,85 @@
 #ifndef UKFFIBER_H_
 #define UKFFIBER_H_
 
+#include <string>
 #include <vector>
 #include <cassert>
 #include "unscented_kalman_filter.h"
 #include "linalg.h"
 
+class TrackingThreadPool;
+class RoiFilter;
+
+/** Read-only view of the state recorded at one point of a fiber */
+typedef Eigen::Map<const State> StateView;
+
+/** Part of the state covariance that is recorded at every point */
+enum CovarianceMode
+  {
+  COVARIANCE_PACKED,  // The upper triangle, row by row, state_dim * (state_dim + 1) / 2 values
+  COVARIANCE_DIAGONAL // The variances, state_dim values
+  };
+
+/** Converts "packed" or "diagonal" to a CovarianceMode. Returns true on failure. */
+bool ParseCovarianceMode(const std::string& name, CovarianceMode& mode);
+
 /**
- * \struct UKFFiber
- * \brief Points of a fiber, and scalars corresponding to the points
+ * \struct FiberArena
+ * \brief Points of many fibers, stored as one flat column per recorded value
  *
- * The points that make a fiber are defined as a vector of 3D points. In addition
- * there is a vector of scalar values for each scalar value that can be recorded
- * of the same length
+ * Every tracking thread owns an arena and appends the points of the fibers it traces to the end of it, so
+ * recording a point only ever appends to a few vectors that keep their capacity between runs. The state and
+ * the covariance are stored flat as well, with state_dim and CovarianceSize() values per point. Columns that are
+ * not recorded stay empty.
 */
-struct UKFFiber
+struct FiberArena
+  {
+  FiberArena() : state_dim(0), covariance_mode(COVARIANCE_PACKED), covariance_single(false)
+  {
+  }
+
+  /** Removes all points but keeps the allocated memory and the way the covariance is recorded */
+  void Clear(const int new_state_dim);
+
+  size_t NumberOfPoints() const
+  {
+    return position.size();
+  }
+
+  /** Number of covariance values recorded per point */
+  int CovarianceSize() const
+  {
+    return covariance_mode == COVARIANCE_DIAGONAL ? state_dim : (state_dim * (state_dim + 1) ) / 2;
+  }
+
+  bool HasCovariance() const
   {
+    return !covariance.empty() || !covariance_float.empty();
+  }
+
+  /** Appends the part of the state_dim x state_dim covariance p selected by covariance_mode */
+  void RecordCovariance(const ukfMatrixType& p);
+
+  /**
+   * Sets the number of points to num_points. Only the columns that are recorded in columns, which may be this
+   * arena, are resized; the others are left empty.
+  */
+  void Resize(const size_t num_points, const FiberArena& columns);
+
+  /**
+   * Overwrites the points starting at target_begin with the points [begin, end) of a fiber stored in another
+   * arena, or with them in reverse order if reversed is set. Both arenas must record the same columns. Copies
+   * to disjoint ranges of points may run concurrently.
+  */
+  void CopyPoints(const FiberArena& source, const size_t begin, const size_t end, const bool reversed,
+                  const size_t target_begin);
+
+  /** Number of values of the state vector recorded per point */
+  int state_dim;
+  /** Part of the covariance that RecordCovariance stores */
+  CovarianceMode covariance_mode;
+  /** Whether RecordCovariance stores to covariance_float instead of covariance */
+  bool covariance_single;
 
   /** vector of 3D points defining the fiber path */
   stdVec_t position;
@@ -31,10 +95,12 @@ struct UKFFiber
   std::vector<ukfPrecisionType> fa2;
   /** Array 2 norm of the covariance matrix */
   std::vector<ukfPrecisionType> norm;
-  /** State of the current model at the current position*/
-  std::vector<State> state;
-  /** dim(state) x dim(state) matrix */
-  std::vector<ukfMatrixType > covariance;
+  /** State of the current model at the current position, state_dim values per point */
+  std::vector<ukfPrecisionType> state;
+  /** CovarianceSize() values of the covariance matrix per point */
+  std::vector<ukfPrecisionType> covariance;
+  /** The same in single precision, recorded instead of covariance if covariance_single is set */
+  std::vector<float> covariance_float;
   /** Percentage of free water i.e. 1-w */
   std::vector<ukfPrecisionType> free_water;
   /** Normalized mean squared error of the signal reconstruction to the signal */
@@ -45,6 +111,95 @@ struct UKFFiber
   std::vector<ukfPrecisionType> trace2;
   };
 
+/**
+ * \struct UKFFiber
+ * \brief Points of a fiber, and scalars corresponding to the points
+ *
+ * A fiber is a range of consecutive points in a FiberArena. It is only valid as long as the arena is not
+ * cleared; appending to the arena, also from other fibers, does not invalidate it.
+*/
+struct UKFFiber
+  {
+  UKFFiber() : arena(NULL), begin(0), length(0), excluded(false)
+  {
+  }
+
+  /** Starts an empty fiber at the end of an arena, the points recorded next belong to it */
+  void Start(FiberArena *fiber_arena)
+  {
+    arena = fiber_arena;
+    begin = fiber_arena->NumberOfPoints();
+    length = 0;
+    excluded = false;
+  }
+
+  size_t size() const
+  {
+    return length;
+  }
+
+  const vec3_t & position(const size_t i) const
+  {
+    return arena->position[begin + i];
+  }
+
+  ukfPrecisionType fa(const size_t i) const
+  {
+    return arena->fa[begin + i];
+  }
+
+  ukfPrecisionType fa2(const size_t i) const
+  {
+    return arena->fa2[begin + i];
+  }
+
+  ukfPrecisionType norm(const size_t i) const
+  {
+    return arena->norm[begin + i];
+  }
+
+  StateView state(const size_t i) const
+  {
+    return StateView(&arena->state[(begin + i) * arena->state_dim], arena->state_dim);
+  }
+
+  /** Covariance value k of point i, in the layout of the arena's covariance_mode */
+  ukfPrecisionType covariance(const size_t i, const int k) const
+  {
+    const size_t index = (begin + i) * arena->CovarianceSize() + k;
+    return arena->covariance_single ? arena->covariance_float[index] : arena->covariance[index];
+  }
+
+  ukfPrecisionType free_water(const size_t i) const
+  {
+    return arena->free_water[begin + i];
+  }
+
+  ukfPrecisionType normMSE(const size_t i) const
+  {
+    return arena->normMSE[begin + i];
+  }
+
+  ukfPrecisionType trace(const size_t i) const
+  {
+    return arena->trace[begin + i];
+  }
+
+  ukfPrecisionType trace2(const size_t i) const
+  {
+    return arena->trace2[begin + i];
+  }
+
+  /** The arena holding the points */
+  FiberArena *arena;
+  /** Index of the first point in the arena */
+  size_t begin;
+  /** Number of points */
+  size_t length;
+  /** Set if the fiber was stopped on entering the ROI_EXCLUDE region, the fibers joined from it are rejected */
+  bool excluded;
+  };
+
 /**
  * \struct BranchingSeedAffiliation
  * \brief Which fibers belong together
@@ -54,6 +209,7 @@ struct UKFFiber
 struct BranchingSeedAffiliation
   {
   size_t fiber_index_;
+  /** Number of points recorded on the primary fiber when the branch was found */
   int position_on_fiber_;
   };
 
@@ -61,11 +217,17 @@ struct BranchingSeedAffiliation
  * \brief Joins two fibers originating from the same seed point
  *
  * A pair of two primary fibers are started from each seed point in two opposite directions. This functions joins them up pairly to
- * form complete primary fibers, and eliminates fibers that are too short. Besides, each branch is back traced to form a whole fiber
+ * form complete primary fibers, and eliminates fibers that are too short. Besides, each branch is back traced to form a whole fiber.
+ * The resulting fibers are appended to fibers and their points, consecutively and in the same order, to output_arena.
+ * The output is sized once from the number of points on every fiber, after which the points are copied in place,
+ * in parallel on the workers of thread_pool if one is given.
+ * Joined fibers with an excluded piece are rejected, and so are those that do not pass the include and the end
+ * region of roi, if one is given. The rejected fibers are never copied.
 */
 void PostProcessFibers( const std::vector<UKFFiber>& raw_primary, const std::vector<UKFFiber>& raw_branch,
                         const std::vector<BranchingSeedAffiliation>& branching_seed_affiliation,
-                        const bool branches_only, std::vector<UKFFiber>& fibers);
+                        const bool branches_only, FiberArena& output_arena, std::vector<UKFFiber>& fibers,
+                        TrackingThreadPool *thread_pool = NULL, const RoiFilter *roi = NULL);
 
 /** The minimum number of points on a fiber. UKFFiber with fewer points are rejected */
 const int MINIMUM_NUM_POINTS_ON_FIBER = 10;
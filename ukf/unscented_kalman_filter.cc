@@ -19,7 +19,7 @@ using namespace QuadProgPP;
 //using namespace LU_Solver;
 
 UnscentedKalmanFilter::UnscentedKalmanFilter(FilterModel *filter_model)
-  : m_FilterModel(filter_model), m_SigmaPointSpread(0.01)
+  : m_FilterModel(filter_model), m_SigmaPointSpread(0.01), m_NumberOfQPSolves(0)
 {
   const unsigned int dim = m_FilterModel->state_dim();
 
@@ -86,6 +86,7 @@ void UnscentedKalmanFilter::Constrain(ukfVectorType& x, const ukfMatrixType& W)
     // The equality constraints are just dummy variables. The solve_quadprog function has been changed
     // to ignore equality constraints.
     const ukfPrecisionType error = solve_quadprog(W_tmp, g0, m_DummyZeroCE, m_DummyZeroce0, D, d, x);
+    ++m_NumberOfQPSolves;
     if( error > 0.01 )   // error usually much smaller than that, if solve_quadprog fails it returns inf
       {
       throw std::logic_error("solve_quadprog error exceeds threshold 0.01!");
@@ -144,7 +145,8 @@ void UnscentedKalmanFilter::Filter(const State& x,
   const int signal_dim = localConstFilterModel->signal_dim();
 
   /** The state spread out according to the unscented transform */
-  ukfMatrixType X(dim, 2 * dim + 1);
+  ukfMatrixType& X = m_X;
+  X.resize(dim, 2 * dim + 1); // no-op unless the model changed
   X.setConstant(ukfZero);
   // Create sigma points.
   SigmaPoints(x, p, X); // doesnt change p, its const
@@ -167,7 +169,8 @@ void UnscentedKalmanFilter::Filter(const State& x,
   // std::cout<<"recorded signal: "<<z_Eigen;
 
   /** Used for the estimation of the new state */
-  ukfMatrixType dim_dimext(dim, 2 * dim + 1);
+  ukfMatrixType& dim_dimext = m_DimDimext;
+  dim_dimext.resize(dim, 2 * dim + 1);
   dim_dimext.setConstant(ukfZero);
   // std::cout << "\n X:"<<X <<"\n Weigths" << this->m_Weights;
   const ukfVectorType X_hat = X * this->m_Weights;
@@ -187,12 +190,14 @@ void UnscentedKalmanFilter::Filter(const State& x,
   const ukfMatrixType yhat = Yk * X_hat;
   // std::cout << "\n P: " << p_new << "\n yhat: " << yhat <<"\n Q: "<<Q;
   // exit(1);
-  ukfMatrixType Z(signal_dim, 2 * dim + 1);
+  ukfMatrixType& Z = m_Z;
+  Z.resize(signal_dim, 2 * dim + 1);
   Z.setConstant(ukfZero);
   localConstFilterModel->H(X, Z);
   /** Used for the estimation of the signal */
 
-  ukfMatrixType     signaldim_dimext(signal_dim, 2 * dim + 1);
+  ukfMatrixType& signaldim_dimext = m_SignalDimDimext;
+  signaldim_dimext.resize(signal_dim, 2 * dim + 1);
   signaldim_dimext.setConstant(ukfZero);
   const ukfVectorType Z_hat = Z * this->m_Weights;
   for( unsigned int i = 0; i < signaldim_dimext.cols(); ++i )
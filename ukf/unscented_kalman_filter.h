@@ -8,6 +8,7 @@
 #ifndef UNSCENTED_KALMAN_FILTER_H_
 #define UNSCENTED_KALMAN_FILTER_H_
 
+#include <stdint.h>
 #include <vector>
 #include "ukf_types.h"
 
@@ -41,7 +42,12 @@ public:
   void Filter(const State& x, const ukfMatrixType& p, const ukfVectorType& z, // This is the signal
               State& x_new, ukfMatrixType& p_new, ukfPrecisionType& dNormMSE);
 
-private:
+  /** Number of quadratic programs solved to constrain the states since the filter was created */
+  uint64_t GetNumberOfQPSolves() const
+  {
+    return m_NumberOfQPSolves;
+  }
+
   /** Spreads the points around the current state using the covariance. */
   void SigmaPoints(const State& x, const ukfMatrixType& p, ukfMatrixType& x_spread);
 
@@ -53,6 +59,7 @@ private:
   */
   void Constrain(ukfMatrixType& X, const ukfMatrixType& W);
 
+private:
   /**
    * \brief Contrains the state vector
    * \param X The state vector which will be constrained.
@@ -84,6 +91,15 @@ private:
   //DUMMY VARIABLES TAHT ARE ALWAYS ZERO and not used.
   ukfMatrixType m_DummyZeroCE;
   ukfVectorType m_DummyZeroce0;
+
+  /** Work matrices of Filter(). Every thread owns its own filter, so they are reused from step to step and
+   * from run to run instead of being allocated on each call. */
+  ukfMatrixType m_X;
+  ukfMatrixType m_Z;
+  ukfMatrixType m_DimDimext;
+  ukfMatrixType m_SignalDimDimext;
+
+  uint64_t m_NumberOfQPSolves;
 };
 
 #endif  // UNSCENTED_KALMAN_FILTER_H_
@@ -70,10 +70,8 @@ ukfPrecisionType s2adc(const ukfMatrixType& signal)
 }
 
 
-ukfPrecisionType curve_radius(const stdVec_t& fiber)
+ukfPrecisionType curve_radius(const vec3_t *fiber, const size_t length)
 {
-  size_t length = fiber.size();
-
   if( length < 3 )
     {
     return ukfOne;
@@ -24,8 +24,8 @@ ukfPrecisionType s2ga(const ukfMatrixType& signal);
 /** Calculate Generalized anisotropy from signal */
 ukfPrecisionType s2adc(const ukfMatrixType& signal);
 
-/** Calculate curve radius from fiber */
-ukfPrecisionType curve_radius(const stdVec_t& fiber);
+/** Calculate curve radius at the last of the length consecutive points of a fiber */
+ukfPrecisionType curve_radius(const vec3_t *fiber, const size_t length);
 
 // special case for real x
 double dawsonf(double kappa);
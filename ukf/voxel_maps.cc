@@ -0,0 +1,229 @@
+/**
+ * \file voxel_maps.cc
+ * \brief implementation of voxel_maps.h
+*/
+
+#include "voxel_maps.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <teem/nrrd.h>
+
+void GetVoxelMapScalars(const bool noddi, std::vector<VoxelMapScalar>& scalars)
+{
+  const VoxelMapScalar all[] =
+    {
+      { "EstimatedUncertainty", &FiberArena::norm },
+      { noddi ? "Vic1" : "FA1", &FiberArena::fa },
+      { noddi ? "Vic2" : "FA2", &FiberArena::fa2 },
+      { noddi ? "OrientationDispersionIndex1" : "trace1", &FiberArena::trace },
+      { noddi ? "OrientationDispersionIndex2" : "trace2", &FiberArena::trace2 },
+      { noddi ? "Viso" : "FreeWater", &FiberArena::free_water },
+      { "NormalizedSignalEstimationError", &FiberArena::normMSE }
+    };
+  scalars.assign(all, all + sizeof(all) / sizeof(all[0]) );
+}
+
+VoxelMapAccumulator::VoxelMapAccumulator() : _nx(0), _ny(0), _nz(0), _num_fibers(0)
+{
+}
+
+void VoxelMapAccumulator::Reset(const vec3_t& dim, const std::vector<VoxelMapScalar>& scalars)
+{
+  _nx = static_cast<int>(dim[0]);
+  _ny = static_cast<int>(dim[1]);
+  _nz = static_cast<int>(dim[2]);
+  _scalars = scalars;
+  _recorded.assign(scalars.size(), false);
+  _slots.clear();
+  _voxels.clear();
+  _fibers.clear();
+  _points.clear();
+  _last_fiber.clear();
+  _sums.clear();
+  _num_fibers = 0;
+}
+
+size_t VoxelMapAccumulator::Slot(const uint64_t voxel)
+{
+  std::pair<std::unordered_map<uint64_t, size_t>::iterator, bool> inserted =
+    _slots.insert(std::make_pair(voxel, _voxels.size() ) );
+  if( inserted.second )
+    {
+    _voxels.push_back(voxel);
+    _fibers.push_back(0);
+    _points.push_back(0);
+    _last_fiber.push_back(0);
+    _sums.resize(_sums.size() + 2 * _scalars.size(), 0.0);
+    }
+  return inserted.first->second;
+}
+
+void VoxelMapAccumulator::AddFiber(const UKFFiber& fiber)
+{
+  if( fiber.size() == 0 )
+    {
+    return;
+    }
+  // Fibers are numbered from 1, so that 0 marks a voxel no fiber was counted in yet
+  const uint64_t fiber_id = ++_num_fibers;
+
+  const FiberArena& arena = *fiber.arena;
+  std::vector<const ukfPrecisionType *> columns(_scalars.size(), static_cast<const ukfPrecisionType *>(NULL) );
+  for( size_t s = 0; s < _scalars.size(); ++s )
+    {
+    const std::vector<ukfPrecisionType>& column = arena.*_scalars[s].column;
+    if( !column.empty() )
+      {
+      columns[s] = &column[fiber.begin];
+      _recorded[s] = true;
+      }
+    }
+
+  for( size_t i = 0; i < fiber.size(); ++i )
+    {
+    // Same voxel lookup as NrrdData::ScalarMaskValue
+    const vec3_t& pos = fiber.position(i);
+    const int     x = static_cast<int>(std::round(pos[0]) );
+    const int     y = static_cast<int>(std::round(pos[1]) );
+    const int     z = static_cast<int>(std::round(pos[2]) );
+    if( x < 0 || _nx <= x || y < 0 || _ny <= y || z < 0 || _nz <= z )
+      {
+      continue;
+      }
+    const uint64_t voxel = (static_cast<uint64_t>(x) * _ny + y) * _nz + z;
+    const size_t   slot = Slot(voxel);
+
+    if( _last_fiber[slot] != fiber_id )
+      {
+      _last_fiber[slot] = fiber_id;
+      ++_fibers[slot];
+      }
+    ++_points[slot];
+    double *sums = &_sums[2 * _scalars.size() * slot];
+    for( size_t s = 0; s < _scalars.size(); ++s )
+      {
+      if( columns[s] )
+        {
+        const double value = columns[s][i];
+        sums[2 * s] += value;
+        sums[2 * s + 1] += value * value;
+        }
+      }
+    }
+}
+
+void VoxelMapAccumulator::Merge(const VoxelMapAccumulator& other)
+{
+  const size_t num_sums = 2 * _scalars.size();
+  for( size_t s = 0; s < _scalars.size(); ++s )
+    {
+    _recorded[s] = _recorded[s] || other._recorded[s];
+    }
+  for( size_t other_slot = 0; other_slot < other._voxels.size(); ++other_slot )
+    {
+    const size_t slot = Slot(other._voxels[other_slot]);
+    _fibers[slot] += other._fibers[other_slot];
+    _points[slot] += other._points[other_slot];
+    for( size_t k = 0; k < num_sums; ++k )
+      {
+      _sums[num_sums * slot + k] += other._sums[num_sums * other_slot + k];
+      }
+    }
+  _num_fibers += other._num_fibers;
+}
+
+bool VoxelMapAccumulator::WriteDensity(const std::string& file_name, const ukfMatrixType& i2r) const
+{
+  std::vector<float> density(static_cast<size_t>(_nx) * _ny * _nz, 0.0f);
+  for( size_t slot = 0; slot < _voxels.size(); ++slot )
+    {
+    density[_voxels[slot]] = static_cast<float>(_fibers[slot]);
+    }
+  return WriteMap(file_name, density, i2r);
+}
+
+bool VoxelMapAccumulator::WriteScalarMaps(const std::string& prefix, const ukfMatrixType& i2r) const
+{
+  const size_t       num_sums = 2 * _scalars.size();
+  std::vector<float> mean(static_cast<size_t>(_nx) * _ny * _nz);
+  std::vector<float> stddev(mean.size() );
+  for( size_t s = 0; s < _scalars.size(); ++s )
+    {
+    if( !_recorded[s] )
+      {
+      continue;
+      }
+    std::fill(mean.begin(), mean.end(), 0.0f);
+    std::fill(stddev.begin(), stddev.end(), 0.0f);
+    for( size_t slot = 0; slot < _voxels.size(); ++slot )
+      {
+      const double n = _points[slot];
+      const double m = _sums[num_sums * slot + 2 * s] / n;
+      // Population standard deviation, as vtk2mask computes it
+      const double variance = _sums[num_sums * slot + 2 * s + 1] / n - m * m;
+      mean[_voxels[slot]] = static_cast<float>(m);
+      stddev[_voxels[slot]] = static_cast<float>(std::sqrt(std::max(variance, 0.0) ) );
+      }
+    if( WriteMap(prefix + _scalars[s].name + "_mean.nrrd", mean, i2r) ||
+        WriteMap(prefix + _scalars[s].name + "_std.nrrd", stddev, i2r) )
+      {
+      return true;
+      }
+    }
+  return false;
+}
+
+bool VoxelMapAccumulator::WriteMap(const std::string& file_name, const std::vector<float>& values,
+                                   const ukfMatrixType& i2r) const
+{
+  // The index runs fastest over the last reversed axis, i.e. over the first axis of the volume
+  Nrrd *nrrd = nrrdNew();
+  if( nrrdWrap_va(nrrd, const_cast<float *>(&values[0]), nrrdTypeFloat, 3,
+                  static_cast<size_t>(_nz), static_cast<size_t>(_ny), static_cast<size_t>(_nx) ) )
+    {
+    char *txt = biffGetDone(NRRD);
+    std::cout << "Could not create " << file_name << ": " << txt << std::endl;
+    free( txt );
+    nrrdNix(nrrd);
+    return true;
+    }
+
+  double directions[NRRD_DIM_MAX][NRRD_SPACE_DIM_MAX];
+  double origin[NRRD_SPACE_DIM_MAX];
+  int    kinds[NRRD_DIM_MAX];
+  for( int axis = 0; axis < 3; ++axis )
+    {
+    for( int k = 0; k < 3; ++k )
+      {
+      directions[axis][k] = i2r(k, axis);
+      }
+    origin[axis] = i2r(axis, 3);
+    kinds[axis] = nrrdKindSpace;
+    }
+  // The DWI data is converted to RAS when it is loaded, see dwi_normalize.cc
+  nrrdSpaceSet(nrrd, nrrdSpaceRightAnteriorSuperior);
+  nrrdSpaceOriginSet(nrrd, origin);
+  nrrdAxisInfoSet_nva(nrrd, nrrdAxisInfoSpaceDirection, directions);
+  nrrdAxisInfoSet_nva(nrrd, nrrdAxisInfoKind, kinds);
+
+  // Most of the volume is 0, which compresses well
+  NrrdIoState *nio = nrrdIoStateNew();
+  if( nrrdEncodingGzip->available() )
+    {
+    nio->encoding = nrrdEncodingGzip;
+    }
+  const bool failed = nrrdSave(file_name.c_str(), nrrd, nio) != 0;
+  if( failed )
+    {
+    char *txt = biffGetDone(NRRD);
+    std::cout << "Could not write " << file_name << ": " << txt << std::endl;
+    free( txt );
+    }
+  nrrdIoStateNix(nio);
+  // The values belong to the caller
+  nrrdNix(nrrd);
+  return failed;
+}
@@ -0,0 +1,103 @@
+/**
+ * \file voxel_maps.h
+ * \brief Tract density and mean scalar maps accumulated from the fibers while they are traced
+*/
+
+#ifndef VOXEL_MAPS_H_
+#define VOXEL_MAPS_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "ukffiber.h"
+
+/** A column of the fiber arena that is mapped, e.g. &FiberArena::fa */
+typedef std::vector<ukfPrecisionType> FiberArena::* FiberScalarColumn;
+
+/**
+ * \struct VoxelMapScalar
+ * \brief A per point scalar whose mean and standard deviation per voxel are written
+*/
+struct VoxelMapScalar
+  {
+  std::string       name;   // Name of the point data array in the tract output
+  FiberScalarColumn column;
+  };
+
+/** The scalars the fibers can carry, named like the arrays the VtkWriter writes */
+void GetVoxelMapScalars(const bool noddi, std::vector<VoxelMapScalar>& scalars);
+
+/**
+ * \class VoxelMapAccumulator
+ * \brief Sparse per voxel sums of the fibers added to it
+ *
+ * Every tracking thread adds the fibers it finishes to its own accumulator. Only the voxels a fiber passes
+ * are stored, so an accumulator stays small while most of the volume is never reached. At the end the
+ * accumulators are merged and written as NRRD maps in the space of the DWI data:
+ *
+ *   density   number of fibers passing a voxel, every fiber counted once per voxel
+ *   mean, std of the values of a scalar at all points in the voxel, like vtk2mask computes them
+ *
+ * The positions are ijk in reverse axis order, as the fibers store them, and are rounded to the nearest
+ * voxel. Points outside the volume are ignored.
+*/
+class VoxelMapAccumulator
+{
+public:
+  VoxelMapAccumulator();
+
+  /**
+   * Removes all sums and sets the volume
+   * \param[in] dim Size of the volume in reverse axis order, see ISignalData::dim()
+   * \param[in] scalars The scalars to sum, those a fiber does not record are skipped
+  */
+  void Reset(const vec3_t& dim, const std::vector<VoxelMapScalar>& scalars);
+
+  void AddFiber(const UKFFiber& fiber);
+
+  /** Adds the sums of another accumulator of the same volume */
+  void Merge(const VoxelMapAccumulator& other);
+
+  /** Number of voxels reached by at least one fiber */
+  size_t NumberOfVoxels() const
+  {
+    return _voxels.size();
+  }
+
+  /**
+   * Writes the fiber count per voxel to file_name
+   * \param[in] i2r The ijk-to-RAS matrix of the volume
+   * \return true on failure
+  */
+  bool WriteDensity(const std::string& file_name, const ukfMatrixType& i2r) const;
+
+  /**
+   * Writes <prefix><name>_mean.nrrd and <prefix><name>_std.nrrd for every scalar some fiber recorded
+   * \return true on failure
+  */
+  bool WriteScalarMaps(const std::string& prefix, const ukfMatrixType& i2r) const;
+
+private:
+  /** Slot of a voxel in the sums, added if the voxel was not reached before */
+  size_t Slot(const uint64_t voxel);
+
+  /** Writes one value per voxel of the volume, voxels that were not reached are 0 */
+  bool WriteMap(const std::string& file_name, const std::vector<float>& values, const ukfMatrixType& i2r) const;
+
+  int                                  _nx, _ny, _nz;
+  std::vector<VoxelMapScalar>          _scalars;
+  // Whether some fiber recorded the scalar, the others are not written
+  std::vector<bool>                    _recorded;
+  std::unordered_map<uint64_t, size_t> _slots;
+  // Per slot: the voxel index, the number of fibers and points, the last fiber counted and
+  // sum, sum of squares of every scalar
+  std::vector<uint64_t>                _voxels;
+  std::vector<uint32_t>                _fibers;
+  std::vector<uint32_t>                _points;
+  std::vector<uint64_t>                _last_fiber;
+  std::vector<double>                  _sums;
+  uint64_t                             _num_fibers;
+};
+
+#endif // VOXEL_MAPS_H_
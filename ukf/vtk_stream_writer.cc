@@ -0,0 +1,434 @@
+/**
+ * \file vtk_stream_writer.cc
+ * \brief implementation of vtk_stream_writer.h
+*/
+
+#include "vtk_stream_writer.h"
+
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include "vtkByteSwap.h"
+#include "git_version.h"
+
+namespace
+{
+/** Digits reserved in the header for the number of points, which is only known at the end */
+const int NUM_POINTS_WIDTH = 12;
+
+/** Writes the length of a string in the prefix encoding of binary legacy VTK string arrays */
+void WriteStringLength(std::ostream& out, const size_t length)
+{
+  if( length < (1u << 6) )
+    {
+    const unsigned char len = static_cast<unsigned char>( (3u << 6) | length);
+    out.write(reinterpret_cast<const char *>(&len), 1);
+    }
+  else if( length < (1u << 14) )
+    {
+    unsigned short len = static_cast<unsigned short>( (2u << 14) | length);
+    vtkByteSwap::Swap2BE(&len);
+    out.write(reinterpret_cast<const char *>(&len), 2);
+    }
+  else
+    {
+    unsigned int len = static_cast<unsigned int>( (1u << 30) | length);
+    vtkByteSwap::Swap4BE(&len);
+    out.write(reinterpret_cast<const char *>(&len), 4);
+    }
+}
+}
+
+VtkStreamWriter::VtkStreamWriter(const ISignalData *signal_data, Tractography::model_type filter_model_type,
+                                 bool write_tensors) :
+  VtkWriter(signal_data, filter_model_type, write_tensors),
+  _write_state(false),
+  _if_noddi(false),
+  _arrays_created(false),
+  _has_nmse(false),
+  _num_fibers(0),
+  _num_points(0),
+  _nmse_sum(0)
+{
+  _lines.components = 0;
+  _lines.stream = NULL;
+}
+
+VtkStreamWriter::~VtkStreamWriter()
+{
+  RemoveSpillFiles();
+}
+
+bool VtkStreamWriter::Open(const std::string& file_name, bool write_state, bool if_noddi)
+{
+  _file_name = file_name;
+  _write_state = write_state;
+  _if_noddi = if_noddi;
+
+  _output.open(file_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if( !_output )
+    {
+    std::cout << "Could not open " << file_name << " for writing." << std::endl;
+    return true;
+    }
+
+  std::stringstream version;
+  version << "UKF_GIT_HASH:" << UKF_GIT_HASH;
+
+  _output << "# vtk DataFile Version 3.0\n"
+          << "vtk output\n"
+          << (_writeBinary ? "BINARY\n" : "ASCII\n")
+          << "DATASET POLYDATA\n"
+          << "FIELD FieldData 1\n"
+          << "UKF_VERSION_INFO 1 1 string\n";
+  if( _writeBinary )
+    {
+    WriteStringLength(_output, version.str().size() );
+    }
+  _output << version.str() << "\n";
+  _output << "POINTS ";
+  _num_points_pos = _output.tellp();
+  _output << std::setw(NUM_POINTS_WIDTH) << std::setfill('0') << 0 << std::setfill(' ') << " float\n";
+
+  _lines.name = "lines";
+  _lines.path = file_name + ".lines.tmp";
+  _lines.stream = new std::ofstream(_lines.path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if( !*_lines.stream )
+    {
+    std::cout << "Could not open " << _lines.path << " for writing." << std::endl;
+    return true;
+    }
+  return !_output;
+}
+
+bool VtkStreamWriter::AddArray(const std::string& name, const int components)
+{
+  SpillArray array;
+  array.name = name;
+  array.components = components;
+  array.path = _file_name + "." + name + ".tmp";
+  array.stream = new std::ofstream(array.path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  _arrays.push_back(array);
+  if( !*array.stream )
+    {
+    std::cout << "Could not open " << array.path << " for writing." << std::endl;
+    return true;
+    }
+  return false;
+}
+
+bool VtkStreamWriter::CreateArrays(const FiberArena& arena)
+{
+  // Same arrays, names and order as VtkWriter::Write
+  bool failed = AddArray("EstimatedUncertainty", 1);
+  if( !arena.fa.empty() )
+    {
+    failed |= AddArray(_if_noddi ? "Vic1" : "FA1", 1);
+    }
+  if( !arena.fa2.empty() )
+    {
+    failed |= AddArray(_if_noddi ? "Vic2" : "FA2", 1);
+    }
+  if( !arena.trace.empty() )
+    {
+    failed |= AddArray(_if_noddi ? "OrientationDispersionIndex1" : "trace1", 1);
+    }
+  if( !arena.trace2.empty() )
+    {
+    failed |= AddArray(_if_noddi ? "OrientationDispersionIndex2" : "trace2", 1);
+    }
+  if( !arena.free_water.empty() )
+    {
+    failed |= AddArray(_if_noddi ? "Viso" : "FreeWater", 1);
+    }
+  _has_nmse = !arena.normMSE.empty();
+  if( _has_nmse )
+    {
+    failed |= AddArray("NormalizedSignalEstimationError", 1);
+    }
+  if( _write_state )
+    {
+    failed |= AddArray("state", arena.state_dim);
+    }
+  if( arena.HasCovariance() )
+    {
+    failed |= AddArray(arena.covariance_mode == COVARIANCE_DIAGONAL ? "covarianceDiagonal" : "covariance",
+                       arena.CovarianceSize() );
+    }
+  if( _write_tensors )
+    {
+    for( int i = 1; i <= _num_tensors; ++i )
+      {
+      std::stringstream ss;
+      ss << "tensor" << i;
+      failed |= AddArray(ss.str(), 9);
+      }
+    }
+  _arrays_created = true;
+  return failed;
+}
+
+void VtkStreamWriter::WriteValues(std::ostream& out, const float *values, const size_t count, const int components)
+{
+  if( _writeBinary )
+    {
+    _buffer.assign(values, values + count);
+    vtkByteSwap::Swap4BERange(&_buffer[0], count);
+    out.write(reinterpret_cast<const char *>(&_buffer[0]), count * sizeof(float) );
+    }
+  else
+    {
+    for( size_t i = 0; i < count; ++i )
+      {
+      out << values[i] << ( (i + 1) % components == 0 ? "\n" : " ");
+      }
+    }
+}
+
+void VtkStreamWriter::WriteScalarColumn(SpillArray& array, const std::vector<ukfPrecisionType>& column)
+{
+  std::vector<float> values(column.begin(), column.end() );
+  if( !values.empty() )
+    {
+    WriteValues(*array.stream, &values[0], values.size(), 1);
+    }
+}
+
+bool VtkStreamWriter::Append(const FiberArena& arena, const std::vector<UKFFiber>& fibers)
+{
+  if( fibers.empty() )
+    {
+    return false;
+    }
+  assert(fibers.front().begin == 0 && fibers.back().begin + fibers.back().size() == arena.NumberOfPoints() );
+  if( !_arrays_created && CreateArrays(arena) )
+    {
+    return true;
+    }
+
+  const size_t num_points = arena.NumberOfPoints();
+  std::vector<float> values(3 * num_points);
+  for( size_t i = 0; i < num_points; ++i )
+    {
+    const vec3_t point = PointConvert(arena.position[i]);
+    values[3 * i] = static_cast<float>(point[0]);
+    values[3 * i + 1] = static_cast<float>(point[1]);
+    values[3 * i + 2] = static_cast<float>(point[2]);
+    }
+  WriteValues(_output, &values[0], values.size(), 3);
+
+  // Legacy cells are the number of points followed by the point ids
+  std::vector<int> cells;
+  cells.reserve(fibers.size() + num_points);
+  for( size_t i = 0; i < fibers.size(); ++i )
+    {
+    cells.push_back(static_cast<int>(fibers[i].size() ) );
+    for( size_t j = 0; j < fibers[i].size(); ++j )
+      {
+      cells.push_back(static_cast<int>(_num_points + fibers[i].begin + j) );
+      }
+    }
+  if( _writeBinary )
+    {
+    vtkByteSwap::Swap4BERange(&cells[0], cells.size() );
+    _lines.stream->write(reinterpret_cast<const char *>(&cells[0]), cells.size() * sizeof(int) );
+    }
+  else
+    {
+    size_t next_cell = 0;
+    for( size_t i = 0; i < cells.size(); ++i )
+      {
+      const bool last = (i == next_cell + cells[next_cell]);
+      *_lines.stream << cells[i] << (last ? "\n" : " ");
+      if( last )
+        {
+        next_cell = i + 1;
+        }
+      }
+    }
+
+  size_t a = 0;
+  WriteScalarColumn(_arrays[a++], arena.norm);
+  if( !arena.fa.empty() )
+    {
+    WriteScalarColumn(_arrays[a++], arena.fa);
+    }
+  if( !arena.fa2.empty() )
+    {
+    WriteScalarColumn(_arrays[a++], arena.fa2);
+    }
+  if( !arena.trace.empty() )
+    {
+    WriteScalarColumn(_arrays[a++], arena.trace);
+    }
+  if( !arena.trace2.empty() )
+    {
+    WriteScalarColumn(_arrays[a++], arena.trace2);
+    }
+  if( !arena.free_water.empty() )
+    {
+    WriteScalarColumn(_arrays[a++], arena.free_water);
+    }
+  if( !arena.normMSE.empty() )
+    {
+    for( size_t i = 0; i < arena.normMSE.size(); ++i )
+      {
+      _nmse_sum += arena.normMSE[i];
+      }
+    WriteScalarColumn(_arrays[a++], arena.normMSE);
+    }
+  if( _write_state )
+    {
+    WriteScalarColumn(_arrays[a++], arena.state);
+    }
+  if( arena.HasCovariance() )
+    {
+    // The covariance is recorded in the layout it is written in
+    if( arena.covariance_single )
+      {
+      WriteValues(*_arrays[a].stream, &arena.covariance_float[0], arena.covariance_float.size(),
+                  _arrays[a].components);
+      }
+    else
+      {
+      values.assign(arena.covariance.begin(), arena.covariance.end() );
+      WriteValues(*_arrays[a].stream, &values[0], values.size(), _arrays[a].components);
+      }
+    ++a;
+    }
+  if( _write_tensors )
+    {
+    mat33_t D;
+    for( int t = 1; t <= _num_tensors; ++t )
+      {
+      values.resize(9 * num_points);
+      for( size_t i = 0; i < num_points; ++i )
+        {
+        State2Tensor(StateView(&arena.state[i * arena.state_dim], arena.state_dim), D, t);
+        for( int r = 0, v = 0; r < 3; ++r )
+          {
+          for( int c = 0; c < 3; ++c, ++v )
+            {
+            values[9 * i + v] = static_cast<float>(D(r, c) );
+            }
+          }
+        }
+      WriteValues(*_arrays[a].stream, &values[0], values.size(), 9);
+      ++a;
+      }
+    }
+  assert(a == _arrays.size() );
+
+  _num_fibers += fibers.size();
+  _num_points += num_points;
+
+  bool failed = !_output || !*_lines.stream;
+  for( size_t i = 0; i < _arrays.size(); ++i )
+    {
+    failed |= !*_arrays[i].stream;
+    }
+  if( failed )
+    {
+    std::cout << "Writing to " << _file_name << " failed." << std::endl;
+    }
+  return failed;
+}
+
+int VtkStreamWriter::Close()
+{
+  if( _num_fibers == 0 )
+    {
+    std::cout << "No fiber exists." << std::endl;
+    _output.close();
+    std::remove(_file_name.c_str() );
+    RemoveSpillFiles();
+    return EXIT_FAILURE;
+    }
+
+  _output << "\nLINES " << _num_fibers << " " << _num_fibers + _num_points << "\n";
+  _lines.stream->close();
+    {
+    std::ifstream spill(_lines.path.c_str(), std::ios::in | std::ios::binary);
+    _output << spill.rdbuf();
+    }
+
+  // The attributes are the ones VtkWriter sets: the last array before the tensors is the active scalar and
+  // the last tensor the active tensor. All other arrays are field data, written between the two.
+  const size_t num_tensors = _write_tensors ? _num_tensors : 0;
+  const size_t scalars = _arrays.size() - num_tensors - 1;
+  const size_t tensors = _write_tensors ? _arrays.size() - 1 : _arrays.size();
+  std::vector<size_t> order(1, scalars);
+  for( size_t i = 0; i < _arrays.size(); ++i )
+    {
+    if( i != scalars && i != tensors )
+      {
+      order.push_back(i);
+      }
+    }
+  if( _write_tensors )
+    {
+    order.push_back(tensors);
+    }
+  const size_t num_fields = order.size() - (_write_tensors ? 2 : 1);
+
+  _output << "\nPOINT_DATA " << _num_points << "\n";
+  for( size_t k = 0; k < order.size(); ++k )
+    {
+    const size_t i = order[k];
+    if( i == scalars )
+      {
+      _output << "SCALARS " << _arrays[i].name << " float " << _arrays[i].components << "\n";
+      _output << "LOOKUP_TABLE default\n";
+      }
+    else if( i == tensors )
+      {
+      _output << "TENSORS " << _arrays[i].name << " float\n";
+      }
+    else
+      {
+      if( k == 1 )
+        {
+        _output << "FIELD FieldData " << num_fields << "\n";
+        }
+      _output << _arrays[i].name << " " << _arrays[i].components << " " << _num_points << " float\n";
+      }
+    _arrays[i].stream->close();
+      {
+      std::ifstream spill(_arrays[i].path.c_str(), std::ios::in | std::ios::binary);
+      _output << spill.rdbuf();
+      }
+    _output << "\n";
+    }
+
+  // Fill in the placeholder for the number of points
+  _output.seekp(_num_points_pos);
+  _output << std::setw(NUM_POINTS_WIDTH) << std::setfill('0') << _num_points << std::setfill(' ');
+  _output.close();
+  RemoveSpillFiles();
+
+  std::cout << "nmse_avg=" << (_has_nmse ? _nmse_sum / _num_points : 0) << std::endl;
+
+  if( _output.fail() )
+    {
+    std::cout << "Writing to " << _file_name << " failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
+
+void VtkStreamWriter::RemoveSpillFiles()
+{
+  if( _lines.stream )
+    {
+    delete _lines.stream;
+    _lines.stream = NULL;
+    std::remove(_lines.path.c_str() );
+    }
+  for( size_t i = 0; i < _arrays.size(); ++i )
+    {
+    delete _arrays[i].stream;
+    std::remove(_arrays[i].path.c_str() );
+    }
+  _arrays.clear();
+}
@@ -0,0 +1,97 @@
+/**
+ * \file vtk_stream_writer.h
+ * \brief Incremental writing of fibers to a legacy VTK file
+*/
+
+#ifndef VTK_STREAM_WRITER_H_
+#define VTK_STREAM_WRITER_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include "vtk_writer.h"
+
+/**
+ * \class VtkStreamWriter
+ * \brief Writes fibers to a legacy .vtk file batch by batch, so that they never have to be in memory at once
+ *
+ * The points are written to the output file as the batches arrive. The lines and every point data array go
+ * to a spill file of their own next to the output, which Close() appends behind the points before it fills in
+ * the number of points in the header. The arrays are the ones VtkWriter::Write attaches; glyphs and the
+ * file for the second tensor are not supported.
+*/
+class VtkStreamWriter : public VtkWriter
+{
+public:
+  VtkStreamWriter(const ISignalData *signal_data, Tractography::model_type filter_model_type, bool write_tensors);
+
+  /** Removes the spill files if Close() was not called */
+  virtual ~VtkStreamWriter();
+
+  /**
+   * Creates the output file and writes the header
+   * \return true on failure
+  */
+  bool Open(const std::string& file_name, bool write_state, bool if_noddi);
+
+  /**
+   * Appends fibers whose points are stored consecutively and in the same order in arena, i.e. the output
+   * of PostProcessFibers
+   * \return true on failure
+  */
+  bool Append(const FiberArena& arena, const std::vector<UKFFiber>& fibers);
+
+  /**
+   * Completes the output file
+   * \return EXIT_FAILURE if writing failed or no fiber was appended, EXIT_SUCCESS otherwise
+  */
+  int Close();
+
+  size_t GetNumberOfFibers() const
+  {
+    return _num_fibers;
+  }
+
+  size_t GetNumberOfPoints() const
+  {
+    return _num_points;
+  }
+
+private:
+  /** A point data array collected in a spill file */
+  struct SpillArray
+    {
+    std::string    name;
+    int            components;
+    std::string    path;
+    std::ofstream *stream;
+    };
+
+  /** Decides which arrays are written, from the columns recorded in the first batch */
+  bool CreateArrays(const FiberArena& arena);
+
+  bool AddArray(const std::string& name, const int components);
+
+  /** Writes count floats in the file type of the output, components values per line in ASCII files */
+  void WriteValues(std::ostream& out, const float *values, const size_t count, const int components);
+
+  void WriteScalarColumn(SpillArray& array, const std::vector<ukfPrecisionType>& column);
+
+  void RemoveSpillFiles();
+
+  std::string             _file_name;
+  std::ofstream           _output;
+  std::streampos          _num_points_pos;
+  bool                    _write_state;
+  bool                    _if_noddi;
+  bool                    _arrays_created;
+  bool                    _has_nmse;
+  std::vector<SpillArray> _arrays;
+  SpillArray              _lines;
+  size_t                  _num_fibers;
+  size_t                  _num_points;
+  ukfPrecisionType        _nmse_sum;
+  std::vector<float>      _buffer;
+};
+
+#endif // VTK_STREAM_WRITER_H_
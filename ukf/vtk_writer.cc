@@ -7,12 +7,17 @@
 #include "vtkVersion.h"
 #include "ukf_types.h"
 #include "vtk_writer.h"
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include "ISignalData.h"
 #include "utilities.h"
 #include "ukffiber.h"
+#include "thread.h"
+#include "tract_file.h"
+#include "run_report.h"
 #include "itksys/SystemTools.hxx"
 #include "vtkPoints.h"
 #include "vtkPolyData.h"
@@ -21,6 +26,7 @@
 #include "vtkStringArray.h"
 #include "vtkSmartPointer.h"
 #include "vtkFloatArray.h"
+#include "vtkIdTypeArray.h"
 #include "vtkPointData.h"
 #include "vtkFieldData.h"
 #include "vtkXMLPolyDataWriter.h"
@@ -36,8 +42,14 @@ VtkWriter::VtkWriter(const ISignalData *signal_data, Tractography::model_type fi
   _scale_glyphs(0.01),
   _write_tensors(write_tensors),
   _eigenScaleFactor(1),
+  _thread_pool(NULL),
+  _run_report(NULL),
   _writeBinary(true),
-  _writeCompressed(true)
+  _writeCompressed(true),
+  _compressor(VTP_COMPRESSOR_ZLIB),
+  _compressTractFile(false),
+  _max_position_error(0),
+  _max_scalar_error(0)
 {
 
   if( filter_model_type == Tractography::_1T || filter_model_type == Tractography::_1T_FW )
@@ -112,100 +124,256 @@ VtkWriter::VtkWriter(const ISignalData *signal_data, Tractography::model_type fi
     i2r(1, 0) / voxel[2], i2r(1, 1) / voxel[1], i2r(1, 2) / voxel[0],
     i2r(2, 0) / voxel[2], i2r(2, 1) / voxel[1], i2r(2, 2) / voxel[0];
 
+  // Fixed size copy of the ijk->RAS transform for PointConvert
+  _i2r_linear = i2r.block<3, 3>(0, 0);
+  _i2r_offset = i2r.block<3, 1>(0, 3);
 }
 
+VtkWriter::FiberArrays::FiberArrays() :
+  points(NULL),
+  lines(NULL),
+  norm(NULL),
+  fa(NULL),
+  fa2(NULL),
+  trace(NULL),
+  trace2(NULL),
+  free_water(NULL),
+  normMSE(NULL),
+  state(NULL),
+  covariance(NULL)
+{
+}
 
+/** The fibers shared by the workers of the pool, which claim them in chunks */
+struct VtkWriter::FillWork
+  {
+  const VtkWriter *            writer;
+  const std::vector<UKFFiber> *fibers;
+  const std::vector<size_t> *  point_offsets;
+  const FiberArrays *          arrays;
+  std::atomic<size_t>          next;
+  };
+
+namespace
+{
+/** Fibers claimed at once by a worker */
+const size_t FILL_CHUNK_SIZE = 256;
+}
 
-void VtkWriter
-::PopulateFibersAndTensors(vtkPolyData* polyData,
-                           const std::vector<UKFFiber>& fibers)
+void VtkWriter::FillCallback(int, void *data)
 {
-  vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+  FillWork&    work = *static_cast<FillWork *>(data);
+  const size_t num_fibers = work.fibers->size();
+  for( ;; )
+    {
+    const size_t begin = work.next.fetch_add(FILL_CHUNK_SIZE);
+    if( begin >= num_fibers )
+      {
+      break;
+      }
+    const size_t end = std::min(begin + FILL_CHUNK_SIZE, num_fibers);
+    for( size_t i = begin; i < end; ++i )
+      {
+      // Every line is preceded by its number of points
+      const size_t point_offset = (*work.point_offsets)[i];
+      work.writer->FillFiber((*work.fibers)[i], point_offset, point_offset + i, *work.arrays);
+      }
+    }
+}
 
-  size_t num_fibers = fibers.size();
-  size_t num_points = 0;
-  for( size_t i = 0; i < num_fibers; ++i )
+void VtkWriter::FillFibers(const std::vector<UKFFiber>& fibers, const FiberArrays& arrays) const
+{
+  std::vector<size_t> point_offsets(fibers.size() );
+  size_t              num_points = 0;
+  for( size_t i = 0; i < fibers.size(); ++i )
     {
-    num_points += fibers[i].position.size();
+    point_offsets[i] = num_points;
+    num_points += fibers[i].size();
     }
 
-  for( size_t i = 0; i < num_fibers; ++i )
+  FillWork work;
+  work.writer = this;
+  work.fibers = &fibers;
+  work.point_offsets = &point_offsets;
+  work.arrays = &arrays;
+  work.next = 0;
+  if( _thread_pool && _thread_pool->GetNumberOfThreads() > 1 && fibers.size() > FILL_CHUNK_SIZE )
+    {
+    _thread_pool->Execute(FillCallback, &work);
+    }
+  else
+    {
+    FillCallback(0, &work);
+    }
+}
+
+void VtkWriter::FillFiber(const UKFFiber& fiber, const size_t point_offset, const size_t line_offset,
+                          const FiberArrays& arrays) const
+{
+  const size_t fiber_size = fiber.size();
+  const int    state_dim = fiber.arena->state_dim;
+
+  if( arrays.lines )
     {
-    size_t fiber_size = fibers[i].position.size();
+    vtkIdType *ids = arrays.lines + line_offset;
+    *ids++ = static_cast<vtkIdType>(fiber_size);
     for( size_t j = 0; j < fiber_size; ++j )
       {
-      vec3_t current = PointConvert(fibers[i].position[j]);
-      points->InsertNextPoint(current[0],current[1],current[2]);
+      *ids++ = static_cast<vtkIdType>(point_offset + j);
       }
     }
-  polyData->SetPoints(points);
 
-  // do the lines
-  vtkSmartPointer<vtkCellArray> lines = vtkSmartPointer<vtkCellArray>::New();
-
-  vtkIdType counter = 0;
-  for(size_t i = 0; i < num_fibers; ++i)
+  mat33_t D;
+  for( size_t j = 0; j < fiber_size; ++j )
     {
-    int fiber_size = static_cast<int>(fibers[i].position.size());
-    vtkIdType *ids = new vtkIdType[fiber_size];
-    for(int j = 0; j < fiber_size; ++j)
+    const size_t point = point_offset + j;
+    if( arrays.points )
+      {
+      const vec3_t current = PointConvert(fiber.position(j) );
+      float *      p = arrays.points + 3 * point;
+      p[0] = current[0];
+      p[1] = current[1];
+      p[2] = current[2];
+      }
+    for( size_t t = 0; t < arrays.tensors.size(); ++t )
+      {
+      State2Tensor(fiber.state(j), D, static_cast<int>(t) + 1);
+      float *tensor = arrays.tensors[t] + 9 * point;
+      for( unsigned ii = 0, v = 0; ii < 3; ++ii )
+        {
+        for( unsigned jj = 0; jj < 3; ++jj, ++v )
+          {
+          tensor[v] = D(ii, jj);
+          }
+        }
+      }
+    if( arrays.norm )
+      {
+      arrays.norm[point] = fiber.norm(j);
+      }
+    if( arrays.fa )
+      {
+      arrays.fa[point] = fiber.fa(j);
+      }
+    if( arrays.fa2 )
+      {
+      arrays.fa2[point] = fiber.fa2(j);
+      }
+    if( arrays.trace )
+      {
+      arrays.trace[point] = fiber.trace(j);
+      }
+    if( arrays.trace2 )
+      {
+      arrays.trace2[point] = fiber.trace2(j);
+      }
+    if( arrays.free_water )
       {
-      ids[j] = counter;
-      counter++;
+      arrays.free_water[point] = fiber.free_water(j);
+      }
+    if( arrays.normMSE )
+      {
+      arrays.normMSE[point] = fiber.normMSE(j);
+      }
+    if( arrays.state )
+      {
+      const StateView state = fiber.state(j);
+      float *         values = arrays.state + point * state_dim;
+      for( int k = 0; k < state_dim; ++k )
+        {
+        values[k] = state[k];
+        }
+      }
+    if( arrays.covariance )
+      {
+      const int cov_size = fiber.arena->CovarianceSize();
+      float *   values = arrays.covariance + point * cov_size;
+      for( int k = 0; k < cov_size; ++k )
+        {
+        values[k] = fiber.covariance(j, k);
+        }
       }
-    vtkSmartPointer<vtkLine> curLine = vtkSmartPointer<vtkLine>::New();
-    curLine->Initialize(fiber_size,ids,points);
-    lines->InsertNextCell(curLine);
-    delete [] ids;
     }
-  polyData->SetLines(lines);
+}
+
+float * VtkWriter::AddFloatArray(vtkPointData *pointData, const char *name, const int components,
+                                 const size_t num_points)
+{
+  vtkSmartPointer<vtkFloatArray> array = vtkSmartPointer<vtkFloatArray>::New();
+  array->SetNumberOfComponents(components);
+  array->SetNumberOfTuples(num_points);
+  array->SetName(name);
+  const int idx = pointData->AddArray(array);
+  pointData->SetActiveAttribute(idx, vtkDataSetAttributes::SCALARS);
+  return array->GetPointer(0);
+}
+
+
+
+void VtkWriter
+::PopulateFibersAndTensors(vtkPolyData* polyData,
+                           const std::vector<UKFFiber>& fibers)
+{
+  size_t num_fibers = fibers.size();
+  size_t num_points = 0;
+  for( size_t i = 0; i < num_fibers; ++i )
+    {
+    num_points += fibers[i].size();
+    }
+
+  // All arrays are sized up front and then filled fiber by fiber, possibly in parallel
+  FiberArrays arrays;
+
+  vtkSmartPointer<vtkFloatArray> coordinates = vtkSmartPointer<vtkFloatArray>::New();
+  coordinates->SetNumberOfComponents(3);
+  coordinates->SetNumberOfTuples(num_points);
+  arrays.points = coordinates->GetPointer(0);
+  vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+  points->SetData(coordinates);
+  polyData->SetPoints(points);
+
+  // do the lines
+  vtkSmartPointer<vtkIdTypeArray> ids = vtkSmartPointer<vtkIdTypeArray>::New();
+  ids->SetNumberOfValues(num_fibers + num_points);
+  arrays.lines = ids->GetPointer(0);
 
   /////
   // Dataset attribute part starts
   /////
 
-
+  std::vector<vtkSmartPointer<vtkFloatArray> > tensors;
   if( _write_tensors )
     {
-    counter = 0;
-    vtkPointData *pointData = polyData->GetPointData();
-
-    mat33_t D;
     for( int local_tensorNumber = 1; local_tensorNumber <= _num_tensors; ++local_tensorNumber )
       {
       vtkSmartPointer<vtkFloatArray> curTensor = vtkSmartPointer<vtkFloatArray>::New();
       curTensor->SetNumberOfComponents(9);
-      curTensor->Allocate(num_points * 9);
+      curTensor->SetNumberOfTuples(num_points);
         {
         std::stringstream ss;
         ss << "tensor" << local_tensorNumber;
         curTensor->SetName(ss.str().c_str());
         }
-      for( size_t i = 0; i < num_fibers; i++ )
-        {
-        const size_t fiber_size = fibers[i].position.size();
-        for( size_t j = 0; j < fiber_size; ++j )
-          {
-          const State & state = fibers[i].state[j];
-          State2Tensor(state, D, local_tensorNumber);
-          ukfPrecisionType tmp[9];
-          for(unsigned ii = 0, v = 0; ii < 3; ++ii)
-            {
-            for(unsigned jj = 0; jj < 3; ++jj, ++v)
-              {
-              tmp[v] = D(ii,jj);
-              }
-            }
-          curTensor->InsertNextTuple(tmp);
-          }
-        }
-      const int idx = static_cast<int>(pointData->AddArray(curTensor));
-      pointData->SetActiveAttribute(idx,vtkDataSetAttributes::TENSORS);
+      arrays.tensors.push_back(curTensor->GetPointer(0) );
+      tensors.push_back(curTensor);
       }
     }
+
+  FillFibers(fibers, arrays);
+
+  vtkSmartPointer<vtkCellArray> lines = vtkSmartPointer<vtkCellArray>::New();
+  lines->SetCells(num_fibers, ids);
+  polyData->SetLines(lines);
+
+  vtkPointData *pointData = polyData->GetPointData();
+  for( size_t i = 0; i < tensors.size(); ++i )
+    {
+    const int idx = static_cast<int>(pointData->AddArray(tensors[i]));
+    pointData->SetActiveAttribute(idx,vtkDataSetAttributes::TENSORS);
+    }
 }
 
-void
+int
 VtkWriter
 ::WritePolyData(vtkSmartPointer<vtkPolyData> pd, const char *filename) const
 {
@@ -221,8 +389,31 @@ VtkWriter
   // Output filename extension
   const std::string ext(itksys::SystemTools::GetFilenameExtension(filename));
 
-  if(ext == ".vtp")
+  if(ext == ".ukf")
+    {
+    // The arrays were filled fiber by fiber, so the columns are written as they are
+    TractFileWriter writer;
+    writer.SetWriteCompressed(this->_compressTractFile);
+    writer.SetCompressor(_compressor);
+    writer.SetNumberOfThreads(_thread_pool ? _thread_pool->GetNumberOfThreads() : 1);
+    writer.SetMaximumError(_max_position_error, _max_scalar_error);
+    if(writer.Write(pd, filename))
+      {
+      return EXIT_FAILURE;
+      }
+    }
+  else if(ext == ".vtp")
     {
+    // vtkXMLPolyDataWriter compresses on one thread, so spread the blocks over the threads of the pool
+    const int num_threads = _thread_pool ? _thread_pool->GetNumberOfThreads() : 1;
+    if(this->_writeBinary && this->_writeCompressed && num_threads > 1 &&
+       VtpBlockWriter::IsCompressorAvailable(_compressor) && VtpBlockWriter::CanWrite(pd))
+      {
+      VtpBlockWriter writer;
+      writer.SetNumberOfThreads(num_threads);
+      writer.SetCompressor(_compressor);
+      return writer.Write(pd, filename) ? EXIT_FAILURE : EXIT_SUCCESS;
+      }
     vtkSmartPointer<vtkXMLPolyDataWriter> writer =
       vtkSmartPointer<vtkXMLPolyDataWriter>::New();
     if(this->_writeBinary)
@@ -233,7 +424,16 @@ VtkWriter
       {
       writer->SetDataModeToAscii();
       }
-    if(this->_writeCompressed)
+    if(this->_writeCompressed && _compressor == VTP_COMPRESSOR_LZ4)
+      {
+#if VTK_MAJOR_VERSION > 8 || (VTK_MAJOR_VERSION == 8 && VTK_MINOR_VERSION >= 2)
+      writer->SetCompressorTypeToLZ4();
+#else
+      std::cout << "LZ4 compression needs VTK 8.2, writing zlib compressed data." << std::endl;
+      writer->SetCompressorTypeToZLib();
+#endif
+      }
+    else if(this->_writeCompressed)
       {
       writer->SetCompressorTypeToZLib();
       }
@@ -247,7 +447,11 @@ VtkWriter
     writer->SetInputData(pd);
 #endif
     writer->SetFileName(filename);
-    writer->Write();
+    if(writer->Write() == 0)
+      {
+      std::cout << "Writing " << filename << " failed." << std::endl;
+      return EXIT_FAILURE;
+      }
     }
   else
     {
@@ -264,8 +468,13 @@ VtkWriter
 #endif
     writer->SetFileName(filename);
 
-    writer->Write();
+    if(writer->Write() == 0)
+      {
+      std::cout << "Writing " << filename << " failed." << std::endl;
+      return EXIT_FAILURE;
+      }
     }
+  return EXIT_SUCCESS;
 }
 
 int
@@ -295,6 +504,7 @@ VtkWriter
       return EXIT_FAILURE;
       }
     }
+  RunReportPhase populate(_run_report, "populate");
   // polyData object to fill in
   vtkSmartPointer<vtkPolyData> polyData = vtkSmartPointer<vtkPolyData>::New();
   // handle fibers and tensors
@@ -305,7 +515,10 @@ VtkWriter
     {
     vtkSmartPointer<vtkPolyData> polyData2 = vtkSmartPointer<vtkPolyData>::New();
     this->PopulateFibersAndTensors(polyData2,fibers);
-    WritePolyData(polyData2, tractsWithSecondTensor.c_str());
+    if( WritePolyData(polyData2, tractsWithSecondTensor.c_str() ) == EXIT_FAILURE )
+      {
+      return EXIT_FAILURE;
+      }
     }
 
   // norm, fa etc hung as arrays on the point data for the polyData
@@ -316,228 +529,72 @@ VtkWriter
   size_t num_points = 0;
   for( int i = 0; i < num_fibers; ++i )
     {
-    num_points += fibers[i].position.size();
+    num_points += fibers[i].size();
     }
 
-  // write norm
-  {
-  vtkSmartPointer<vtkFloatArray> norms = vtkSmartPointer<vtkFloatArray>::New();
-  norms->SetNumberOfComponents(1);
-  norms->Allocate(num_points);
-  norms->SetName("EstimatedUncertainty");
-  for( int i = 0; i < num_fibers; ++i )
+  // The arrays are added in the same order as before, the last one is the active scalar
+  FiberArrays arrays;
+  const FiberArena& arena = *fibers[0].arena;
+  arrays.norm = AddFloatArray(pointData, "EstimatedUncertainty", 1, num_points);
+  if(!arena.fa.empty())
     {
-    size_t fiber_size = fibers[i].position.size();
-    for ( size_t j = 0; j < fiber_size; ++j )
-      {
-      norms->InsertNextValue(fibers[i].norm[j]);
-      }
+    arrays.fa = AddFloatArray(pointData, if_noddi ? "Vic1" : "FA1", 1, num_points);
     }
-  int idx = pointData->AddArray(norms);
-  pointData->SetActiveAttribute(idx,vtkDataSetAttributes::SCALARS);
-  }
-
-  // write fa
-  if(fibers[0].fa.size() > 0)
+  if(!arena.fa2.empty())
     {
-    vtkSmartPointer<vtkFloatArray> fa = vtkSmartPointer<vtkFloatArray>::New();
-    fa->SetNumberOfComponents(1);
-    fa->Allocate(num_points);
-    if(if_noddi)
-      fa->SetName("Vic1");
-    else
-      fa->SetName("FA1");
-    for( int i = 0; i < num_fibers; ++i )
-      {
-      size_t fiber_size = fibers[i].position.size();
-      for ( size_t j = 0; j < fiber_size; ++j )
-        {
-        fa->InsertNextValue(fibers[i].fa[j]);
-        }
-      }
-    int idx = pointData->AddArray(fa);
-    pointData->SetActiveAttribute(idx,vtkDataSetAttributes::SCALARS);
+    arrays.fa2 = AddFloatArray(pointData, if_noddi ? "Vic2" : "FA2", 1, num_points);
     }
-
-  // fa2
-  if(fibers[0].fa2.size() > 0)
+  if(!arena.trace.empty())
     {
-    vtkSmartPointer<vtkFloatArray> fa2 = vtkSmartPointer<vtkFloatArray>::New();
-    if(if_noddi)
-      fa2->SetName("Vic2");
-    else
-      fa2->SetName("FA2");
-    fa2->SetNumberOfComponents(1);
-    fa2->Allocate(num_points);
-    for( int i = 0; i < num_fibers; ++i )
-      {
-      size_t fiber_size = fibers[i].position.size();
-      for( size_t j = 0; j < fiber_size; ++j )
-        {
-        fa2->InsertNextValue(fibers[i].fa2[j]);
-        }
-      }
-    int idx = pointData->AddArray(fa2);
-    pointData->SetActiveAttribute(idx,vtkDataSetAttributes::SCALARS);
+    arrays.trace = AddFloatArray(pointData, if_noddi ? "OrientationDispersionIndex1" : "trace1", 1, num_points);
     }
-
-  // trace
-  if(fibers[0].trace.size() > 0)
+  if(!arena.trace2.empty())
     {
-    vtkSmartPointer<vtkFloatArray> trace = vtkSmartPointer<vtkFloatArray>::New();
-    trace->SetNumberOfComponents(1);
-    trace->Allocate(num_points);
-    if(if_noddi)
-      trace->SetName("OrientationDispersionIndex1");
-    else
-      trace->SetName("trace1");
-    for( int i = 0; i < num_fibers; ++i )
-      {
-      size_t fiber_size = fibers[i].position.size();
-      for( size_t j = 0; j < fiber_size; ++j )
-        {
-        trace->InsertNextValue(fibers[i].trace[j]);
-        }
-      }
-    int idx = pointData->AddArray(trace);
-    pointData->SetActiveAttribute(idx,vtkDataSetAttributes::SCALARS);
+    arrays.trace2 = AddFloatArray(pointData, if_noddi ? "OrientationDispersionIndex2" : "trace2", 1, num_points);
     }
-
-  // trace2
-  if(fibers[0].trace2.size() > 0)
+  if(!arena.free_water.empty())
     {
-    vtkSmartPointer<vtkFloatArray> trace2 = vtkSmartPointer<vtkFloatArray>::New();
-    trace2->SetNumberOfComponents(1);
-    trace2->Allocate(num_points);
-    if(if_noddi)
-      trace2->SetName("OrientationDispersionIndex2");
-    else
-      trace2->SetName("trace2");
-    for( int i = 0; i < num_fibers; ++i )
-      {
-      size_t fiber_size = fibers[i].position.size();
-      for( size_t j = 0; j < fiber_size; ++j )
-        {
-        trace2->InsertNextValue(fibers[i].trace2[j]);
-        }
-      }
-    int idx = pointData->AddArray(trace2);
-    pointData->SetActiveAttribute(idx,vtkDataSetAttributes::SCALARS);
+    arrays.free_water = AddFloatArray(pointData, if_noddi ? "Viso" : "FreeWater", 1, num_points);
     }
-
-  if(fibers[0].free_water.size() > 0)
+  if(!arena.normMSE.empty())
     {
-    vtkSmartPointer<vtkFloatArray> free_water = vtkSmartPointer<vtkFloatArray>::New();
-    free_water->SetNumberOfComponents(1);
-    free_water->Allocate(num_points);
-    if(if_noddi)
-      free_water->SetName("Viso");
-    else
-      free_water->SetName("FreeWater");
-    for( int i = 0; i < num_fibers; ++i )
-      {
-      size_t fiber_size = fibers[i].position.size();
-      for( size_t j = 0; j < fiber_size; ++j )
-        {
-        free_water->InsertNextValue(fibers[i].free_water[j]);
-        }
-      }
-    int idx = pointData->AddArray(free_water);
-    pointData->SetActiveAttribute(idx,vtkDataSetAttributes::SCALARS);
+    arrays.normMSE = AddFloatArray(pointData, "NormalizedSignalEstimationError", 1, num_points);
+    }
+  const int state_dim = arena.state_dim;
+  if(write_state)
+    {
+    arrays.state = AddFloatArray(pointData, "state", state_dim, num_points);
+    }
+  if(arena.HasCovariance())
+    {
+    arrays.covariance = AddFloatArray(pointData,
+                                      arena.covariance_mode == COVARIANCE_DIAGONAL ? "covarianceDiagonal" : "covariance",
+                                      arena.CovarianceSize(), num_points);
     }
 
-  if(fibers[0].normMSE.size() > 0)
+  FillFibers(fibers, arrays);
+
+  if(arrays.normMSE)
     {
     ukfPrecisionType nmse_sum(0);
-    unsigned counter(0);
-    vtkSmartPointer<vtkFloatArray> normMSE = vtkSmartPointer<vtkFloatArray>::New();
-    normMSE->SetNumberOfComponents(1);
-    normMSE->Allocate(num_points);
-    normMSE->SetName("NormalizedSignalEstimationError");
     for( int i = 0; i < num_fibers; ++i )
       {
-      size_t fiber_size = fibers[i].position.size();
+      size_t fiber_size = fibers[i].size();
       for( size_t j = 0; j < fiber_size; ++j )
         {
-        normMSE->InsertNextValue(fibers[i].normMSE[j]);
-        nmse_sum += fibers[i].normMSE[j];
-        ++counter;
+        nmse_sum += fibers[i].normMSE(j);
         }
       }
-    int idx = pointData->AddArray(normMSE);
-    pointData->SetActiveAttribute(idx,vtkDataSetAttributes::SCALARS);
-    std::cout << "nmse_avg=" << nmse_sum / counter << std::endl;
+    std::cout << "nmse_avg=" << nmse_sum / num_points << std::endl;
     }
   else
     {
     std::cout << "nmse_avg=0" << std::endl;
     }
+  populate.End();
 
-  if(write_state)
-    {
-    int state_dim = fibers[0].state[0].size();
-    vtkSmartPointer<vtkFloatArray> stateArray = vtkSmartPointer<vtkFloatArray>::New();
-    stateArray->SetNumberOfComponents(state_dim);
-    stateArray->Allocate(num_points);
-    stateArray->SetName("state");
-
-    float *tmpArray = new float[state_dim];
-
-    for( int i = 0; i < num_fibers; i++ )
-      {
-      const int fiber_size = static_cast<int>(fibers[i].position.size() );
-      for( int j = 0; j < fiber_size; ++j )
-        {
-        const State & state = fibers[i].state[j];
-        for(int k = 0; k < state_dim; ++k)
-          {
-          tmpArray[k] = state[k];
-          }
-        stateArray->InsertNextTuple(tmpArray);
-        }
-      }
-    int idx = pointData->AddArray(stateArray);
-    pointData->SetActiveAttribute(idx,vtkDataSetAttributes::SCALARS);
-    delete [] tmpArray;
-    }
-
-  if(fibers[0].covariance.size() > 0)
-    {
-    int state_dim = fibers[0].state[0].size();
-
-    int cov_dim = (state_dim * (state_dim + 1)) / 2;
-
-    vtkSmartPointer<vtkFloatArray> covarianceArray = vtkSmartPointer<vtkFloatArray>::New();
-    covarianceArray->SetNumberOfComponents(cov_dim);
-    covarianceArray->Allocate(num_points);
-    covarianceArray->SetName("covariance");
-
-    float *tmpArray = new float[cov_dim];
-
-    for( int i = 0; i < num_fibers; i++ )
-      {
-      const int fiber_size = static_cast<int>(fibers[i].position.size() );
-      for( int j = 0; j < fiber_size; ++j )
-        {
-        int covIndex = 0;
-        for(int a = 0; a < state_dim; ++a)
-          {
-          for(int b = a; b < state_dim; ++b)
-            {
-            tmpArray[covIndex] = fibers[i].covariance[j](a,b);
-            ++covIndex;
-            }
-          }
-        covarianceArray->InsertNextTuple(tmpArray);
-        }
-      }
-    int idx = pointData->AddArray(covarianceArray);
-    pointData->SetActiveAttribute(idx,vtkDataSetAttributes::SCALARS);
-    delete [] tmpArray;
-    }
-
-  WritePolyData(polyData,file_name.c_str());
-  return EXIT_SUCCESS;
+  RunReportPhase write(_run_report, "write");
+  return WritePolyData(polyData,file_name.c_str());
 }
 
 int VtkWriter::WriteGlyphs(const std::string& file_name,
@@ -556,21 +613,21 @@ int VtkWriter::WriteGlyphs(const std::string& file_name,
   size_t num_points = 0;
   for( size_t i = 0; i < num_fibers; ++i )
     {
-    num_points += fibers[i].position.size();
+    num_points += fibers[i].size();
     }
 
-  size_t num_tensors = fibers[0].state[0].size() / 5;
+  size_t num_tensors = fibers[0].arena->state_dim / 5;
 
   const ukfPrecisionType scale = ukfHalf * _scale_glyphs;
 
 
   for( size_t i = 0; i < num_fibers; ++i )
     {
-    size_t fiber_size = fibers[i].position.size();
+    size_t fiber_size = fibers[i].size();
     for( size_t j = 0; j < fiber_size; ++j )
       {
-      vec3_t        point = fibers[i].position[j];
-      const State& state = fibers[i].state[j];
+      vec3_t        point = fibers[i].position(j);
+      const StateView state = fibers[i].state(j);
 
       // Get the directions.
       vec3_t m1 = vec3_t::Zero();
@@ -690,39 +747,10 @@ int VtkWriter::WriteGlyphs(const std::string& file_name,
     lines->InsertNextCell(line);
     }
   polyData->SetLines(lines);
-  WritePolyData(polyData,file_name.c_str());
-  return EXIT_SUCCESS;
-}
-
-vec3_t
-VtkWriter::
-PointConvert(const vec3_t& point)
-{
-  vec3_t rval;
-  ukfVectorType p(4);
-  p[0] = point[2];    // NOTICE the change of order here. Flips back to the original axis order
-  p[1] = point[1];
-  p[2] = point[0];
-
-  if( _transform_position )
-    {
-    p[3] = ukfOne;
-    ukfVectorType p_new(4);
-    p_new = _signal_data->i2r() * p;    // ijk->RAS transform
-    rval[0] = p_new[0];
-    rval[1] = p_new[1];
-    rval[2] = p_new[2];
-    }
-  else
-    {
-    rval[0] = p[2];
-    rval[1] = p[1];
-    rval[2] = p[0];
-    }
-  return rval;
+  return WritePolyData(polyData,file_name.c_str());
 }
 
-void VtkWriter::State2Tensor(const State & state, mat33_t & D, const int tensorNumber) const
+void VtkWriter::State2Tensor(const StateView & state, mat33_t & D, const int tensorNumber) const
 {
   vec3_t eigenVec1;
   const int tensorIndex= ( tensorNumber - 1 );
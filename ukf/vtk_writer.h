@@ -14,6 +14,7 @@
 #include "linalg.h"
 #include "tractography.h"
 #include "ukffiber.h"
+#include "vtp_block_writer.h"
 #include "vtkByteSwap.h"
 #include <fstream>
 #include "vtkPolyData.h"
@@ -21,6 +22,9 @@
 
 class ISignalData;
 class vtkPointData;
+class vtkFloatArray;
+class TrackingThreadPool;
+class RunReport;
 /**
  * \class VtkWriter
  * \brief Class that allows to write a bunch of fibers to a .vtk file
@@ -61,9 +65,23 @@ public:
     {
       _transform_position = transform_position;
     }
+  /** Fills the VTK arrays in parallel on the workers of pool, NULL fills them on the calling thread */
+  void SetThreadPool(TrackingThreadPool *pool) { this->_thread_pool = pool; }
+  /** Times the conversion of the fibers and the writing of the file in report, NULL for none */
+  void SetRunReport(RunReport *report) { this->_run_report = report; }
   /** set the WriteBinary flag */
   void SetWriteBinary(bool wb) { this->_writeBinary = wb; }
   void SetWriteCompressed(bool wc) { this->_writeCompressed = wc; }
+  /** Codec of compressed .vtp and .ukf files */
+  void SetCompressor(VtpCompressor compressor) { this->_compressor = compressor; }
+  /** Compress the columns of .ukf files, off by default so that they can be mapped and used in place */
+  void SetCompressTractFile(bool compress) { this->_compressTractFile = compress; }
+  /** Largest error of the quantized points and scalars of .ukf files, 0 writes them lossless */
+  void SetMaximumError(ukfPrecisionType position_error, ukfPrecisionType scalar_error)
+    {
+      this->_max_position_error = position_error;
+      this->_max_scalar_error = scalar_error;
+    }
 
   /**
    * Writes the fibers and all values attached to them to a VTK file
@@ -75,7 +93,57 @@ protected:
   /**
    * Convert a point from the internal representation into what VTK expects
   */
-  vec3_t PointConvert(const vec3_t &point);
+  vec3_t PointConvert(const vec3_t &point) const
+    {
+      // NOTICE the change of order here. Flips back to the original axis order
+      const vec3_t p(point[2], point[1], point[0]);
+      if( _transform_position )
+        {
+        return _i2r_linear * p + _i2r_offset;    // ijk->RAS transform
+        }
+      return point;
+    }
+
+  /**
+   * \struct FiberArrays
+   * \brief Data of the VTK arrays, filled by FillFibers. Arrays that are NULL are skipped.
+  */
+  struct FiberArrays
+    {
+    FiberArrays();
+
+    /** 3 values per point */
+    float *points;
+    /** The number of points followed by the point ids for every fiber, i.e. the legacy vtkCellArray layout */
+    vtkIdType *lines;
+    /** 9 values per point for each tensor */
+    std::vector<float *> tensors;
+    float *norm;
+    float *fa;
+    float *fa2;
+    float *trace;
+    float *trace2;
+    float *free_water;
+    float *normMSE;
+    /** state_dim values per point */
+    float *state;
+    /** The recorded covariance values, CovarianceSize() of the arena per point */
+    float *covariance;
+    };
+
+  /** Fills arrays with the points of fibers, in chunks of fibers that are spread over the thread pool */
+  void FillFibers(const std::vector<UKFFiber>& fibers, const FiberArrays& arrays) const;
+
+  /** Fills the values of one fiber, starting at its first point and its line */
+  void FillFiber(const UKFFiber& fiber, const size_t point_offset, const size_t line_offset,
+                 const FiberArrays& arrays) const;
+
+  struct FillWork;
+  static void FillCallback(int, void *data);
+
+  /** Creates an array of num_points tuples, adds it to the point data and returns its values to fill */
+  static float * AddFloatArray(vtkPointData *pointData, const char *name, const int components,
+                               const size_t num_points);
   /**
    * Write a single scalar value out in binary.
    */
@@ -104,14 +172,15 @@ protected:
         }
     }
 
-  void WritePolyData(vtkSmartPointer <vtkPolyData> pd, const char *filename) const;
+  /** Writes pd to filename in the format given by its extension, returns EXIT_FAILURE or EXIT_SUCCESS */
+  int WritePolyData(vtkSmartPointer <vtkPolyData> pd, const char *filename) const;
 
   /**
    * \brief Reconstructs the tensor from the state for each case
    * \param[out] D The calculated diffusion tensor
    * \todo I think there is something wrong with choosing a orthonormal basis for the tensor
   */
-  void State2Tensor(const State & state, mat33_t & D, const int tensorNumber) const;
+  void State2Tensor(const StateView & state, mat33_t & D, const int tensorNumber) const;
 
   /** The diffusion weighted signal data */
   const ISignalData *_signal_data;
@@ -147,10 +216,24 @@ protected:
   /** Transformation matrix from ijk-RAS with voxel size normalized out */
   mat33_t _sizeFreeI2R;
 
+  /** The ijk-to-RAS transform of the signal, as a linear part and an offset */
+  mat33_t _i2r_linear;
+  vec3_t  _i2r_offset;
+
+  /** Optional workers filling the arrays */
+  TrackingThreadPool *_thread_pool;
+
+  RunReport *_run_report;
+
   /** is the file to be written binary? */
   bool _writeBinary;
   /** is the file to be written compressed? */
   bool _writeCompressed;
+  VtpCompressor _compressor;
+  /** are the columns of .ukf files compressed? SetWriteCompressed only applies to .vtp files */
+  bool _compressTractFile;
+  ukfPrecisionType _max_position_error;
+  ukfPrecisionType _max_scalar_error;
 };
 
 #endif  // VTK_WRITER_H_
@@ -0,0 +1,540 @@
+/**
+ * \file vtp_block_writer.cc
+ * \brief implementation of vtp_block_writer.h
+*/
+
+#include "vtp_block_writer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#ifdef UKF_USE_LZ4
+#include <lz4.h>
+#endif
+
+#include "vtkVersion.h"
+#include "vtkType.h"
+#include "vtkPolyData.h"
+#include "vtkPoints.h"
+#include "vtkCellArray.h"
+#include "vtkDataArray.h"
+#include "vtkStringArray.h"
+#include "vtkPointData.h"
+#include "vtkCellData.h"
+#include "vtkFieldData.h"
+
+namespace
+{
+/** Uncompressed size of a block, the default of vtkXMLWriter */
+const size_t BLOCK_SIZE = 32768;
+
+/** The default level of vtkZLibDataCompressor */
+const int ZLIB_LEVEL = 5;
+
+/** An array in the appended data section */
+struct AppendedArray
+  {
+  std::string                xml_type;
+  std::string                name;
+  int                        components;
+  vtkIdType                  tuples;
+  const unsigned char *      data;
+  size_t                     size;
+  // Holds the data of arrays that are built for writing, e.g. the line connectivity
+  std::vector<vtkTypeInt64>  owned;
+  size_t                     first_block;
+  size_t                     num_blocks;
+  size_t                     offset;
+  };
+
+/** The blocks of all buffers, which the threads claim one at a time */
+struct CompressWork
+  {
+  const std::vector<CompressionBuffer> *    buffers;
+  size_t                                    block_size;
+  // Buffer and position in the buffer of every block
+  std::vector<std::pair<size_t, size_t> >   block_start;
+  std::vector<std::vector<unsigned char> > *compressed;
+  VtpCompressor                             compressor;
+  std::atomic<size_t>                       next;
+  std::atomic<bool>                         failed;
+  };
+
+bool CompressBlock(const VtpCompressor compressor, const unsigned char *input, const size_t size,
+                   std::vector<unsigned char>& output)
+{
+  if( compressor == VTP_COMPRESSOR_ZLIB )
+    {
+    uLongf output_size = compressBound(static_cast<uLong>(size) );
+    output.resize(output_size);
+    if( compress2(&output[0], &output_size, input, static_cast<uLong>(size), ZLIB_LEVEL) != Z_OK )
+      {
+      return true;
+      }
+    output.resize(output_size);
+    return false;
+    }
+#ifdef UKF_USE_LZ4
+  const int bound = LZ4_compressBound(static_cast<int>(size) );
+  output.resize(bound);
+  const int output_size = LZ4_compress_default(reinterpret_cast<const char *>(input),
+                                               reinterpret_cast<char *>(&output[0]), static_cast<int>(size), bound);
+  if( output_size <= 0 )
+    {
+    return true;
+    }
+  output.resize(output_size);
+  return false;
+#else
+  return true;
+#endif
+}
+
+void CompressLoop(CompressWork *work)
+{
+  for( ;; )
+    {
+    const size_t block = work->next++;
+    if( block >= work->block_start.size() || work->failed )
+      {
+      break;
+      }
+    const CompressionBuffer& buffer = (*work->buffers)[work->block_start[block].first];
+    const size_t             begin = work->block_start[block].second;
+    const size_t             size = std::min(work->block_size, buffer.second - begin);
+    if( CompressBlock(work->compressor, buffer.first + begin, size, (*work->compressed)[block]) )
+      {
+      work->failed = true;
+      }
+    }
+}
+
+/** Name of a VTK data type in the type attribute of a DataArray, NULL if it cannot be written */
+const char * XMLTypeName(const int data_type, const int size)
+{
+  switch( data_type )
+    {
+    case VTK_FLOAT:
+      return "Float32";
+    case VTK_DOUBLE:
+      return "Float64";
+    case VTK_CHAR:
+    case VTK_SIGNED_CHAR:
+    case VTK_SHORT:
+    case VTK_INT:
+    case VTK_LONG:
+    case VTK_LONG_LONG:
+    case VTK_ID_TYPE:
+      switch( size )
+        {
+        case 1: return "Int8";
+        case 2: return "Int16";
+        case 4: return "Int32";
+        case 8: return "Int64";
+        }
+      break;
+    case VTK_UNSIGNED_CHAR:
+    case VTK_UNSIGNED_SHORT:
+    case VTK_UNSIGNED_INT:
+    case VTK_UNSIGNED_LONG:
+    case VTK_UNSIGNED_LONG_LONG:
+      switch( size )
+        {
+        case 1: return "UInt8";
+        case 2: return "UInt16";
+        case 4: return "UInt32";
+        case 8: return "UInt64";
+        }
+      break;
+    }
+  return NULL;
+}
+
+bool IsWritable(vtkDataArray *array)
+{
+  return array != NULL && XMLTypeName(array->GetDataType(), array->GetDataTypeSize() ) != NULL;
+}
+
+std::string EscapeXML(const std::string& text)
+{
+  std::string escaped;
+  for( size_t i = 0; i < text.size(); ++i )
+    {
+    switch( text[i] )
+      {
+      case '&': escaped += "&amp;"; break;
+      case '<': escaped += "&lt;"; break;
+      case '>': escaped += "&gt;"; break;
+      case '"': escaped += "&quot;"; break;
+      default: escaped += text[i];
+      }
+    }
+  return escaped;
+}
+
+void AddDataArray(vtkDataArray *array, const std::string& name, std::vector<AppendedArray>& arrays)
+{
+  AppendedArray appended;
+  appended.xml_type = XMLTypeName(array->GetDataType(), array->GetDataTypeSize() );
+  appended.name = name;
+  appended.components = array->GetNumberOfComponents();
+  appended.tuples = array->GetNumberOfTuples();
+  appended.size = static_cast<size_t>(appended.tuples) * appended.components * array->GetDataTypeSize();
+  appended.data = appended.size > 0 ? static_cast<const unsigned char *>(array->GetVoidPointer(0) ) : NULL;
+  arrays.push_back(appended);
+}
+
+void AddOwnedArray(const std::string& name, std::vector<AppendedArray>& arrays)
+{
+  AppendedArray appended;
+  appended.xml_type = "Int64";
+  appended.name = name;
+  appended.components = 1;
+  appended.tuples = 0;
+  appended.data = NULL;
+  appended.size = 0;
+  arrays.push_back(appended);
+}
+
+void WriteDataArrayElement(std::ostream& out, const char *element, const AppendedArray& array, const bool tuples)
+{
+  out << "<" << element << " type=\"" << array.xml_type << "\" Name=\"" << EscapeXML(array.name) << "\"";
+  if( tuples )
+    {
+    out << " NumberOfTuples=\"" << array.tuples << "\"";
+    }
+  if( array.components != 1 )
+    {
+    out << " NumberOfComponents=\"" << array.components << "\"";
+    }
+  out << " format=\"appended\" offset=\"" << array.offset << "\"/>\n";
+}
+
+/** Writes the names of the active attributes of the point data, e.g. Scalars="FA1" */
+void WriteActiveAttributes(std::ostream& out, vtkPointData *pointData)
+{
+  vtkDataArray *active[5] =
+    { pointData->GetScalars(), pointData->GetVectors(), pointData->GetNormals(), pointData->GetTensors(),
+      pointData->GetTCoords() };
+  const char *attribute[5] = { "Scalars", "Vectors", "Normals", "Tensors", "TCoords" };
+  for( int i = 0; i < 5; ++i )
+    {
+    if( active[i] != NULL && active[i]->GetName() != NULL )
+      {
+      out << " " << attribute[i] << "=\"" << EscapeXML(active[i]->GetName() ) << "\"";
+      }
+    }
+}
+}
+
+bool ParseVtpCompressor(const std::string& name, VtpCompressor& compressor)
+{
+  if( name == "zlib" )
+    {
+    compressor = VTP_COMPRESSOR_ZLIB;
+    }
+  else if( name == "lz4" )
+    {
+    compressor = VTP_COMPRESSOR_LZ4;
+    }
+  else
+    {
+    std::cout << "Unknown compressor " << name << std::endl;
+    return true;
+    }
+  return false;
+}
+
+bool CompressBlocks(const VtpCompressor compressor, const std::vector<CompressionBuffer>& buffers,
+                    const size_t block_size, const int num_threads, std::vector<std::vector<unsigned char> >& blocks)
+{
+  CompressWork work;
+  for( size_t i = 0; i < buffers.size(); ++i )
+    {
+    for( size_t begin = 0; begin < buffers[i].second; begin += block_size )
+      {
+      work.block_start.push_back(std::make_pair(i, begin) );
+      }
+    }
+  blocks.clear();
+  blocks.resize(work.block_start.size() );
+  work.buffers = &buffers;
+  work.block_size = block_size;
+  work.compressed = &blocks;
+  work.compressor = compressor;
+  work.next = 0;
+  work.failed = false;
+
+  const int num_workers = std::max(1, std::min(num_threads, static_cast<int>(blocks.size() ) ) );
+  std::vector<std::thread> threads;
+  for( int i = 1; i < num_workers; ++i )
+    {
+    threads.push_back(std::thread(CompressLoop, &work) );
+    }
+  CompressLoop(&work);
+  for( size_t i = 0; i < threads.size(); ++i )
+    {
+    threads[i].join();
+    }
+  return work.failed;
+}
+
+bool DecompressBlock(const VtpCompressor compressor, const unsigned char *input, const size_t input_size,
+                     unsigned char *output, const size_t output_size)
+{
+  if( compressor == VTP_COMPRESSOR_ZLIB )
+    {
+    uLongf size = static_cast<uLongf>(output_size);
+    return uncompress(output, &size, input, static_cast<uLong>(input_size) ) != Z_OK || size != output_size;
+    }
+#ifdef UKF_USE_LZ4
+  return LZ4_decompress_safe(reinterpret_cast<const char *>(input), reinterpret_cast<char *>(output),
+                             static_cast<int>(input_size), static_cast<int>(output_size) ) !=
+         static_cast<int>(output_size);
+#else
+  return true;
+#endif
+}
+
+VtpBlockWriter::VtpBlockWriter() :
+  _num_threads(1),
+  _compressor(VTP_COMPRESSOR_ZLIB)
+{
+}
+
+bool VtpBlockWriter::IsCompressorAvailable(const VtpCompressor compressor)
+{
+#ifdef UKF_USE_LZ4
+  (void)compressor;
+  return true;
+#else
+  return compressor == VTP_COMPRESSOR_ZLIB;
+#endif
+}
+
+bool VtpBlockWriter::CanWrite(vtkPolyData *polyData)
+{
+  if( polyData == NULL || polyData->GetPoints() == NULL || !IsWritable(polyData->GetPoints()->GetData() ) )
+    {
+    return false;
+    }
+  if( polyData->GetNumberOfVerts() > 0 || polyData->GetNumberOfStrips() > 0 || polyData->GetNumberOfPolys() > 0 ||
+      polyData->GetCellData()->GetNumberOfArrays() > 0 )
+    {
+    return false;
+    }
+  vtkPointData *pointData = polyData->GetPointData();
+  for( int i = 0; i < pointData->GetNumberOfArrays(); ++i )
+    {
+    if( !IsWritable(pointData->GetArray(i) ) )
+      {
+      return false;
+      }
+    }
+  vtkFieldData *fieldData = polyData->GetFieldData();
+  for( int i = 0; i < fieldData->GetNumberOfArrays(); ++i )
+    {
+    vtkAbstractArray *array = fieldData->GetAbstractArray(i);
+    if( vtkStringArray::SafeDownCast(array) == NULL && !IsWritable(vtkDataArray::SafeDownCast(array) ) )
+      {
+      return false;
+      }
+    }
+  return true;
+}
+
+bool VtpBlockWriter::Write(vtkPolyData *polyData, const std::string& file_name) const
+{
+  if( !CanWrite(polyData) )
+    {
+    std::cout << "The polydata holds cells or arrays that cannot be written to " << file_name << std::endl;
+    return true;
+    }
+  if( !IsCompressorAvailable(_compressor) )
+    {
+    std::cout << "LZ4 compression is not available in this build." << std::endl;
+    return true;
+    }
+
+  // Collect the arrays in the order they appear in the file
+  std::vector<AppendedArray> arrays;
+  std::vector<vtkStringArray *> string_arrays;
+  std::vector<size_t>           field_arrays;
+  vtkFieldData *                fieldData = polyData->GetFieldData();
+  for( int i = 0; i < fieldData->GetNumberOfArrays(); ++i )
+    {
+    vtkAbstractArray *array = fieldData->GetAbstractArray(i);
+    if( vtkStringArray *strings = vtkStringArray::SafeDownCast(array) )
+      {
+      // Strings are short and written inline
+      string_arrays.push_back(strings);
+      }
+    else
+      {
+      field_arrays.push_back(arrays.size() );
+      AddDataArray(vtkDataArray::SafeDownCast(array), array->GetName() ? array->GetName() : "", arrays);
+      }
+    }
+  vtkPointData *pointData = polyData->GetPointData();
+  const size_t  first_point_array = arrays.size();
+  for( int i = 0; i < pointData->GetNumberOfArrays(); ++i )
+    {
+    vtkDataArray *array = pointData->GetArray(i);
+    AddDataArray(array, array->GetName() ? array->GetName() : "", arrays);
+    }
+  const size_t points_array = arrays.size();
+  AddDataArray(polyData->GetPoints()->GetData(), "Points", arrays);
+
+  // The lines are stored as connectivity and the offset of the end of every line
+  const size_t connectivity_array = arrays.size();
+  AddOwnedArray("connectivity", arrays);
+  AddOwnedArray("offsets", arrays);
+  std::vector<vtkTypeInt64>& connectivity = arrays[connectivity_array].owned;
+  std::vector<vtkTypeInt64>& offsets = arrays[connectivity_array + 1].owned;
+  vtkCellArray *             lines = polyData->GetLines();
+  if( lines != NULL )
+    {
+    offsets.reserve(lines->GetNumberOfCells() );
+    vtkIdType npts = 0;
+#if VTK_MAJOR_VERSION >= 9
+    const vtkIdType *pts = NULL;
+#else
+    vtkIdType *pts = NULL;
+#endif
+    lines->InitTraversal();
+    while( lines->GetNextCell(npts, pts) )
+      {
+      connectivity.insert(connectivity.end(), pts, pts + npts);
+      offsets.push_back(static_cast<vtkTypeInt64>(connectivity.size() ) );
+      }
+    }
+  for( size_t i = connectivity_array; i < arrays.size(); ++i )
+    {
+    arrays[i].tuples = static_cast<vtkIdType>(arrays[i].owned.size() );
+    arrays[i].size = arrays[i].owned.size() * sizeof(vtkTypeInt64);
+    arrays[i].data = arrays[i].owned.empty() ? NULL : reinterpret_cast<const unsigned char *>(&arrays[i].owned[0]);
+    }
+
+  // Compress the blocks of all arrays at once
+  std::vector<CompressionBuffer> buffers;
+  for( size_t i = 0; i < arrays.size(); ++i )
+    {
+    arrays[i].first_block = i == 0 ? 0 : arrays[i - 1].first_block + arrays[i - 1].num_blocks;
+    arrays[i].num_blocks = (arrays[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    buffers.push_back(CompressionBuffer(arrays[i].data, arrays[i].size) );
+    }
+  std::vector<std::vector<unsigned char> > compressed;
+  if( CompressBlocks(_compressor, buffers, BLOCK_SIZE, _num_threads, compressed) )
+    {
+    std::cout << "Compressing the data of " << file_name << " failed." << std::endl;
+    return true;
+    }
+
+  // Every array starts with a header of UInt64 values: the number of blocks, the block size, the size of
+  // the last block if it is partial and the compressed size of every block
+  size_t offset = 0;
+  for( size_t i = 0; i < arrays.size(); ++i )
+    {
+    arrays[i].offset = offset;
+    offset += (3 + arrays[i].num_blocks) * sizeof(vtkTypeUInt64);
+    for( size_t b = 0; b < arrays[i].num_blocks; ++b )
+      {
+      offset += compressed[arrays[i].first_block + b].size();
+      }
+    }
+
+  const int          one = 1;
+  const bool         little_endian = *reinterpret_cast<const char *>(&one) == 1;
+  std::ostringstream header;
+  header << "<?xml version=\"1.0\"?>\n"
+         << "<VTKFile type=\"PolyData\" version=\"1.0\" byte_order=\""
+         << (little_endian ? "LittleEndian" : "BigEndian") << "\" header_type=\"UInt64\" compressor=\""
+         << (_compressor == VTP_COMPRESSOR_ZLIB ? "vtkZLibDataCompressor" : "vtkLZ4DataCompressor") << "\">\n"
+         << "  <PolyData>\n";
+  if( !string_arrays.empty() || !field_arrays.empty() )
+    {
+    header << "    <FieldData>\n";
+    for( size_t i = 0; i < string_arrays.size(); ++i )
+      {
+      // ASCII strings are written as character codes, each string terminated by a 0
+      vtkStringArray *strings = string_arrays[i];
+      header << "      <Array type=\"String\" Name=\"" << EscapeXML(strings->GetName() ? strings->GetName() : "")
+             << "\" NumberOfTuples=\"" << strings->GetNumberOfValues() << "\" format=\"ascii\">\n        ";
+      for( vtkIdType v = 0; v < strings->GetNumberOfValues(); ++v )
+        {
+        const std::string value = strings->GetValue(v);
+        for( size_t c = 0; c < value.size(); ++c )
+          {
+          header << static_cast<int>(static_cast<unsigned char>(value[c]) ) << " ";
+          }
+        header << "0" << (v + 1 < strings->GetNumberOfValues() ? " " : "");
+        }
+      header << "\n      </Array>\n";
+      }
+    for( size_t i = 0; i < field_arrays.size(); ++i )
+      {
+      header << "      ";
+      WriteDataArrayElement(header, "Array", arrays[field_arrays[i]], true);
+      }
+    header << "    </FieldData>\n";
+    }
+  header << "    <Piece NumberOfPoints=\"" << polyData->GetNumberOfPoints() << "\" NumberOfVerts=\"0\""
+         << " NumberOfLines=\"" << offsets.size() << "\" NumberOfStrips=\"0\" NumberOfPolys=\"0\">\n"
+         << "      <PointData";
+  WriteActiveAttributes(header, pointData);
+  header << ">\n";
+  for( size_t i = first_point_array; i < points_array; ++i )
+    {
+    header << "        ";
+    WriteDataArrayElement(header, "DataArray", arrays[i], false);
+    }
+  header << "      </PointData>\n"
+         << "      <CellData>\n"
+         << "      </CellData>\n"
+         << "      <Points>\n        ";
+  WriteDataArrayElement(header, "DataArray", arrays[points_array], false);
+  header << "      </Points>\n"
+         << "      <Lines>\n        ";
+  WriteDataArrayElement(header, "DataArray", arrays[connectivity_array], false);
+  header << "        ";
+  WriteDataArrayElement(header, "DataArray", arrays[connectivity_array + 1], false);
+  header << "      </Lines>\n"
+         << "    </Piece>\n"
+         << "  </PolyData>\n"
+         << "  <AppendedData encoding=\"raw\">\n"
+         << "   _";
+
+  std::ofstream output(file_name.c_str(), std::ios::binary);
+  const std::string header_text = header.str();
+  output.write(header_text.data(), header_text.size() );
+  for( size_t i = 0; i < arrays.size(); ++i )
+    {
+    std::vector<vtkTypeUInt64> block_header;
+    block_header.push_back(arrays[i].num_blocks);
+    block_header.push_back(BLOCK_SIZE);
+    block_header.push_back(arrays[i].size % BLOCK_SIZE);
+    for( size_t b = 0; b < arrays[i].num_blocks; ++b )
+      {
+      block_header.push_back(compressed[arrays[i].first_block + b].size() );
+      }
+    output.write(reinterpret_cast<const char *>(&block_header[0]), block_header.size() * sizeof(vtkTypeUInt64) );
+    for( size_t b = 0; b < arrays[i].num_blocks; ++b )
+      {
+      const std::vector<unsigned char>& block = compressed[arrays[i].first_block + b];
+      output.write(reinterpret_cast<const char *>(&block[0]), block.size() );
+      }
+    }
+  output << "\n  </AppendedData>\n</VTKFile>\n";
+  output.close();
+  if( output.fail() )
+    {
+    std::cout << "Writing " << file_name << " failed." << std::endl;
+    return true;
+    }
+  return false;
+}
@@ -0,0 +1,89 @@
+/**
+ * \file vtp_block_writer.h
+ * \brief Writes compressed .vtp files with the compression of the data blocks spread over several threads
+*/
+
+#ifndef VTP_BLOCK_WRITER_H_
+#define VTP_BLOCK_WRITER_H_
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+class vtkPolyData;
+
+/** Codec of the compressed data blocks of a .vtp file */
+enum VtpCompressor
+  {
+  VTP_COMPRESSOR_ZLIB, // vtkZLibDataCompressor, readable by every VTK version that reads compressed .vtp
+  VTP_COMPRESSOR_LZ4   // vtkLZ4DataCompressor, several times faster at a lower ratio, needs VTK 8.2 to read
+  };
+
+/** Converts "zlib" or "lz4" to a VtpCompressor. Returns true on failure. */
+bool ParseVtpCompressor(const std::string& name, VtpCompressor& compressor);
+
+/** A buffer of bytes to compress */
+typedef std::pair<const unsigned char *, size_t> CompressionBuffer;
+
+/**
+ * Splits every buffer into blocks of block_size bytes, the last one possibly shorter, and compresses the blocks
+ * of all buffers on num_threads threads
+ * \param[out] blocks The compressed blocks of the first buffer, followed by those of the second, etc.
+ * \return true on failure
+*/
+bool CompressBlocks(const VtpCompressor compressor, const std::vector<CompressionBuffer>& buffers,
+                    const size_t block_size, const int num_threads, std::vector<std::vector<unsigned char> >& blocks);
+
+/**
+ * Decompresses one block that is known to expand to output_size bytes
+ * \return true on failure
+*/
+bool DecompressBlock(const VtpCompressor compressor, const unsigned char *input, const size_t input_size,
+                     unsigned char *output, const size_t output_size);
+
+/**
+ * \class VtpBlockWriter
+ * \brief Writes polydata in the appended, block-compressed layout of vtkXMLPolyDataWriter
+ *
+ * vtkXMLPolyDataWriter compresses the blocks of all arrays one after the other. The blocks are independent,
+ * so this writer compresses all of them in parallel first and then writes the XML header, whose offsets
+ * depend on the compressed sizes, followed by the appended data. The blocks have the size and the codec
+ * vtkXMLPolyDataWriter uses, so vtkXMLPolyDataReader reads the file as usual. Only what the tractography
+ * writes is supported: points, lines, numeric point data arrays and numeric or string field data arrays;
+ * see CanWrite().
+*/
+class VtpBlockWriter
+{
+public:
+  VtpBlockWriter();
+
+  /** Number of threads compressing blocks, values below 1 use one thread */
+  void SetNumberOfThreads(const int num_threads)
+  {
+    _num_threads = num_threads;
+  }
+
+  void SetCompressor(const VtpCompressor compressor)
+  {
+    _compressor = compressor;
+  }
+
+  /** Whether the codec was compiled in, LZ4 needs a build with UKF_USE_LZ4 */
+  static bool IsCompressorAvailable(const VtpCompressor compressor);
+
+  /** Whether the polydata only holds data this writer supports, otherwise use vtkXMLPolyDataWriter */
+  static bool CanWrite(vtkPolyData *polyData);
+
+  /**
+   * Writes polyData to file_name
+   * \return true on failure
+  */
+  bool Write(vtkPolyData *polyData, const std::string& file_name) const;
+
+private:
+  int           _num_threads;
+  VtpCompressor _compressor;
+};
+
+#endif // VTP_BLOCK_WRITER_H_